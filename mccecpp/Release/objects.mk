@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -lgdbm -lz -lm
+LIBS := -lz -lm -lgomp
 
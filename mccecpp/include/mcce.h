@@ -12,13 +12,15 @@
 #define VERSION       "MCCE2.4"
 #define USERERR -1
 #define MAXCHAR_LINE 160
-#define DUMMY_GDBM   "~temp.dbm.XXXXXX"
 #define FN_RUNPRM    "run.prm"
 #define FN_HVROT     "hvrot.pdb"
 #define STEP1_OUT    "step1_out.pdb"
 #define STEP2_OUT    "step2_out.pdb"
 #define STEP3_OUT    "step3_out.pdb"
 #define ENERGY_TABLE "energies.opp"
+#define ENERGY_MAP   "energies.bin"
+#define OPP_FOLDER   "energies"
+#define PW_ROW_MAGIC "MCCEROW"
 #define FN_CONFLIST1 "head1.lst"
 #define FN_CONFLIST2 "head2.lst"
 #define FN_CONFLIST3 "head3.lst"
@@ -134,9 +136,13 @@ int db_open();
 int iatom(const char *conf_name, const char *atom_name);
 int param_get(const char *key1, const char *key2, const char *key3, void *value);
 int param_exist(const char *key1, const char *key2, const char *key3);
+int param_id(const char *key1, const char *key2, const char *key3);
+const void *param_value(int id);
+const void *param_ptr(const char *key1, const char *key2, const char *key3);
 int check_tpl(char *fname);
 int load_param(char *fname);
 int load_all_param(char *dirname);
+int load_all_param_cached(char *dirname, char *extra, char *cache_dir);
 
 #define LEN_KEY1 9
 #define LEN_KEY2 6
@@ -310,6 +316,28 @@ typedef struct {
     int    k_subres;
 } SUBRES;
 
+typedef struct {          /* 1-2, 1-3 and 1-4 partners of one atom inside one conformer */
+    CONF   *conf;
+    int    n_word;        /* words per mask, bit i_atom of conf */
+    unsigned int *mask;   /* 3*n_word words: 1-2 mask, 1-3 mask, 1-4 mask */
+} EXCL_MASK;
+
+#define CONF_SOA_LOCAL 128
+typedef struct {          /* packed copy of the atoms on in one conformer, refilled by conf_soa_pack() */
+    int    n;
+    double *x, *y, *z;
+    float  *crg;
+    int    *type;         /* vdw type, atom.i_elem */
+    int    *i_atom;       /* index in conf.atom */
+    float  *d2;           /* scratch for the kernels */
+    char   *heap;         /* block for conformers over CONF_SOA_LOCAL atoms */
+    double x_local[CONF_SOA_LOCAL], y_local[CONF_SOA_LOCAL], z_local[CONF_SOA_LOCAL];
+    float  crg_local[CONF_SOA_LOCAL], d2_local[CONF_SOA_LOCAL];
+    int    type_local[CONF_SOA_LOCAL], i_atom_local[CONF_SOA_LOCAL];
+} CONF_SOA;
+
+struct ATOM_ARENA;        /* atom storage of one residue, private to ins_conf() and del_conf() */
+
 struct RES {
     int    original_index;
     int    resSeq;       /* used for identifying a residue */
@@ -329,6 +357,8 @@ struct RES {
     VECTOR r_max;
     int    n_conf;
     CONF   *conf;
+    int    max_conf;        /* slots allocated in conf */
+    ATOM_ARENA *arena;      /* atoms of the conformers made by ins_conf() */
     int    n_conf_ori;      /* in step2, used to record the original number of conformer before rotamer making */
                             /* also used by jmao in step 3 to indicate the dielectric boundary conf */
     
@@ -347,10 +377,16 @@ struct RES {
     ATOM ****connect12;  /* (ATOM *) connect12[i_conf][i_atom][i_connect] */
     ATOM ****connect13;
     ATOM ****connect14;
+    int **n_excl;        /* (int) n_excl[i_conf][i_atom] */
+    EXCL_MASK ***excl;   /* (EXCL_MASK) excl[i_conf][i_atom][i_excl], built from the lists above */
     float r12sq_max;
     float r13sq_max;
     float r14sq_max;
 
+    unsigned long long connect_sig;  /* get_connect12() state this residue's atom.connect12 were made in, 0 to redo */
+    int    connect_lo, connect_hi;   /* residue offsets searched for connect12 */
+    char   connect_all;              /* ligand or terminal links, the whole protein was searched */
+
     CONF   *conf_w;
     CONF   *conf_new;
     CONF   *conf_old;
@@ -411,6 +447,7 @@ typedef struct GROUP_STRUCT {
 struct PROT {
     int n_res;
     RES *res;
+    int max_res;            /* slots allocated in res */
 
     double E_base;
     double E_state;
@@ -475,6 +512,70 @@ typedef struct {
    PAIRWISE  **pw;   
 } EMATRIX;
 
+/* energies.bin: header, conformer heads, tile offsets and tiles. A tile is
+ * tile_rows full rows of PAIRWISE, raw or zlib compressed on its own, so the
+ * file can be mapped and read one row at a time.
+ */
+typedef struct {
+   char   magic[8];      /* "MCCEMAP" */
+   char   version[8];
+   int    n;
+   int    tile_rows;
+   int    compressed;
+   int    n_tile;
+} EMAP_HEAD;
+
+typedef struct {
+   int       n;
+   CONF_HEAD *conf;         /* points into the mapped file */
+   int       tile_rows;
+   int       compressed;
+   int       n_tile;
+   long long *tile_offset;  /* n_tile+1 entries, the last one is the end of the last tile */
+   char      *map;
+   size_t    map_size;
+   PAIRWISE  *tile;         /* inflated tile of a compressed file */
+   int       i_tile;        /* tile held in tile, -1 for none */
+} EMATRIX_MAP;
+
+/* step 4 pairwise table without the negligible couplings, rows in CSR form.
+ * Columns of a row are in conformer order, so the couplings with one
+ * neighbor residue are contiguous.
+ */
+typedef struct {
+   int    n;         /* number of conformers */
+   long   *start;    /* row ic is entries start[ic] to start[ic+1]-1 */
+   int    *col;      /* conformer of each entry */
+   float  *value;
+   long   n_alloc;
+} SPARSE_PW;
+
+/* step 3 output of one conformer, <uniqID>.pwb: the head, n side chain entries
+ * in conformer order, then n_bkbn backbone entries, one per residue.
+ */
+typedef struct {
+   char   magic[8];      /* PW_ROW_MAGIC */
+   int    iconf;         /* index of this conformer among the side chain entries */
+   int    n;
+   int    n_bkbn;
+   char   uniqID[16];
+   float  E_vdw0;
+   float  E_vdw1;
+   float  E_epol;
+   float  E_tors;
+   float  rxn_multi;
+   float  rxn_single;
+   float  rxn_prot;
+   float  rxn_solv;
+} PW_ROW_HEAD;
+
+typedef struct {
+   float  ele;           /* corrected, or the raw value before the rxn run */
+   float  vdw;
+   float  ori;           /* uncorrected */
+   char   mark[4];
+} PW_ROW;
+
 /* IPECE */
 typedef struct {
     int x;
@@ -600,6 +701,7 @@ typedef struct {
     int   rotamer_limit;
     int   repacks;
     int   repack_fav_vdw_off;
+    int   repack_dee;         /* dead-end elimination before repacking */
     int   nconf_limit;
     int   n_hv_conf_limit;
 
@@ -624,6 +726,7 @@ typedef struct {
     float hv_relax_shake_tol;
     int   hv_relax_include_ngh;
     float hv_relax_ngh_thr;
+    float hv_relax_verlet_skin; /* skin of the LJ Verlet lists in relaxation, 0 to compute all pairs */
 
     char  relax_h;
     float relax_e_thr;
@@ -762,6 +865,13 @@ typedef struct {
     int   rotamer_seed;
     float s2_vdw;
     int ms_out;
+
+    int   n_threads;   /* threads for parallel sections, 0 uses OMP_NUM_THREADS or all cores */
+    char  energy_format[16];  /* opp (zlib stream), bin (mapped tiles) or binz (compressed tiles) */
+    float pw_sparse_thr;  /* step 4 drops pairwise with |E| <= thr and stores the rest sparse, <0 is dense */
+    int   pbe_workers;    /* step 3 PBE jobs run concurrently, each in its own scratch folder */
+    int   export_opp;     /* step 3 also writes the text <uniqID>.opp rows to OPP_FOLDER */
+    char  param_cache[256];  /* folder of the parameter snapshots, the run folder by default, "none" to parse every time */
 } ENV;
 
 extern ENV env;
@@ -770,7 +880,7 @@ extern ENV env;
 ATOM   pdbline2atom(char *line);
 PROT   load_pdb(FILE *fp);
 PROT load_standard_pdb(FILE *fp);
-int    write_pdb(FILE *stream, PROT prot);
+int    write_pdb(FILE *stream, const PROT &prot);
 
 int    ins_conf(RES *res, int ins, int n_atom);
 int    del_conf(RES *res, int pos);
@@ -782,43 +892,49 @@ int    cpy_res(RES *tgt, RES *src);
 
 PROT   new_prot();
 int    del_prot(PROT *prot);
-int    cpy_prot(PROT *tgt, PROT *src);
+int    cpy_prot(PROT *tgt, const PROT *src);
 
 
 /* Energy calculation */
-float vdw(ATOM atom1, ATOM atom2);
+float vdw(const ATOM &atom1, const ATOM &atom2);
 VECTOR vdw_frc(VECTOR v1, VECTOR v2, float C6, float C12);
-float vdw_conf(int ires, int iconf, int jres, int jconf, PROT prot);
-float vdw_conf_hv(int ires, int iconf, int jres, int jconf, PROT prot);
+float vdw_conf(int ires, int iconf, int jres, int jconf, const PROT &prot);
+float vdw_conf_hv(int ires, int iconf, int jres, int jconf, const PROT &prot);
 float coulomb(ATOM atom1, ATOM atom2);
 VECTOR coulomb_frc(VECTOR v1, VECTOR v2, float crg1, float crg2);
-float coulomb_conf(int ires, int iconf, int jres, int jconf, PROT prot);
+float coulomb_conf(int ires, int iconf, int jres, int jconf, const PROT &prot);
 //int setup_C6_C12(PROT prot);
-void setup_vdw_fast(PROT prot);
-void setup_vdw_fast_res(int i_res, PROT prot);
-void setup_connect_res(PROT prot, int i_res);
-void free_connect_res(PROT prot, int i_res);
-float vdw_conf_fast(int i_res, int i_conf, int j_res, int j_conf, PROT prot, int handle);
-float vdw_conf_fast_print(int i_res, int i_conf, int j_res, int j_conf, PROT prot);
-float coulomb_conf_fast(int i_res, int i_conf, int j_res, int j_conf, PROT prot);
+void setup_vdw_fast(const PROT &prot);
+void setup_vdw_fast_res(int i_res, const PROT &prot);
+void setup_connect_res(const PROT &prot, int i_res);
+void free_connect_res(const PROT &prot, int i_res);
+int vdw_type(ATOM *atom_p);
+void conf_soa_pack(CONF *conf_p, int handle_hv, CONF_SOA *soa);
+void conf_soa_free(CONF_SOA *soa);
+float vdw_conf_fast(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot, int handle);
+float vdw_conf_fast_print(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot);
+float coulomb_conf_fast(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot);
 int out_of_range(VECTOR i_min, VECTOR i_max, VECTOR j_min, VECTOR j_max, float range2);
+int setup_vdw_grid(const PROT &prot);
+int vdw_grid_near(CONF *conf_p, char *near);
+void free_vdw_grid();
 float torsion_angle(VECTOR v0, VECTOR v1, VECTOR v2, VECTOR v3);
 int torsion_atoms(CONF *conf_p, int i_atom, ATOM **atom0_p, ATOM **atom1_p, ATOM **atom2_p, ATOM **atom3_p, TORS *tors, int handle);
 float torsion(float phi, float phi0, float n_fold, float barrier);
 float torsion_conf(CONF *conf_p);
 float torsion_conf_print(CONF *conf_p);
 VECTOR torsion_torq(float phi, float V2, float n_fold, float gamma, VECTOR k);
-float Ecoulomb_conf2conf(PROT prot, int ir, int ic, int kr, int kc, float epsilon);
-float Evdw_conf2conf(PROT prot, int ir, int ic, int kr, int kc);
+float Ecoulomb_conf2conf(const PROT &prot, int ir, int ic, int kr, int kc, float epsilon);
+float Evdw_conf2conf(const PROT &prot, int ir, int ic, int kr, int kc);
 float CoulombBySAS(ATOM atom1, ATOM atom2);
-float RxnBySAS(CONF conf);
-int sas_native(PROT prot);
-int sas_ionizable(PROT prot, float probe_rad);
+float RxnBySAS(const CONF &conf);
+int sas_native(const PROT &prot);
+int sas_ionizable(const PROT &prot, float probe_rad);
 
 /* IPECE related */
-int probe(PROT prot, IPECE *ipece);
+int probe(const PROT &prot, IPECE *ipece);
 int free_probe(IPECE *ipece);
-int create_grid_box(PROT prot, IPECE *ipece);
+int create_grid_box(const PROT &prot, IPECE *ipece);
 INT_VECT coor2grid(VECTOR r, IPECE *ipece);
 VECTOR grid2coor(INT_VECT grid, IPECE *ipece);
 char *reach_label(INT_VECT grid, IPECE *ipece);
@@ -833,47 +949,61 @@ FILE *cpremcce_rename(FILE *fp_in, const char *rule_path);
 int rm_comment(char *target, char *str);
 int strip(char *target, const char *str);
 int get_env();
-int assign_vdw_param(PROT &prot);
-int assign_rad(PROT prot);
-int assign_crg(PROT prot);
-int get_connect12(PROT prot);
-int get_connect12_conf(int i_res, int i_conf, PROT prot);
-int delete_h(PROT prot);
-int surfw(PROT prot, float probe_rad);
-int surfw_res(PROT prot, int ir, float probe_rad);
-int surfw_l2(PROT prot, float probe_rad);
+int assign_vdw_param(const PROT &prot);
+int assign_rad(const PROT &prot);
+int assign_crg(const PROT &prot);
+int get_connect12(const PROT &prot);
+int get_connect12_conf(int i_res, int i_conf, const PROT &prot);
+int delete_h(const PROT &prot);
+int surfw(const PROT &prot, float probe_rad);
+int surfw_res(const PROT &prot, int ir, float probe_rad);
+void sas_env_free();
+int surfw_l2(const PROT &prot, float probe_rad);
 void shuffle_n(int *array, int n);
-int cmp_conf(CONF conf1, CONF conf2, float IDEN_THR);
-int cmp_conf_hv(CONF conf1, CONF conf2, float IDEN_THR);
-float dist_conf_hv(CONF conf1, CONF conf2);
-float rmsd_conf_hv(CONF conf1, CONF conf2);
-void id_conf(PROT &prot);
-int sort_conf(PROT prot);
-int sort_res(PROT prot);
-void get_vdw0(PROT prot);
-void get_vdw0_no_sas(PROT prot);
-void get_vdw1(PROT prot);
-void get_vdw0_res(int i_res, PROT prot);
-void get_vdw0_res_no_sas(int i_res, PROT prot);
-void get_vdw1_res(int i_res, PROT prot);
-void load_headlst(PROT prot);
-void write_headlst(PROT prot);
+int cmp_conf(const CONF &conf1, const CONF &conf2, float IDEN_THR);
+int cmp_conf_hv(const CONF &conf1, const CONF &conf2, float IDEN_THR);
+float dist_conf_hv(const CONF &conf1, const CONF &conf2);
+float rmsd_conf_hv(const CONF &conf1, const CONF &conf2);
+void id_conf(const PROT &prot);
+int sort_conf(const PROT &prot);
+int sort_res(const PROT &prot);
+void get_vdw0(const PROT &prot);
+void get_vdw0_no_sas(const PROT &prot);
+void get_vdw1(const PROT &prot);
+void get_vdw0_res(int i_res, const PROT &prot);
+void get_vdw0_res_no_sas(int i_res, const PROT &prot);
+void get_vdw1_res(int i_res, const PROT &prot);
+void load_headlst(const PROT &prot);
+void write_headlst(const PROT &prot);
 double ran2(long *idum);
 int cmp_Eself(const void *a, const void *b);
 float hbond_extra(CONF a, CONF b);
 int def(FILE *source, FILE *dest, int level);
 int inf(FILE *source, FILE *dest);
 int del_dir(char *dir_name);
-int place_missing(PROT prot, int handle_addconf);
-int place_missing_res(PROT prot, int i_res, int handle_addconf);
+int place_missing(const PROT &prot, int handle_addconf);
+int place_missing_res(const PROT &prot, int i_res, int handle_addconf);
 
 /* done */
 int free_ematrix(EMATRIX *ematrix);
-int make_matrices(PROT prot, char *dir);
+int make_matrices(const PROT &prot, char *dir);
 int write_energies(EMATRIX *ematrix, char *dir, int verbose);
 int head3lst_param(EMATRIX ematrix);
+FILE *open_energies_opp(const char *dir, int *n_conf);
 int load_energies(EMATRIX *ematrix, const char *dir, int verbose);
 int extract_matrix(EMATRIX *ematrix, char *dir, int verbose);
+int write_energies_map(EMATRIX *ematrix, const char *dir, int compressed);
+int open_energies_map(EMATRIX_MAP *emap, const char *dir);
+const PAIRWISE *energies_map_row(EMATRIX_MAP *emap, int i);
+int close_energies_map(EMATRIX_MAP *emap);
+int alloc_sparse_pw(SPARSE_PW *spw, int n);
+int add_sparse_pw_row(SPARSE_PW *spw, int ic, const float *row, float thr);
+float get_sparse_pw(const SPARSE_PW *spw, int ic, int jc);
+int sym_sparse_pw(SPARSE_PW *spw, float thr);
+int merge_sparse_pw(SPARSE_PW *spw, float thr, double (*pair)(int ic, int jc, float p, float pt));
+int free_sparse_pw(SPARSE_PW *spw);
+int write_pw_row(const char *fname, PW_ROW_HEAD *head, PW_ROW *row);
+int read_pw_row(const char *fname, PW_ROW_HEAD *head, PW_ROW **row);
 
 /* Modeules */
 int init();
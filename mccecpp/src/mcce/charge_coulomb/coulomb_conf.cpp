@@ -3,7 +3,7 @@
 #include <string.h>
 #include "mcce.h"
 
-float coulomb_conf(int ires, int iconf, int jres, int jconf, PROT prot)
+float coulomb_conf(int ires, int iconf, int jres, int jconf, const PROT &prot)
 {
     float  e = 0.0;
     int    iatom, jatom;
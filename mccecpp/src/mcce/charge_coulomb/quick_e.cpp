@@ -36,7 +36,7 @@ float CoulombBySAS(ATOM atom1, ATOM atom2)
    else return 331.5*atom1.crg*atom2.crg/d * exp(-d/7.8) * (1.25-atom1.sas)*(1.25-atom2.sas)*0.44;
 }
 
-float RxnBySAS(CONF conf)
+float RxnBySAS(const CONF &conf)
 {  float dsolv, rxn0;
    int ia, n_atom;
    float av_sas, av_crg, rxn;
@@ -74,7 +74,7 @@ float RxnBySAS(CONF conf)
    else return rxn;
 }
 
-float Ecoulomb_conf2conf(PROT prot, int ir, int ic, int kr, int kc, float epsilon)
+float Ecoulomb_conf2conf(const PROT &prot, int ir, int ic, int kr, int kc, float epsilon)
 {  int ia, ka;
    float E = 0;
    
@@ -91,7 +91,7 @@ float Ecoulomb_conf2conf(PROT prot, int ir, int ic, int kr, int kc, float epsilo
    return E/epsilon;
 }
 
-float Evdw_conf2conf(PROT prot, int ir, int ic, int kr, int kc)
+float Evdw_conf2conf(const PROT &prot, int ir, int ic, int kr, int kc)
 {  int ia, ka;
    float E = 0;
    
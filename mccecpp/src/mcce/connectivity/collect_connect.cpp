@@ -3,7 +3,7 @@
 #include <string.h>
 #include "mcce.h"
 
-void collect_all_connect12(int i_res, int i_conf, int i_atom, PROT prot, int (*n_connect12), ATOM **(*connect12)) {
+void collect_all_connect12(int i_res, int i_conf, int i_atom, const PROT &prot, int (*n_connect12), ATOM **(*connect12)) {
     ATOM *atom_p;
     int j_res, j_conf, j_atom, i_connect;
     
@@ -48,7 +48,7 @@ void collect_all_connect12(int i_res, int i_conf, int i_atom, PROT prot, int (*n
     }
 }
 
-void collect_all_connect(int i_res, int i_conf, int i_atom, PROT prot, int (*n_connect12), ATOM ***connect12, int (*n_connect13), ATOM ***connect13, int (*n_connect14), ATOM ***connect14) {
+void collect_all_connect(int i_res, int i_conf, int i_atom, const PROT &prot, int (*n_connect12), ATOM ***connect12, int (*n_connect13), ATOM ***connect13, int (*n_connect14), ATOM ***connect14) {
     ATOM *atom_p;
     int j_res, j_conf, j_atom, i_connect,j_connect;
     int n_connect12_j;
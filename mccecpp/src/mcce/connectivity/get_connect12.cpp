@@ -6,20 +6,107 @@
 #define BOND_THR 2.4
 #define MAX_LIGS 1000
 
-int get_connect12(PROT prot) {
-    int         i_res, i_conf;
+static int connect12_conf(int i_res, int i_conf, const PROT &prot, int *lo, int *hi, char *all);
+
+static unsigned long long sig_bytes(unsigned long long h, const void *p, size_t n)
+{
+    /* FNV-1a */
+    const unsigned char *c = (const unsigned char *) p;
+    size_t i;
+
+    for (i=0; i<n; i++) {
+        h ^= c[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned long long res_connect_sig(const PROT &prot, int i_res)
+{
+    /* everything of a residue that get_connect12_conf() looks at or points to */
+    const RES *res_p = &prot.res[i_res];
+    const ATOM *atom_p;
+    int i_conf, i_atom;
+    unsigned long long h = 14695981039346656037ULL;
+
+    h = sig_bytes(h, &i_res, sizeof(int));
+    h = sig_bytes(h, &res_p->n_conf, sizeof(int));
+    for (i_conf=0; i_conf<res_p->n_conf; i_conf++) {
+        h = sig_bytes(h, res_p->conf[i_conf].confName, sizeof(res_p->conf[i_conf].confName));
+        h = sig_bytes(h, &res_p->conf[i_conf].n_atom, sizeof(int));
+        h = sig_bytes(h, &res_p->conf[i_conf].atom, sizeof(ATOM *));
+        for (i_atom=0; i_atom<res_p->conf[i_conf].n_atom; i_atom++) {
+            atom_p = &res_p->conf[i_conf].atom[i_atom];
+            h = sig_bytes(h, &atom_p->on, sizeof(atom_p->on));
+            h = sig_bytes(h, atom_p->name, sizeof(atom_p->name));
+            h = sig_bytes(h, &atom_p->xyz, sizeof(VECTOR));
+        }
+    }
+    return h;
+}
+
+static unsigned long long env_connect_sig(const PROT &prot, int i_res, const unsigned long long *res_sig, unsigned long long all_sig)
+{
+    /* the residue and the residues its last get_connect12() searched */
+    const RES *res_p = &prot.res[i_res];
+    unsigned long long h = res_sig[i_res];
+    int j_res;
+
+    h = sig_bytes(h, &prot.n_res, sizeof(int));
+    for (j_res=i_res+res_p->connect_lo; j_res<=i_res+res_p->connect_hi; j_res++) {
+        if (j_res < 0 || j_res >= prot.n_res || j_res == i_res) continue;
+        h = sig_bytes(h, &res_sig[j_res], sizeof(unsigned long long));
+    }
+    if (res_p->connect_all) h = sig_bytes(h, &all_sig, sizeof(unsigned long long));
+    return h? h : 1;
+}
+
+int get_connect12(const PROT &prot) {
+    /* A residue keeps its connectivity while neither it nor any residue its CONNECT records searched
+     * changed: conformers, atom names, on flags and coordinates are hashed into res.connect_sig.
+     * Residues with ligand or terminal links search the whole protein and follow any change.
+     */
+    int         i_res, i_conf, lo, hi, res_err;
     int         ret_val, err = 0;
-    
+    char        all;
+    unsigned long long *res_sig, all_sig = 14695981039346656037ULL;
+    RES         *res_p;
+
+    if (!(res_sig = (unsigned long long *) malloc((prot.n_res+1)*sizeof(unsigned long long)))) {
+        printf("   Error! get_connect12(): memory error\n");
+        return -1;
+    }
     for (i_res=0; i_res<prot.n_res; i_res++) {
-        for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
-            ret_val = get_connect12_conf(i_res, i_conf, prot);
+        res_sig[i_res] = res_connect_sig(prot, i_res);
+        all_sig = sig_bytes(all_sig, &res_sig[i_res], sizeof(unsigned long long));
+    }
+
+    for (i_res=0; i_res<prot.n_res; i_res++) {
+        res_p = &prot.res[i_res];
+        if (res_p->connect_sig && res_p->connect_sig == env_connect_sig(prot, i_res, res_sig, all_sig)) continue;
+
+        lo = hi = 0;
+        all = 0;
+        res_err = 0;
+        for (i_conf=0; i_conf<res_p->n_conf; i_conf++) {
+            ret_val = connect12_conf(i_res, i_conf, prot, &lo, &hi, &all);
             if (ret_val == -1) {
                 printf("   Error! get_connect12(): Error in CONNECT parameter, refer to debug log file: %s for detail\n", env.debug_log);
+                res_p->connect_sig = 0;
+                free(res_sig);
                 return -1;
             }
-            else err += ret_val;
+            else res_err += ret_val;
         }
+        err += res_err;
+
+        res_p->connect_lo  = lo;
+        res_p->connect_hi  = hi;
+        res_p->connect_all = all;
+        /* residues with errors are redone every time, as the parameters may be completed later */
+        res_p->connect_sig = res_err? 0 : env_connect_sig(prot, i_res, res_sig, all_sig);
     }
+    free(res_sig);
 
     if (err)
         printf("   Error in connectivity, grep \"get_connect12\" from %s to find details!\n",env.debug_log);
@@ -27,9 +114,21 @@ int get_connect12(PROT prot) {
     return 0;
 }
 
-int get_connect12_conf(int i_res, int i_conf, PROT prot)
+int get_connect12_conf(int i_res, int i_conf, const PROT &prot)
+{
+    int  lo, hi;
+    char all;
+
+    prot.res[i_res].connect_sig = 0;  /* redone by the next get_connect12() */
+    return connect12_conf(i_res, i_conf, prot, &lo, &hi, &all);
+}
+
+static int connect12_conf(int i_res, int i_conf, const PROT &prot, int *lo, int *hi, char *all)
 {
-    CONNECT     connect;
+    /* connectivity of one conformer, widens [*lo, *hi] to the residue offsets searched and sets *all
+     * when the whole protein was searched (ligand and terminal links)
+     */
+    const CONNECT *connect;
     FILE        *debug_fp;
     int         i_atom;
     int         j_connect, k_connect, n_connect;
@@ -55,7 +154,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
         
         /* Error checking for connectivity parameter */
         memset(atom_p->connect12, 0, MAX_CONNECTED*sizeof(void *));
-        if (param_get("CONNECT", conf_p->confName, atom_p->name, &connect) ) {
+        if (!(connect = (const CONNECT *) param_ptr("CONNECT", conf_p->confName, atom_p->name))) {
             debug_fp = fopen(env.debug_log, "a");
             fprintf(debug_fp, "   Error! get_connect12(): Can't find CONNECT parameter of conformer \"%s\" atom \"%s\"\n", conf_p->confName, atom_p->name);
             fclose(debug_fp);
@@ -63,7 +162,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
             continue;
         }
 
-        if (connect.n > MAX_CONNECTED) {
+        if (connect->n > MAX_CONNECTED) {
             debug_fp = fopen(env.debug_log, "a");
             fprintf(debug_fp, "   Error! get_connect12(): Error in CONNECT parameter for conformer \"%s\" atom \"%s\", number of connected atoms is bigger than array size\nCheck parameter file or fix mcce.h with a bigger MAX_CONNECTED \n", conf_p->confName, atom_p->name);
             fclose(debug_fp);
@@ -74,14 +173,14 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
         // ligand connectivity means this atom is connected with a ligand.
         lig_treated = 0;
         /* Looping over each connectivity member */
-        for (j_connect=0; j_connect<connect.n; j_connect++) {
+        for (j_connect=0; j_connect<connect->n; j_connect++) {
             connect_found = 0;
             
             /* Ligand type connectivity or not */
-            if (!connect.atom[j_connect].ligand) {      /* NOT ligand type */
-                if (!connect.atom[j_connect].res_offset) { /* If within the same residue (off_set is 0) */
+            if (!connect->atom[j_connect].ligand) {      /* NOT ligand type */
+                if (!connect->atom[j_connect].res_offset) { /* If within the same residue (off_set is 0) */
                     j_res = i_res;
-                    if ( !param_get("IATOM", conf_p->confName, connect.atom[j_connect].name, &j_atom) ) {
+                    if ( !param_get("IATOM", conf_p->confName, connect->atom[j_connect].name, &j_atom) ) {
                         /* First search atom in the same conformer */
                         j_conf = i_conf;
                         atom_p->connect12[j_connect] = &prot.res[j_res].conf[j_conf].atom[j_atom];
@@ -95,7 +194,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                         */
                         for (j_conf = 0; j_conf < prot.res[j_res].n_conf; j_conf++) {
                             if (j_conf == i_conf) continue;
-                            if ( !param_get("IATOM", prot.res[j_res].conf[j_conf].confName, connect.atom[j_connect].name, &j_atom) ) {
+                            if ( !param_get("IATOM", prot.res[j_res].conf[j_conf].confName, connect->atom[j_connect].name, &j_atom) ) {
                                 atom_p->connect12[j_connect] = &prot.res[j_res].conf[j_conf].atom[j_atom];
                                 atom_p->connect12_res[j_connect] = j_res;
                                 connect_found = 1;
@@ -108,7 +207,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                             char err_msg2[MAXCHAR_LINE];
                             sprintf(err_msg1,"   Error! get_connect12(): connectivity of atom \"%s %s %c%04d\" is not complete",
                             atom_p->name, conf_p->confName, res_p->chainID, res_p->resSeq);
-                            sprintf(err_msg2,"          get_connect12(): atom %s in the same residue is not found", connect.atom[j_connect].name);
+                            sprintf(err_msg2,"          get_connect12(): atom %s in the same residue is not found", connect->atom[j_connect].name);
                             if (param_exist(err_msg1, "", "")) {
                                 if (param_exist(err_msg2, "", "")) {
                                     continue;
@@ -127,13 +226,15 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                     }
                 }
                 else {        /* Not in the same reside. */
-                    j_res = i_res + connect.atom[j_connect].res_offset;
+                    j_res = i_res + connect->atom[j_connect].res_offset;
+                    if (connect->atom[j_connect].res_offset < *lo) *lo = connect->atom[j_connect].res_offset;
+                    if (connect->atom[j_connect].res_offset > *hi) *hi = connect->atom[j_connect].res_offset;
                     if (j_res < 0 || j_res >= prot.n_res) {     /* j_res is out of residue list */
                         char err_msg1[MAXCHAR_LINE];
                         char err_msg2[MAXCHAR_LINE];
                         sprintf(err_msg1, "   Error! get_connect12(): connectivity of atom \"%s %s %c%04d\" is not complete:\n",
                         atom_p->name, res_p->resName, res_p->chainID, res_p->resSeq);
-                        sprintf(err_msg2, "          get_connect12(): atom %s of residue i%+d is not found \n", connect.atom[j_connect].name,connect.atom[j_connect].res_offset);
+                        sprintf(err_msg2, "          get_connect12(): atom %s of residue i%+d is not found \n", connect->atom[j_connect].name,connect->atom[j_connect].res_offset);
                         if (param_exist(err_msg1, "", "")) {
                             if (param_exist(err_msg2, "", "")) {
                                 continue;
@@ -153,7 +254,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                     }
                     
                     for (j_conf = 0; j_conf < prot.res[j_res].n_conf; j_conf++) {
-                        if ( !param_get("IATOM", prot.res[j_res].conf[j_conf].confName, connect.atom[j_connect].name, &j_atom) ) {
+                        if ( !param_get("IATOM", prot.res[j_res].conf[j_conf].confName, connect->atom[j_connect].name, &j_atom) ) {
                             if (!prot.res[j_res].conf[j_conf].atom[j_atom].on) {
                                 atom_p->connect12[j_connect] = &prot.res[j_res].conf[j_conf].atom[j_atom];
                                 atom_p->connect12_res[j_connect] = j_res;
@@ -161,7 +262,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
 
                                 debug_fp = fopen(env.debug_log, "a");
                                 fprintf(debug_fp, "   WARNING! get_connect12(): atom %s of residue i%+d is in connectivity list of atom \"%s %s %c%04d\", but it's not on\n",
-                                connect.atom[j_connect].name,connect.atom[j_connect].res_offset,atom_p->name, res_p->resName, res_p->chainID, res_p->resSeq);
+                                connect->atom[j_connect].name,connect->atom[j_connect].res_offset,atom_p->name, res_p->resName, res_p->chainID, res_p->resSeq);
                                 fclose(debug_fp);
                                 break;
                             }
@@ -180,7 +281,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                         char err_msg2[MAXCHAR_LINE];
                         sprintf(err_msg1, "   Error! get_connect12(): connectivity of atom \"%s %s %c%04d\" is not complete:\n",
                         atom_p->name, res_p->resName, res_p->chainID, res_p->resSeq);
-                        sprintf(err_msg2, "          get_connect12(): atom %s of residue i%+d is not found \n", connect.atom[j_connect].name,connect.atom[j_connect].res_offset);
+                        sprintf(err_msg2, "          get_connect12(): atom %s of residue i%+d is not found \n", connect->atom[j_connect].name,connect->atom[j_connect].res_offset);
 
                         if (param_exist(err_msg1, "", "")) {
                             if (param_exist(err_msg2, "", "")) {
@@ -203,6 +304,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
 
             else {      /* Ligand type connectivity */
                 if (lig_treated) continue;
+                *all = 1;
                 
                 /* Loop over all atoms and find all atom within bond threshold */
                 n_ligs = 0;
@@ -228,19 +330,19 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                 }
                 
                 /* Go over connectivity list and put connected atoms in for those atom name is defined */
-                for (k_connect=j_connect; k_connect<connect.n; k_connect++) {
-                    if (!connect.atom[k_connect].ligand) continue;
+                for (k_connect=j_connect; k_connect<connect->n; k_connect++) {
+                    if (!connect->atom[k_connect].ligand) continue;
                     if (atom_p->connect12[k_connect]) continue;
-                    if (strchr(connect.atom[k_connect].name, '?')) continue; /* If atom name in parameter is a '?', then go to next one */
+                    if (strchr(connect->atom[k_connect].name, '?')) continue; /* If atom name in parameter is a '?', then go to next one */
                     
                     for (k_lig=0; k_lig<n_ligs; k_lig++) {
-                        if (strcmp(ligs[k_lig]->name, connect.atom[k_connect].name)) continue;
+                        if (strcmp(ligs[k_lig]->name, connect->atom[k_connect].name)) continue;
                         
                         /* Check if ligand atom is already in the connectivity list, this is for the case one atom connect to over one atom with same name */
-                        for (l_connect=j_connect; l_connect<connect.n; l_connect++) {
+                        for (l_connect=j_connect; l_connect<connect->n; l_connect++) {
                             if (ligs[k_lig] == atom_p->connect12[l_connect]) break;
                         }
-                        if (l_connect < connect.n) continue;
+                        if (l_connect < connect->n) continue;
                         
                         /* Adding ligs[k_lig] into list */
                         // it kind of randomly adds ligand atoms to the lignad connectivity entries.
@@ -251,12 +353,12 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                 }
                 
                 /* Then go over connectivity list again and put atoms in for those atom name is not defined */
-                for (k_connect=j_connect; k_connect<connect.n; k_connect++) {
+                for (k_connect=j_connect; k_connect<connect->n; k_connect++) {
                     int k_lig_add;
                     float lig_dist;
-                    if (!connect.atom[k_connect].ligand) continue;
+                    if (!connect->atom[k_connect].ligand) continue;
                     if (atom_p->connect12[k_connect]) continue;
-                    if (!strchr(connect.atom[k_connect].name, '?')) continue;   /* If atom name in parameter is not a '?', then go to next one */
+                    if (!strchr(connect->atom[k_connect].name, '?')) continue;   /* If atom name in parameter is not a '?', then go to next one */
                     
                     k_lig_add = -1;
                     lig_dist = BOND_THR;
@@ -265,11 +367,11 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                         if (ligs[k_lig]->name[1] == 'H') continue; /* If it's a proton, then not considered */
                         
                         /* Check if ligand atom is already in the connectivity list, this is for the case one atom connect to over one atom with same name */
-                        for (l_connect=j_connect; l_connect<connect.n; l_connect++) {
+                        for (l_connect=j_connect; l_connect<connect->n; l_connect++) {
                             if (ligs[k_lig] == atom_p->connect12[l_connect]) break;
                         }
 
-                        if (l_connect < connect.n) continue;
+                        if (l_connect < connect->n) continue;
                         
                         if (dvv(atom_p->xyz, ligs[k_lig]->xyz) < lig_dist) {
                             lig_dist = dvv(atom_p->xyz,ligs[k_lig]->xyz);
@@ -285,12 +387,12 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                 }
                 
                 /* Go over connectivity list to check if there is empty slot */
-                for (k_connect=j_connect; k_connect<connect.n; k_connect++) {
-                    if (!connect.atom[k_connect].ligand) continue;
+                for (k_connect=j_connect; k_connect<connect->n; k_connect++) {
+                    if (!connect->atom[k_connect].ligand) continue;
                     if (atom_p->connect12[k_connect]) continue;
 
                     char err_msg1[MAXCHAR_LINE];
-                    sprintf(err_msg1, "   Warning! get_connect12(): An empty ligand connectivity slot found for atom %s in residue %s %d to atom %s\n", atom_p->name, res_p->resName, res_p->resSeq, connect.atom[k_connect].name);
+                    sprintf(err_msg1, "   Warning! get_connect12(): An empty ligand connectivity slot found for atom %s in residue %s %d to atom %s\n", atom_p->name, res_p->resName, res_p->resSeq, connect->atom[k_connect].name);
                     
                     if (param_exist(err_msg1, "", "")) {
                         continue;
@@ -308,10 +410,10 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                     if (ligs[k_lig]->name[1] == 'H') continue; /* If it's a proton, then not considered */
                     
                     /* Check if ligand atom is already in the connectivity list, this is for the case one atom connect to over one atom with same name */
-                    for (l_connect=j_connect; l_connect<connect.n; l_connect++) {
+                    for (l_connect=j_connect; l_connect<connect->n; l_connect++) {
                         if (ligs[k_lig] == atom_p->connect12[l_connect]) break;
                     }
-                    if (l_connect < connect.n) continue;
+                    if (l_connect < connect->n) continue;
 
                     char err_msg1[MAXCHAR_LINE];
                     sprintf(err_msg1, "   Warning! get_connect12(): An atom (%s in residue %s %d) within bond threshold to atom %s in residue %s %d is not put in the connectivity list \n",ligs[k_lig]->name, ligs[k_lig]->resName, ligs[k_lig]->resSeq, atom_p->name, res_p->resName, res_p->resSeq);
@@ -334,9 +436,10 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
             /* If connecting to a dummy atom, it could be the case connecting to NTR or CTR */
             if (!atom_p->connect12[j_connect]) continue;
             if ( atom_p->connect12[j_connect]->on) continue;
-            if (strcmp(connect.atom[j_connect].name, " CA ") && strcmp(connect.atom[j_connect].name, " C  ")) continue;
+            if (strcmp(connect->atom[j_connect].name, " CA ") && strcmp(connect->atom[j_connect].name, " C  ")) continue;
             //printf("   Debugging! residue %s%4d,conformer %s, on=%d\n", res_p->resName,res_p->resSeq,conf_p->confName,atom_p->connect12[j_connect]->on);
             connect_found = 0;
+            *all = 1;
             for (j_res=0; j_res<prot.n_res; j_res++) {
                 if (strcmp(prot.res[j_res].resName, "NTR"))
                     if (strcmp(prot.res[j_res].resName, "NTG"))
@@ -347,7 +450,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
                         jatom_p = &prot.res[j_res].conf[j_conf].atom[j_atom];
                         if (!jatom_p->on) continue;
                         
-                        if (strcmp(connect.atom[j_connect].name, jatom_p->name)) continue;
+                        if (strcmp(connect->atom[j_connect].name, jatom_p->name)) continue;
                         if (BOND_THR > dvv(atom_p->xyz, jatom_p->xyz)) {
                             atom_p->connect12[j_connect] = jatom_p;
                             atom_p->connect12_res[j_connect] = j_res;
@@ -362,7 +465,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
         }
         
         /* Move NULL pointer to the end of the array */
-        n_connect = connect.n;
+        n_connect = connect->n;
         for (j_connect=0; j_connect < n_connect-1; j_connect++) {
             if (!atom_p->connect12[j_connect]) {
                 for (k_connect=j_connect; k_connect<n_connect-1; k_connect++) {
@@ -377,9 +480,9 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
             }
         }
         if (!strcmp(conf_p->confName, "HOH-1")) {
-        	printf("HOH-1, atomName: %s, conn: %d,", atom_p->name, connect.n);
+        	printf("HOH-1, atomName: %s, conn: %d,", atom_p->name, connect->n);
         	int iz;
-        	for (iz=0; iz<connect.n; iz++) {
+        	for (iz=0; iz<connect->n; iz++) {
         		printf("%s\t", atom_p->connect12[iz]->name);
         	}
         	printf("\n");
@@ -389,7 +492,7 @@ int get_connect12_conf(int i_res, int i_conf, PROT prot)
     if (!strcmp(conf_p->confName, "HOH-1")) {
     	printf("HOH-1, atomName: %s,", conf_p->atom[1].name);
 //    	int iz;
-//    	for (iz=0; iz<connect.n; iz++) {
+//    	for (iz=0; iz<connect->n; iz++) {
 //    		printf("%s\t", atom_p->connect12[iz]->name);
 //    	}
     	printf("\n");
@@ -6,24 +6,30 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <zlib.h>
 #include "mcce.h"
 
-int refresh_prot(PROT prot);
+#define EMAP_MAGIC     "MCCEMAP"
+#define EMAP_TILE_SIZE (1<<20)   /* target bytes of a tile before compression */
 
-int make_matrices(PROT prot, char *dir)
+int refresh_prot(const PROT &prot);
+int load_energies_map(EMATRIX *ematrix, EMATRIX_MAP *emap, int verbose);
+int write_opp_row(EMATRIX *ematrix, const PAIRWISE *row, int i, char *dir);
+int write_energies_opp(EMATRIX *ematrix, char *dir, int verbose);
+
+int make_matrices(const PROT &prot, char *dir)
 {
-	int i, kr, kc, counter, verbose = 0;
-	int n_conf, n_dummies;
+	int i, k, kr, kc, counter, verbose = 0;
+	int n_conf, n_dummies, n_real, err;
 	char fname[MAXCHAR_LINE];
-	FILE *fp;
-	char sbuff[MAXCHAR_LINE];
-	char sbuff2[MAXCHAR_LINE];
 	char confName[6];
 	int natom;
-	int serial;
-	char uniqID[15];
-	char dummy;
+	char *is_dummy;
+	int *col;
+	PW_ROW_HEAD head;
+	PW_ROW *row;
 	EMATRIX ematrix;
 
 
@@ -121,94 +127,79 @@ int make_matrices(PROT prot, char *dir)
 	head3lst_param(ematrix); /* fine tune and complete the rest param  */
 
 	/* updating the pw of matrix */
-	n_dummies = 0;
+	/* step 3 rows list the conformers without the dummies, col maps them to the matrix */
+	if (!(is_dummy = (char *) malloc(ematrix.n)) || !(col = (int *) malloc(ematrix.n*sizeof(int)))) {
+		printf("   Allocate memory error\n");
+		return USERERR;
+	}
+	n_real = 0;
 	for (kc=0; kc<ematrix.n; kc++) {
-		/* dummy conformer doesn't have opp file */
 		strncpy(confName, ematrix.conf[kc].uniqID, 5); confName[5] = '\0';
 		if (param_get("NATOM", confName, "", &natom)) {
 			printf("   WARNING: no NATOM for %s, 0 assumed\n", confName);
 			natom = 0;
 			param_sav("NATOM", confName, "", &natom, sizeof(int));
 		}
-		if (natom == 0) { /* dummy */
+		is_dummy[kc] = (natom == 0);
+		if (!is_dummy[kc]) col[n_real++] = kc;
+	}
+
+	err = 0;
+	n_dummies = 0;
+	for (kc=0; kc<ematrix.n; kc++) {
+		if (is_dummy[kc]) { /* dummy conformer doesn't have a row file */
 			n_dummies ++;
 			ematrix.conf[kc].on = 't';
-			for (i=0; i<ematrix.n; i++) {
+		}
+		else if (((kc-n_dummies+1) >= env.pbe_start && (kc-n_dummies+1) <= env.pbe_end)) { /* in current calculation */
+			ematrix.conf[kc].on = 't';
+		}
+		else continue;
+		for (i=0; i<ematrix.n; i++) {
+			if (is_dummy[kc] || is_dummy[i]) {
 				ematrix.pw[kc][i].ele = ematrix.pw[kc][i].vdw = ematrix.pw[kc][i].crt = ematrix.pw[kc][i].ori = 0.0;
 				ematrix.pw[kc][i].mark[0] = '\0';
 			}
-			continue;
 		}
+	}
 
-		if (((kc-n_dummies+1) >= env.pbe_start && (kc-n_dummies+1) <= env.pbe_end)) { /* in current calculation */
-			ematrix.conf[kc].on = 't';
-			sprintf(fname, "%s.opp", ematrix.conf[kc].uniqID);
-			if (!(fp = fopen(fname, "r"))) {
-				printf("   FATAL: read file error %s\n", fname);
-				return USERERR;
-			}
-
-			/* load pairwise energy */
-			for (i=0; i<ematrix.n; i++) {
-				/* Skip dummies */
-				while (1) { /* a mismatch, dummy */
-					strncpy(confName, ematrix.conf[i].uniqID, 5); confName[5] = '\0';
-					if (param_get("NATOM", confName, "", &natom)) {
-						printf("   FATAL: no NATOM for %s\n", confName);
-						return USERERR;
-					}
-
-					if (natom == 0) {
-						ematrix.pw[kc][i].ele = ematrix.pw[kc][i].vdw = ematrix.pw[kc][i].crt = ematrix.pw[kc][i].ori = 0.0;
-						ematrix.pw[kc][i].mark[0] = '\0';
-						dummy = 1;
-						i++;  /* skip to the next valid */
-					}
-					else {
-						dummy = 0;
-						break;          /* break as non dummy */
-					}
-
-					if (i>=ematrix.n) break; /* break as done, dummy would continue */
-				}
-				if (dummy) break;
-
-				/* everything reaches here is non dummy */
-				if (!fgets(sbuff, sizeof(sbuff), fp)) {
-					printf("   FATAL: Unexpected end of file %s.\n", fname);
-					return USERERR;
-				}
-
-
-				strncpy(sbuff2, sbuff, 5); sbuff2[5] = '\0';
-				serial = atoi(sbuff2);
-
-				strncpy(uniqID, sbuff+6, 14); uniqID[14] = '\0';
-
-				strncpy(sbuff2, sbuff+20, 10); sbuff2[10] = '\0';
-				ematrix.pw[kc][i].crt = atof(sbuff2);
-
-				strncpy(sbuff2, sbuff+30, 10); sbuff2[10] = '\0';
-				ematrix.pw[kc][i].vdw = atof(sbuff2);
-
-				strncpy(sbuff2, sbuff+40, 10); sbuff2[10] = '\0';
-				ematrix.pw[kc][i].ori = atof(sbuff2);
-
-				strncpy(ematrix.pw[kc][i].mark, sbuff+50, 3);
-				*(strchr(ematrix.pw[kc][i].mark,'\n')) = '\0';
-
-				//sscanf(sbuff, "%d %s %f %f %f %s", &serial, uniqID, &pairwise_raw[kc][i].ele, &pairwise_raw[kc][i].vdw, &pairwise_raw[kc][i].ori, pairwise_raw[kc][i].mark);
-				if (strcmp(uniqID, ematrix.conf[i].uniqID)) {
-					printf("   FATAL: Mismatch %s in protein structure and %s in %s.\n", ematrix.conf[i].uniqID,
-							uniqID,
-							fname);
-					return USERERR;
-				}
-			}
-			fclose(fp);
+	/* rows are independent files, read them concurrently */
+#pragma omp parallel for schedule(dynamic) private(i, kc, fname, head, row) reduction(|:err)
+	for (k=env.pbe_start-1; k<env.pbe_end; k++) {
+		if (k < 0 || k >= n_real) continue;
+		kc = col[k];
+		sprintf(fname, "%s.pwb", ematrix.conf[kc].uniqID);
+		if (read_pw_row(fname, &head, &row)) {
+			err = 1;
+			continue;
+		}
+		if (head.iconf != k || head.n != n_real || strncmp(head.uniqID, ematrix.conf[kc].uniqID, sizeof(head.uniqID))) {
+			printf("   FATAL: Mismatch %s (conformer %d of %d) in protein structure and %s (conformer %d of %d) in %s.\n",
+					ematrix.conf[kc].uniqID, k, n_real, head.uniqID, head.iconf, head.n, fname);
+			free(row);
+			err = 1;
+			continue;
+		}
+		for (i=0; i<n_real; i++) {
+			ematrix.pw[kc][col[i]].crt = row[i].ele;
+			ematrix.pw[kc][col[i]].vdw = row[i].vdw;
+			ematrix.pw[kc][col[i]].ori = row[i].ori;
+			strcpy(ematrix.pw[kc][col[i]].mark, row[i].mark);
 		}
+		free(row);
 	}
-
+	if (err) return USERERR;
+
+	if (env.export_opp) {
+		sprintf(fname, "%s/%s", dir, OPP_FOLDER);
+		mkdir(fname, 0755);
+		for (k=env.pbe_start-1; k<env.pbe_end && k<n_real; k++) {
+			if (k < 0) continue;
+			if (write_opp_row(&ematrix, ematrix.pw[col[k]], col[k], fname)) return USERERR;
+		}
+	}
+	free(is_dummy);
+	free(col);
 
 	if (write_energies(&ematrix, dir, verbose)) {
 		printf("   Error in writing energy lookuptable %s/%s\n", dir, ENERGY_TABLE);
@@ -221,21 +212,21 @@ int make_matrices(PROT prot, char *dir)
 	return 0;
 }
 
-int load_energies(EMATRIX *ematrix, const char *dir, int verbose)
-/* this program returns number of conformers loaded, or -1 if no exsiting energy table */
+FILE *open_energies_opp(const char *dir, int *n_conf)
+/* inflate energies.opp and read its first line. The n_conf conformer heads follow
+ * in the returned file, then n_conf rows of n_conf PAIRWISE. NULL if there is no
+ * readable table.
+ */
 {
-	int i, n_conf;
     char sbuff[128];
     FILE *fp, *fp2;
-    CONF_HEAD *conf;
-    PAIRWISE *pw;
     char version[128];
 
     /* Obtain the first line of the energy lookup table, which is the number of conformers */
     sprintf(sbuff, "%s/%s", dir, ENERGY_TABLE);
     if (!(fp = fopen(sbuff, "r"))) {
         printf("energies.opp not found\n");
-        return -1;
+        return NULL;
     }
 
     // unzip the energies.opp
@@ -246,11 +237,12 @@ int load_energies(EMATRIX *ematrix, const char *dir, int verbose)
 
 
     fgets(sbuff, sizeof(sbuff), fp2);
-    if (sscanf(sbuff, "%d %s", &n_conf, version) != 2) {
+    if (sscanf(sbuff, "%d %s", n_conf, version) != 2) {
 
        printf("   Version mismatch: Opp file was made by pre-MCCE2.3 and this program is for %s\n", VERSION);
        printf("                     Use oppconvert to fix the mismatch\n");
-       return USERERR;
+       fclose(fp2);
+       return NULL;
     }
 
     if (strncmp(VERSION, version, 7)) {
@@ -261,6 +253,27 @@ int load_energies(EMATRIX *ematrix, const char *dir, int verbose)
          */
     }
 
+    return fp2;
+}
+
+int load_energies(EMATRIX *ematrix, const char *dir, int verbose)
+/* this program returns number of conformers loaded, or -1 if no exsiting energy table */
+{
+	int i, n_conf;
+    FILE *fp2;
+    CONF_HEAD *conf;
+    PAIRWISE *pw;
+
+    /* the mapped table is read in place, no temporary file */
+    EMATRIX_MAP emap;
+    if (!open_energies_map(&emap, dir)) {
+        n_conf = load_energies_map(ematrix, &emap, verbose);
+        close_energies_map(&emap);
+        return n_conf;
+    }
+
+    if (!(fp2 = open_energies_opp(dir, &n_conf))) return -1;
+
     /* allocate memeory */
     if (ematrix->n > 0) {  /* existing table */
        if (ematrix->n != n_conf) {
@@ -324,11 +337,30 @@ int load_energies(EMATRIX *ematrix, const char *dir, int verbose)
 }
 
 int extract_matrix(EMATRIX *ematrix, char *dir, int verbose)
+/* write the <uniqID>.opp rows and head3.lst of a matrix. An empty ematrix is
+ * read from dir: a mapped energies.bin is written out one row at a time and
+ * never loaded, energies.opp is loaded into ematrix.
+ */
 {
-	int i, j;
+	int i;
 	FILE *fp;
-	char sbuff[256];
 	char fname[256];
+	EMATRIX_MAP emap;
+	EMATRIX heads;
+	const PAIRWISE *row;
+	int mapped = 0;
+
+	if (ematrix->n == 0) {
+		if (!open_energies_map(&emap, dir)) {
+			heads.n    = emap.n;
+			heads.conf = emap.conf;
+			heads.pw   = NULL;
+			ematrix = &heads;
+			mapped = 1;
+		}
+		else if (load_energies(ematrix, dir, verbose) < 0) return USERERR;
+	}
+
 	if ( verbose == 1 ) {
 		printf(" Extracting matrix ...\n"); fflush(stdout);
 	}
@@ -337,21 +369,18 @@ int extract_matrix(EMATRIX *ematrix, char *dir, int verbose)
 		//printf("%11s\n",ematrix->conf[i].history);
 		if (ematrix->conf[i].on != 't') continue;
 		if (ematrix->conf[i].uniqID[3] == 'D' && ematrix->conf[i].uniqID[4] == 'M') continue;
-		sprintf(sbuff, "%s/%s.opp", dir, ematrix->conf[i].uniqID);
-		if (!(fp=fopen(sbuff, "w"))) {
-			printf("   Open file %s error\n", sbuff);
+		row = mapped? energies_map_row(&emap, i) : ematrix->pw[i];
+		if (!row || write_opp_row(ematrix, row, i, dir)) {
+			if (mapped) close_energies_map(&emap);
 			return USERERR;
 		}
-		for (j=0; j<ematrix->n; j++) {
-			fprintf(fp, "%05d %s %8.3f%8.3f%8.3f%8.3f %s\n", j+1, ematrix->conf[j].uniqID, ematrix->pw[i][j].ele, ematrix->pw[i][j].vdw, ematrix->pw[i][j].crt, ematrix->pw[i][j].ori, ematrix->pw[i][j].mark);
-		}
-		fclose(fp);
 	}
 
 	/* write head3.lst */
 	sprintf(fname, "%s/%s", dir, FN_CONFLIST3);
 	if (!(fp = fopen(fname, "w"))) {
 		printf("   Can not open file %s to write. Abort ...\n", fname);
+		if (mapped) close_energies_map(&emap);
 		return USERERR;
 	}
 
@@ -377,11 +406,107 @@ int extract_matrix(EMATRIX *ematrix, char *dir, int verbose)
 	}
 
 	fclose(fp);
+	if (mapped) close_energies_map(&emap);
+
+	return 0;
+}
+
+
+static float round3(float x)
+/* the value a %.3f text field reads back as */
+{
+	return (float) (rint((double) x * 1000.0) / 1000.0);
+}
+
+int write_pw_row(const char *fname, PW_ROW_HEAD *head, PW_ROW *row)
+/* write the binary step 3 row of one conformer. The energies are rounded to
+ * 3 decimals in place, the precision the text rows were written with.
+ */
+{
+	FILE *fp;
+	int i;
+
+	head->E_vdw0 = round3(head->E_vdw0);
+	head->E_vdw1 = round3(head->E_vdw1);
+	head->E_epol = round3(head->E_epol);
+	head->E_tors = round3(head->E_tors);
+	head->rxn_multi  = round3(head->rxn_multi);
+	head->rxn_single = round3(head->rxn_single);
+	head->rxn_prot   = round3(head->rxn_prot);
+	head->rxn_solv   = round3(head->rxn_solv);
+	for (i=0; i<head->n+head->n_bkbn; i++) {
+		row[i].ele = round3(row[i].ele);
+		row[i].vdw = round3(row[i].vdw);
+		row[i].ori = round3(row[i].ori);
+	}
+
+	if (!(fp=fopen(fname, "w"))) {
+		printf("   Open file %s error\n", fname);
+		return USERERR;
+	}
+	if (fwrite(head, sizeof(PW_ROW_HEAD), 1, fp) != 1
+			|| fwrite(row, sizeof(PW_ROW), head->n+head->n_bkbn, fp) != (size_t) (head->n+head->n_bkbn)) {
+		printf("   Write file %s error\n", fname);
+		fclose(fp);
+		return USERERR;
+	}
+	fclose(fp);
+
+	return 0;
+}
 
+int read_pw_row(const char *fname, PW_ROW_HEAD *head, PW_ROW **row)
+/* read the binary step 3 row of one conformer, row is allocated here */
+{
+	FILE *fp;
+
+	*row = NULL;
+	if (!(fp=fopen(fname, "r"))) {
+		printf("   FATAL: read file error %s\n", fname);
+		return USERERR;
+	}
+	if (fread(head, sizeof(PW_ROW_HEAD), 1, fp) != 1 || strncmp(head->magic, PW_ROW_MAGIC, 8)
+			|| head->n < 0 || head->n_bkbn < 0) {
+		printf("   FATAL: %s is not a step 3 row file\n", fname);
+		fclose(fp);
+		return USERERR;
+	}
+	if (!(*row = (PW_ROW *) malloc((head->n+head->n_bkbn+1)*sizeof(PW_ROW)))) {
+		printf("   Allocate memory error\n");
+		fclose(fp);
+		return USERERR;
+	}
+	if (fread(*row, sizeof(PW_ROW), head->n+head->n_bkbn, fp) != (size_t) (head->n+head->n_bkbn)) {
+		printf("   FATAL: Unexpected end of file %s.\n", fname);
+		free(*row);
+		*row = NULL;
+		fclose(fp);
+		return USERERR;
+	}
+	fclose(fp);
 
 	return 0;
 }
 
+int write_opp_row(EMATRIX *ematrix, const PAIRWISE *row, int i, char *dir)
+/* write row i of the matrix as the text file <uniqID>.opp */
+{
+	int j;
+	FILE *fp;
+	char sbuff[256];
+
+	sprintf(sbuff, "%s/%s.opp", dir, ematrix->conf[i].uniqID);
+	if (!(fp=fopen(sbuff, "w"))) {
+		printf("   Open file %s error\n", sbuff);
+		return USERERR;
+	}
+	for (j=0; j<ematrix->n; j++) {
+		fprintf(fp, "%05d %s %8.3f%8.3f%8.3f%8.3f %s\n", j+1, ematrix->conf[j].uniqID, row[j].ele, row[j].vdw, row[j].crt, row[j].ori, row[j].mark);
+	}
+	fclose(fp);
+
+	return 0;
+}
 
 int head3lst_param(EMATRIX ematrix)
 {  int kc;
@@ -456,7 +581,7 @@ int head3lst_param(EMATRIX ematrix)
 
 int write_energies(EMATRIX *ematrix, char *dir, int verbose)
 {
-	FILE *fp, *fp2;
+	FILE *fp;
     int i, j;
     char fname[MAXCHAR_LINE];
     
@@ -526,32 +651,12 @@ int write_energies(EMATRIX *ematrix, char *dir, int verbose)
     
     
     /* write out the matrices */
-    fp2 = tmpfile();
-    /* The firest line is a two-field record, number of comformers and version number separated by white space */
-    fprintf(fp2, "%d %s\n", ematrix->n, VERSION);
-    fwrite(ematrix->conf, sizeof(CONF_HEAD), ematrix->n, fp2);
-    for (i=0; i<ematrix->n; i++) {
-	    if (verbose == 1) {
-			printf("writing row %05d\r", i);
-		}
-
-        fwrite(ematrix->pw[i], sizeof(PAIRWISE), ematrix->n, fp2);
+    if (!strcmp(env.energy_format, "opp")) {
+        if (write_energies_opp(ematrix, dir, verbose)) return USERERR;
     }
-    fputc(EOF, fp2); rewind(fp2);
-
-    sprintf(fname, "%s/%s", dir, ENERGY_TABLE);
-    if (!(fp = fopen(fname, "w"))) {
-        printf("   Can not open file %s to write. Abort ...\n", fname);
-        return USERERR;
-    }
-
-    if (def(fp2, fp, 9) != Z_OK) {
-        printf("Compress file %s error\n", fname);
-        fclose(fp);
-        fclose(fp2);
-        return USERERR;
+    else {
+        if (write_energies_map(ematrix, dir, !strcmp(env.energy_format, "binz"))) return USERERR;
     }
-    fclose(fp2); fclose(fp);
 
     /* write head3.lst */
     sprintf(fname, "%s/%s", dir, FN_CONFLIST3);
@@ -585,6 +690,271 @@ int write_energies(EMATRIX *ematrix, char *dir, int verbose)
    return 0;
 }
 
+int write_energies_opp(EMATRIX *ematrix, char *dir, int verbose)
+/* the whole matrix as one zlib stream in energies.opp */
+{
+    FILE *fp, *fp2;
+    int i;
+    char fname[MAXCHAR_LINE];
+
+    sprintf(fname, "%s/%s", dir, ENERGY_MAP);
+    remove(fname);  /* would be picked up before the opp file */
+
+    fp2 = tmpfile();
+    /* The firest line is a two-field record, number of comformers and version number separated by white space */
+    fprintf(fp2, "%d %s\n", ematrix->n, VERSION);
+    fwrite(ematrix->conf, sizeof(CONF_HEAD), ematrix->n, fp2);
+    for (i=0; i<ematrix->n; i++) {
+	    if (verbose == 1) {
+			printf("writing row %05d\r", i);
+		}
+
+        fwrite(ematrix->pw[i], sizeof(PAIRWISE), ematrix->n, fp2);
+    }
+    fputc(EOF, fp2); rewind(fp2);
+
+    sprintf(fname, "%s/%s", dir, ENERGY_TABLE);
+    if (!(fp = fopen(fname, "w"))) {
+        printf("   Can not open file %s to write. Abort ...\n", fname);
+        return USERERR;
+    }
+
+    if (def(fp2, fp, 9) != Z_OK) {
+        printf("Compress file %s error\n", fname);
+        fclose(fp);
+        fclose(fp2);
+        return USERERR;
+    }
+    fclose(fp2); fclose(fp);
+
+    return 0;
+}
+
+int write_energies_map(EMATRIX *ematrix, const char *dir, int compressed)
+/* write energies.bin, tiles of whole rows that are compressed one by one if asked */
+{
+    FILE *fp;
+    EMAP_HEAD head;
+    char fname[MAXCHAR_LINE];
+    long long *offset, pos;
+    int  i, i_tile, n_rows;
+    uLongf n_zip;
+    size_t tile_size;
+    PAIRWISE *tile;
+    Bytef *zip = NULL;
+
+    memset(&head, 0, sizeof(EMAP_HEAD));
+    strcpy(head.magic, EMAP_MAGIC);
+    snprintf(head.version, sizeof(head.version), "%s", VERSION);
+    head.n = ematrix->n;
+    head.tile_rows = ematrix->n? EMAP_TILE_SIZE / (ematrix->n * sizeof(PAIRWISE)) : 1;
+    if (head.tile_rows < 1) head.tile_rows = 1;
+    head.compressed = compressed;
+    head.n_tile = (ematrix->n + head.tile_rows - 1) / head.tile_rows;
+
+    tile_size = (size_t) head.tile_rows * ematrix->n * sizeof(PAIRWISE);
+    offset = (long long *) calloc(head.n_tile+1, sizeof(long long));
+    tile = (PAIRWISE *) malloc(tile_size + 1);
+    if (compressed) zip = (Bytef *) malloc(compressBound(tile_size));
+    if (!offset || !tile || (compressed && !zip)) {
+        printf("   Memory error in write_energies_map\n");
+        return USERERR;
+    }
+
+    sprintf(fname, "%s/%s", dir, ENERGY_MAP);
+    if (!(fp = fopen(fname, "wb"))) {
+        printf("   Can not open file %s to write. Abort ...\n", fname);
+        return USERERR;
+    }
+
+    /* header, conformer heads and the offset table (filled in at the end), 8 byte aligned */
+    fwrite(&head, sizeof(EMAP_HEAD), 1, fp);
+    fwrite(ematrix->conf, sizeof(CONF_HEAD), ematrix->n, fp);
+    pos = sizeof(EMAP_HEAD) + (long long) ematrix->n * sizeof(CONF_HEAD);
+    while (pos % 8) { fputc(0, fp); pos++; }
+    fwrite(offset, sizeof(long long), head.n_tile+1, fp);
+    pos += (long long) (head.n_tile+1) * sizeof(long long);
+
+    for (i_tile=0; i_tile<head.n_tile; i_tile++) {
+        offset[i_tile] = pos;
+        n_rows = ematrix->n - i_tile*head.tile_rows;
+        if (n_rows > head.tile_rows) n_rows = head.tile_rows;
+        for (i=0; i<n_rows; i++)
+            memcpy(tile + (size_t) i*ematrix->n, ematrix->pw[i_tile*head.tile_rows+i], ematrix->n*sizeof(PAIRWISE));
+        if (compressed) {
+            n_zip = compressBound(tile_size);
+            if (compress2(zip, &n_zip, (Bytef *) tile, (uLong) n_rows*ematrix->n*sizeof(PAIRWISE), 6) != Z_OK) {
+                printf("   Compress tile %d of %s error\n", i_tile, fname);
+                fclose(fp);
+                return USERERR;
+            }
+            fwrite(zip, 1, n_zip, fp);
+            pos += n_zip;
+        }
+        else {
+            fwrite(tile, sizeof(PAIRWISE), (size_t) n_rows*ematrix->n, fp);
+            pos += (long long) n_rows*ematrix->n*sizeof(PAIRWISE);
+        }
+    }
+    offset[head.n_tile] = pos;
+
+    fseek(fp, (sizeof(EMAP_HEAD) + (long long) ematrix->n * sizeof(CONF_HEAD) + 7) / 8 * 8, SEEK_SET);
+    fwrite(offset, sizeof(long long), head.n_tile+1, fp);
+    if (ferror(fp)) {
+        printf("   Error in writing %s\n", fname);
+        fclose(fp);
+        return USERERR;
+    }
+    fclose(fp);
+
+    free(offset);
+    free(tile);
+    free(zip);
+    return 0;
+}
+
+int open_energies_map(EMATRIX_MAP *emap, const char *dir)
+/* map energies.bin read only, returns -1 if there is no valid one */
+{
+    int fd;
+    struct stat st;
+    char fname[MAXCHAR_LINE];
+    EMAP_HEAD *head;
+    long long pos;
+
+    memset(emap, 0, sizeof(EMATRIX_MAP));
+    emap->i_tile = -1;
+    sprintf(fname, "%s/%s", dir, ENERGY_MAP);
+    if ((fd = open(fname, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(EMAP_HEAD)) {
+        close(fd);
+        return -1;
+    }
+    emap->map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (emap->map == MAP_FAILED) {
+        emap->map = NULL;
+        return -1;
+    }
+    emap->map_size = st.st_size;
+
+    head = (EMAP_HEAD *) emap->map;
+    if (strncmp(head->magic, EMAP_MAGIC, 8)) {
+        printf("   %s is not an energy map, ignored\n", fname);
+        close_energies_map(emap);
+        return -1;
+    }
+    emap->n          = head->n;
+    emap->tile_rows  = head->tile_rows;
+    emap->compressed = head->compressed;
+    emap->n_tile     = head->n_tile;
+    emap->conf = (CONF_HEAD *) (emap->map + sizeof(EMAP_HEAD));
+    pos = (sizeof(EMAP_HEAD) + (long long) emap->n * sizeof(CONF_HEAD) + 7) / 8 * 8;
+    emap->tile_offset = (long long *) (emap->map + pos);
+    if (pos + (long long) ((emap->n_tile+1)*sizeof(long long)) > (long long) emap->map_size
+        || emap->tile_offset[emap->n_tile] > (long long) emap->map_size) {
+        printf("   %s is truncated, ignored\n", fname);
+        close_energies_map(emap);
+        return -1;
+    }
+
+    if (emap->compressed) {
+        if (!(emap->tile = (PAIRWISE *) malloc((size_t) emap->tile_rows * emap->n * sizeof(PAIRWISE)))) {
+            printf("   Memory error in open_energies_map\n");
+            close_energies_map(emap);
+            return -1;
+        }
+    }
+    else {
+        madvise(emap->map, emap->map_size, MADV_SEQUENTIAL);
+    }
+
+    return 0;
+}
+
+const PAIRWISE *energies_map_row(EMATRIX_MAP *emap, int i)
+/* row i of the mapped matrix, valid until the next call on a compressed map */
+{
+    int i_tile = i / emap->tile_rows;
+    uLongf n_rows, size;
+
+    if (!emap->compressed)
+        return (PAIRWISE *) (emap->map + emap->tile_offset[i_tile]) + (size_t) (i % emap->tile_rows) * emap->n;
+
+    if (emap->i_tile != i_tile) {
+        n_rows = emap->n - i_tile*emap->tile_rows;
+        if (n_rows > (uLongf) emap->tile_rows) n_rows = emap->tile_rows;
+        size = n_rows * emap->n * sizeof(PAIRWISE);
+        if (uncompress((Bytef *) emap->tile, &size, (Bytef *) emap->map + emap->tile_offset[i_tile],
+                       emap->tile_offset[i_tile+1] - emap->tile_offset[i_tile]) != Z_OK) {
+            printf("   Error in inflating tile %d of %s\n", i_tile, ENERGY_MAP);
+            return NULL;
+        }
+        emap->i_tile = i_tile;
+    }
+
+    return emap->tile + (size_t) (i % emap->tile_rows) * emap->n;
+}
+
+int close_energies_map(EMATRIX_MAP *emap)
+{
+    if (emap->map) munmap(emap->map, emap->map_size);
+    free(emap->tile);
+    memset(emap, 0, sizeof(EMATRIX_MAP));
+    emap->i_tile = -1;
+
+    return 0;
+}
+
+int load_energies_map(EMATRIX *ematrix, EMATRIX_MAP *emap, int verbose)
+/* same as load_energies() from the mapped file, one row in memory at a time */
+{
+    int i, n_conf = emap->n;
+    const PAIRWISE *pw;
+
+    if (ematrix->n > 0) {  /* existing table */
+       if (ematrix->n != n_conf) {
+          printf("error in loading Energy lookup table size %d on to %d\n", n_conf, ematrix->n);
+          return USERERR;
+       }
+    }
+    else {
+       if (!(ematrix->conf = (CONF_HEAD *) calloc(n_conf, sizeof(CONF_HEAD)))) {
+          printf("   Memory error in A load_energies\n");
+          return 0;
+       }
+       if (!(ematrix->pw = (PAIRWISE **) calloc(n_conf, sizeof(PAIRWISE *)))) {
+          printf("   Memory error in B load_energies\n");
+          return 0;
+       }
+       for (i=0; i<n_conf; i++) {
+          if (!(ematrix->pw[i] = (PAIRWISE *) calloc(n_conf, sizeof(PAIRWISE)))) {
+             printf("   Memory error in C load_energies\n");
+             return 0;
+          }
+       }
+       ematrix->n = n_conf;
+    }
+
+    for (i=0; i<n_conf; i++) {
+        if (verbose == 1) {
+            printf("reading row %05d\r", i); fflush(stdout);
+        }
+        if (emap->conf[i].on == 't') {
+            if (!(pw = energies_map_row(emap, i))) return USERERR;
+            memcpy(&ematrix->conf[i], &emap->conf[i], sizeof(CONF_HEAD));
+            memcpy(ematrix->pw[i], pw, n_conf*sizeof(PAIRWISE));
+        }
+        if (ematrix->conf[i].on != 't') /* initilize even if not a valid delphi run */
+            memcpy(&ematrix->conf[i], &emap->conf[i], sizeof(CONF_HEAD));
+    }
+    if (verbose == 1) {
+        printf("\n"); fflush(stdout);
+    }
+
+    return n_conf;
+}
+
 int free_ematrix(EMATRIX *ematrix)
 {  int i;
 
@@ -600,7 +970,165 @@ int free_ematrix(EMATRIX *ematrix)
    return 0;
 }
 
-int refresh_prot(PROT prot)
+int alloc_sparse_pw(SPARSE_PW *spw, int n)
+/* empty table of n rows, rows are then added in order by add_sparse_pw_row() */
+{
+   memset(spw, 0, sizeof(SPARSE_PW));
+   if (!(spw->start = (long *) calloc(n+1, sizeof(long)))) {
+      printf("   FATAL: memory error in alloc_sparse_pw()\n");
+      return USERERR;
+   }
+   spw->n = n;
+
+   return 0;
+}
+
+int add_sparse_pw_row(SPARSE_PW *spw, int ic, const float *row, float thr)
+/* keep the entries of dense row ic whose magnitude is above thr */
+{
+   int jc;
+   long k;
+
+   k = spw->start[ic];
+   for (jc=0; jc<spw->n; jc++) {
+      if (fabs(row[jc]) <= thr) continue;
+      if (k == spw->n_alloc) {
+         spw->n_alloc = spw->n_alloc? 2*spw->n_alloc : spw->n;
+         spw->col   = (int *) realloc(spw->col, spw->n_alloc * sizeof(int));
+         spw->value = (float *) realloc(spw->value, spw->n_alloc * sizeof(float));
+         if (!spw->col || !spw->value) {
+            printf("   FATAL: memory error in add_sparse_pw_row()\n");
+            return USERERR;
+         }
+      }
+      spw->col[k]   = jc;
+      spw->value[k] = row[jc];
+      k++;
+   }
+   spw->start[ic+1] = k;
+
+   return 0;
+}
+
+float get_sparse_pw(const SPARSE_PW *spw, int ic, int jc)
+/* binary search in row ic, entries not stored are 0 */
+{
+   long lo = spw->start[ic], hi = spw->start[ic+1] - 1, mid;
+
+   while (lo <= hi) {
+      mid = (lo + hi) / 2;
+      if (spw->col[mid] < jc) lo = mid + 1;
+      else if (spw->col[mid] > jc) hi = mid - 1;
+      else return spw->value[mid];
+   }
+
+   return 0.0;
+}
+
+static double average_pw(int ic, int jc, float p, float pt)
+{
+   return (p + pt) / 2.0;
+}
+
+int sym_sparse_pw(SPARSE_PW *spw, float thr)
+/* replace the table by (P + P^T)/2, keeping the entries whose magnitude is above thr */
+{
+   return merge_sparse_pw(spw, thr, average_pw);
+}
+
+int merge_sparse_pw(SPARSE_PW *spw, float thr, double (*pair)(int ic, int jc, float p, float pt))
+/* replace entry (ic,jc) by pair(ic, jc, P[ic][jc], P[jc][ic]) wherever either side is stored,
+ * an entry not stored is passed as 0. Keeps the results whose magnitude is above thr.
+ */
+{
+   int ic, jc, n = spw->n;
+   long k, kt, k_end, kt_end;
+   long *t_start, *fill;
+   int *t_row;
+   float *t_value, v;
+   SPARSE_PW sym;
+
+   /* transpose, rows of the transpose come out sorted since rows are scanned in order */
+   t_start = (long *) calloc(n+1, sizeof(long));
+   fill    = (long *) malloc(n * sizeof(long));
+   t_row   = (int *) malloc((spw->start[n]+1) * sizeof(int));
+   t_value = (float *) malloc((spw->start[n]+1) * sizeof(float));
+   memset(&sym, 0, sizeof(SPARSE_PW));
+   if (!t_start || !fill || !t_row || !t_value || alloc_sparse_pw(&sym, n)) {
+      printf("   FATAL: memory error in merge_sparse_pw()\n");
+      free(t_start); free(fill); free(t_row); free(t_value);
+      free_sparse_pw(&sym);
+      return USERERR;
+   }
+   for (k=0; k<spw->start[n]; k++) t_start[spw->col[k]+1]++;
+   for (jc=0; jc<n; jc++) t_start[jc+1] += t_start[jc];
+   memcpy(fill, t_start, n * sizeof(long));
+   for (ic=0; ic<n; ic++) {
+      for (k=spw->start[ic]; k<spw->start[ic+1]; k++) {
+         t_row[fill[spw->col[k]]]     = ic;
+         t_value[fill[spw->col[k]]++] = spw->value[k];
+      }
+   }
+
+   /* merge row ic of P and of P^T */
+   sym.n_alloc = spw->start[n]? spw->start[n] : n;
+   sym.col   = (int *) malloc(sym.n_alloc * sizeof(int));
+   sym.value = (float *) malloc(sym.n_alloc * sizeof(float));
+   if (!sym.col || !sym.value) {
+      printf("   FATAL: memory error in merge_sparse_pw()\n");
+      free(t_start); free(fill); free(t_row); free(t_value);
+      free_sparse_pw(&sym);
+      return USERERR;
+   }
+   for (ic=0; ic<n; ic++) {
+      k  = spw->start[ic]; k_end  = spw->start[ic+1];
+      kt = t_start[ic];    kt_end = t_start[ic+1];
+      sym.start[ic+1] = sym.start[ic];
+      while (k < k_end || kt < kt_end) {
+         if (kt == kt_end || (k < k_end && spw->col[k] < t_row[kt])) {
+            jc = spw->col[k]; v = pair(ic, jc, spw->value[k++], 0.0);
+         }
+         else if (k == k_end || t_row[kt] < spw->col[k]) {
+            jc = t_row[kt]; v = pair(ic, jc, 0.0, t_value[kt++]);
+         }
+         else {
+            jc = spw->col[k]; v = pair(ic, jc, spw->value[k++], t_value[kt++]);
+         }
+         if (fabs(v) <= thr) continue;
+         if (sym.start[ic+1] == sym.n_alloc) {
+            sym.n_alloc *= 2;
+            sym.col   = (int *) realloc(sym.col, sym.n_alloc * sizeof(int));
+            sym.value = (float *) realloc(sym.value, sym.n_alloc * sizeof(float));
+            if (!sym.col || !sym.value) {
+               printf("   FATAL: memory error in merge_sparse_pw()\n");
+               free(t_start); free(fill); free(t_row); free(t_value);
+               free_sparse_pw(&sym);
+               return USERERR;
+            }
+         }
+         sym.col[sym.start[ic+1]]     = jc;
+         sym.value[sym.start[ic+1]++] = v;
+      }
+   }
+
+   free(t_start); free(fill); free(t_row); free(t_value);
+   free_sparse_pw(spw);
+   *spw = sym;
+
+   return 0;
+}
+
+int free_sparse_pw(SPARSE_PW *spw)
+{
+   free(spw->start);
+   free(spw->col);
+   free(spw->value);
+   memset(spw, 0, sizeof(SPARSE_PW));
+
+   return 0;
+}
+
+int refresh_prot(const PROT &prot)
 {  int kr, kc;
    char fname[256];
    FILE *fp;
@@ -6,6 +6,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <zlib.h>
 #include "mcce.h"
 
@@ -54,19 +56,22 @@ char pbe_folder[300];
 char cur_folder[300];
 VECTOR apbs_cglen, apbs_fglen;
 
-int conf_energies(int kr, int kc, PROT prot);
-int conf_rxn(int kr, int kc, PROT prot);
-int define_boundary(PROT prot);
+int conf_energies(int kr, int kc, const PROT &prot);
+int conf_rxn(int kr, int kc, const PROT &prot);
+int define_boundary(const PROT &prot);
 int find_atom(VECTOR v, int counter);
 int delphi_depth();
 void write_fort15();
-int define_boundary_res(PROT prot, int kr, int kc);
+int define_boundary_res(const PROT &prot, int kr, int kc);
+int pbe_jobs(const PROT &prot, int do_rxn, FILE *progress_fp);
+static int pbe_worker(const PROT &prot, int do_rxn, int w, int n_job, int *job_res, int *job_conf, int *next_job, FILE *progress_fp);
+static int read_row_summary(CONF *conf);
 
 /* apbs */
 int write_pqr(FILE *pqr);
 
 //int refresh_prot(PROT prot);
-int add_dummies(PROT prot);
+int add_dummies(const PROT &prot);
 static time_t time_start, nowA, nowB;
 
 int energies()
@@ -214,6 +219,13 @@ int energies()
 			counter ++;
 		}
 	}
+
+	/* conformer grid for culling pairwise vdw, shared by the PBE workers */
+	if (setup_vdw_grid(prot)) {
+		del_dir(pbe_folder);
+		chdir(cur_folder);
+		return USERERR;
+	}
 	printf("   Done\n\n");
 
 	if (!strcmp(env.pbe_solver, "apbs")) printf("   Running APBS calculations ...\n");
@@ -228,35 +240,46 @@ int energies()
 	if (env.pbe_end > n_conf) env.pbe_end = n_conf;
 
 	printf("   Computing pairwise from conformer %d to %d of %d total conformers\n      see %s for progress...\n", env.pbe_start,env.pbe_end, n_conf, env.progress_log); fflush(stdout);
-	counter = 0;
-	for (i=0; i<prot.n_res; i++) {
-		for (j=1; j<prot.res[i].n_conf; j++) {
-			if (counter < env.pbe_start-1 || counter > env.pbe_end-1) {
-				counter++;
-				continue;
-			}
+	if (env.pbe_workers > 1) {
+		if (pbe_jobs(prot, 0, progress_fp)) {
+			printf("   Fatal error reported by a PBE worker, QUIT.\n");
+			fflush(stdout);
+			del_dir(pbe_folder);
+			chdir(cur_folder);
+			return USERERR;
+		}
+	}
+	else {
+		counter = 0;
+		for (i=0; i<prot.n_res; i++) {
+			for (j=1; j<prot.res[i].n_conf; j++) {
+				if (counter < env.pbe_start-1 || counter > env.pbe_end-1) {
+					counter++;
+					continue;
+				}
 
-			counter++;
-			nowA = time(NULL);
-			fprintf(progress_fp, "   Doing pairwise %5d of %5d conformers.", counter, n_conf); fflush(progress_fp);
+				counter++;
+				nowA = time(NULL);
+				fprintf(progress_fp, "   Doing pairwise %5d of %5d conformers.", counter, n_conf); fflush(progress_fp);
+
+				if (conf_energies(i, j, prot)) {
+					printf("   Fatal error reported by conf_energies(), QUIT.\n");
+					fflush(stdout);
+					del_dir(pbe_folder);
+					chdir(cur_folder);
+					return USERERR;
+				}
 
-			if (conf_energies(i, j, prot)) {
-				printf("   Fatal error reported by conf_energies(), QUIT.\n");
-				fflush(stdout);
-				del_dir(pbe_folder);
-				chdir(cur_folder);
-				return USERERR;
+				nowB = time(NULL);
+				fprintf(progress_fp, "%5ld seconds\n", nowB-nowA);
 			}
-
-			nowB = time(NULL);
-			fprintf(progress_fp, "%5ld seconds\n", nowB-nowA);
-		}
-		/* turn back on the radii of conformers in this residue */
-		for (j=1; j<prot.res[i].n_conf; j++) {
-			for (k=0; k<prot.res[i].conf[j].n_atom; k++) {
-				if (!prot.res[i].conf[j].atom[k].on) continue;
-				if (ele_bound.unf[prot.res[i].conf[j].atom[k].serial].rad < prot.res[i].conf[j].atom[k].rad)
-					ele_bound.unf[prot.res[i].conf[j].atom[k].serial].rad = prot.res[i].conf[j].atom[k].rad;
+			/* turn back on the radii of conformers in this residue */
+			for (j=1; j<prot.res[i].n_conf; j++) {
+				for (k=0; k<prot.res[i].conf[j].n_atom; k++) {
+					if (!prot.res[i].conf[j].atom[k].on) continue;
+					if (ele_bound.unf[prot.res[i].conf[j].atom[k].serial].rad < prot.res[i].conf[j].atom[k].rad)
+						ele_bound.unf[prot.res[i].conf[j].atom[k].serial].rad = prot.res[i].conf[j].atom[k].rad;
+				}
 			}
 		}
 	}
@@ -303,44 +326,56 @@ int energies()
 		}
 	}
 
-	counter = 0;
-	for (i=0; i<prot.n_res; i++) {
-		for (j=1; j<prot.res[i].n_conf; j++) {
-			if (counter < env.pbe_start-1 || counter > env.pbe_end-1) {
-				counter++;
-				continue;
-			}
+	if (env.pbe_workers > 1) {
+		if (pbe_jobs(prot, 1, progress_fp)) {
+			printf("   Fatal error reported by a PBE worker, QUIT.\n");
+			fflush(stdout);
+			del_dir(pbe_folder);
+			chdir(cur_folder);
+			return USERERR;
+		}
+	}
+	else {
+		counter = 0;
+		for (i=0; i<prot.n_res; i++) {
+			for (j=1; j<prot.res[i].n_conf; j++) {
+				if (counter < env.pbe_start-1 || counter > env.pbe_end-1) {
+					counter++;
+					continue;
+				}
 
-			counter++;
-			nowA = time(NULL);
-			fprintf(progress_fp, "   Doing rxn %5d of %5d conformers.", counter, n_conf); fflush(progress_fp);
-			if (n_retry<100 && conf_rxn(i, j, prot)) {
-				remove("ARCDAT");
-				fprintf(progress_fp, "   Retry\n");
-				n_retry++;
-				fflush(stdout);
-				counter--;
-				j--;
-			}
-			else if (n_retry>=100) {
-				printf("   Too many retries, quit\n");
-				del_dir(pbe_folder);
-				chdir(cur_folder);
-				return USERERR;
+				counter++;
+				nowA = time(NULL);
+				fprintf(progress_fp, "   Doing rxn %5d of %5d conformers.", counter, n_conf); fflush(progress_fp);
+				if (n_retry<100 && conf_rxn(i, j, prot)) {
+					remove("ARCDAT");
+					fprintf(progress_fp, "   Retry\n");
+					n_retry++;
+					fflush(stdout);
+					counter--;
+					j--;
+				}
+				else if (n_retry>=100) {
+					printf("   Too many retries, quit\n");
+					del_dir(pbe_folder);
+					chdir(cur_folder);
+					return USERERR;
+				}
+				else n_retry = 0;
+				nowB = time(NULL);
+				fprintf(progress_fp, "%5ld seconds\n", nowB-nowA);
 			}
-			else n_retry = 0;
-			nowB = time(NULL);
-			fprintf(progress_fp, "%5ld seconds\n", nowB-nowA);
-		}
-		/* turn off all side chain of this residue but the one used for the dielectric boundary, prepare for the next residue */
-		if (prot.res[i].n_conf>1) {
-			for (k=0; k<prot.res[i].conf[prot.res[i].i_bound].n_atom; k++) { /* Restore the dielectric boundary */
-				if (!prot.res[i].conf[prot.res[i].i_bound].atom[k].on) continue;
-				ele_bound.unf[prot.res[i].conf[prot.res[i].i_bound].atom[k].serial].rad = prot.res[i].conf[prot.res[i].i_bound].atom[k].rad;
+			/* turn off all side chain of this residue but the one used for the dielectric boundary, prepare for the next residue */
+			if (prot.res[i].n_conf>1) {
+				for (k=0; k<prot.res[i].conf[prot.res[i].i_bound].n_atom; k++) { /* Restore the dielectric boundary */
+					if (!prot.res[i].conf[prot.res[i].i_bound].atom[k].on) continue;
+					ele_bound.unf[prot.res[i].conf[prot.res[i].i_bound].atom[k].serial].rad = prot.res[i].conf[prot.res[i].i_bound].atom[k].rad;
+				}
 			}
 		}
 	}
 	printf("   Done\n\n"); fflush(stdout);
+	free_vdw_grid();
 
 
 	fclose(progress_fp);
@@ -371,7 +406,10 @@ int energies()
 	nowB = time(NULL);
 	printf("   Total time for step3 (energy calculation) is %ld seconds.\n\n", nowB - time_start);
 	printf("   Output files (epsilon = %.2f):\n", env.epsilon_prot);
-	printf("      %-16s: energy lookup table, use opp to decode the file\n", ENERGY_TABLE);
+	if (!strcmp(env.energy_format, "opp"))
+		printf("      %-16s: energy lookup table, use opp to decode the file\n", ENERGY_TABLE);
+	else
+		printf("      %-16s: energy lookup table, tiled for mapped access\n", ENERGY_MAP);
 	printf("      %-16s: conformer summary\n", FN_CONFLIST3);
 	printf("\n"); fflush(stdout);
 
@@ -379,7 +417,7 @@ int energies()
 	return 0;
 }
 
-int conf_energies(int kr, int kc, PROT prot)
+int conf_energies(int kr, int kc, const PROT &prot)
 /* compute energies related to that conformer and write out to a file */
 {
 	int i, j, k, counter, n_conf;
@@ -393,6 +431,9 @@ int conf_energies(int kr, int kc, PROT prot)
 	char del_err, notpassed;
 	float weight, val, rxn_corrected, grid_dim;
 	VECTOR center;
+	PW_ROW_HEAD head;
+	PW_ROW *row;
+	char *near;
 
 
 	/* count conformers */
@@ -813,22 +854,30 @@ int conf_energies(int kr, int kc, PROT prot)
 	ele0 = 0.0;
 
 
-	sprintf(fname, "%s.opp", prot.res[kr].conf[kc].uniqID);
-	fp = fopen(fname, "w");
+	/* pairwise row, conf_rxn() corrects it later */
+	if (!(row = (PW_ROW *) calloc(n_conf, sizeof(PW_ROW))) || !(near = (char *) malloc(n_conf))) {
+		printf("   FATAL: Memory error in conf_energies()\n");
+		return USERERR;
+	}
+	/* conformers out of vdw reach of this one get 0 without an atom pair loop */
+	if (vdw_grid_near(&prot.res[kr].conf[kc], near)) memset(near, 1, n_conf);
+	memset(&head, 0, sizeof(PW_ROW_HEAD));
+	strcpy(head.magic, PW_ROW_MAGIC);
+	strcpy(head.uniqID, prot.res[kr].conf[kc].uniqID);
+
 	counter = 0;
 	for (i=0; i<prot.n_res; i++) {
 		for (j=1; j<prot.res[i].n_conf; j++) {
-			vdwt = vdw_conf(kr, kc, i, j, prot);
+			if (i==kr && j==kc) head.iconf = counter;
+			if (near[prot.res[i].conf[j].i_conf_prot]) vdwt = vdw_conf(kr, kc, i, j, prot);
+			else vdwt = 0.0;
 			if (vdwt > 999.0) vdwt = 999.0;
-			fprintf(fp, "%05d %14s %9.3f %9.3f\n", counter,
-					prot.res[i].conf[j].uniqID,
-					pairwise_ele[counter],
-					vdwt);
+			row[counter].ele = row[counter].ori = pairwise_ele[counter];
+			row[counter].vdw = vdwt;
 			counter ++;
 		}
 	}
-
-	fprintf(fp, "\n");   /* separator of bkb */
+	head.n = counter;
 
 	for (i=0; i<prot.n_res; i++) {
 		if (prot.res[i].n_conf == 0) {
@@ -837,37 +886,206 @@ int conf_energies(int kr, int kc, PROT prot)
 					prot.res[i].resSeq);
 		}
 		else {
-			vdwt = vdw_conf(kr, kc, i, 0, prot);
-			fprintf(fp, "%05d%15s%10.3f%10.3f\n", counter,
-					prot.res[i].conf[0].uniqID,
-					pairwise_ele[counter],
-					vdwt);
+			if (near[prot.res[i].conf[0].i_conf_prot]) vdwt = vdw_conf(kr, kc, i, 0, prot);
+			else vdwt = 0.0;
+			row[counter].ele = row[counter].ori = pairwise_ele[counter];
+			row[counter].vdw = vdwt;
 			vdw1 += vdwt;
 			ele0 += pairwise_ele[counter];
 			counter++;
 		}
 	}
+	head.n_bkbn = counter - head.n;
 
-	fprintf(fp, "\n");   /* separator of misc */
-
-	fprintf(fp, "VDW_SELF  %10.3f\n", prot.res[kr].conf[kc].E_vdw0);
-	fprintf(fp, "VDW_BKBN  %10.3f\n", vdw1);
-	fprintf(fp, "ELE_BKBN  %10.3f\n", ele0);
-	fprintf(fp, "TORSION   %10.3f\n", torsion);
-	fprintf(fp, "RXNMULTI  %10.3f\n", rxn_corrected);
+	head.E_vdw0 = prot.res[kr].conf[kc].E_vdw0;
+	head.E_vdw1 = vdw1;
+	head.E_epol = ele0;
+	head.E_tors = torsion;
+	head.rxn_multi = rxn_corrected;
 
 	prot.res[kr].conf[kc].E_vdw1 = vdw1;
 	prot.res[kr].conf[kc].E_epol = ele0;
 	prot.res[kr].conf[kc].E_tors = torsion;
 
-	fclose(fp);
+	sprintf(fname, "%s.pwb", prot.res[kr].conf[kc].uniqID);
+	if (write_pw_row(fname, &head, row)) {
+		free(row);
+		free(near);
+		free(pairwise_ele);
+		return USERERR;
+	}
+	free(row);
+	free(near);
 
 	free(pairwise_ele);
 
 	return 0;
 }
 
-int define_boundary(PROT prot)
+/* Run the pairwise (do_rxn = 0) or rxn (do_rxn = 1) PBE jobs of conformers pbe_start
+ * to pbe_end on env.pbe_workers processes. Each worker is forked from the boundary as
+ * the serial loop would see it, works in its own subfolder of pbe_folder and takes the
+ * next conformer from a counter shared by all workers. The .pwb file of a finished
+ * conformer is kept in pbe_folder, where conf_rxn() and make_matrices() expect it.
+ */
+int pbe_jobs(const PROT &prot, int do_rxn, FILE *progress_fp)
+{
+	int i, j, w, counter, n_job, n_workers, status, err;
+	int *job_res, *job_conf, *next_job;
+	pid_t *pid;
+
+	counter = 0;
+	for (i=0; i<prot.n_res; i++) counter += prot.res[i].n_conf;
+	job_res  = (int *) malloc(counter*sizeof(int));
+	job_conf = (int *) malloc(counter*sizeof(int));
+	pid = (pid_t *) malloc(env.pbe_workers*sizeof(pid_t));
+	next_job = (int *) mmap(NULL, sizeof(int), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (!job_res || !job_conf || !pid || next_job == MAP_FAILED) {
+		printf("   FATAL: memory error in pbe_jobs()\n");
+		return USERERR;
+	}
+
+	/* same order and range as the serial loop */
+	counter = 0;
+	n_job = 0;
+	for (i=0; i<prot.n_res; i++) {
+		for (j=1; j<prot.res[i].n_conf; j++) {
+			if (counter >= env.pbe_start-1 && counter <= env.pbe_end-1) {
+				job_res[n_job]  = i;
+				job_conf[n_job] = j;
+				n_job++;
+			}
+			counter++;
+		}
+	}
+	*next_job = 0;
+
+	n_workers = env.pbe_workers < n_job ? env.pbe_workers : n_job;
+	fflush(stdout);
+	fflush(progress_fp);
+	for (w=0; w<n_workers; w++) {
+		if ((pid[w] = fork()) == 0) {
+			status = pbe_worker(prot, do_rxn, w, n_job, job_res, job_conf, next_job, progress_fp);
+			fflush(stdout);
+			fflush(progress_fp);
+			_exit(status? 1 : 0);
+		}
+		if (pid[w] < 0) {
+			/* the workers already started take over the remaining jobs */
+			printf("   WARNING: could not start PBE worker %d, continue with %d workers\n", w, w);
+			n_workers = w;
+			break;
+		}
+	}
+
+	err = n_workers? 0 : 1;
+	for (w=0; w<n_workers; w++) {
+		if (waitpid(pid[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) err = 1;
+	}
+
+	/* conformer energies set by the workers live in their own copies of prot */
+	for (w=0; !err && w<n_job; w++) {
+		if (read_row_summary(&prot.res[job_res[w]].conf[job_conf[w]])) err = 1;
+	}
+
+	munmap(next_job, sizeof(int));
+	free(pid);
+	free(job_res);
+	free(job_conf);
+	return err? USERERR : 0;
+}
+
+static int pbe_worker(const PROT &prot, int do_rxn, int w, int n_job, int *job_res, int *job_conf, int *next_job, FILE *progress_fp)
+{
+	int k, kr, kc, ic, ia, err;
+	char base[MAXCHAR_LINE];
+	char folder[MAXCHAR_LINE + 16];
+	char fname[MAXCHAR_LINE];
+	char sbuff[2*MAXCHAR_LINE];
+	time_t t0, t1;
+
+	/* workers start in pbe_folder, which may be given relative to the run folder */
+	if (!getcwd(base, sizeof(base)) || snprintf(folder, sizeof(folder), "%s/worker%02d", base, w) >= (int) sizeof(folder)) {
+		printf("   FATAL: PBE worker folder name too long \"%s/worker%02d\"\n", pbe_folder, w);
+		return USERERR;
+	}
+	if (mkdir(folder, 0755) || chdir(folder)) {
+		printf("   FATAL: failed creating PBE worker folder \"%s\"\n", folder);
+		return USERERR;
+	}
+	if (!strcmp(env.pbe_solver, "delphi")) write_fort15();
+
+	err = 0;
+	n_retry = 0;
+	while (!err && (k = __sync_fetch_and_add(next_job, 1)) < n_job) {
+		kr = job_res[k];
+		kc = job_conf[k];
+		t0 = time(NULL);
+		sprintf(fname, "%s.pwb", prot.res[kr].conf[kc].uniqID);
+		snprintf(sbuff, sizeof(sbuff), "%s/%s", base, fname);
+
+		if (do_rxn) {
+			rename(sbuff, fname);
+			while (conf_rxn(kr, kc, prot)) {
+				remove("ARCDAT");
+				if (++n_retry >= 100) {
+					printf("   Too many retries, quit\n");
+					err = 1;
+					break;
+				}
+				fprintf(progress_fp, "   Worker %02d retry rxn of %s\n", w, prot.res[kr].conf[kc].uniqID);
+				fflush(progress_fp);
+			}
+			if (!err) n_retry = 0;
+		}
+		else if (conf_energies(kr, kc, prot)) {
+			printf("   Fatal error reported by conf_energies(), QUIT.\n");
+			err = 1;
+		}
+
+		/* jobs of one worker hop between residues, so restore the boundary of this
+		 * residue after every conformer instead of after the whole residue */
+		for (ic=1; ic<prot.res[kr].n_conf; ic++) {
+			for (ia=0; ia<prot.res[kr].conf[ic].n_atom; ia++) {
+				if (!prot.res[kr].conf[ic].atom[ia].on) continue;
+				if (do_rxn) {
+					if (ic != prot.res[kr].i_bound) continue;
+					ele_bound.unf[prot.res[kr].conf[ic].atom[ia].serial].rad = prot.res[kr].conf[ic].atom[ia].rad;
+				}
+				else if (ele_bound.unf[prot.res[kr].conf[ic].atom[ia].serial].rad < prot.res[kr].conf[ic].atom[ia].rad)
+					ele_bound.unf[prot.res[kr].conf[ic].atom[ia].serial].rad = prot.res[kr].conf[ic].atom[ia].rad;
+			}
+		}
+
+		rename(fname, sbuff);
+		t1 = time(NULL);
+		fprintf(progress_fp, "   Worker %02d did %s %5d of the range.%5ld seconds\n", w, do_rxn? "rxn" : "pairwise", env.pbe_start+k, t1-t0);
+		fflush(progress_fp);
+	}
+
+	del_dir(folder);
+	return err? USERERR : 0;
+}
+
+/* bring back the conformer energies that a worker wrote in the head of the row file */
+static int read_row_summary(CONF *conf)
+{
+	char fname[MAXCHAR_LINE];
+	PW_ROW_HEAD head;
+	PW_ROW *row;
+
+	sprintf(fname, "%s.pwb", conf->uniqID);
+	if (read_pw_row(fname, &head, &row)) return USERERR;
+	free(row);
+
+	conf->E_vdw1 = head.E_vdw1;
+	conf->E_epol = head.E_epol;
+	conf->E_tors = head.E_tors;
+	conf->E_rxn  = head.rxn_single;
+	return 0;
+}
+
+int define_boundary(const PROT &prot)
 {
 	// map all the conformers
 	// atom.serial refers to the index in the boundary map
@@ -939,7 +1157,7 @@ int define_boundary(PROT prot)
 	return 0;
 }
 
-int define_boundary_res(PROT prot, int kr, int kc)
+int define_boundary_res(const PROT &prot, int kr, int kc)
 {
 	int ka, counter;
 
@@ -1041,25 +1259,25 @@ void write_fort15()
 }
 
 
-int conf_rxn(int kr, int kc, PROT prot)
+int conf_rxn(int kr, int kc, const PROT &prot)
 {
 	int i, ic, j, k, counter;
 	char fname[MAXCHAR_LINE];
 	float *potentials = NULL;
 	FILE *fp, *fp2;
 	char sbuff[MAXCHAR_LINE];
-	char rxnmulti[MAXCHAR_LINE];
 	float rxn[100]; /*rxn at focusing runs*/
 	float rxn_min;
 	VECTOR center;
 	float weight;
-	char uniqID[MAXCHAR_LINE];
 	float k_single_multi;
 	char del_err;
 	float phi, fdummy;
 	float vdw1,vdwt, torsion, ele0;
 	float val,rxn_protein, rxn_solvent, grid_dim;  /*rxn energies in apbs calculations*/
 	float *potentials_rxn = NULL; /*collects potentials of the reference solvation run in apbs  */
+	PW_ROW_HEAD head;
+	PW_ROW *row;
 
 
 	if (!(potentials = (float *) calloc(sizeof(float), ele_bound.n))) {
@@ -1596,49 +1814,44 @@ int conf_rxn(int kr, int kc, PROT prot)
 	/* ele to the backbone */
 	ele0 = 0.0;
 
-	sprintf(fname, "%s.opp", prot.res[kr].conf[kc].uniqID);
+	sprintf(fname, "%s.pwb", prot.res[kr].conf[kc].uniqID);
 
-	/* read the existing opp file */
-	fp = fopen(fname, "r");
+	/* read the row left by conf_energies() */
+	if (read_pw_row(fname, &head, &row)) return USERERR;
+	if (strcmp(head.uniqID, prot.res[kr].conf[kc].uniqID)) {
+		printf("   ERROR: Mismatch %s and %s in %s\n", prot.res[kr].conf[kc].uniqID, head.uniqID, fname);
+		free(row);
+		return USERERR;
+	}
 
-	/* read */
 	/* side chain */
+	counter = 0;
 	for (i=0; i<prot.n_res; i++) {
 		for (j=1; j<prot.res[i].n_conf; j++) {
-			fgets(sbuff, sizeof(sbuff), fp);
-			sscanf(sbuff, "%d %s %f %f", &prot.res[i].conf[j].iConf, \
-					uniqID, \
-					&prot.res[i].conf[j].tmp_pw_ele, \
-					&prot.res[i].conf[j].tmp_pw_vdw);
-			if (strcmp(uniqID, prot.res[i].conf[j].uniqID)) {
-				printf("   ERROR: Mismatch %s and %s in %s.opp\n", prot.res[i].conf[j].uniqID, uniqID, prot.res[kr].conf[kc].uniqID);
+			if (counter >= head.n) {
+				printf("   ERROR: %s has %d conformers, the protein has more\n", fname, head.n);
+				free(row);
 				return USERERR;
 			}
+			prot.res[i].conf[j].iConf = counter;
+			prot.res[i].conf[j].tmp_pw_ele = row[counter].ele;
+			prot.res[i].conf[j].tmp_pw_vdw = row[counter].vdw;
+			counter++;
 		}
 	}
-	fgets(sbuff, sizeof(sbuff), fp);
 
+	/* backbone */
 	for (i=0; i<prot.n_res; i++) {
-		fgets(sbuff, sizeof(sbuff), fp);
-		sscanf(sbuff, "%d %s %f %f", &counter, \
-				uniqID, \
-				&prot.res[i].conf[0].tmp_pw_ele, \
-				&prot.res[i].conf[0].tmp_pw_vdw);
-	}
-
-	rxnmulti[0] = '\n';
-	while (fgets(sbuff, sizeof(sbuff), fp)) {
-		if (!strncmp("RXNMULTI", sbuff, 8)) {
-			strcpy(rxnmulti, sbuff);
-			break;
-		}
+		if (prot.res[i].n_conf == 0) continue;
+		if (counter >= head.n + head.n_bkbn) break;
+		prot.res[i].conf[0].tmp_pw_ele = row[counter].ele;
+		prot.res[i].conf[0].tmp_pw_vdw = row[counter].vdw;
+		counter++;
 	}
 
-	fclose(fp);
-
 
 	/* write */
-	fp = fopen(fname, "w");
+	counter = 0;
 	for (i=0; i<prot.n_res; i++) {
 		if (i==kr)
 			k_single_multi = 0.0;
@@ -1665,29 +1878,20 @@ int conf_rxn(int kr, int kc, PROT prot)
 
 		 reliability = exp(-fabs((prot.res[i].conf[prot.res[i].i_bound].tmp_pw_ele-prot.res[i].conf[j].tmp_pw_ele))\
 								 /(fabs(prot.res[i].conf[prot.res[i].i_bound].tmp_pw_ele)+0.01));
-		 fprintf(fp, "%05d%15s%10.3f%10.3f%10.3f", prot.res[i].conf[j].iConf,
-											prot.res[i].conf[j].uniqID,
-											prot.res[i].conf[j].tmp_pw_ele * \
-											(k_single_multi*reliability+(1-reliability)),
-											prot.res[i].conf[j].tmp_pw_vdw,
-											prot.res[i].conf[j].tmp_pw_ele);
 			 */
 			/* No additional correction on k */
-			fprintf(fp, "%05d%15s%10.3f%10.3f%10.3f", prot.res[i].conf[j].iConf,
-					prot.res[i].conf[j].uniqID,
-					prot.res[i].conf[j].tmp_pw_ele * k_single_multi,
-					prot.res[i].conf[j].tmp_pw_vdw,
-					prot.res[i].conf[j].tmp_pw_ele);
-
-			if (prot.res[i].conf[prot.res[i].i_bound].tmp_pw_vdw > 50.0) fprintf(fp, "?");
-			if (j==prot.res[i].i_bound) fprintf(fp, "*\n");
-			else fprintf(fp, "\n");
+			row[counter].ele = prot.res[i].conf[j].tmp_pw_ele * k_single_multi;
+			row[counter].vdw = prot.res[i].conf[j].tmp_pw_vdw;
+			row[counter].ori = prot.res[i].conf[j].tmp_pw_ele;
+
+			k = 0;
+			if (prot.res[i].conf[prot.res[i].i_bound].tmp_pw_vdw > 50.0) row[counter].mark[k++] = '?';
+			if (j==prot.res[i].i_bound) row[counter].mark[k++] = '*';
+			row[counter].mark[k] = '\0';
+			counter++;
 		}
 	}
 
-
-	fprintf(fp, "\n");   /* separator of bkb */
-
 	for (i=0; i<prot.n_res; i++) {
 		if (prot.res[i].n_conf == 0) {
 			printf("   WARNING: no conformers in residue %s%c%04d\n", prot.res[i].resName,
@@ -1695,42 +1899,40 @@ int conf_rxn(int kr, int kc, PROT prot)
 					prot.res[i].resSeq);
 		}
 		else {
-			vdwt = vdw_conf(kr, kc, i, 0, prot);
-			fprintf(fp, "%05d%15s%10.3f%10.3f%10.3f\n", i,
-					prot.res[i].conf[0].uniqID,
-					prot.res[i].conf[0].tmp_pw_epol, /* backbone recalculated */
-					prot.res[i].conf[0].tmp_pw_vdw,
-					prot.res[i].conf[0].tmp_pw_ele);
+			vdwt = prot.res[i].conf[0].tmp_pw_vdw; /* vdw_conf() to the backbone, from conf_energies() */
+			row[counter].ele = prot.res[i].conf[0].tmp_pw_epol; /* backbone recalculated */
+			row[counter].vdw = prot.res[i].conf[0].tmp_pw_vdw;
+			row[counter].ori = prot.res[i].conf[0].tmp_pw_ele;
+			row[counter].mark[0] = '\0';
 			vdw1 += vdwt;
 			ele0 += prot.res[i].conf[0].tmp_pw_epol;
+			counter++;
 		}
 	}
 
-	fprintf(fp, "\n");   /* separator of misc */
-
-	fprintf(fp, "VDW_SELF  %10.3f\n", prot.res[kr].conf[kc].E_vdw0);
-	fprintf(fp, "VDW_BKBN  %10.3f\n", vdw1);
-	fprintf(fp, "ELE_BKBN  %10.3f\n", ele0);
-	fprintf(fp, "TORSION   %10.3f\n", torsion);
-	fprintf(fp, "%s\n", rxnmulti);
-
-	prot.res[kr].conf[kc].E_vdw1 = vdw1;
-	prot.res[kr].conf[kc].E_epol = ele0;
-	prot.res[kr].conf[kc].E_tors = torsion;
-
-	prot.res[kr].conf[kc].E_rxn = rxn_min;
-	fprintf(fp, "RXNSINGLE %10.3f\n", rxn_min);
-
+	head.E_vdw0 = prot.res[kr].conf[kc].E_vdw0;
+	head.E_vdw1 = vdw1;
+	head.E_epol = ele0;
+	head.E_tors = torsion;
+	head.rxn_single = rxn_min;
 	if (!strcmp(env.rxn_method,"self")) {
-		fprintf(fp, "RXN_prot  %10.3f\n", rxn_protein);
-		fprintf(fp, "RXN_solv  %10.3f\n", rxn_solvent);
+		head.rxn_prot = rxn_protein;
+		head.rxn_solv = rxn_solvent;
 	}
 
-	fclose(fp);
-	return 0;
+	counter = write_pw_row(fname, &head, row);
+	free(row);
+
+	/* from the rounded head, as read_row_summary() gets them when a worker did the conformer */
+	prot.res[kr].conf[kc].E_vdw1 = head.E_vdw1;
+	prot.res[kr].conf[kc].E_epol = head.E_epol;
+	prot.res[kr].conf[kc].E_tors = head.E_tors;
+	prot.res[kr].conf[kc].E_rxn  = head.rxn_single;
+
+	return counter;
 }
 
-int add_dummies(PROT prot)
+int add_dummies(const PROT &prot)
 {
 	int n = 0;
 	int i, kr, kc;
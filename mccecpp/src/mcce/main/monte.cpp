@@ -4,6 +4,9 @@
 #include <time.h>
 #include <math.h>
 #include <stdbool.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "mcce.h"
 
 /* normal pw is guaranteed to be smaller than 2000. When it is bigger than 5000, it is
@@ -53,6 +56,13 @@ typedef struct  {
     int *res;
 } BIGLIST;
 
+/* residues flipped by one Monte Carlo move, and where they were before it */
+typedef struct {
+    int n;
+    int *res;   /* indices of free residues */
+    int *conf;  /* conformers they had before the move */
+} MOVE;
+
 typedef struct {
     char  resName[4];
     char  chainID;
@@ -101,15 +111,15 @@ int writeBits(char *charArray, int arrayLen, FILE *out_fp);
 void MC_smp(int n);
 
 STRINGS ms_spe_lst;        // global vairable, saving names of marked residues to save microstates.
-FILE   *ms_fp;
 FILE   *bit_fp;
-FILE   *pro_fp;      // protonation states, protonation.txt
 /* for the microstate */
 
 /* public variables */
 PROT     prot;
 RES      conflist, conflist_bak;
 float    **pairwise, **pairwise_vdw, **pairwise_ele;
+SPARSE_PW pw_sparse;  /* replaces pairwise in step 4 sampling when PW_SPARSE_THR >= 0 */
+SPARSE_PW pw_sparse_vdw, pw_sparse_ele;  /* replace pairwise_vdw and pairwise_ele in the mfe analysis */
 float    E_base, E_state;
 float    ph, eh;
 int      *state, *state_bak;
@@ -117,16 +127,31 @@ int      *state, *state_bak;
 RESIDUE  *free_res, *fixed_res, *all_res, *mfe_res; // mfe_res is all the mfe residue
 int      n_free, n_fixed, n_all, n_mfe;
 BIGLIST  *biglist;   /* same length as free residues */
+double   *field;     /* interaction of each free conformer with the current state */
+int      *conf_free; /* free residue of each free conformer, -1 for the others */
+int      *since;     /* step at which each free residue took its current conformer */
+MOVE     move;
 TYPES    Sconverge, SconvergeBak;
 float    E_minimum;
 FILE     *fp;
 time_t   timerA, timerB, timerC;
+unsigned long long rng_key, rng_ctr; /* counter based random number stream on this thread */
+int      run_threads = 1;   /* threads sharing the monte_runs of one titration point */
 
 float    **MC_occ;    /* occ of 3 parallel MC */
 float    **occ_table;   /* occ of conformers at various pH/Eh */
 float    **entropy_table;
 /* public variables */
 
+/* Monte Carlo state private to each titration point. Titration points run in
+ * parallel, one per thread, so every thread works on its own copy of these.
+ * Shared by all threads and read only during the titration: prot, conflist_bak,
+ * pairwise.  occ_table and entropy_table are written by titration point index.
+ */
+#pragma omp threadprivate(conflist, E_base, E_state, ph, eh, state, free_res, fixed_res, all_res, \
+                          n_free, n_fixed, n_all, biglist, field, conf_free, since, move, Sconverge, SconvergeBak, \
+                          E_minimum, fp, MC_occ, bit_fp, rng_key, rng_ctr)
+
 
 
 
@@ -139,6 +164,12 @@ int   verify_flag();
 int   load_pairwise();
 int   load_pairwise_fround3();
 int   load_pairwise_vdw();
+int   load_pairwise_map(EMATRIX_MAP *emap);
+int   load_pairwise_opp();
+int   load_pairwise_fround3_sparse();
+double state_pw(int ic);
+const float *mfe_row(float **dense, const SPARSE_PW *spw, int ic, float *buf);
+float mfe_pw(float **dense, const SPARSE_PW *spw, int ic, int jc);
 
 void  group_confs();
 
@@ -146,6 +177,18 @@ float get_base();
 float get_E();
 
 void  mk_neighbors();
+void  mc_srand(unsigned int seed, int i_titr, int i_run);
+int   mc_rand();
+int   titrate(int i, unsigned int seed, FILE **fp_out, FILE **bit_out);
+void  monte_run(int i_run, int n_start, int n_smp);
+int   append_file(FILE *dest, FILE *src);
+void  init_field();
+void  update_field(int old_conf, int new_conf);
+double move_field(int ic);
+float flip(int ires, int new_conf);
+void  accept_move(int step);
+void  reject_move();
+void  count_state(int n_total);
 void MC(int n);
 int reduce_conflist();
 int fitit();
@@ -163,10 +206,11 @@ char **shead;
 
 int monte()
 {
-	int i, j, k, counter, k_run;
-    float *sigma, sigma_max, t;
-    int N_smp;
-    float S_max;
+	int i, j;
+    int err;
+    unsigned int seed;
+    FILE *mc_fp, *ms_bit_fp = NULL;
+    FILE **titr_fp, **titr_bit_fp;
     
     timerA = time(NULL);
 
@@ -223,17 +267,13 @@ int monte()
     printf("   Do titration at %d points...\n", env.titr_steps);
     printf("   Detailed progress is in file \"%s\"\n", MC_OUT);
     fflush(stdout);
-    if (env.monte_seed < 0) srand(time(NULL));
-    else srand(env.monte_seed);
-    
-    MC_occ = (float **) malloc(env.monte_runs * sizeof(float *));
-    for (i=0; i<env.monte_runs; i++) {
-        if (!(MC_occ[i] = (float *) malloc(conflist.n_conf * sizeof(float)))) {
-            printf("   FATAL: memory error.\n");
-            return USERERR;
-        }
-        
-    }
+    if (env.monte_seed < 0) seed = time(NULL);
+    else seed = env.monte_seed;
+#ifdef _OPENMP
+    /* threads left after one per titration point are shared by the runs */
+    if (env.titr_steps > 0 && env.titr_steps < omp_get_max_threads())
+        run_threads = omp_get_max_threads() / env.titr_steps;
+#endif
     
     occ_table = (float **) malloc(conflist.n_conf*sizeof(float *));
     for (i=0; i<conflist.n_conf; i++) occ_table[i] = (float *) malloc(env.titr_steps * sizeof(float));
@@ -241,16 +281,14 @@ int monte()
     entropy_table = (float **) malloc(conflist.n_conf*sizeof(float *));
     for (i=0; i<conflist.n_conf; i++) entropy_table[i] = (float *) malloc(env.titr_steps * sizeof(float));
 
-    sigma = (float *) malloc(conflist.n_conf * sizeof(float *));
-    
     if (!env.minimize_size) {
-       if (!(fp = fopen(MC_OUT, "w"))) {
+       if (!(mc_fp = fopen(MC_OUT, "w"))) {
           printf("   FATAL: Can not write to file \"%s\"\n", MC_OUT);
           return USERERR;
        }
     }
     else {
-       fp = tmpfile();
+       mc_fp = tmpfile();
     }
     
     //printf("ms_out: %d\n", env.ms_out);
@@ -278,10 +316,10 @@ int monte()
 //    			fwrite(ms_spe_lst.strings[i_spe], 8, sizeof(char), ms_fp);
 //    		}
 
-    		bit_fp = fopen(FN_BIT_OUT, "wb");
-    		fwrite(&ms_spe_lst.n, 1, sizeof(int), bit_fp);
+    		ms_bit_fp = fopen(FN_BIT_OUT, "wb");
+    		fwrite(&ms_spe_lst.n, 1, sizeof(int), ms_bit_fp);
     		for (i_spe=0; i_spe<ms_spe_lst.n; i_spe++) {
-    			fwrite(ms_spe_lst.strings[i_spe], 8, sizeof(char), bit_fp);
+    			fwrite(ms_spe_lst.strings[i_spe], 8, sizeof(char), ms_bit_fp);
     		}
 
 //    		pro_fp = fopen(FN_PROTONATION, "w");
@@ -300,205 +338,32 @@ int monte()
     printf("   Monte Carlo set up time: %ld seconds.\n", timerB-timerA); fflush(stdout);
     
     
-    /* entropy sampling and correction */
-    /* group conformers */
-    group_conftype();  /* This ininitializes Sconverge and SconvergeBak */
-
+    /* titration points are independent, run them in parallel and merge the
+     * output in titration order */
+    titr_fp = (FILE **) calloc(env.titr_steps, sizeof(FILE *));
+    titr_bit_fp = (FILE **) calloc(env.titr_steps, sizeof(FILE *));
+    err = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(|:err)
     for (i=0; i<env.titr_steps; i++) {
-        timerB = time(NULL);
-        
-        ph = env.titr_ph0;
-        eh = env.titr_eh0;
-        if (env.titr_type == 'p') ph = env.titr_ph0 + i*env.titr_phd;
-        else eh = env.titr_eh0 + i*env.titr_ehd;
-        fprintf(fp, "Titration (%dth) at pH = %6.2f Eh = %6.2f:\n", i+1, ph, eh); fflush(fp);
-
-        
-        /* reduce prot to free residues, conformers fixed as 0 occ are excluded from this free residues */
-        free(conflist.conf);
-        conflist.n_conf = 0; conflist.conf = NULL;
-        cpy_res(&conflist, &conflist_bak);
-        
-        group_confs();
-        fprintf(fp, "Identified %d free residues from %d residues.\n", n_free, n_all);
-        fflush(fp);
-        
-        /* get big list */
-        mk_neighbors();
-        
-        /* Compute base energy, self and mfe */
-        E_base = get_base();
-        
-        /* get a microstate */
-        state = (int *) realloc(state, n_free*sizeof(int));
-        for (j=0; j<n_free; j++)
-            state[j] = free_res[j].conf[rand() / (RAND_MAX/free_res[j].n + 1)];
-        
-        /* DEBUG
-        for (j=0; j<n_free; j++) printf("%03d ", state[j]);
-        printf("\n");
-        */
-
-        /* Do annealing */
-        /*
-        fprintf(fp, "Conformer list before reduction: E_base = %10.3f\n", E_base);
-        for (j=0; j<conflist.n_conf; j++) {
-            fprintf(fp, "%s %c %4.2f self = %8.3f mfe = %8.3f\n", conflist.conf[j].uniqID, 
-            conflist.conf[j].on,
-            conflist.conf[j].occ,
-            conflist.conf[j].E_self0,
-            conflist.conf[j].E_mfe);
-        }
-        fprintf(fp, "\n"); fflush(fp);
-        */
-        counter = 0;
-        for (j=0; j<n_free; j++) counter+=free_res[j].n;
-        N_smp = env.monte_nstart * counter;
-        fprintf(fp, "Doing annealing... \n"); fflush(fp);
-        if (N_smp) MC(N_smp);
-        fprintf(fp, "Done\n\n");
-
-        /* memcpy(state_check, state, sizeof(int)*n_free);  DEBUG */
-        
-        /* Do equalibriation */
-        counter = 0;
-        for (j=0; j<n_free; j++) counter+=free_res[j].n;
-        N_smp = env.monte_neq * counter;
-        fprintf(fp, "Doing equalibration ... \n"); fflush(fp);
-        if (N_smp) MC(N_smp);
-        fprintf(fp, "Done\n\n");
-        
-        /* do reduction */
-        fprintf(fp, "Reducing conflist ... %d conformers are marked as fixed.\n\n", reduce_conflist());
-        group_confs();
-        fprintf(fp, "%d free residues from %d residues, after reduction.\n\n", n_free, n_all);
-        fflush(fp);
+        if (titrate(i, seed, &titr_fp[i], &titr_bit_fp[i])) err = 1;
+    }
+    if (err) return USERERR;
 
-        /* reset */
-        mk_neighbors();
-
-        j = 0; S_max = 999.9;
-        for (k=0; k<Sconverge.n; k++) SconvergeBak.conftype[k].E_TS = 0.0;
-        if (env.monte_tsx) {
-        	while (S_max > 0.5) {
-        		E_base = get_base();
-        		if (enumerate(i) == -1) { /* Non-ANALYTICAL SOLOTION */
-        			counter = 0;
-        			for (k=0; k<n_free; k++) counter+=free_res[k].n;
-        			N_smp = env.monte_niter * counter;
-
-        			fprintf(fp, "Doing Entropy sampling cycle %d...\n", j+1); fflush(fp);
-        			if (env.monte_nstart * counter) MC(env.monte_nstart * counter);
-        			if (N_smp) MC(N_smp);
-        		}
-        		update_Sconvergence(); /* calculate entropy from occupancy */
-        		S_max = s_stat();
-        		fprintf(fp, "Max delta = %8.3f\n", S_max);
-
-        		/* backup */
-        		for (k=0; k<Sconverge.n; k++) SconvergeBak.conftype[k] = Sconverge.conftype[k];
-
-        		j++;
-        	}
-        	fprintf(fp, "Done, exit at max entropy convergence %.3f \n\n", S_max);
-        }
-        
-        
-        E_base = get_base();
-        /* ANALYTICAL SOLOTION */
-        if (enumerate(i) == -1) {
-            /*
-            fprintf(fp, "Conformer list after reduction: E_base = %10.3f\n", E_base);
-            for (j=0; j<conflist.n_conf; j++) {
-                fprintf(fp, "%s %c %4.2f self = %8.3f mfe = %8.3f\n", conflist.conf[j].uniqID,
-                conflist.conf[j].on,
-                conflist.conf[j].occ,
-                conflist.conf[j].E_self0,
-                conflist.conf[j].E_mfe);
-            }
-            fprintf(fp, "\n"); fflush(fp);
-            */
-            counter = 0;
-            for (j=0; j<n_free; j++) counter+=free_res[j].n;
-            N_smp = env.monte_niter * counter;
-            
-            for (j=0; j<env.monte_runs; j++) {
-                /* a new state */
-                for (k=0; k<n_free; k++)
-                    state[k] = free_res[k].conf[rand() / (RAND_MAX/free_res[k].n + 1)];
-                
-                fprintf(fp, "Doing annealing of MC %2d ...\n", j+1); fflush(fp);
-                if (env.monte_nstart * counter) MC(env.monte_nstart * counter);
-                
-                fprintf(fp, "Doing MC %2d ... \n", j+1); fflush(fp);
-                if (N_smp) MC(N_smp);
-                if (N_smp) {
-                    if (env.ms_out) MC_smp(N_smp);
-                    else MC(N_smp);
-                }
-                for (k=0; k<conflist.n_conf; k++) {
-                    MC_occ[j][k] = conflist.conf[k].occ;
-                }
-                fprintf(fp, "Done\n\n");
-                 /* average -Yifan */
-                for (k=0; k<conflist.n_conf; k++) conflist.conf[k].occ = 0.0;
-                for (k_run=0; k_run<j+1; k_run++) {
-                    for (k=0; k<conflist.n_conf; k++) {
-                        conflist.conf[k].occ +=  MC_occ[k_run][k]/(j+1);
-                    }
-                }
-                if (env.monte_tsx) {
-                    update_Sconvergence(); /* calculate entropy from occupancy */
-                    E_base = get_base();
-                }
-            }
-            
-            /* average */
-            for (k=0; k<conflist.n_conf; k++) conflist.conf[k].occ = 0.0;
-            for (j=0; j<env.monte_runs; j++) {
-                for (k=0; k<conflist.n_conf; k++) {
-                    conflist.conf[k].occ +=  MC_occ[j][k]/env.monte_runs;
-                }
-            }
-            
-            /* standard deviation */
-            sigma_max = 0.0;
-            for (j=0; j<conflist.n_conf; j++) {
-                t = 0.0;
-                for (k=0; k<env.monte_runs; k++) {
-                    t += (MC_occ[k][j] - conflist.conf[j].occ) * (MC_occ[k][j] - conflist.conf[j].occ) ;
-                }
-                if (env.monte_runs > 1) sigma[j] = sqrt(t/(env.monte_runs-1));
-                else sigma[j] = 999.00;
-                
-                if (sigma_max < sigma[j]) sigma_max = sigma[j];
-            }
-        }    
-        /* write statstics */
-        fprintf(fp, "Conformer     flag   E_self");
-        for (j=0; j<env.monte_runs; j++) fprintf(fp, "   mc%02d", j+1);
-        fprintf(fp, "      occ Sgm(n-1)\n");
-        for (j=0; j<conflist.n_conf; j++) {
-            occ_table[j][i] = conflist.conf[j].occ;
-            entropy_table[j][i] = conflist.conf[j].E_TS;
-            fprintf(fp, "%s   %c %8.3f", conflist.conf[j].uniqID,
-            conflist.conf[j].on,
-            conflist.conf[j].E_self0);
-            for (k=0; k<env.monte_runs; k++) fprintf(fp, " %6.3f", MC_occ[k][j]);
-            fprintf(fp, " Av=%5.3f Sg=%5.3f\n", conflist.conf[j].occ, sigma[j]);
-        }
-        fprintf(fp, "\n"); fflush(fp);
-        
-        timerC = time(NULL);
-        printf("   Titration %2d: %5ld seconds, biggest stdev of conformer occ = %5.3f\n",
-        i+1, timerC-timerB, sigma_max);
-        fflush(stdout);
-  
+    for (i=0; i<env.titr_steps; i++) {
+        append_file(mc_fp, titr_fp[i]);
+        if (titr_bit_fp[i]) append_file(ms_bit_fp, titr_bit_fp[i]);
     }
+    free(titr_fp);
+    free(titr_bit_fp);
 
-    fclose(fp);
-    fclose(ms_fp);
-    fclose(pro_fp);
+    fclose(mc_fp);
+    if (ms_bit_fp) fclose(ms_bit_fp);
+
+    /* conflist and residue groups as loaded, for the fitting */
+    free(conflist.conf);
+    conflist.n_conf = 0; conflist.conf = NULL;
+    cpy_res(&conflist, &conflist_bak);
+    group_confs();
     printf("   Done MC sampling\n\n"); fflush(stdout);
 
 
@@ -575,20 +440,28 @@ int monte()
     
     
     /* free MC stat */
-    for (i=0; i<env.monte_runs; i++) {
-        free(MC_occ[i]);
+    if (MC_occ) {
+        for (i=0; i<env.monte_runs; i++) {
+            free(MC_occ[i]);
+        }
+        free(MC_occ);
     }
-    free(MC_occ);
-    free(sigma);
     
     /* free conflist */
     free(conflist.conf);
     free(conflist_bak.conf);
     
     /* free pairwise */
-    for (i=0; i<conflist.n_conf; i++)
-        free(pairwise[i]);
-    free(pairwise);
+    if (pairwise) {
+        for (i=0; i<conflist.n_conf; i++)
+            free(pairwise[i]);
+        free(pairwise);
+    }
+    else {
+        free_sparse_pw(&pw_sparse);
+        free_sparse_pw(&pw_sparse_vdw);
+        free_sparse_pw(&pw_sparse_ele);
+    }
     
     /* free residues */
     for (i=0; i<n_free; i++)
@@ -610,6 +483,268 @@ int monte()
     return 0;
 }
 
+int titrate(int i, unsigned int seed, FILE **fp_out, FILE **bit_out)
+/* One titration point: annealing, equilibration, reduction and sampling.
+ * Titration points are independent, each runs on the MC state private to
+ * its thread and writes its mc_out section to *fp_out.
+ */
+{
+	int j, k, counter, k_run;
+    float *sigma, sigma_max, t;
+    int N_smp;
+    FILE *titr_fp, **run_fp;
+    float S_max;
+    time_t timerB, timerC;
+
+    timerB = time(NULL);
+
+    /* everything below works on this thread's copy of the MC state */
+    mc_srand(seed, i, -1);
+    if (!(fp = tmpfile())) {
+        printf("   FATAL: Can not open temporary file for titration %d\n", i+1);
+        return USERERR;
+    }
+    *fp_out = fp;
+    if (env.ms_out) {
+        bit_fp = tmpfile();
+        *bit_out = bit_fp;
+    }
+    if (!(MC_occ = (float **) malloc(env.monte_runs * sizeof(float *)))) {
+        printf("   FATAL: memory error.\n");
+        return USERERR;
+    }
+    for (j=0; j<env.monte_runs; j++) {
+        if (!(MC_occ[j] = (float *) malloc(conflist_bak.n_conf * sizeof(float)))) {
+            printf("   FATAL: memory error.\n");
+            return USERERR;
+        }
+    }
+    sigma = (float *) calloc(conflist_bak.n_conf, sizeof(float));
+    sigma_max = 0.0;
+
+    ph = env.titr_ph0;
+    eh = env.titr_eh0;
+    if (env.titr_type == 'p') ph = env.titr_ph0 + i*env.titr_phd;
+    else eh = env.titr_eh0 + i*env.titr_ehd;
+    fprintf(fp, "Titration (%dth) at pH = %6.2f Eh = %6.2f:\n", i+1, ph, eh); fflush(fp);
+
+    
+    /* reduce prot to free residues, conformers fixed as 0 occ are excluded from this free residues */
+    free(conflist.conf);
+    conflist.n_conf = 0; conflist.conf = NULL;
+    cpy_res(&conflist, &conflist_bak);
+    group_conftype();  /* This ininitializes Sconverge and SconvergeBak */
+    
+    group_confs();
+    fprintf(fp, "Identified %d free residues from %d residues.\n", n_free, n_all);
+    fflush(fp);
+    
+    /* get big list */
+    mk_neighbors();
+    
+    /* Compute base energy, self and mfe */
+    E_base = get_base();
+    
+    /* get a microstate */
+    state = (int *) realloc(state, n_free*sizeof(int));
+    for (j=0; j<n_free; j++)
+        state[j] = free_res[j].conf[mc_rand() / (RAND_MAX/free_res[j].n + 1)];
+    
+    /* DEBUG
+    for (j=0; j<n_free; j++) printf("%03d ", state[j]);
+    printf("\n");
+    */
+
+    /* Do annealing */
+    /*
+    fprintf(fp, "Conformer list before reduction: E_base = %10.3f\n", E_base);
+    for (j=0; j<conflist.n_conf; j++) {
+        fprintf(fp, "%s %c %4.2f self = %8.3f mfe = %8.3f\n", conflist.conf[j].uniqID, 
+        conflist.conf[j].on,
+        conflist.conf[j].occ,
+        conflist.conf[j].E_self0,
+        conflist.conf[j].E_mfe);
+    }
+    fprintf(fp, "\n"); fflush(fp);
+    */
+    counter = 0;
+    for (j=0; j<n_free; j++) counter+=free_res[j].n;
+    N_smp = env.monte_nstart * counter;
+    fprintf(fp, "Doing annealing... \n"); fflush(fp);
+    if (N_smp) MC(N_smp);
+    fprintf(fp, "Done\n\n");
+
+    /* memcpy(state_check, state, sizeof(int)*n_free);  DEBUG */
+    
+    /* Do equalibriation */
+    counter = 0;
+    for (j=0; j<n_free; j++) counter+=free_res[j].n;
+    N_smp = env.monte_neq * counter;
+    fprintf(fp, "Doing equalibration ... \n"); fflush(fp);
+    if (N_smp) MC(N_smp);
+    fprintf(fp, "Done\n\n");
+    
+    /* do reduction */
+    fprintf(fp, "Reducing conflist ... %d conformers are marked as fixed.\n\n", reduce_conflist());
+    group_confs();
+    fprintf(fp, "%d free residues from %d residues, after reduction.\n\n", n_free, n_all);
+    fflush(fp);
+
+    /* reset */
+    mk_neighbors();
+
+    j = 0; S_max = 999.9;
+    for (k=0; k<Sconverge.n; k++) SconvergeBak.conftype[k].E_TS = 0.0;
+    if (env.monte_tsx) {
+    	while (S_max > 0.5) {
+    		E_base = get_base();
+    		if (enumerate(i) == -1) { /* Non-ANALYTICAL SOLOTION */
+    			counter = 0;
+    			for (k=0; k<n_free; k++) counter+=free_res[k].n;
+    			N_smp = env.monte_niter * counter;
+
+    			fprintf(fp, "Doing Entropy sampling cycle %d...\n", j+1); fflush(fp);
+    			if (env.monte_nstart * counter) MC(env.monte_nstart * counter);
+    			if (N_smp) MC(N_smp);
+    		}
+    		update_Sconvergence(); /* calculate entropy from occupancy */
+    		S_max = s_stat();
+    		fprintf(fp, "Max delta = %8.3f\n", S_max);
+
+    		/* backup */
+    		for (k=0; k<Sconverge.n; k++) SconvergeBak.conftype[k] = Sconverge.conftype[k];
+
+    		j++;
+    	}
+    	fprintf(fp, "Done, exit at max entropy convergence %.3f \n\n", S_max);
+    }
+    
+    
+    E_base = get_base();
+    /* ANALYTICAL SOLOTION */
+    if (enumerate(i) == -1) {
+        /*
+        fprintf(fp, "Conformer list after reduction: E_base = %10.3f\n", E_base);
+        for (j=0; j<conflist.n_conf; j++) {
+            fprintf(fp, "%s %c %4.2f self = %8.3f mfe = %8.3f\n", conflist.conf[j].uniqID,
+            conflist.conf[j].on,
+            conflist.conf[j].occ,
+            conflist.conf[j].E_self0,
+            conflist.conf[j].E_mfe);
+        }
+        fprintf(fp, "\n"); fflush(fp);
+        */
+        counter = 0;
+        for (j=0; j<n_free; j++) counter+=free_res[j].n;
+        N_smp = env.monte_niter * counter;
+
+        /* Runs are independent unless the entropy correction is refined between
+         * them, or microstates are streamed out. Each run draws from its own
+         * stream and logs to its own file, so the result is the same for any
+         * number of threads.
+         */
+        run_fp = (FILE **) calloc(env.monte_runs, sizeof(FILE *));
+        titr_fp = fp;
+#pragma omp parallel num_threads(run_threads) if(!env.monte_tsx && !env.ms_out) private(j, k, k_run) \
+        copyin(conflist, E_base, ph, eh, state, free_res, n_free, biglist, MC_occ)
+        {
+#ifdef _OPENMP
+            if (omp_get_thread_num()) {  /* private working copy of the titration's state */
+                CONF *conf = (CONF *) malloc(conflist.n_conf * sizeof(CONF));
+                int  *state_w = (int *) malloc(n_free * sizeof(int));
+                memcpy(conf, conflist.conf, conflist.n_conf * sizeof(CONF));
+                conflist.conf = conf;
+                state = state_w;
+                field = NULL; since = NULL;
+                move.res = NULL; move.conf = NULL;
+            }
+#pragma omp barrier
+#endif
+#pragma omp for schedule(dynamic, 1)
+            for (j=0; j<env.monte_runs; j++) {
+                if (!(run_fp[j] = tmpfile())) run_fp[j] = titr_fp;
+                fp = run_fp[j];
+                mc_srand(seed, i, j);
+                monte_run(j, env.monte_nstart * counter, N_smp);
+
+                if (env.monte_tsx) {  /* average -Yifan */
+                    for (k=0; k<conflist.n_conf; k++) conflist.conf[k].occ = 0.0;
+                    for (k_run=0; k_run<j+1; k_run++) {
+                        for (k=0; k<conflist.n_conf; k++) {
+                            conflist.conf[k].occ +=  MC_occ[k_run][k]/(j+1);
+                        }
+                    }
+                    update_Sconvergence(); /* calculate entropy from occupancy */
+                    E_base = get_base();
+                }
+            }
+#ifdef _OPENMP
+            if (omp_get_thread_num()) {
+                free(conflist.conf); free(state);
+                free(field); free(since);
+                free(move.res); free(move.conf);
+            }
+#endif
+        }
+        fp = titr_fp;
+        for (j=0; j<env.monte_runs; j++) {
+            if (run_fp[j] && run_fp[j] != titr_fp) append_file(fp, run_fp[j]);
+        }
+        free(run_fp);
+        
+        /* average */
+        for (k=0; k<conflist.n_conf; k++) conflist.conf[k].occ = 0.0;
+        for (j=0; j<env.monte_runs; j++) {
+            for (k=0; k<conflist.n_conf; k++) {
+                conflist.conf[k].occ +=  MC_occ[j][k]/env.monte_runs;
+            }
+        }
+        
+        /* standard deviation */
+        sigma_max = 0.0;
+        for (j=0; j<conflist.n_conf; j++) {
+            t = 0.0;
+            for (k=0; k<env.monte_runs; k++) {
+                t += (MC_occ[k][j] - conflist.conf[j].occ) * (MC_occ[k][j] - conflist.conf[j].occ) ;
+            }
+            if (env.monte_runs > 1) sigma[j] = sqrt(t/(env.monte_runs-1));
+            else sigma[j] = 999.00;
+            
+            if (sigma_max < sigma[j]) sigma_max = sigma[j];
+        }
+    }    
+    /* write statstics */
+    fprintf(fp, "Conformer     flag   E_self");
+    for (j=0; j<env.monte_runs; j++) fprintf(fp, "   mc%02d", j+1);
+    fprintf(fp, "      occ Sgm(n-1)\n");
+    for (j=0; j<conflist.n_conf; j++) {
+        occ_table[j][i] = conflist.conf[j].occ;
+        entropy_table[j][i] = conflist.conf[j].E_TS;
+        fprintf(fp, "%s   %c %8.3f", conflist.conf[j].uniqID,
+        conflist.conf[j].on,
+        conflist.conf[j].E_self0);
+        for (k=0; k<env.monte_runs; k++) fprintf(fp, " %6.3f", MC_occ[k][j]);
+        fprintf(fp, " Av=%5.3f Sg=%5.3f\n", conflist.conf[j].occ, sigma[j]);
+    }
+    fprintf(fp, "\n"); fflush(fp);
+    
+    timerC = time(NULL);
+    printf("   Titration %2d: %5ld seconds, biggest stdev of conformer occ = %5.3f\n",
+    i+1, timerC-timerB, sigma_max);
+    fflush(stdout);
+
+    /* this thread's copies, allocated again by its next titration point */
+    for (j=0; j<env.monte_runs; j++) free(MC_occ[j]);
+    free(MC_occ);
+    MC_occ = NULL;
+    free(Sconverge.conftype);
+    free(SconvergeBak.conftype);
+    Sconverge.conftype = SconvergeBak.conftype = NULL;
+
+    free(sigma);
+    return 0;
+}
+
 int load_conflist()
 {
 	FILE *fp;
@@ -797,6 +932,17 @@ int verify_flag()
 int load_pairwise()
 {   int i, j, kc;
     EMATRIX ematrix;
+    EMATRIX_MAP emap;
+
+    /* a mapped table is read a row at a time, the full EMATRIX is never built */
+    if (!open_energies_map(&emap, ".")) {
+        i = load_pairwise_map(&emap);
+        close_energies_map(&emap);
+        return i;
+    }
+
+    /* the sparse table is filled as energies.opp is read, no full EMATRIX either */
+    if (env.pw_sparse_thr >= 0.0) return load_pairwise_opp();
 
     ematrix.n = 0;  
     if (load_energies(&ematrix, ".", 0)<0) {
@@ -876,6 +1022,136 @@ int load_pairwise()
     return 0;
 }
 
+int load_pairwise_map(EMATRIX_MAP *emap)
+/* Build pairwise from energies.bin. Rows are scaled as they are read and made
+ * symmetric afterwards, (P + P^T)/2, which is what load_pairwise() computes
+ * from the two PAIRWISE records.
+ */
+{
+    int i, j, n = emap->n;
+    const PAIRWISE *pw;
+    float *row;
+
+    if (!(row = (float *) malloc(n * sizeof(float)))) {
+        printf("   FATAL: memory error in load_pairwise()\n");
+        return USERERR;
+    }
+    if (env.pw_sparse_thr >= 0.0) {
+        if (alloc_sparse_pw(&pw_sparse, n)) return USERERR;
+        pairwise = NULL;
+    }
+    else {
+        if (!(pairwise = (float **) malloc(n * sizeof(float *)))) {
+            printf("   FATAL: memory error in load_pairwise()\n");
+            return USERERR;
+        }
+    }
+
+    for (i=0; i<n; i++) {
+        if (emap->conf[i].on != 't') {  /* not a valid delphi run, same as load_energies() */
+            memset(row, 0, n * sizeof(float));
+        }
+        else {
+            if (!(pw = energies_map_row(emap, i))) {
+                free(row);
+                if (!pairwise) free_sparse_pw(&pw_sparse);
+                return USERERR;
+            }
+            for (j=0; j<n; j++) row[j] = pw[j].ele*env.scale_ele + pw[j].vdw*env.scale_vdw;
+        }
+
+        if (!pairwise) {
+            if (add_sparse_pw_row(&pw_sparse, i, row, 0.0)) {
+                free(row);
+                free_sparse_pw(&pw_sparse);
+                return USERERR;
+            }
+            continue;
+        }
+        if (!(pairwise[i] = (float *) malloc(n * sizeof(float)))) {
+            printf("   FATAL: memory error in load_pairwise()\n");
+            return USERERR;
+        }
+        memcpy(pairwise[i], row, n * sizeof(float));
+    }
+    free(row);
+
+    if (!pairwise) {
+        if (sym_sparse_pw(&pw_sparse, env.pw_sparse_thr)) {
+            free_sparse_pw(&pw_sparse);
+            return USERERR;
+        }
+        printf("   Sparse pairwise: %ld of %ld couplings above %.3f are kept.\n",
+               pw_sparse.start[n], (long) n * n, env.pw_sparse_thr);
+    }
+    else {
+        for (i=0; i<n; i++) {
+            for (j=0; j<i; j++)
+                pairwise[i][j] = pairwise[j][i] = (pairwise[i][j] + pairwise[j][i])/2.0;
+        }
+    }
+
+    return 0;
+}
+
+int load_pairwise_opp()
+/* Sparse pairwise from energies.opp, one row in memory at a time. As in
+ * load_pairwise_map() rows are scaled as they are read and made symmetric by
+ * sym_sparse_pw() before the threshold is applied.
+ */
+{
+    int i, j, n, err = 0;
+    FILE *fp;
+    CONF_HEAD *conf;
+    PAIRWISE *pw;
+    float *row;
+
+    if (!(fp = open_energies_opp(".", &n))) {
+        printf("   File %s not found\n", ENERGY_TABLE);
+        return USERERR;
+    }
+    conf = (CONF_HEAD *) malloc((n+1) * sizeof(CONF_HEAD));
+    pw   = (PAIRWISE *) malloc((n+1) * sizeof(PAIRWISE));
+    row  = (float *) malloc((n+1) * sizeof(float));
+    if (!conf || !pw || !row || alloc_sparse_pw(&pw_sparse, n)) {
+        printf("   FATAL: memory error in load_pairwise()\n");
+        err = USERERR;
+    }
+    pairwise = NULL;
+
+    if (!err && fread(conf, sizeof(CONF_HEAD), n, fp) != (size_t) n) {
+        printf("   Error in loading pairwise interaction headers of %s\n", ENERGY_TABLE);
+        err = USERERR;
+    }
+    for (i=0; !err && i<n; i++) {
+        if (fread(pw, sizeof(PAIRWISE), n, fp) != (size_t) n) {
+            printf("   FATAL: Unexpected end of file %s.\n", ENERGY_TABLE);
+            err = USERERR;
+            break;
+        }
+        if (conf[i].on != 't') {  /* not a valid delphi run, same as load_energies() */
+            memset(row, 0, n * sizeof(float));
+        }
+        else {
+            for (j=0; j<n; j++) row[j] = pw[j].ele*env.scale_ele + pw[j].vdw*env.scale_vdw;
+        }
+        if (add_sparse_pw_row(&pw_sparse, i, row, 0.0)) err = USERERR;
+    }
+    fclose(fp);
+    free(conf);
+    free(pw);
+    free(row);
+
+    if (err || sym_sparse_pw(&pw_sparse, env.pw_sparse_thr)) {
+        free_sparse_pw(&pw_sparse);
+        return USERERR;
+    }
+    printf("   Sparse pairwise: %ld of %ld couplings above %.3f are kept.\n",
+           pw_sparse.start[n], (long) n * n, env.pw_sparse_thr);
+
+    return 0;
+}
+
 int load_pairwise_vdw()
 {
     int i, j, kc;
@@ -1011,6 +1287,16 @@ void group_confs()
         }
     }
     
+    /* the sparse rows name conformers, conf_free tells which free residue holds one */
+    if (!(conf_free = (int *) realloc(conf_free, (conflist.n_conf+1) * sizeof(int)))) {
+        printf("   FATAL: memory error in group_confs()\n");
+        exit(-1);
+    }
+    for (ic=0; ic<conflist.n_conf; ic++) conf_free[ic] = -1;
+    for (ir=0; ir<n_free; ir++) {
+        for (ic=0; ic<free_res[ir].n; ic++) conf_free[free_res[ir].conf[ic]] = ir;
+    }
+    
     return;
 }
 
@@ -1018,7 +1304,10 @@ float get_base()
 {
 	float E;
     int kr, kc, ir, ic;
+    long k;
     float mfe;
+    double *mfe_all = NULL;
+    int *fixed_of = NULL;
     
     E = 0.0;
     
@@ -1047,13 +1336,35 @@ float get_base()
     }
 
     /* mfe on all conformers from fixed conformers */
+    if (!pairwise) {
+        /* the table is symmetric, so the rows of the fixed conformers are scattered */
+        mfe_all  = (double *) calloc(conflist.n_conf+1, sizeof(double));
+        fixed_of = (int *) malloc((conflist.n_conf+1) * sizeof(int));
+        if (!mfe_all || !fixed_of) {
+            printf("   FATAL: memory error in get_base()\n");
+            exit(-1);
+        }
+        for (ic=0; ic<conflist.n_conf; ic++) fixed_of[ic] = -1;
+        for (ir=0; ir<n_fixed; ir++) {
+            for (ic=0; ic<fixed_res[ir].n; ic++) {
+                kc = fixed_res[ir].conf[ic];
+                fixed_of[kc] = ir;
+                if (conflist.conf[kc].occ == 0.0) continue;
+                for (k=pw_sparse.start[kc]; k<pw_sparse.start[kc+1]; k++)
+                    mfe_all[pw_sparse.col[k]] += pw_sparse.value[k] * conflist.conf[kc].occ;
+            }
+        }
+    }
     for (kr=0; kr<n_all; kr++) {
         for (kc=0; kc<all_res[kr].n; kc++) {
-            mfe = 0.0;
-            for (ir=0; ir<n_fixed; ir++) {
-                for (ic=0; ic<fixed_res[ir].n; ic++) {
-                    mfe += pairwise[all_res[kr].conf[kc]][fixed_res[ir].conf[ic]]
-                    *conflist.conf[fixed_res[ir].conf[ic]].occ; /* self - self was already set to 0 */
+            if (!pairwise) mfe = mfe_all[all_res[kr].conf[kc]];
+            else {
+                mfe = 0.0;
+                for (ir=0; ir<n_fixed; ir++) {
+                    for (ic=0; ic<fixed_res[ir].n; ic++) {
+                        mfe += pairwise[all_res[kr].conf[kc]][fixed_res[ir].conf[ic]]
+                        *conflist.conf[fixed_res[ir].conf[ic]].occ; /* self - self was already set to 0 */
+                    }
                 }
             }
             conflist.conf[all_res[kr].conf[kc]].E_mfe = mfe;
@@ -1068,6 +1379,25 @@ float get_base()
         }
     }
     /* substract double counted mfe on fixed conformers */
+    if (!pairwise) {
+        /* every pair of two fixed residues is met from both sides */
+        double dE = 0.0;
+        for (ir=0; ir<n_fixed; ir++) {
+            for (ic=0; ic<fixed_res[ir].n; ic++) {
+                kc = fixed_res[ir].conf[ic];
+                if (conflist.conf[kc].occ == 0.0) continue;
+                for (k=pw_sparse.start[kc]; k<pw_sparse.start[kc+1]; k++) {
+                    kr = fixed_of[pw_sparse.col[k]];
+                    if (kr < 0 || kr == ir) continue;
+                    dE += pw_sparse.value[k] * conflist.conf[kc].occ * conflist.conf[pw_sparse.col[k]].occ;
+                }
+            }
+        }
+        E -= dE/2.0;
+        free(mfe_all);
+        free(fixed_of);
+        return E;
+    }
     for (ir=0; ir<n_fixed; ir++) {
         for (kr=ir+1; kr<n_fixed; kr++) {
             for (ic=0; ic<fixed_res[ir].n; ic++) {
@@ -1091,6 +1421,18 @@ float get_E()
     
     /* Triangl calculation, no bias but expensive */
     for (kr=0; kr<n_free; kr++) E += conflist.conf[state[kr]].E_self;
+    if (!pairwise) {  /* each pair is in the rows of both conformers */
+        double pw = 0.0;
+        long k;
+        for (kr=0; kr<n_free; kr++) {
+            for (k=pw_sparse.start[state[kr]]; k<pw_sparse.start[state[kr]+1]; k++) {
+                ir = conf_free[pw_sparse.col[k]];
+                if (ir < 0 || ir == kr || state[ir] != pw_sparse.col[k]) continue;
+                pw += pw_sparse.value[k];
+            }
+        }
+        return E + pw/2.0;
+    }
     for (kr=0; kr<n_free; kr++) {
         for (ir=0; ir<kr; ir++)
             E += pairwise[state[kr]][state[ir]];
@@ -1107,6 +1449,36 @@ void mk_neighbors()
     /* here */
     biglist = (BIGLIST *) malloc(n_free * sizeof(BIGLIST));
     
+    if (!pairwise) {  /* mark the residues met in the rows of kr, then list them in order */
+        int *seen = (int *) malloc((n_free+1) * sizeof(int));
+        long k;
+        if (!biglist || !seen) {
+            printf("   FATAL: memory error in mk_neighbors()\n");
+            exit(-1);
+        }
+        for (ir=0; ir<n_free; ir++) seen[ir] = -1;
+        for (kr=0; kr<n_free; kr++) {
+            biglist[kr].n = 0;
+            biglist[kr].res = NULL;
+            for (kc=0; kc<free_res[kr].n; kc++) {
+                ic = free_res[kr].conf[kc];
+                for (k=pw_sparse.start[ic]; k<pw_sparse.start[ic+1]; k++) {
+                    if (fabs(pw_sparse.value[k]) <= env.big_pairwise) continue;
+                    ir = conf_free[pw_sparse.col[k]];
+                    if (ir >= 0 && ir != kr) seen[ir] = kr;
+                }
+            }
+            for (ir=0; ir<n_free; ir++) {
+                if (seen[ir] != kr) continue;
+                biglist[kr].n++;
+                biglist[kr].res = (int *) realloc(biglist[kr].res, biglist[kr].n*sizeof(int));
+                biglist[kr].res[biglist[kr].n-1] = ir;
+            }
+        }
+        free(seen);
+        return;
+    }
+    
     for (kr=0; kr<n_free; kr++) {
         biglist[kr].n = 0;
         biglist[kr].res = NULL;
@@ -1133,13 +1505,233 @@ void mk_neighbors()
 }
 
 
+double state_pw(int ic)
+/* pairwise of conformer ic with the conformers of the current state, from the sparse row of ic */
+{
+	long k;
+    int ir;
+    double f = 0.0;
+
+    for (k=pw_sparse.start[ic]; k<pw_sparse.start[ic+1]; k++) {
+        ir = conf_free[pw_sparse.col[k]];
+        if (ir >= 0 && state[ir] == pw_sparse.col[k]) f += pw_sparse.value[k];
+    }
+
+    return f;
+}
+
+void init_field()
+/* field[ic] is the pairwise interaction of free conformer ic with the current
+ * microstate, so a flip costs a lookup instead of a loop over free residues.
+ */
+{
+	int kr, kc, ir, ic;
+	long k;
+    double f;
+
+    field = (double *) realloc(field, conflist.n_conf * sizeof(double));
+    if (!pairwise) {  /* scatter the nonzero couplings of the occupied conformers */
+        for (ic=0; ic<conflist.n_conf; ic++) field[ic] = 0.0;
+        for (ir=0; ir<n_free; ir++) {
+            for (k=pw_sparse.start[state[ir]]; k<pw_sparse.start[state[ir]+1]; k++)
+                field[pw_sparse.col[k]] += pw_sparse.value[k];
+        }
+        return;
+    }
+    for (kr=0; kr<n_free; kr++) {
+        for (kc=0; kc<free_res[kr].n; kc++) {
+            ic = free_res[kr].conf[kc];
+            f = 0.0;
+            for (ir=0; ir<n_free; ir++) f += pairwise[ic][state[ir]];
+            field[ic] = f;
+        }
+    }
+
+    return;
+}
+
+void update_field(int old_conf, int new_conf)
+/* old_conf was replaced by new_conf in the accepted microstate */
+{
+	int kr, kc, ic;
+	long k;
+
+    if (!pairwise) {  /* only conformers coupled to old_conf or new_conf change */
+        for (k=pw_sparse.start[new_conf]; k<pw_sparse.start[new_conf+1]; k++)
+            field[pw_sparse.col[k]] += pw_sparse.value[k];
+        for (k=pw_sparse.start[old_conf]; k<pw_sparse.start[old_conf+1]; k++)
+            field[pw_sparse.col[k]] -= pw_sparse.value[k];
+        return;
+    }
+
+    float *pw_new = pairwise[new_conf];
+    float *pw_old = pairwise[old_conf];
+
+    for (kr=0; kr<n_free; kr++) {
+        for (kc=0; kc<free_res[kr].n; kc++) {
+            ic = free_res[kr].conf[kc];
+            field[ic] += pw_new[ic] - pw_old[ic];
+        }
+    }
+
+    return;
+}
+
+double move_field(int ic)
+/* field of conformer ic in the trial microstate, field[] is still the accepted one */
+{
+	int k, ir;
+    double f = field[ic];
+
+    if (!pairwise) {  /* the moved residues add their new conformer and take off the old one */
+        long kk;
+        for (kk=pw_sparse.start[ic]; kk<pw_sparse.start[ic+1]; kk++) {
+            ir = conf_free[pw_sparse.col[kk]];
+            if (ir < 0) continue;
+            for (k=0; k<move.n; k++) {
+                if (move.res[k] != ir) continue;
+                if (state[ir] == pw_sparse.col[kk]) f += pw_sparse.value[kk];
+                if (move.conf[k] == pw_sparse.col[kk]) f -= pw_sparse.value[kk];
+                break;
+            }
+        }
+        return f;
+    }
+    for (k=0; k<move.n; k++)
+        f += pairwise[ic][state[move.res[k]]] - pairwise[ic][move.conf[k]];
+
+    return f;
+}
+
+float flip(int ires, int new_conf)
+/* flip free residue ires to new_conf as part of the current move, returns the energy change */
+{
+	int k;
+    int old_conf = state[ires];
+
+    for (k=0; k<move.n; k++) {
+        if (move.res[k] == ires) break;
+    }
+    if (k == move.n) {  /* first time this residue moves, remember where it was */
+        move.res[k]  = ires;
+        move.conf[k] = old_conf;
+        move.n++;
+    }
+
+    state[ires] = new_conf;
+    return conflist.conf[new_conf].E_self - conflist.conf[old_conf].E_self
+           + move_field(new_conf) - move_field(old_conf);
+}
+
+void accept_move(int step)
+/* commit the current move, step is the index of the MC step that accepted it */
+{
+	int k, ires;
+
+    for (k=0; k<move.n; k++) {
+        ires = move.res[k];
+        if (state[ires] == move.conf[k]) continue;
+        conflist.conf[move.conf[k]].counter += step - since[ires];
+        since[ires] = step;
+        update_field(move.conf[k], state[ires]);
+    }
+    move.n = 0;
+
+    return;
+}
+
+void reject_move()
+{
+	int k;
+
+    for (k=0; k<move.n; k++) state[move.res[k]] = move.conf[k];
+    move.n = 0;
+
+    return;
+}
+
+void count_state(int n_total)
+/* credit each free residue's current conformer with the steps it has been held */
+{
+	int j;
+
+    for (j=0; j<n_free; j++) {
+        conflist.conf[state[j]].counter += n_total - since[j];
+        since[j] = n_total;
+    }
+
+    return;
+}
+
+void mc_srand(unsigned int seed, int i_titr, int i_run)
+/* start the random number stream of run i_run (-1 for annealing and reduction)
+ * of titration point i_titr on this thread
+ */
+{
+	rng_key = ((unsigned long long) seed << 32) ^ ((unsigned long long) (i_titr+1) << 16) ^ (unsigned long long) (i_run+1);
+    rng_key = rng_key * 0xbf58476d1ce4e5b9ULL + 0x9e3779b97f4a7c15ULL;
+    rng_ctr = 0;
+    return;
+}
+
+int mc_rand()
+/* rand() replacement: the n-th number of a stream is a hash of (key, n), so
+ * streams don't depend on the order or the thread they are drawn on.
+ */
+{
+	unsigned long long z = rng_key + (++rng_ctr) * 0x9e3779b97f4a7c15ULL;
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z = z ^ (z >> 31);
+    return (int) (z % ((unsigned long long) RAND_MAX + 1));
+}
+
+void monte_run(int i_run, int n_start, int n_smp)
+/* one of the monte_runs of a titration point: a new random state, annealing
+ * and sampling, the occupancy goes to MC_occ[i_run]
+ */
+{
+	int k;
+
+    for (k=0; k<n_free; k++)
+        state[k] = free_res[k].conf[mc_rand() / (RAND_MAX/free_res[k].n + 1)];
+
+    fprintf(fp, "Doing annealing of MC %2d ...\n", i_run+1); fflush(fp);
+    if (n_start) MC(n_start);
+
+    fprintf(fp, "Doing MC %2d ... \n", i_run+1); fflush(fp);
+    if (n_smp) MC(n_smp);
+    if (n_smp) {
+        if (env.ms_out) MC_smp(n_smp);
+        else MC(n_smp);
+    }
+    for (k=0; k<conflist.n_conf; k++) {
+        MC_occ[i_run][k] = conflist.conf[k].occ;
+    }
+    fprintf(fp, "Done\n\n");
+
+    return;
+}
+
+int append_file(FILE *dest, FILE *src)
+/* copy src from the beginning to the end of dest, then close src */
+{
+	char buf[4096];
+    size_t n;
+
+    rewind(src);
+    while ((n = fread(buf, 1, sizeof(buf), src)) > 0) fwrite(buf, 1, n, dest);
+    fclose(src);
+
+    return 0;
+}
+
 void MC(int n)
 {
 	int cycles, n_total, n_cycle;
     int i, j, k;
-    int iters;
-    int mem;
-    int *old_state;
+    int step;
     float  old_E;
     float dE;
     float b;
@@ -1152,8 +1744,10 @@ void MC(int n)
 
     b = -KCAL2KT/(env.monte_temp/ROOMT);
 
-    mem =n_free * sizeof(int);
-    old_state = (int *) malloc(mem);
+    since = (int *) realloc(since, n_free * sizeof(int));
+    move.res  = (int *) realloc(move.res, (env.monte_flips+1) * sizeof(int));
+    move.conf = (int *) realloc(move.conf, (env.monte_flips+1) * sizeof(int));
+    move.n = 0;
     E_minimum = E_state = get_E();
 
     /* number of cycles and iters in each cycle */
@@ -1167,10 +1761,12 @@ void MC(int n)
         n_total = n_cycle = n;
     }
 
-    /* clear counters */
+    /* clear counters, a conformer is counted when it leaves the state */
     for (i=0; i<conflist.n_conf; i++) conflist.conf[i].counter = 0;
+    for (j=0; j<n_free; j++) since[j] = 0;
     H_average = 0.0;
 
+    step = 0;
     for (i=0; i<cycles; i++) {
         /*
         fprintf(fp, "Step %10d, E_minimum = %10.2f, E_running = %10.2f, E_reset = %10.2f\n",
@@ -1179,25 +1775,23 @@ void MC(int n)
         fprintf(fp, "Step %10d, E_minimum = %10.2f, E_running = %10.2f\n",
         i*n_cycle, E_minimum+E_base, E_state+E_base);
         fflush(fp);
-        iters = n_cycle;
-        while (iters) {
+
+        /* rebuild the field every cycle so round off errors don't accumulate */
+        init_field();
+
+        for (; step<(i+1)*n_cycle; step++) {
             /*  save state */
             old_E = E_state;
-            memcpy(old_state, state, mem);
 
             /* 1st flip */
-            ires  = rand()/(RAND_MAX/n_free + 1);
+            ires  = mc_rand()/(RAND_MAX/n_free + 1);
             while (1) {
-                iconf = rand()/(RAND_MAX/free_res[ires].n + 1);
+                iconf = mc_rand()/(RAND_MAX/free_res[ires].n + 1);
                 old_conf = state[ires];
                 new_conf = free_res[ires].conf[iconf];
                 if (old_conf != new_conf) break;
             }
-            state[ires] = new_conf;
-            E_state += conflist.conf[new_conf].E_self - conflist.conf[old_conf].E_self;
-            for (j=0; j<n_free; j++) {
-                E_state += pairwise[new_conf][state[j]] - pairwise[old_conf][state[j]];
-            }
+            E_state += flip(ires, new_conf);
 
             /* now multiple flip */
             /*   1st flip -> No (50% probablity)
@@ -1208,21 +1802,16 @@ void MC(int n)
              *     |
              *   4th flip (any res in big list)
              */
-            if (rand() & 1) {   /* do multiple flip if odd number */
+            if (mc_rand() & 1) {   /* do multiple flip if odd number */
                 if (biglist[ires].n) {
                     nflips = env.monte_flips > (biglist[ires].n+1) ? biglist[ires].n+1: env.monte_flips;
                     for (k=1; k<nflips; k++) {
                         
-                        iflip = biglist[ires].res[rand()/(RAND_MAX/biglist[ires].n + 1)];
-                        iconf = rand()/(RAND_MAX/free_res[iflip].n + 1);
-                        old_conf = state[iflip];
+                        iflip = biglist[ires].res[mc_rand()/(RAND_MAX/biglist[ires].n + 1)];
+                        iconf = mc_rand()/(RAND_MAX/free_res[iflip].n + 1);
                         new_conf = free_res[iflip].conf[iconf];
 
-                        state[iflip] = new_conf;
-                        E_state += conflist.conf[new_conf].E_self - conflist.conf[old_conf].E_self;
-                        for (j=0; j<n_free; j++) {
-                            E_state += pairwise[new_conf][state[j]] - pairwise[old_conf][state[j]];
-                        }
+                        E_state += flip(iflip, new_conf);
                     }
                 }
             }
@@ -1237,12 +1826,14 @@ void MC(int n)
 
             dE = E_state - old_E;
             if (dE < 0.0) {                                 /* go to new low */
+                accept_move(step);
             }
             /*<<< Boltzmann distribution >>>*/
-            else if ((float) rand()/RAND_MAX < exp(b*dE)) { /* Go */
+            else if ((float) mc_rand()/RAND_MAX < exp(b*dE)) { /* Go */
+                accept_move(step);
             }
             else {                                                    /* stay, restore the state */
-                memcpy(state, old_state, mem);
+                reject_move();
                 E_state = old_E;
             }
 
@@ -1253,17 +1844,12 @@ void MC(int n)
 
             /* count this state energy */
             H_average += E_state/n_total;
-
-            /*<<< Do statistics >>>*/
-            for (j=0; j<n_free; j++) {
-                conflist.conf[state[j]].counter++;
-                //+= pairwise_vdw[j]
-            }
-            
-            iters --;
         }
     }
 
+    /*<<< Do statistics >>>*/
+    count_state(n_total);
+
     fprintf(fp, "Exit %10d, E_minimum = %10.2f, E_running = %10.2f\n", n_total, E_minimum+E_base, E_state+E_base);
     fprintf(fp, "The average running energy, corresponding to H, is %8.3f kCal/mol\n", H_average+E_base);
     fflush(fp);
@@ -1274,8 +1860,6 @@ void MC(int n)
         conflist.conf[i].occ = (float) conflist.conf[i].counter / n_total;
     }
 
-    free(old_state);
-
     return;
 }
 
@@ -1423,11 +2007,18 @@ int fitit()
     else printf("   MFE: didn't specify mfe point, do mfe at pKa or Em \n");
           
     /* free pairwise */
-    for (i=0; i<conflist.n_conf; i++)
-        free(pairwise[i]);
-    free(pairwise);
+    if (pairwise) {
+        for (i=0; i<conflist.n_conf; i++)
+            free(pairwise[i]);
+        free(pairwise);
+        i = load_pairwise_fround3();
+    }
+    else {
+        free_sparse_pw(&pw_sparse);
+        i = load_pairwise_fround3_sparse();
+    }
    // load the pairwise interaction again, round the ele and vdw to keep consistent with mfe.py  
-    if (load_pairwise_fround3()) {
+    if (i) {
         printf("   FATAL: mfe pairwise interaction not loaded\n");
         return USERERR;
     }
@@ -1755,6 +2346,104 @@ int load_pairwise_fround3()
     return 0;
 }
 
+int load_pairwise_fround3_sparse()
+/* The tables of load_pairwise_fround3() without the couplings that are 0, read a
+ * row at a time from energies.bin or energies.opp. As there, they are not made symmetric.
+ */
+{
+    int i, j, n, mapped, err = 0;
+    char on;
+    EMATRIX_MAP emap;
+    FILE *fp = NULL;
+    CONF_HEAD *conf = NULL;
+    PAIRWISE *pw_buf = NULL;
+    const PAIRWISE *pw = NULL;
+    float *row, *row_vdw, *row_ele;
+
+    if ((mapped = !open_energies_map(&emap, "."))) n = emap.n;
+    else if (!(fp = open_energies_opp(".", &n))) {
+        printf("   File %s not found\n", ENERGY_TABLE);
+        return USERERR;
+    }
+    row = (float *) malloc(3 * (n+1) * sizeof(float));
+    if (!mapped) {
+        conf   = (CONF_HEAD *) malloc((n+1) * sizeof(CONF_HEAD));
+        pw_buf = (PAIRWISE *) malloc((n+1) * sizeof(PAIRWISE));
+    }
+    if (!row || (!mapped && (!conf || !pw_buf)) || alloc_sparse_pw(&pw_sparse, n)
+        || alloc_sparse_pw(&pw_sparse_vdw, n) || alloc_sparse_pw(&pw_sparse_ele, n)) {
+        printf("   FATAL: memory error in load_pairwise_fround3_sparse()\n");
+        exit(-1);
+    }
+    row_vdw = row + n;
+    row_ele = row_vdw + n;
+    pairwise = pairwise_vdw = pairwise_ele = NULL;
+
+    if (!mapped && fread(conf, sizeof(CONF_HEAD), n, fp) != (size_t) n) {
+        printf("   Error in loading pairwise interaction headers of %s\n", ENERGY_TABLE);
+        err = USERERR;
+    }
+    for (i=0; !err && i<n; i++) {
+        if (mapped) {
+            on = emap.conf[i].on;
+            if (on == 't' && !(pw = energies_map_row(&emap, i))) err = USERERR;
+        }
+        else {
+            on = conf[i].on;
+            pw = pw_buf;
+            if (fread(pw_buf, sizeof(PAIRWISE), n, fp) != (size_t) n) {
+                printf("   FATAL: Unexpected end of file %s.\n", ENERGY_TABLE);
+                err = USERERR;
+            }
+        }
+        if (err) break;
+        if (on != 't') {  /* not a valid delphi run, same as load_energies() */
+            memset(row, 0, 3 * n * sizeof(float));
+        }
+        else {
+            for (j=0; j<n; j++) {
+                row[j]     = fround3(pw[j].ele) * env.scale_ele + fround3(pw[j].vdw) * env.scale_vdw;
+                row_vdw[j] = fround3(pw[j].vdw) * env.scale_vdw;
+                row_ele[j] = fround3(pw[j].ele) * env.scale_ele;
+            }
+        }
+        if (add_sparse_pw_row(&pw_sparse, i, row, 0.0) || add_sparse_pw_row(&pw_sparse_vdw, i, row_vdw, 0.0)
+            || add_sparse_pw_row(&pw_sparse_ele, i, row_ele, 0.0)) err = USERERR;
+    }
+
+    if (mapped) close_energies_map(&emap);
+    else fclose(fp);
+    free(conf);
+    free(pw_buf);
+    free(row);
+    if (err) {
+        free_sparse_pw(&pw_sparse);
+        free_sparse_pw(&pw_sparse_vdw);
+        free_sparse_pw(&pw_sparse_ele);
+        return USERERR;
+    }
+
+    return 0;
+}
+
+const float *mfe_row(float **dense, const SPARSE_PW *spw, int ic, float *buf)
+/* row ic of a dense table, or of a sparse one spread out into buf */
+{
+    long k;
+
+    if (dense) return dense[ic];
+    memset(buf, 0, spw->n * sizeof(float));
+    for (k=spw->start[ic]; k<spw->start[ic+1]; k++) buf[spw->col[k]] = spw->value[k];
+
+    return buf;
+}
+
+float mfe_pw(float **dense, const SPARSE_PW *spw, int ic, int jc)
+{
+    if (dense) return dense[ic][jc];
+    return get_sparse_pw(spw, ic, jc);
+}
+
 int print_mfe(int i_res, float mfeP, FILE *pK_fp, FILE *res_fp)
 {
     int i_low, i_high;
@@ -1939,6 +2628,8 @@ int get_mfe(int i_res, int t_point)
     double Eref[2];
     MFE E_ground, E_ionize;
     float *mfe, *mfe_vdw, *mfe_ele;
+    float *pw_buf = NULL, *vdw_buf = NULL, *ele_buf = NULL;
+    const float *pw_row, *vdw_row, *ele_row;
 
     memset(&E_ground, 0, sizeof(MFE));
     memset(&E_ionize, 0, sizeof(MFE));
@@ -1954,6 +2645,15 @@ int get_mfe(int i_res, int t_point)
     mfe_ele = (float *) calloc(mfe_res[i_res].n, sizeof(float));
     nocc = (double *) calloc(mfe_res[i_res].n, sizeof(double));
     rocc = (double *) calloc(mfe_res[i_res].n, sizeof(double));
+    if (!pairwise) {  /* rows of the sparse tables are spread out here */
+        pw_buf  = (float *) malloc((pw_sparse.n+1) * sizeof(float));
+        vdw_buf = (float *) malloc((pw_sparse.n+1) * sizeof(float));
+        ele_buf = (float *) malloc((pw_sparse.n+1) * sizeof(float));
+        if (!pw_buf || !vdw_buf || !ele_buf) {
+            printf("   FATAL: memory error in get_mfe()\n");
+            exit(-1);
+        }
+    }
 
     ph = env.titr_ph0;
     eh = env.titr_eh0;
@@ -1969,10 +2669,13 @@ int get_mfe(int i_res, int t_point)
         conflist.conf[mfe_res[i_res].conf[j]].E_ph =  conflist.conf[mfe_res[i_res].conf[j]].H * (ph-conflist.conf[mfe_res[i_res].conf[j]].pKa) * PH2KCAL;
         conflist.conf[mfe_res[i_res].conf[j]].E_eh =  conflist.conf[mfe_res[i_res].conf[j]].e * (eh-conflist.conf[mfe_res[i_res].conf[j]].Em) * mev2Kcal;
 
+        pw_row  = mfe_row(pairwise, &pw_sparse, mfe_res[i_res].conf[j], pw_buf);
+        vdw_row = mfe_row(pairwise_vdw, &pw_sparse_vdw, mfe_res[i_res].conf[j], vdw_buf);
+        ele_row = mfe_row(pairwise_ele, &pw_sparse_ele, mfe_res[i_res].conf[j], ele_buf);
         for (k=0; k<conflist.n_conf; k++) {
-                mfe[j] += pairwise[mfe_res[i_res].conf[j]][conflist.conf[k].iConf] * fround3(occ_table[k][t_point]);
-                mfe_vdw[j] += pairwise_vdw[mfe_res[i_res].conf[j]][conflist.conf[k].iConf] * fround3(occ_table[k][t_point]);
-                mfe_ele[j] += pairwise_ele[mfe_res[i_res].conf[j]][conflist.conf[k].iConf] * fround3(occ_table[k][t_point]);
+                mfe[j] += pw_row[conflist.conf[k].iConf] * fround3(occ_table[k][t_point]);
+                mfe_vdw[j] += vdw_row[conflist.conf[k].iConf] * fround3(occ_table[k][t_point]);
+                mfe_ele[j] += ele_row[conflist.conf[k].iConf] * fround3(occ_table[k][t_point]);
         }
 
         conflist.conf[mfe_res[i_res].conf[j]].E_self = conflist.conf[mfe_res[i_res].conf[j]].E_self0
@@ -2031,6 +2734,9 @@ int get_mfe(int i_res, int t_point)
     }
 
     for (j=0; j<mfe_res[i_res].n; j++) {
+        pw_row  = mfe_row(pairwise, &pw_sparse, mfe_res[i_res].conf[j], pw_buf);
+        vdw_row = mfe_row(pairwise_vdw, &pw_sparse_vdw, mfe_res[i_res].conf[j], vdw_buf);
+        ele_row = mfe_row(pairwise_ele, &pw_sparse_ele, mfe_res[i_res].conf[j], ele_buf);
         if (strchr(conflist.conf[mfe_res[i_res].conf[j]].uniqID, '+') || strchr(conflist.conf[mfe_res[i_res].conf[j]].uniqID, '-')) {
             E_ionize.vdw0 += nocc[j] * conflist.conf[mfe_res[i_res].conf[j]].E_vdw0; 
             E_ionize.vdw1 += nocc[j] * conflist.conf[mfe_res[i_res].conf[j]].E_vdw1; 
@@ -2050,20 +2756,20 @@ int get_mfe(int i_res, int t_point)
                 	if (!strcmp(conflist.conf[mfe_res[i_res].conf[0]].uniqID, "Ub101M0311_001")) {
                 		if (!strcmp(conflist.conf[all_res[k].conf[q]].uniqID, "ALA01M0221_001")) {
                 			printf("%s, %s,", conflist.conf[mfe_res[i_res].conf[0]].uniqID, conflist.conf[all_res[k].conf[q]].uniqID);
-                			printf("%.2f\n", pairwise[mfe_res[i_res].conf[0]][all_res[k].conf[q]]);
+                			printf("%.2f\n", mfe_pw(pairwise, &pw_sparse, mfe_res[i_res].conf[0], all_res[k].conf[q]));
                 		}
                 	}
                 	if (!strcmp(conflist.conf[mfe_res[i_res].conf[1]].uniqID, "Ub1-1M0311_002")) {
                   	    if (!strcmp(conflist.conf[all_res[k].conf[q]].uniqID, "ALA01M0221_001")) {
                 	        printf("%s, %s,", conflist.conf[mfe_res[i_res].conf[1]].uniqID, conflist.conf[all_res[k].conf[q]].uniqID);
-                            printf("%.3f, %.3f, %.3f\n", pairwise_vdw[mfe_res[i_res].conf[j]][all_res[k].conf[q]],
-                            							 pairwise_ele[mfe_res[i_res].conf[j]][all_res[k].conf[q]],
-                            							 pairwise[mfe_res[i_res].conf[1]][all_res[k].conf[q]]);
+                            printf("%.3f, %.3f, %.3f\n", vdw_row[all_res[k].conf[q]],
+                            							 ele_row[all_res[k].conf[q]],
+                            							 mfe_pw(pairwise, &pw_sparse, mfe_res[i_res].conf[1], all_res[k].conf[q]));
                 	    }
                 	}
-                    E_ionize.mfePair[k] += nocc[j] * (pairwise[mfe_res[i_res].conf[j]][all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
-                    E_ionize.vdw[k] += nocc[j] * (pairwise_vdw[mfe_res[i_res].conf[j]][all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
-                    E_ionize.ele[k] += nocc[j] * (pairwise_ele[mfe_res[i_res].conf[j]][all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
+                    E_ionize.mfePair[k] += nocc[j] * (pw_row[all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
+                    E_ionize.vdw[k] += nocc[j] * (vdw_row[all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
+                    E_ionize.ele[k] += nocc[j] * (ele_row[all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
                 }
             }
         }
@@ -2083,9 +2789,9 @@ int get_mfe(int i_res, int t_point)
             E_ground.total = E_ground.vdw0 + E_ground.vdw1 + E_ground.ebkb + E_ground.tors + E_ground.dsol + E_ground.offset + E_ground.pHpK0 + E_ground.EhEm0 + E_ground.TS + E_ground.residues;
             for (k=0; k<n_all; k++) {
                 for (q=0; q<all_res[k].n; q++) {
-                   E_ground.mfePair[k] += nocc[j] * pairwise[mfe_res[i_res].conf[j]][all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point]);
-                   E_ground.vdw[k] += nocc[j] * (pairwise_vdw[mfe_res[i_res].conf[j]][all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
-                   E_ground.ele[k] += nocc[j] * (pairwise_ele[mfe_res[i_res].conf[j]][all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
+                   E_ground.mfePair[k] += nocc[j] * pw_row[all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point]);
+                   E_ground.vdw[k] += nocc[j] * (vdw_row[all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
+                   E_ground.ele[k] += nocc[j] * (ele_row[all_res[k].conf[q]] * fround3(occ_table[all_res[k].conf[q]][t_point])) ;
 
                 }
             }
@@ -2114,6 +2820,7 @@ int get_mfe(int i_res, int t_point)
     free(E_ground.mfePair); free(E_ground.vdw); free(E_ground.ele);
     free(E_ionize.mfePair); free(E_ionize.vdw); free(E_ionize.ele);
     free(mfe); free(nocc); free(rocc);
+    free(pw_buf); free(vdw_buf); free(ele_buf);
 
     return 0;
 }
@@ -2309,8 +3016,11 @@ int enumerate(int i_ph_eh)
             new_conf = state[ires] = free_res[ires].conf[0];
             
             E_state += conflist.conf[new_conf].E_self - conflist.conf[old_conf].E_self;
-            for (jres=0; jres<n_free; jres++) {
-                E_state += pairwise[new_conf][state[jres]] - pairwise[old_conf][state[jres]];
+            if (!pairwise) E_state += state_pw(new_conf) - state_pw(old_conf);
+            else {
+                for (jres=0; jres<n_free; jres++) {
+                    E_state += pairwise[new_conf][state[jres]] - pairwise[old_conf][state[jres]];
+                }
             }
             
             ires++;
@@ -2322,8 +3032,11 @@ int enumerate(int i_ph_eh)
         
         new_conf = state[ires] = free_res[ires].conf[free_res[ires].on];
         E_state += conflist.conf[new_conf].E_self - conflist.conf[old_conf].E_self;
-        for (jres=0; jres<n_free; jres++) {
-            E_state += pairwise[new_conf][state[jres]] - pairwise[old_conf][state[jres]];
+        if (!pairwise) E_state += state_pw(new_conf) - state_pw(old_conf);
+        else {
+            for (jres=0; jres<n_free; jres++) {
+                E_state += pairwise[new_conf][state[jres]] - pairwise[old_conf][state[jres]];
+            }
         }
         
         E_states[istate]=E_state;
@@ -2584,9 +3297,7 @@ void MC_smp(int n)
 {
 	int cycles, n_total, n_cycle;
     int i, j, k;
-    int iters;
-    int mem;
-    int *old_state;
+    int step;
     float  old_E;
     float dE;
     float b;
@@ -2598,8 +3309,10 @@ void MC_smp(int n)
 
     b = -KCAL2KT/(env.monte_temp/ROOMT);
 
-    mem =n_free * sizeof(int);
-    old_state = (int *) malloc(mem);
+    since = (int *) realloc(since, n_free * sizeof(int));
+    move.res  = (int *) realloc(move.res, (env.monte_flips+1) * sizeof(int));
+    move.conf = (int *) realloc(move.conf, (env.monte_flips+1) * sizeof(int));
+    move.n = 0;
     E_minimum = E_state = get_E();
 
     /* number of cycles and iters in each cycle */
@@ -2613,8 +3326,9 @@ void MC_smp(int n)
         n_total = n_cycle = n;
     }
 
-    /* clear counters */
+    /* clear counters, a conformer is counted when it leaves the state */
     for (i=0; i<conflist.n_conf; i++) conflist.conf[i].counter = 0;
+    for (j=0; j<n_free; j++) since[j] = 0;
     H_average = 0.0;
 
     MSRECORD ms_state;
@@ -2624,6 +3338,7 @@ void MC_smp(int n)
     ms_state.counter = 0;
 
 //    printf("   cycles= %d, ites= %d\n", cycles, n_cycle);
+    step = 0;
     for (i=0; i<cycles; i++) {
         /*
         fprintf(fp, "Step %10d, E_minimum = %10.2f, E_running = %10.2f, E_reset = %10.2f\n",
@@ -2632,42 +3347,34 @@ void MC_smp(int n)
         fprintf(fp, "Step %10d, E_minimum = %10.2f, E_running = %10.2f, E_base = %10.2f\n",
         i*n_cycle, E_minimum + E_base, E_state + E_base, E_base);
         fflush(fp);
-        iters = n_cycle;
 
-        while (iters) {
+        /* rebuild the field every cycle so round off errors don't accumulate */
+        init_field();
+
+        for (; step<(i+1)*n_cycle; step++) {
             /*  save state */
             old_E = E_state;
-            memcpy(old_state, state, mem);
 
             /* 1st flip */
-            ires  = rand()/(RAND_MAX/n_free + 1);
+            ires  = mc_rand()/(RAND_MAX/n_free + 1);
             while (1) {
-                iconf = rand()/(RAND_MAX/free_res[ires].n + 1);
+                iconf = mc_rand()/(RAND_MAX/free_res[ires].n + 1);
                 old_conf = state[ires];
                 new_conf = free_res[ires].conf[iconf];
                 if (old_conf != new_conf) break;
             }
-            state[ires] = new_conf;
-            E_state += conflist.conf[new_conf].E_self - conflist.conf[old_conf].E_self;
-            for (j=0; j<n_free; j++) {
-                E_state += pairwise[new_conf][state[j]] - pairwise[old_conf][state[j]];
-            }
+            E_state += flip(ires, new_conf);
 
-            if (rand() & 1) {   /* do multiple flip if odd number */
+            if (mc_rand() & 1) {   /* do multiple flip if odd number */
                 if (biglist[ires].n) {
                     nflips = env.monte_flips > (biglist[ires].n+1) ? biglist[ires].n+1: env.monte_flips;
                     for (k=1; k<nflips; k++) {
 
-                        iflip = biglist[ires].res[rand()/(RAND_MAX/biglist[ires].n + 1)];
-                        iconf = rand()/(RAND_MAX/free_res[iflip].n + 1);
-                        old_conf = state[iflip];
+                        iflip = biglist[ires].res[mc_rand()/(RAND_MAX/biglist[ires].n + 1)];
+                        iconf = mc_rand()/(RAND_MAX/free_res[iflip].n + 1);
                         new_conf = free_res[iflip].conf[iconf];
 
-                        state[iflip] = new_conf;
-                        E_state += conflist.conf[new_conf].E_self - conflist.conf[old_conf].E_self;
-                        for (j=0; j<n_free; j++) {
-                            E_state += pairwise[new_conf][state[j]] - pairwise[old_conf][state[j]];
-                        }
+                        E_state += flip(iflip, new_conf);
                     }
                 }
             }
@@ -2676,7 +3383,9 @@ void MC_smp(int n)
             if (E_minimum > E_state) E_minimum = E_state;
 
             dE = E_state - old_E;
-            if (dE < 0.0 || (float) rand()/RAND_MAX < exp(b*dE)) {   /* go to new low */
+            if (dE < 0.0 || (float) mc_rand()/RAND_MAX < exp(b*dE)) {   /* go to new low */
+                accept_move(step);
+
             	// write the previous state first
                 if (ms_state.counter != 0) {
                 	write_ms(&ms_state);
@@ -2689,7 +3398,7 @@ void MC_smp(int n)
                 ms_state.Hsq     = (E_state + E_base) * (E_state+E_base);
             }
             else {     /* stay, restore the state */
-                memcpy(state, old_state, mem);
+                reject_move();
                 E_state = old_E;
                 if (ms_state.counter != 0) {
                     ms_state.counter++;
@@ -2706,18 +3415,13 @@ void MC_smp(int n)
 
             /* count this state energy */
             H_average += E_state/n_total;
-
-            /*<<< Do statistics >>>*/
-            for (j=0; j<n_free; j++) {
-                conflist.conf[state[j]].counter++;
-                //+= pairwise_vdw[j]
-            }
-
-            iters --;
         }
     }
     if (ms_state.counter != 0) write_ms(&ms_state);
 
+    /*<<< Do statistics >>>*/
+    count_state(n_total);
+
     fprintf(fp, "Exit %10d, E_minimum = %10.2f, E_running = %10.2f\n", n_total, E_minimum+E_base, E_state+E_base);
     fprintf(fp, "The average running energy, corresponding to H, is %8.3f kCal/mol\n", H_average+E_base);
     fflush(fp);
@@ -2728,8 +3432,6 @@ void MC_smp(int n)
         conflist.conf[i].occ = (float) conflist.conf[i].counter / n_total;
     }
 
-    free(old_state);
-
     return;
 }
 
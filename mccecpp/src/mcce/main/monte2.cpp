@@ -7,19 +7,25 @@
 
 PROT monte2_load_conflist(const char *fname);
 PROT monte2_load_pk1out(const char *pk1out, const char *dconf2);
-void monte2_get_biglist(PROT prot);
-void monte2_set_toggle(PROT prot);
-PROT monte2_reduce(PROT prot);
-int  monte2_load_pairwise(PROT prot);
+void monte2_get_biglist(const PROT &prot);
+void monte2_set_toggle(const PROT &prot);
+PROT monte2_reduce(const PROT &prot);
+int  monte2_load_pairwise(const PROT &prot);
 void monte2_mc(PROT *prot_p);
-int  monte2_check_toggle(PROT prot);
+int  monte2_check_toggle(const PROT &prot);
 void zero_counters(PROT *prot_p);
 void do_free_energy(PROT *prot_p);
-double free_unf(PROT prot);
-int curve_fitting(PROT prot);
+double free_unf(const PROT &prot);
+int curve_fitting(const PROT &prot);
 int monte_out(PROT prot, int n_titra);
 
 static double  **pairwise;
+static SPARSE_PW pw_sparse;   /* used instead of pairwise when PW_SPARSE_THR >= 0 */
+static int     *conf_res;     /* residue of each conformer in the working prot, -1 if reduced away */
+static const PROT *sym_prot;
+static void monte2_map_res(const PROT &prot);
+static double monte2_sym_pw(int ic, int jc, float p, float pt);
+static double monte2_state_pw(const PROT *prot_p, int ic);
 RES     **flip_res;
 GROUP     **flip_group;
 static long    idum;
@@ -145,9 +151,20 @@ int monte2()
             for (i_res=0;i_res<prot_red.n_res;i_res++) {
                 prot_red.E_state += prot_red.res[i_res].conf_w->E_self;
                 ic = prot_red.res[i_res].conf_w->i_conf_prot;
-                for (j_res=i_res+1;j_res<prot_red.n_res;j_res++) {
-                    jc = prot_red.res[j_res].conf_w->i_conf_prot;
-                    prot_red.E_state += pairwise[ic][jc];
+                if (pairwise) {
+                    for (j_res=i_res+1;j_res<prot_red.n_res;j_res++) {
+                        jc = prot_red.res[j_res].conf_w->i_conf_prot;
+                        prot_red.E_state += pairwise[ic][jc];
+                    }
+                }
+                else {
+                    long k;
+                    for (k=pw_sparse.start[ic]; k<pw_sparse.start[ic+1]; k++) {
+                        jc = pw_sparse.col[k];
+                        j_res = conf_res[jc];
+                        if (j_res > i_res && prot_red.res[j_res].conf_w->i_conf_prot == jc)
+                            prot_red.E_state += pw_sparse.value[k];
+                    }
                 }
             }
             prot_red.E_min = prot_red.E_state;
@@ -415,7 +432,7 @@ PROT monte2_load_conflist(const char *fname) {
     return prot;
 }
 
-int monte2_load_pairwise(PROT prot)
+int monte2_load_pairwise(const PROT &prot)
 {
     int   ic, jc, jc_start;
     char  fname[MAXCHAR_LINE];
@@ -428,21 +445,38 @@ int monte2_load_pairwise(PROT prot)
     float ele_pair, vdw_pair;
     int   n_miss_jc = 0,i_miss_ic,j_miss_ic,i_miss_jc,j_miss_jc;
     int   *n_miss_ic = NULL, **miss_ic = NULL, *miss_jc = NULL;
+    double *row = NULL;
+    float *row_f = NULL;
+    int   sparse = env.pw_sparse_thr >= 0.0;
     
-    /* declare memory */
-    if (!(pairwise = (double **) malloc(prot.nc * sizeof(double *)))) {
-        printf("   FATAL: memory error in load_pairwise()\n");fflush(stdout);
-        return USERERR;
+    /* declare memory, the sparse table is built row by row from the opp files without a full table */
+    if (sparse) {
+        row   = (double *) malloc(prot.nc * sizeof(double));
+        row_f = (float *) malloc(prot.nc * sizeof(float));
+        conf_res = (int *) malloc(prot.nc * sizeof(int));
+        if (!row || !row_f || !conf_res || alloc_sparse_pw(&pw_sparse, prot.nc)) {
+            printf("   FATAL: memory error in load_pairwise()\n");fflush(stdout);
+            free(row); free(row_f);
+            return USERERR;
+        }
     }
-    for (ic=0; ic<prot.nc; ic++) {
-        if (!(pairwise[ic] = (double *) malloc(prot.nc * sizeof(double)))) {
+    else {
+        if (!(pairwise = (double **) malloc(prot.nc * sizeof(double *)))) {
             printf("   FATAL: memory error in load_pairwise()\n");fflush(stdout);
             return USERERR;
         }
-        memset(pairwise[ic],0,prot.nc * sizeof(double));
+        for (ic=0; ic<prot.nc; ic++) {
+            if (!(pairwise[ic] = (double *) malloc(prot.nc * sizeof(double)))) {
+                printf("   FATAL: memory error in load_pairwise()\n");fflush(stdout);
+                return USERERR;
+            }
+            memset(pairwise[ic],0,prot.nc * sizeof(double));
+        }
     }
     
     for (ic=0; ic<prot.nc; ic++) {
+        if (sparse) memset(row, 0, prot.nc * sizeof(double));
+        else row = pairwise[ic];
         
         /* get opp file name */
         if (!env.monte_old_input) {
@@ -462,8 +496,12 @@ int monte2_load_pairwise(PROT prot)
                 param_sav("NATOM", prot.conf[ic]->confName, "", &natom, sizeof(int));
             }
             if (natom == 0) { /* dummy */
-                for (jc=0; jc<prot.nc; jc++) pairwise[ic][jc] = 0.0;
+                for (jc=0; jc<prot.nc; jc++) row[jc] = 0.0;
                 strncpy(prot.conf[ic]->history+2,"DM",2);
+                if (sparse) {
+                    for (jc=0; jc<prot.nc; jc++) row_f[jc] = 0.0;
+                    if (add_sparse_pw_row(&pw_sparse, ic, row_f, 0.0)) return USERERR;
+                }
                 continue;
             }
             else {
@@ -499,9 +537,9 @@ int monte2_load_pairwise(PROT prot)
             if (!strcmp(uniqID, prot.conf[jc]->uniqID)) {
                 //printf("%s-%s %f,%f\n",prot.conf[ic]->uniqID, prot.conf[jc]->uniqID, ele_pair,vdw_pair);
                 if (vdw_pair < 500)
-                    pairwise[ic][jc] = ele_pair*env.scale_ele + vdw_pair*env.scale_vdw;
+                    row[jc] = ele_pair*env.scale_ele + vdw_pair*env.scale_vdw;
                 else
-                    pairwise[ic][jc] = ele_pair*env.scale_ele + vdw_pair;
+                    row[jc] = ele_pair*env.scale_ele + vdw_pair;
 
                 prot.conf[jc]->on = 1;
             }
@@ -518,7 +556,7 @@ int monte2_load_pairwise(PROT prot)
                     param_sav("NATOM", prot.conf[jc]->confName, "", &natom, sizeof(int));
                 }
                 if (natom == 0) {
-                    pairwise[ic][jc] = 0.0;
+                    row[jc] = 0.0;
                 }
                 else {
                     if (!env.adding_conf) {
@@ -542,10 +580,22 @@ int monte2_load_pairwise(PROT prot)
                         n_miss_ic[i_miss_jc]++;
                         miss_ic[i_miss_jc] = (int *) realloc(miss_ic[i_miss_jc],n_miss_ic[i_miss_jc]*sizeof(int));
                         miss_ic[i_miss_jc][n_miss_ic[i_miss_jc]-1]=ic;
+                        
+                        /* marked, the symmetrization takes it from the other opp file */
+                        if (sparse) row[jc] = NAN;
                     }
                 }
             }
         }
+        
+        if (sparse) {
+            for (jc=0; jc<prot.nc; jc++) row_f[jc] = row[jc];
+            if (add_sparse_pw_row(&pw_sparse, ic, row_f, 0.0)) return USERERR;
+        }
+    }
+    if (sparse) {
+        free(row);
+        free(row_f);
     }
     
     if (n_miss_jc) {
@@ -565,7 +615,7 @@ int monte2_load_pairwise(PROT prot)
                         }
                     }
                 }
-                pairwise[ic][jc] = pairwise[jc][ic];
+                if (!sparse) pairwise[ic][jc] = pairwise[jc][ic];
             }
             free(miss_ic[i_miss_jc]);
             n_miss_ic[i_miss_jc] = 0;
@@ -576,6 +626,18 @@ int monte2_load_pairwise(PROT prot)
     
     /* average or pick smaller symetric elements, self to sel set to 0 */
     printf("   WARNING: Big difference (> %.1f%%) is reported\n", env.warn_pairwise);
+    if (sparse) {
+        /* same rules on the stored rows, pairs stored on neither side stay 0 */
+        monte2_map_res(prot);
+        sym_prot = &prot;
+        if (merge_sparse_pw(&pw_sparse, env.pw_sparse_thr, monte2_sym_pw)) {
+            free_sparse_pw(&pw_sparse);
+            return USERERR;
+        }
+        printf("   Sparse pairwise: %ld of %ld couplings above %.3f are kept.\n",
+               pw_sparse.start[prot.nc], (long) prot.nc * prot.nc, env.pw_sparse_thr);
+        return 0;
+    }
     for (i_res=0; i_res<prot.n_res; i_res++) {
         for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) {
             ic = prot.res[i_res].conf[i_conf].i_conf_prot;
@@ -606,6 +668,50 @@ int monte2_load_pairwise(PROT prot)
     return 0;
 }
 
+static double monte2_sym_pw(int ic, int jc, float p, float pt)
+/* the rules of the dense symmetrization for one stored pair, p = [ic][jc], pt = [jc][ic] */
+{
+    double a = p, b = pt;
+    
+    if (isnan(a)) a = b;    /* missing in the opp file of ic */
+    if (isnan(b)) b = a;
+    if (conf_res[ic] == conf_res[jc]) return 0.0; /* Necessary for fast E updating */
+    
+    if (ic < jc && 200.*fabs(a-b)/(a+b) > env.warn_pairwise && fabs(a - b) > 0.5) {
+        if ( (a+b) > 0.2 )
+            printf("%s -> %s = %10.3f, <- = %10.3f\n", sym_prot->conf[ic]->uniqID, sym_prot->conf[jc]->uniqID, a, b);
+    }
+    if (env.average_pairwise) return 0.5*(a+b);
+    return fabs(a) > fabs(b) ? b : a;
+}
+
+static void monte2_map_res(const PROT &prot)
+{
+    int i_res, i_conf, ic;
+    
+    for (ic=0; ic<pw_sparse.n; ic++) conf_res[ic] = -1;
+    for (i_res=0; i_res<prot.n_res; i_res++) {
+        for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) {
+            conf_res[prot.res[i_res].conf[i_conf].i_conf_prot] = i_res;
+        }
+    }
+}
+
+static double monte2_state_pw(const PROT *prot_p, int ic)
+/* interaction of conformer ic with the current conformers, walking the row of ic */
+{
+    double E = 0.0;
+    long k;
+    int jc, j_res;
+    
+    for (k=pw_sparse.start[ic]; k<pw_sparse.start[ic+1]; k++) {
+        jc = pw_sparse.col[k];
+        j_res = conf_res[jc];
+        if (j_res >= 0 && prot_p->res[j_res].conf_w->i_conf_prot == jc) E += pw_sparse.value[k];
+    }
+    return E;
+}
+
 PROT monte2_load_pk1out(const char *pk1out, const char *dconf2) {
     PROT prot;
     FILE *fp1,*fp2;
@@ -760,13 +866,42 @@ PROT monte2_load_pk1out(const char *pk1out, const char *dconf2) {
     return prot;
 }
 
-void monte2_get_biglist(PROT prot) {
+void monte2_get_biglist(const PROT &prot) {
     int i_res, j_res, i_conf, j_conf, ic, jc;
     int added;
+    int *ngh_of = NULL;
+    long k;
+    
+    /* sparse: mark the residues met in the rows of i_res, then add them in residue order */
+    if (!pairwise) {
+        if (!(ngh_of = (int *) malloc(prot.n_res * sizeof(int)))) {
+            printf("   FATAL: memory error in monte2_get_biglist()\n");fflush(stdout);
+            exit(-1);
+        }
+        for (j_res=0;j_res<prot.n_res;j_res++) ngh_of[j_res] = -1;
+    }
     
     for (i_res=0;i_res<prot.n_res;i_res++) {
         prot.res[i_res].n_ngh=0;
         
+        if (!pairwise) {
+            for (i_conf=1;i_conf<prot.res[i_res].n_conf;i_conf++) {
+                ic = prot.res[i_res].conf[i_conf].i_conf_prot;
+                for (k=pw_sparse.start[ic]; k<pw_sparse.start[ic+1]; k++) {
+                    j_res = conf_res[pw_sparse.col[k]];
+                    if (j_res >= 0 && j_res != i_res && fabs(pw_sparse.value[k])>env.big_pairwise) ngh_of[j_res] = i_res;
+                }
+            }
+            for (j_res=0;j_res<prot.n_res;j_res++) {
+                if (ngh_of[j_res] != i_res) continue;
+                prot.res[i_res].n_ngh++;
+                prot.res[i_res].ngh = (RES **) realloc(prot.res[i_res].ngh, prot.res[i_res].n_ngh*sizeof(void *));
+                prot.res[i_res].ngh[prot.res[i_res].n_ngh-1] = &prot.res[j_res];
+            }
+            prot.res[i_res].n_flip_max = (prot.res[i_res].n_ngh+1) < env.monte_flips ? (prot.res[i_res].n_ngh+1) : env.monte_flips;
+            continue;
+        }
+        
         for (j_res=0;j_res<prot.n_res;j_res++) {
             if (i_res == j_res) continue;
             
@@ -790,9 +925,10 @@ void monte2_get_biglist(PROT prot) {
         
         prot.res[i_res].n_flip_max = (prot.res[i_res].n_ngh+1) < env.monte_flips ? (prot.res[i_res].n_ngh+1) : env.monte_flips;
     }
+    free(ngh_of);
 }
 
-void monte2_set_toggle(PROT prot) {
+void monte2_set_toggle(const PROT &prot) {
     int i_res, i_conf;
     int n_fixed;
     
@@ -821,26 +957,46 @@ void monte2_set_toggle(PROT prot) {
     }
 }
 
-PROT monte2_reduce(PROT prot) {
+PROT monte2_reduce(const PROT &prot) {
     /* Uses toggle in prot to creat prot_red, reduced version of prot */
     PROT prot_red;
     int i_res, i_conf, j_res,j_conf;
     int ic, jc;
+    double *dE_self = NULL;
+    long k;
     
     memset(&prot_red,0,sizeof(PROT));
     cpy_prot(&prot_red, &prot);
     
+    /* sparse: the rows of the fixed conformers are collected by conformer, since residues
+     * are deleted while the loop runs */
+    if (!pairwise) {
+        if (!(dE_self = (double *) calloc(pw_sparse.n, sizeof(double)))) {
+            printf("   FATAL: memory error in monte2_reduce()\n");fflush(stdout);
+            exit(-1);
+        }
+        monte2_map_res(prot);
+    }
+    
     for (i_res=prot_red.n_res-1;i_res>=0;i_res--) {
         for (i_conf=prot_red.res[i_res].n_conf-1;i_conf>=1;i_conf--) {
             if (prot_red.res[i_res].conf[i_conf].toggle == 'f') {       /* turn off */
                 ic = prot_red.res[i_res].conf[i_conf].i_conf_prot;
                 
                 prot_red.res[i_res].fixed_occ += prot_red.res[i_res].conf[i_conf].occ;
+                if (dE_self) {
+                    prot_red.res[i_res].conf[i_conf].E_self += dE_self[ic];
+                    for (k=pw_sparse.start[ic]; k<pw_sparse.start[ic+1]; k++) {
+                        jc = pw_sparse.col[k];
+                        if (conf_res[jc] >= 0 && conf_res[jc] != i_res)
+                            dE_self[jc] += pw_sparse.value[k] * prot_red.res[i_res].conf[i_conf].occ;
+                    }
+                }
                 
                 /* Fix energy by mfe */
                 prot_red.E_base += prot_red.res[i_res].conf[i_conf].E_self * prot_red.res[i_res].conf[i_conf].occ;
                 
-                for (j_res=0;j_res<prot_red.n_res;j_res++) {
+                for (j_res=0;j_res<prot_red.n_res && !dE_self;j_res++) {
                     if (i_res==j_res) continue;
                     for (j_conf=1;j_conf<prot_red.res[j_res].n_conf;j_conf++) {
                         jc = prot_red.res[j_res].conf[j_conf].i_conf_prot;
@@ -866,9 +1022,14 @@ PROT monte2_reduce(PROT prot) {
     for (i_res=0;i_res<prot_red.n_res;i_res++) {
         for (i_conf=1;i_conf<prot_red.res[i_res].n_conf;i_conf++) {
             prot_red.conf[ic] = &prot_red.res[i_res].conf[i_conf];
+            if (dE_self) prot_red.conf[ic]->E_self += dE_self[prot_red.conf[ic]->i_conf_prot];
             ic++;
         }
     }
+    if (dE_self) {
+        free(dE_self);
+        monte2_map_res(prot_red);
+    }
     return prot_red;
 }
 
@@ -920,9 +1081,12 @@ void monte2_mc(PROT *prot_p) {
             ic_new = flip_res[i_flip]->conf_new->i_conf_prot;
             
             E_delta += (flip_res[i_flip]->conf_new->E_self - flip_res[i_flip]->conf_old->E_self);
-            for (j_res=0; j_res<prot_p->n_res; j_res++) {
-                jc_w = prot_p->res[j_res].conf_w->i_conf_prot;
-                E_delta += (pairwise[ic_new][jc_w] - pairwise[ic_old][jc_w]);
+            if (!pairwise) E_delta += monte2_state_pw(prot_p, ic_new) - monte2_state_pw(prot_p, ic_old);
+            else {
+                for (j_res=0; j_res<prot_p->n_res; j_res++) {
+                    jc_w = prot_p->res[j_res].conf_w->i_conf_prot;
+                    E_delta += (pairwise[ic_new][jc_w] - pairwise[ic_old][jc_w]);
+                }
             }
             
             /* real flip */
@@ -979,7 +1143,7 @@ void zero_counters(PROT *prot_p) {
     }
 }
 
-int monte2_check_toggle(PROT prot) {
+int monte2_check_toggle(const PROT &prot) {
     int i_res, i_conf, n_fixed;
     float fixed_occ;
     
@@ -1099,7 +1263,7 @@ void do_free_energy(PROT *prot_p) {
     }
 }
 
-double free_unf(PROT prot) {
+double free_unf(const PROT &prot) {
     /*  (Adopted from Marilyn's free_unf.f)
     .           CALCULATION OF REFERENCE FREE ENERGY
     .   G(unfolded)= -kT Sum(i)(# of ionizable) ln(1 +
@@ -1274,7 +1438,7 @@ extern void dhill(float **p, float *y, int ndim, float ftol, float (*funk)(float
 float *pH, *sumcrg;
 float sumcrg_start,sumcrg_end;
 
-int curve_fitting(PROT prot) {
+int curve_fitting(const PROT &prot) {
     int i_res;
     FILE *fp;
     PKA  pka;
@@ -1542,9 +1706,12 @@ void gmonte_mc(PROT *prot_p) {
             for (i_res=0;i_res<flip_group[i_flip]->n_res;i_res++) {
                 ic_old = flip_group[i_flip]->res[i_res]->conf_old->i_conf_prot;
                 ic_new = flip_group[i_flip]->res[i_res]->conf_new->i_conf_prot;
-                for (j_res=0; j_res<prot_p->n_res; j_res++) {
-                    jc = prot_p->res[j_res].conf_w->i_conf_prot;
-                    E_delta = E_delta + (pairwise[ic_new][jc] - pairwise[ic_old][jc]);
+                if (!pairwise) E_delta = E_delta + (monte2_state_pw(prot_p, ic_new) - monte2_state_pw(prot_p, ic_old));
+                else {
+                    for (j_res=0; j_res<prot_p->n_res; j_res++) {
+                        jc = prot_p->res[j_res].conf_w->i_conf_prot;
+                        E_delta = E_delta + (pairwise[ic_new][jc] - pairwise[ic_old][jc]);
+                    }
                 }
                 /* real flip */
                 flip_group[i_flip]->res[i_res]->conf_w = flip_group[i_flip]->res[i_res]->conf_new;
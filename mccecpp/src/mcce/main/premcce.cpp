@@ -35,16 +35,16 @@ FILE *premcce_terminals(FILE *fp_in);
 FILE *premcce_confname(FILE *fp);
 int premcce_match(char *sfrom, char *pattern);
 int cpremcce_replace(char *sto, char *pattern);
-int premcce_hvatoms(PROT prot);
-int premcce_clash(PROT prot);
+int premcce_hvatoms(const PROT &prot);
+int premcce_clash(const PROT &prot);
 int create_param(FILE *pdb_fp, int k_line);
 int cutoff_water(PROT *prot);
-int print_surfw(PROT prot);
-extern int place_missing(PROT prot, int addconf_handle);
+int print_surfw(const PROT &prot);
+extern int place_missing(const PROT &prot, int addconf_handle);
 //extern int delete_h(PROT prot);
-extern int rm_dupconf(PROT prot, float prune_thr);
-int update_headlst(PROT prot);
-int get_resnbrs(PROT prot, float dlimit);
+extern int rm_dupconf(const PROT &prot, float prune_thr);
+int update_headlst(const PROT &prot);
+int get_resnbrs(const PROT &prot, float dlimit);
 
 
 int premcce()
@@ -716,7 +716,7 @@ FILE *premcce_confname(FILE *fp)
 	return fp2;
 }
 
-int premcce_hvatoms(PROT prot)
+int premcce_hvatoms(const PROT &prot)
 {
 	int kr, kc, ka;
 	char Missing, Alt;
@@ -768,7 +768,7 @@ int premcce_hvatoms(PROT prot)
 	return Missing;
 }
 
-int premcce_clash(PROT prot)
+int premcce_clash(const PROT &prot)
 {
 	int kr, kc, ka, ir, ic, ia;
 	float limit = env.clash_distance * env.clash_distance;
@@ -983,7 +983,7 @@ int cutoff_water(PROT *prot)
 	return Counter;
 }
 
-int print_surfw(PROT prot)
+int print_surfw(const PROT &prot)
 {
 	int  i, j, k;
 	int  n_conf;    /* number of conformers to print sas, only conf 0 and 1 are printed */
@@ -1047,7 +1047,7 @@ int print_surfw(PROT prot)
 	return 0;
 }
 
-int update_headlst(PROT prot)
+int update_headlst(const PROT &prot)
 {
 	FILE *fp;
 	char line[MAXCHAR_LINE];
@@ -1096,7 +1096,7 @@ int update_headlst(PROT prot)
 
 
 /* get distance neighbors */
-int get_resnbrs(PROT prot, float dlimit)
+int get_resnbrs(const PROT &prot, float dlimit)
 {
 	int i_res, j_res, i_conf, j_conf, i_atom, j_atom;
 	char nbr_true;
@@ -25,56 +25,60 @@ typedef struct {
 time_t nowA, nowB, nowStart, nowEnd;
 long    idum;
 
-int place_rot(PROT prot);
-int place_rot_rule(int i_res, ROTAMER rule, int n, PROT prot);
-int swing_rot(PROT prot);
-int swing_rot_rule(int i_res, ROTAMER rule, float phi, PROT prot);
-void write_step2stat(FILE *fp, PROT prot, CONFSTAT stat);
-int prune_by_vdw(PROT prot, float delta_E);
-int prune_by_vdw_res(int kr, PROT prot, float delta_E);
-int rot_pack(PROT prot, int n);
-int extra_rot(PROT prot);
-int rot_refine(PROT prot, MICROSTATE state, float ****pariwise);
-int ionization(PROT prot);
-int rm_dupconf(PROT prot, float prune_thr);
-int rm_dupconf_hv(PROT prot);
-int rm_dupconf_res(PROT prot, int i_res, float prune_thr);
-int write_conflist(FILE *fp, PROT prot);
-int load_listrot(char *fname, PROT prot);
+int place_rot(const PROT &prot);
+int place_rot_rule(int i_res, ROTAMER rule, int n, const PROT &prot);
+int swing_rot(const PROT &prot);
+int swing_rot_rule(int i_res, ROTAMER rule, float phi, const PROT &prot);
+void write_step2stat(FILE *fp, const PROT &prot, CONFSTAT stat);
+int prune_by_vdw(const PROT &prot, float delta_E);
+int prune_by_vdw_res(int kr, const PROT &prot, float delta_E);
+int rot_pack(const PROT &prot, int n);
+int extra_rot(const PROT &prot);
+int rot_refine(const PROT &prot, MICROSTATE state, float ****pariwise, char **dead);
+int rot_dee(const PROT &prot, float ****pairwise, char **dead);
+int ionization(const PROT &prot);
+int rm_dupconf(const PROT &prot, float prune_thr);
+int rm_dupconf_hv(const PROT &prot);
+int rm_dupconf_hv_res(const PROT &prot, int i_res, float IDEN_THR);
+int rm_dupconf_res(const PROT &prot, int i_res, float prune_thr);
+int write_conflist(FILE *fp, const PROT &prot);
+int load_listrot(char *fname, const PROT &prot);
 int get_demetri_out(void);
-int prune_hdirected(PROT prot);
-float relax_this_pair(PROT prot, RES *res_a, int conf_a, RES *res_b, int conf_b);
+int prune_hdirected(const PROT &prot);
+float relax_this_pair(const PROT &prot, RES *res_a, int conf_a, RES *res_b, int conf_b);
 int swing_conf_rot_rule(RES *res, int j, ROTAMER rule, float phi);
-int rebuild_sc(PROT prot);
-void del_non_common_h(PROT prot);
-extern int rot_swap(PROT prot);
-extern int get_resnbrs(PROT prot, float dlimit);
-extern int relaxation(PROT prot);
+int rebuild_sc(const PROT &prot);
+void del_non_common_h(const PROT &prot);
+extern int rot_swap(const PROT &prot);
+extern int get_resnbrs(const PROT &prot, float dlimit);
+extern int relaxation(const PROT &prot);
 //extern int self_relaxation(PROT prot);
 extern int relax_h(PROT prot);
-extern int relax_water(PROT prot);
+extern int relax_water(const PROT &prot);
 //extern void collect_all_connect(int i_res, int i_conf, int i_atom, PROT prot, int *n_connect12, ATOM ***connect12, int *n_connect13, ATOM ***connect13, int *n_connect14, ATOM ***connect14);
 //extern int print_vdw_map(PROT prot);
-extern int initial_relaxation(PROT prot);
-int prune_pv(PROT prot, float c1, float c2, float c3);
+extern int initial_relaxation(const PROT &prot);
+int prune_pv(const PROT &prot, float c1, float c2, float c3);
 int over_geo(CONF conf1, CONF conf2, float cutoff);
-int over_ele(PROT prot, int ir, int ic, int jc, float cutoff);
-int over_vdw(PROT prot, int ir, int ic, int jc, float cutoff);
-float max_confSAS(PROT prot, int ir, int ic);
-int label_exposed(PROT prot);
-int rand_conf_prune(PROT prot);
-int place_missing_res(PROT prot, int i_res, int handle_addconf);
-int write_pdb_headlist(const char *fn, PROT prot);
+int over_ele(const PROT &prot, int ir, int ic, int jc, float cutoff);
+int over_vdw(const PROT &prot, int ir, int ic, int jc, float cutoff);
+float max_confSAS(const PROT &prot, int ir, int ic);
+int label_exposed(const PROT &prot);
+int rand_conf_prune(const PROT &prot);
+int place_missing_res(const PROT &prot, int i_res, int handle_addconf);
+int write_pdb_headlist(const char *fn, const PROT &prot);
 void make_rotamer_statistics(CONFSTAT *confstat, PROT *prot);
 
 #define ROT_DIR "rot"
+#define DEE_MARGIN 0.01    /* kept between a dead-end bound and the repacking threshold, covers float rounding */
+#define DEE_MAX_CONF 1000  /* residues with more conformers skip the pair test of rot_dee() */
 
 int rotamers()
 {
 	FILE *fp;
 	PROT prot;
 	CONFSTAT confstat;
-	int c, i, j, kr, kc,ic;
+	int c, i, j, kr, kc;
 	char sbuff[MAXCHAR_LINE];
 
 	nowStart = time(NULL);
@@ -252,15 +256,7 @@ int rotamers()
 	for (kr=0; kr<prot.n_res; kr++) {
 		/* not using rm_dupconf_hv() function because it saves time to skip residues if it starts with only 1 conformer */
 		if (prot.res[kr].n_conf_ori <=2) continue;
-		for (kc=1; kc<prot.res[kr].n_conf; kc++) {
-			for (ic=kc+1; ic<prot.res[kr].n_conf; ic++) {
-				if(!cmp_conf_hv(prot.res[kr].conf[kc], prot.res[kr].conf[ic], env.prune_thr)) {
-					del_conf(&prot.res[kr], ic);
-					ic--;
-					counter_total_deleted++;
-				}
-			}
-		}
+		counter_total_deleted += rm_dupconf_hv_res(prot, kr, env.prune_thr);
 	}
 	printf(" %d conformers deleted.\n", counter_total_deleted);
 	nowB= time(NULL);
@@ -662,7 +658,7 @@ int rotamers()
 	return 0;
 }
 
-int delete_h(PROT prot)
+int delete_h(const PROT &prot)
 {  int n = 0;
 int i, j, k;
 
@@ -684,7 +680,7 @@ for (i=0; i<prot.n_res; i++) {
 return n;
 }
 
-int place_rot(PROT prot)
+int place_rot(const PROT &prot)
 {  int i, i_conf;
 int C;
 char C_str[5];
@@ -754,7 +750,7 @@ for (i=0; i<prot.n_res; i++) {
 return 0;
 }
 
-int place_rot_rule(int i_res, ROTAMER rule, int n, PROT prot)
+int place_rot_rule(int i_res, ROTAMER rule, int n, const PROT &prot)
 {  VECTOR v1, v2, v3;
 GEOM op;
 LINE axis;
@@ -929,7 +925,7 @@ for (j=1; j<n_conf; j++) { /* apply the rotation on passed in confs */
 return 0;
 }
 
-int swing_rot(PROT prot)
+int swing_rot(const PROT &prot)
 {  int i, i_conf;
 int C;
 char C_str[5];
@@ -1000,7 +996,7 @@ for (i=0; i<prot.n_res; i++) {
 return 0;
 }
 
-int swing_rot_rule(int i_res, ROTAMER rule, float phi, PROT prot)
+int swing_rot_rule(int i_res, ROTAMER rule, float phi, const PROT &prot)
 {  VECTOR v1, v2, v3;
 GEOM op;
 LINE axis;
@@ -1205,7 +1201,7 @@ for (j=1; j<n_conf; j++) { /* apply the rotation on passed in confs */
 return 0;
 }
 
-int extra_rot(PROT prot)
+int extra_rot(const PROT &prot)
 {
 	/* this subroutine creates additional rotamers by translation and rotation,
     designed for ligand binding, such as quinones */
@@ -1476,7 +1472,7 @@ int extra_rot(PROT prot)
 	return 0;
 }
 
-void write_step2stat(FILE *fp, PROT prot, CONFSTAT stat)
+void write_step2stat(FILE *fp, const PROT &prot, CONFSTAT stat)
 {  int i;
 
 fprintf(fp, "   Residue   Start  Clean   Swap Rotate   Self  Hbond Repack  Ioni.   TorH     OH  Elect\n");
@@ -1513,7 +1509,7 @@ fprintf(fp, "   Total   %7d%7d%7d%7d%7d%7d%7d%7d%7d%7d%7d\n",
 return;
 }
 
-int prune_by_vdw(PROT prot, float delta_E)
+int prune_by_vdw(const PROT &prot, float delta_E)
 {
 	int n=0;
 	int kr;
@@ -1523,7 +1519,7 @@ int prune_by_vdw(PROT prot, float delta_E)
 	return n;
 }
 
-int prune_by_vdw_res(int kr, PROT prot, float delta_E)
+int prune_by_vdw_res(int kr, const PROT &prot, float delta_E)
 {
 	int n = 0;
 	int kc;
@@ -1549,16 +1545,21 @@ int prune_by_vdw_res(int kr, PROT prot, float delta_E)
 	return n;
 }
 
-int rot_pack(PROT prot, int n)
+int rot_pack(const PROT &prot, int n)
 {
 	FILE *fp;
 	int C, i, j;
 	MICROSTATE state;
 	int flips;
 	float ****pairwise;
-	int i_res,i_conf,j_res,j_conf;
+	int i_res,i_conf,j_res,j_conf,i_atom;
 	float pair_vdw;
 	int counter;
+	int n_pair, i_pair, *pair_ires, *pair_jres;
+	char *pair_small;
+	float ***pair_pw;
+	char **dead;
+	int *n_alive, k;
 	char pipe;
 	float cutoff_far2  = VDW_CUTOFF_FAR  * VDW_CUTOFF_FAR;
 
@@ -1642,91 +1643,116 @@ int rot_pack(PROT prot, int n)
 		prot.res[i_res].ngh = NULL;
 	}
 
+	/* residue pairs (i_res < j_res) close enough to interact, in the order the ngh lists are built */
+	n_pair = 0;
 	for (i_res=0; i_res<prot.n_res; i_res++) {
-		/* lower half of the matrix has already been calculated */
-		for (j_res=0; j_res<i_res; j_res++) {
-			int j_ngh;
-			/* search if i_res is already in ngh list of j_res */
-			for (j_ngh=0; j_ngh<prot.res[j_res].n_ngh; j_ngh++) {
-				if (i_res == prot.res[j_res].ngh[j_ngh]->i_res_prot) {
-					int n_ngh;
-					/* add j_res into ngh list */
-					prot.res[i_res].n_ngh++;
-					n_ngh = prot.res[i_res].n_ngh;
-					prot.res[i_res].ngh = (RES **) realloc(prot.res[i_res].ngh, n_ngh*sizeof(void *));
-					prot.res[i_res].ngh[n_ngh-1] = &prot.res[j_res];
-					/* pointing pairwise(i,j) to pairwise(j,i), which would be transposed for i_res */
-					pairwise[i_res] = (float ***) realloc(pairwise[i_res], n_ngh*sizeof(void *));
-					pairwise[i_res][n_ngh-1] = pairwise[j_res][j_ngh];
-					break;
-				}
-			}
+		for (j_res=i_res+1; j_res<prot.n_res; j_res++) {
+			if (out_of_range(prot.res[i_res].r_min, prot.res[i_res].r_max,
+					prot.res[j_res].r_min, prot.res[j_res].r_max, cutoff_far2)) continue;
+			n_pair++;
 		}
-
-		/* upper half of the matrix */
+	}
+	pair_ires  = (int *) malloc((n_pair+1) * sizeof(int));
+	pair_jres  = (int *) malloc((n_pair+1) * sizeof(int));
+	pair_small = (char *) malloc(n_pair+1);
+	pair_pw    = (float ***) malloc((n_pair+1) * sizeof(void *));
+	if (!pair_ires || !pair_jres || !pair_small || !pair_pw) {printf("Memory Error\n"); return USERERR;}
+	i_pair = 0;
+	for (i_res=0; i_res<prot.n_res; i_res++) {
 		for (j_res=i_res+1; j_res<prot.n_res; j_res++) {
-			int n_ngh,all_small;
-			/* check if i_res and j_res are close enough. */
 			if (out_of_range(prot.res[i_res].r_min, prot.res[i_res].r_max,
 					prot.res[j_res].r_min, prot.res[j_res].r_max, cutoff_far2)) continue;
-
-			/* add j_res into ngh list */
-			prot.res[i_res].n_ngh++;
-			n_ngh = prot.res[i_res].n_ngh;
-			prot.res[i_res].ngh = (RES **) realloc(prot.res[i_res].ngh, n_ngh*sizeof(void *));
-			prot.res[i_res].ngh[n_ngh-1] = &prot.res[j_res];
+			pair_ires[i_pair] = i_res;
+			pair_jres[i_pair] = j_res;
 
 			/* memory for vdw matrix */
-			pairwise[i_res] = (float ***) realloc(pairwise[i_res], n_ngh*sizeof(void *));
-			pairwise[i_res][n_ngh-1] = (float **) malloc(prot.res[i_res].n_conf * sizeof(void *));
-			if (!pairwise[i_res][n_ngh-1]) {printf("Memory Error\n"); return USERERR;}
+			pair_pw[i_pair] = (float **) malloc(prot.res[i_res].n_conf * sizeof(void *));
+			if (!pair_pw[i_pair]) {printf("Memory Error\n"); return USERERR;}
 			for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) {
-				pairwise[i_res][n_ngh-1][i_conf] = (float *) malloc(prot.res[j_res].n_conf * sizeof(float));
-				if (!pairwise[i_res][n_ngh-1][i_conf]) {printf("Memory Error\n"); return USERERR;}
+				pair_pw[i_pair][i_conf] = (float *) calloc(prot.res[j_res].n_conf, sizeof(float));   /* 0 for empty conformers */
+				if (!pair_pw[i_pair][i_conf]) {printf("Memory Error\n"); return USERERR;}
 			}
+			i_pair++;
+		}
+	}
 
-			/* calculate vdw matrix for (i_res,j_res) */
-			all_small = 1;
-			for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) {
-				if (!prot.res[i_res].conf[i_conf].n_atom) continue;
-				for (j_conf=1; j_conf<prot.res[j_res].n_conf; j_conf++) {
-					if (!prot.res[j_res].conf[j_conf].n_atom) continue;
+	/* vdw types are resolved here so the pair loop below only reads atoms and the type table */
+	for (i_res=0; i_res<prot.n_res; i_res++) {
+		for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
+			for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
+				if (!prot.res[i_res].conf[i_conf].atom[i_atom].on) continue;
+				vdw_type(&prot.res[i_res].conf[i_conf].atom[i_atom]);
+			}
+		}
+	}
 
-					pair_vdw = vdw_conf_fast(i_res,i_conf,j_res,j_conf,prot,0);
+	/* calculate vdw matrix for every pair, each pair writes only its own block */
+#pragma omp parallel for schedule(dynamic) private(i_res, j_res, i_conf, j_conf, pair_vdw)
+	for (i_pair=0; i_pair<n_pair; i_pair++) {
+		i_res = pair_ires[i_pair];
+		j_res = pair_jres[i_pair];
+		pair_small[i_pair] = 1;
+		for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) {
+			if (!prot.res[i_res].conf[i_conf].n_atom) continue;
+			for (j_conf=1; j_conf<prot.res[j_res].n_conf; j_conf++) {
+				if (!prot.res[j_res].conf[j_conf].n_atom) continue;
 
-					/* ignore favorable energies */
-					if (env.repack_fav_vdw_off == 1) {
-						if (pair_vdw < 0.) pair_vdw = 0.;
-					}
+				pair_vdw = vdw_conf_fast(i_res,i_conf,j_res,j_conf,prot,0);
 
-					/* H bond energy correction */
-					/* turned off, low energy from h bond traps conformer in certain positions, and loses occupancy for other (exposed) conformers -Yifan */
-					//pair_vdw += hbond_extra(prot.res[i_res].conf[i_conf], prot.res[j_res].conf[j_conf]);
+				/* ignore favorable energies */
+				if (env.repack_fav_vdw_off == 1) {
+					if (pair_vdw < 0.) pair_vdw = 0.;
+				}
 
-					pairwise[i_res][n_ngh-1][i_conf][j_conf] = pair_vdw;
+				/* H bond energy correction */
+				/* turned off, low energy from h bond traps conformer in certain positions, and loses occupancy for other (exposed) conformers -Yifan */
+				//pair_vdw += hbond_extra(prot.res[i_res].conf[i_conf], prot.res[j_res].conf[j_conf]);
 
-					if (fabs(pair_vdw) > env.ngh_vdw_thr) {
-						all_small = 0;
-					}
+				pair_pw[i_pair][i_conf][j_conf] = pair_vdw;
+
+				if (fabs(pair_vdw) > env.ngh_vdw_thr) {
+					pair_small[i_pair] = 0;
 				}
 			}
-			/* if all pairwise are smaller than threshold, remove j_res from neighbor list */
-			if (all_small) {
-				for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) free(pairwise[i_res][n_ngh-1][i_conf]);
-				free(pairwise[i_res][n_ngh-1]);
-				prot.res[i_res].n_ngh--;
-				n_ngh = prot.res[i_res].n_ngh;
-				prot.res[i_res].ngh = (RES **) realloc(prot.res[i_res].ngh, n_ngh*sizeof(void *));
-				pairwise[i_res] = (float ***) realloc(pairwise[i_res], n_ngh*sizeof(void *));
-			}
 		}
+		/* if all pairwise are smaller than threshold, j_res is not a neighbor */
+		if (pair_small[i_pair]) {
+			for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) free(pair_pw[i_pair][i_conf]);
+			free(pair_pw[i_pair]);
+			pair_pw[i_pair] = NULL;
+		}
+	}
 
-		/*
-        printf("%s %c%4d, n_ngh=%3d, sas=%8.2f%%\n",
-        prot.res[i_res].resName,prot.res[i_res].chainID,prot.res[i_res].resSeq,prot.res[i_res].n_ngh,100.*prot.res[i_res].sas);
-		 */
-
+	/* ngh lists, allocated at their final size */
+	for (i_pair=0; i_pair<n_pair; i_pair++) {
+		if (pair_small[i_pair]) continue;
+		prot.res[pair_ires[i_pair]].n_ngh++;
+		prot.res[pair_jres[i_pair]].n_ngh++;
 	}
+	for (i_res=0; i_res<prot.n_res; i_res++) {
+		if (!prot.res[i_res].n_ngh) continue;
+		prot.res[i_res].ngh = (RES **) malloc(prot.res[i_res].n_ngh * sizeof(void *));
+		pairwise[i_res] = (float ***) malloc(prot.res[i_res].n_ngh * sizeof(void *));
+		if (!prot.res[i_res].ngh || !pairwise[i_res]) {printf("Memory Error\n"); return USERERR;}
+		prot.res[i_res].n_ngh = 0;
+	}
+	/* pairs come sorted by i_res, so every residue gets its lower neighbors first, then the upper
+	 * ones, both ascending. pairwise(j,i) points to pairwise(i,j), which would be transposed for j_res */
+	for (i_pair=0; i_pair<n_pair; i_pair++) {
+		if (pair_small[i_pair]) continue;
+		i_res = pair_ires[i_pair];
+		j_res = pair_jres[i_pair];
+		prot.res[i_res].ngh[prot.res[i_res].n_ngh] = &prot.res[j_res];
+		pairwise[i_res][prot.res[i_res].n_ngh] = pair_pw[i_pair];
+		prot.res[i_res].n_ngh++;
+		prot.res[j_res].ngh[prot.res[j_res].n_ngh] = &prot.res[i_res];
+		pairwise[j_res][prot.res[j_res].n_ngh] = pair_pw[i_pair];
+		prot.res[j_res].n_ngh++;
+	}
+	free(pair_ires);
+	free(pair_jres);
+	free(pair_small);
+	free(pair_pw);
 
 	/* free the memory used by connectivity table */
 	for (i_res=0; i_res<prot.n_res; i_res++) {
@@ -1768,6 +1794,24 @@ int rot_pack(PROT prot, int n)
 		}
 	}
 
+	/* conformers that can not be a repacking candidate are left out, they end with 0 occupancy */
+	dead = (char **) malloc(prot.n_res * sizeof(char *));
+	n_alive = (int *) malloc(prot.n_res * sizeof(int));
+	for (i=0; i<prot.n_res; i++) {
+		dead[i] = (char *) calloc(prot.res[i].n_conf+1, sizeof(char));
+		if (!dead[i]) {printf("Memory Error\n"); return USERERR;}
+	}
+	if (env.repack_dee) {
+		counter = 0;
+		for (i=0; i<prot.n_res; i++) counter += prot.res[i].n_conf-1;
+		printf("   Dead-end elimination ruled out %d of %d conformers before repacking.\n", rot_dee(prot, pairwise, dead), counter);
+	}
+	for (i=0; i<prot.n_res; i++) {
+		n_alive[i] = 0;
+		for (j=1; j<prot.res[i].n_conf; j++) {
+			if (!dead[i][j]) n_alive[i]++;
+		}
+	}
 
 	printf("   Repacking in progress, see %s for details...\n", env.progress_log);fflush(stdout);
 
@@ -1786,7 +1830,14 @@ int rot_pack(PROT prot, int n)
 				return USERERR;
 			}
 			else if (prot.res[j].n_conf <= 2) state.res[j] = prot.res[j].n_conf - 1;
-			else state.res[j] = rand() % (prot.res[j].n_conf-1) + 1;
+			else {
+				/* a random live conformer */
+				k = rand() % n_alive[j];
+				for (state.res[j]=1; ; state.res[j]++) {
+					if (dead[j][state.res[j]]) continue;
+					if (!k--) break;
+				}
+			}
 			if (state.res[j])
 				prot.res[j].conf[state.res[j]].on = 1;
 		}
@@ -1794,7 +1845,7 @@ int rot_pack(PROT prot, int n)
 		fprintf(fp, "   Repacking %d:", i); fflush(fp);
 		for (j=0; j<100; j++) { /* maximum converge trials */
 			/* refine the microstate */
-			flips = rot_refine(prot, state, pairwise);
+			flips = rot_refine(prot, state, pairwise, dead);
 			fprintf(fp, " %d", flips); fflush(fp);
 			if (flips == 0) break;
 		}
@@ -1921,6 +1972,9 @@ int rot_pack(PROT prot, int n)
 	rm_dupconf_hv(prot);
 
 	free(state.res);
+	for (i=0; i<prot.n_res; i++) free(dead[i]);
+	free(dead);
+	free(n_alive);
 	for (i_res = 0; i_res < prot.n_res; i_res++) {
 		if (!prot.res[i_res].n_ngh) continue;
 		prot.res[i_res].n_ngh = 0;
@@ -1931,7 +1985,130 @@ int rot_pack(PROT prot, int n)
 	return C;
 }
 
-int rot_refine(PROT prot, MICROSTATE state, float ****pairwise) {
+static float res_repack_e_thr(const RES &res)
+{
+	/* a conformer is a candidate in rot_refine() if it is within this much of the best one */
+	if (res.sas > 0.5) return env.repack_e_thr_exposed;
+	else return 2.*res.sas*env.repack_e_thr_exposed + (1.-2.*res.sas)*env.repack_e_thr_buried;
+}
+
+int rot_dee(const PROT &prot, float ****pairwise, char **dead)
+{
+	/* Goldstein dead-end elimination over the repacking energies. Conformer r of a residue is dead
+	 * if another live conformer t beats it by more than the candidate threshold whatever its
+	 * neighbors do:
+	 *    E_self(r) - E_self(t) + sum_ngh min_s [E(r,s) - E(t,s)] > repack_e_thr
+	 * rot_refine() would then never pick r or count it, so it is left out of the search. t must stay
+	 * clear of the 99999 cap, otherwise a capped r could still tie with it. Elimination repeats until
+	 * nothing changes, since fewer live neighbor conformers make the bounds tighter.
+	 *
+	 * The pair test is costly, so each live conformer first gets the range of its energy over the
+	 * live neighbor conformers:
+	 *    lo(r) = E_self(r) + sum_ngh min_s E(r,s)      hi(r) = E_self(r) + sum_ngh max_s E(r,s)
+	 * lo(r) - hi(t) never exceeds the Goldstein sum, so r is dead against the t of the lowest hi
+	 * without a pair test. The sum never exceeds lo(r) - lo(t) or hi(r) - hi(t) either, so pairs
+	 * that can not pass are not tested. Residues of more than DEE_MAX_CONF conformers only get the
+	 * bound test.
+	 */
+	int i_res, j_res, i_ngh, r, t, s, t_best, changed, n_dead = 0, n_max = 0;
+	float thr, bound, t_max, d, d_min, e_min, e_max, e_rs, e_ts;
+	float *lo, *hi;
+	float **pw;
+
+	for (i_res=0; i_res<prot.n_res; i_res++) {
+		if (prot.res[i_res].n_conf > n_max) n_max = prot.res[i_res].n_conf;
+	}
+	lo = (float *) malloc((n_max+1) * sizeof(float));
+	hi = (float *) malloc((n_max+1) * sizeof(float));
+	if (!lo || !hi) {
+		printf("   FATAL: memory error in rot_dee()\n");
+		exit(-1);
+	}
+
+	do {
+		changed = 0;
+		for (i_res=0; i_res<prot.n_res; i_res++) {
+			if (prot.res[i_res].n_conf <= 2) continue;
+			thr = res_repack_e_thr(prot.res[i_res]);
+
+			/* energy range of each live conformer */
+			t_best = 0;
+			for (r=1; r<prot.res[i_res].n_conf; r++) {
+				if (dead[i_res][r]) continue;
+				lo[r] = hi[r] = prot.res[i_res].conf[r].E_self;
+				for (i_ngh=0; i_ngh<prot.res[i_res].n_ngh; i_ngh++) {
+					j_res = prot.res[i_res].ngh[i_ngh]->i_res_prot;
+					pw = pairwise[i_res][i_ngh];
+					e_min = 1e10;
+					e_max = -1e10;
+					for (s=1; s<prot.res[j_res].n_conf; s++) {
+						if (dead[j_res][s]) continue;
+						e_rs = i_res < j_res? pw[r][s] : pw[s][r];
+						if (e_rs < e_min) e_min = e_rs;
+						if (e_rs > e_max) e_max = e_rs;
+					}
+					lo[r] += e_min;
+					hi[r] += e_max;
+				}
+				if (!t_best || hi[r] < hi[t_best]) t_best = r;
+			}
+
+			for (r=1; r<prot.res[i_res].n_conf; r++) {
+				if (dead[i_res][r] || r == t_best) continue;
+				if (hi[t_best] < 99999. - thr - DEE_MARGIN && lo[r] - hi[t_best] > thr + DEE_MARGIN) {
+					dead[i_res][r] = 1;
+					n_dead++;
+					changed = 1;
+				}
+			}
+			if (prot.res[i_res].n_conf > DEE_MAX_CONF) continue;
+
+			for (r=1; r<prot.res[i_res].n_conf; r++) {
+				if (dead[i_res][r]) continue;
+				for (t=1; t<prot.res[i_res].n_conf; t++) {
+					if (t == r || dead[i_res][t]) continue;
+					if (lo[r] - lo[t] <= thr || hi[r] - hi[t] <= thr) continue;
+					bound = prot.res[i_res].conf[r].E_self - prot.res[i_res].conf[t].E_self;
+					t_max = prot.res[i_res].conf[t].E_self;
+					for (i_ngh=0; i_ngh<prot.res[i_res].n_ngh; i_ngh++) {
+						j_res = prot.res[i_res].ngh[i_ngh]->i_res_prot;
+						pw = pairwise[i_res][i_ngh];
+						d_min = 1e10;
+						e_max = -1e10;
+						for (s=1; s<prot.res[j_res].n_conf; s++) {
+							if (dead[j_res][s]) continue;
+							if (i_res < j_res) {
+								e_rs = pw[r][s];
+								e_ts = pw[t][s];
+							}
+							else {
+								e_rs = pw[s][r];
+								e_ts = pw[s][t];
+							}
+							d = e_rs - e_ts;
+							if (d < d_min) d_min = d;
+							if (e_ts > e_max) e_max = e_ts;
+						}
+						bound += d_min;
+						t_max += e_max;
+					}
+					if (t_max < 99999. - thr - DEE_MARGIN && bound > thr + DEE_MARGIN) {
+						dead[i_res][r] = 1;
+						n_dead++;
+						changed = 1;
+						break;
+					}
+				}
+			}
+		}
+	} while (changed);
+
+	free(lo);
+	free(hi);
+	return n_dead;
+}
+
+int rot_refine(const PROT &prot, MICROSTATE state, float ****pairwise, char **dead) {
 	int i, i_ngh;
 	float E_min;
 	char switching;
@@ -1953,6 +2130,10 @@ int rot_refine(PROT prot, MICROSTATE state, float ****pairwise) {
 
 		E_min = 99999.;
 		for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) {       /* calculate energy for every conformer */
+			if (dead[i_res][i_conf] && i_conf != state.res[i_res]) {    /* never within threshold, see rot_dee() */
+				E_state[i_conf] = 99999.;
+				continue;
+			}
 			E_state[i_conf] = prot.res[i_res].conf[i_conf].E_self;
 			for (i_ngh = 0; i_ngh < prot.res[i_res].n_ngh; i_ngh++) {
 				j_res = prot.res[i_res].ngh[i_ngh]->i_res_prot;
@@ -1974,8 +2155,7 @@ int rot_refine(PROT prot, MICROSTATE state, float ****pairwise) {
 		/* if difference btw current conformer and minimum is bigger than threshold, switch */
 		switching = 0;
 		i_conf = state.res[i_res];
-		if (prot.res[i_res].sas > 0.5) repack_e_thr = env.repack_e_thr_exposed;
-		else repack_e_thr = 2.*prot.res[i_res].sas*env.repack_e_thr_exposed + (1.-2.*prot.res[i_res].sas)*env.repack_e_thr_buried;
+		repack_e_thr = res_repack_e_thr(prot.res[i_res]);
 		if (E_state[i_conf] - E_min > repack_e_thr) {
 			switching = 1;
 			n_candidate = 0;
@@ -2030,7 +2210,7 @@ void sp3d2_5known(VECTOR r0, VECTOR r1, VECTOR r2, VECTOR r3, VECTOR r4, VECTOR
 float get_bond_length(CONF *conf_p, ATOM *atom1_p, ATOM *atom2_p);
 float get_bond_angle(CONF *conf_p, ATOM *atom0_p, ATOM *atom1_p, ATOM *atom2_p, char *orbital);
 
-int place_missing(PROT prot, int handle_addconf) {
+int place_missing(const PROT &prot, int handle_addconf) {
 	int         i_res, i_conf, i_atom, ins;
 	FILE        *debug_fp;
 	CONNECT     connect;
@@ -2713,7 +2893,7 @@ int place_missing(PROT prot, int handle_addconf) {
 	return n_added;
 }
 
-int place_missing_res(PROT prot, int i_res, int handle_addconf) {
+int place_missing_res(const PROT &prot, int i_res, int handle_addconf) {
 	int         i_conf, i_atom, ins;
 	FILE        *debug_fp;
 	CONNECT     connect;
@@ -3897,7 +4077,7 @@ float get_bond_angle(CONF *conf_p, ATOM *atom0_p, ATOM *atom1_p, ATOM *atom2_p,
 	}
 }
 
-int ionization(PROT prot)
+int ionization(const PROT &prot)
 {  int kr, kc, ka, ic, ia, natoms, ins;
 STRINGS confs;
 ATOM *swap;
@@ -3964,27 +4144,130 @@ for (kr=0; kr< prot.n_res; kr++) {
 return 0;
 }
 
-int rm_dupconf_hv(PROT prot)
-{  int kr, kc, ic;
+int rm_dupconf_hv(const PROT &prot)
+{  int kr;
 int C = 0;
 
 for (kr=0; kr<prot.n_res; kr++) {
-	for (kc=1; kc<prot.res[kr].n_conf; kc++) {
-		for (ic=kc+1; ic<prot.res[kr].n_conf; ic++) {
-			if(!cmp_conf_hv(prot.res[kr].conf[kc], prot.res[kr].conf[ic], env.prune_thr)) {
-				//printf("debugging, %d,%d,%d\n",prot.res[kr].resSeq,kc,ic);
-				del_conf(&prot.res[kr], ic);
-				ic--;
+	C += rm_dupconf_hv_res(prot, kr, env.prune_thr);
+}
+
+return C;
+}
+
+static unsigned int dup_cell_hash(long ix, long iy, long iz, unsigned int mask)
+{
+	return ((unsigned int) (ix*73856093L ^ iy*19349663L ^ iz*83492791L)) & mask;
+}
+
+int rm_dupconf_hv_res(const PROT &prot, int i_res, float IDEN_THR)
+{
+	/* Deletes the same conformers as comparing each conformer with every earlier one by cmp_conf_hv():
+	 * a conformer goes if a kept earlier one matches it. Kept conformers are hashed by the cell (IDEN_THR
+	 * wide) of their last heavy atom, the anchor. A match needs an atom of the new conformer within IDEN_THR
+	 * of that anchor, so only conformers filed in the 27 cells around its heavy atoms are compared.
+	 */
+	RES *res_p = &prot.res[i_res];
+	CONF *conf_p;
+	ATOM *atom_p, *anchor_p;
+	int kc, k, ia, dx, dy, dz, n_hv, last, dup, k_empty, stamp;
+	int *head, *next, *anchor, *seen;
+	unsigned int n_bucket, b;
+	long ix, iy, iz;
+	float IDEN_THR2 = IDEN_THR*IDEN_THR;
+	int C = 0;
+
+	if (res_p->n_conf <= 2) return 0;
+	if (IDEN_THR <= 0.) return 0; /* ddvv() < 0 never holds */
+
+	for (n_bucket=64; n_bucket<2*(unsigned int)res_p->n_conf; n_bucket*=2);
+	head   = (int *) malloc(n_bucket*sizeof(int));
+	next   = (int *) malloc(res_p->n_conf*sizeof(int));
+	anchor = (int *) malloc(res_p->n_conf*sizeof(int));
+	seen   = (int *) calloc(res_p->n_conf, sizeof(int));
+	if (!head || !next || !anchor || !seen) {
+		printf("   FATAL: memory error in rm_dupconf_hv_res()\n");
+		exit(-1);
+	}
+	for (b=0; b<n_bucket; b++) head[b] = -1;
+
+	k_empty = 0;
+	stamp = 0;
+	for (kc=1; kc<res_p->n_conf; kc++) {
+		conf_p = &res_p->conf[kc];
+		n_hv = 0;
+		last = -1;
+		for (ia=0; ia<conf_p->n_atom; ia++) {
+			if (!conf_p->atom[ia].on) continue;
+			if (conf_p->atom[ia].name[1] == 'H') continue;
+			n_hv++;
+			last = ia;
+		}
+
+		/* conformers without heavy atoms all match each other */
+		if (!n_hv) {
+			if (k_empty) {
+				del_conf(res_p, kc);
+				kc--;
 				C++;
 			}
+			else k_empty = kc;
+			continue;
+		}
+
+		stamp++;
+		dup = 0;
+		for (ia=0; ia<conf_p->n_atom && !dup; ia++) {
+			atom_p = &conf_p->atom[ia];
+			if (!atom_p->on) continue;
+			if (atom_p->name[1] == 'H') continue;
+			ix = (long) floor(atom_p->xyz.x/IDEN_THR);
+			iy = (long) floor(atom_p->xyz.y/IDEN_THR);
+			iz = (long) floor(atom_p->xyz.z/IDEN_THR);
+			for (dx=-1; dx<=1 && !dup; dx++) {
+				for (dy=-1; dy<=1 && !dup; dy++) {
+					for (dz=-1; dz<=1 && !dup; dz++) {
+						b = dup_cell_hash(ix+dx, iy+dy, iz+dz, n_bucket-1);
+						for (k=head[b]; k>=0; k=next[k]) {
+							if (seen[k] == stamp) continue;
+							anchor_p = &res_p->conf[k].atom[anchor[k]];
+							if (strncmp(anchor_p->name+1, atom_p->name+1, 2)) continue;
+							if (ddvv(anchor_p->xyz, atom_p->xyz) >= IDEN_THR2) continue;
+							seen[k] = stamp;
+							if (!cmp_conf_hv(res_p->conf[k], *conf_p, IDEN_THR)) {
+								dup = 1;
+								break;
+							}
+						}
+					}
+				}
+			}
+		}
+
+		if (dup) {
+			del_conf(res_p, kc);
+			kc--;
+			C++;
+		}
+		else {
+			/* kept, file it under its anchor; earlier conformers never move when later ones are deleted */
+			anchor[kc] = last;
+			b = dup_cell_hash((long) floor(conf_p->atom[last].xyz.x/IDEN_THR),
+					(long) floor(conf_p->atom[last].xyz.y/IDEN_THR),
+					(long) floor(conf_p->atom[last].xyz.z/IDEN_THR), n_bucket-1);
+			next[kc] = head[b];
+			head[b] = kc;
 		}
 	}
-}
 
-return C;
+	free(head);
+	free(next);
+	free(anchor);
+	free(seen);
+	return C;
 }
 
-int rm_dupconf(PROT prot, float prune_thr) {
+int rm_dupconf(const PROT &prot, float prune_thr) {
 	int i_res;
 	int rm_counter=0;
 	for (i_res=0; i_res<prot.n_res; i_res++) {
@@ -3993,7 +4276,7 @@ int rm_dupconf(PROT prot, float prune_thr) {
 	return rm_counter;
 }
 
-int rm_dupconf_res(PROT prot, int i_res, float prune_thr) {
+int rm_dupconf_res(const PROT &prot, int i_res, float prune_thr) {
 	int rm_counter=0;
 	int i_conf;
 	for (i_conf=prot.res[i_res].n_conf-1; i_conf>=1; i_conf--) {
@@ -4010,7 +4293,7 @@ int rm_dupconf_res(PROT prot, int i_res, float prune_thr) {
 	return rm_counter;
 }
 
-int write_conflist(FILE *fp, PROT prot)
+int write_conflist(FILE *fp, const PROT &prot)
 {  int kr, kc, ka;
 
 id_conf(prot);
@@ -4188,7 +4471,7 @@ int get_demetri_out(void)
 	return 0;
 }
 
-int load_listrot(char *fname, PROT prot)
+int load_listrot(char *fname, const PROT &prot)
 {  FILE *fp;
 int i;
 char line[MAXCHAR_LINE];
@@ -4221,7 +4504,7 @@ while (fgets(line, sizeof(line), fp) != NULL) {
 return 0;
 }
 
-int prune_hdirected(PROT prot)
+int prune_hdirected(const PROT &prot)
 {  float d_low = 2.5;
 float d_high = 3.5;
 float vdw_limit = 20.0; /* kCal/mol */
@@ -4331,7 +4614,7 @@ printf("   %d conformers are deleted to fit the limit (%d) of derived conformer
 return 0;
 }
 
-float relax_this_pair(PROT prot, RES *res_a, int conf_a, RES *res_b, int conf_b)
+float relax_this_pair(const PROT &prot, RES *res_a, int conf_a, RES *res_b, int conf_b)
 {  int i, n_a, n_b, kc;
 int C;
 char C_str[5];
@@ -4704,18 +4987,280 @@ return 0;
 }
 
 
-int prune_pv(PROT prot, float c1, float c2, float c3)
+#define PRUNE_NGH_DIST 8.0    /* residues with two atoms closer than this are neighbors in prune_pv() */
+#define PRUNE_GRID_RAD 12.0   /* residues of a bigger bounding sphere are not binned, they are checked against all */
+
+static int prune_ngh_pair(const PROT &prot, int i_res, int j_res)
+{
+	/* the prune_pv() neighbor test, symmetric in i_res and j_res */
+	int i_conf, j_conf, i_atom, j_atom;
+
+	/* check if distance within the threshold */
+	if (out_of_range(prot.res[i_res].r_min,prot.res[i_res].r_max,prot.res[j_res].r_min,prot.res[j_res].r_max,36.)) return 0;
+	for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
+		for (j_conf=0; j_conf<prot.res[j_res].n_conf; j_conf++) {
+			for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
+				if (!prot.res[i_res].conf[i_conf].atom[i_atom].on) continue;
+				for (j_atom=0; j_atom<prot.res[j_res].conf[j_conf].n_atom; j_atom++) {
+					if (!prot.res[j_res].conf[j_conf].atom[j_atom].on) continue;
+					if (ddvv(prot.res[i_res].conf[i_conf].atom[i_atom].xyz,prot.res[j_res].conf[j_conf].atom[j_atom].xyz) < PRUNE_NGH_DIST*PRUNE_NGH_DIST) return 1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int cmp_res_ptr(const void *a, const void *b)
+{
+	const RES *ra = *(RES * const *) a;
+	const RES *rb = *(RES * const *) b;
+	return (ra > rb) - (ra < rb);
+}
+
+static void add_prune_pair(int i_res, int j_res, VECTOR *center, float *rad, int **pair_i, int **pair_j, int *n_pair, int *max_pair)
+{
+	/* keeps the pair if the bounding spheres are within PRUNE_NGH_DIST, 0.1 A spared for rounding */
+	float d = rad[i_res] + rad[j_res] + PRUNE_NGH_DIST + 0.1;
+
+	if (ddvv(center[i_res], center[j_res]) > d*d) return;
+	if (*n_pair >= *max_pair) {
+		*max_pair = *max_pair ? 2*(*max_pair) : 1024;
+		*pair_i = (int *) realloc(*pair_i, *max_pair*sizeof(int));
+		*pair_j = (int *) realloc(*pair_j, *max_pair*sizeof(int));
+		if (!*pair_i || !*pair_j) {
+			printf("   FATAL: memory error in prune_pv_ngh()\n");
+			exit(-1);
+		}
+	}
+	(*pair_i)[*n_pair] = i_res;
+	(*pair_j)[*n_pair] = j_res;
+	(*n_pair)++;
+}
+
+static void prune_pv_ngh(const PROT &prot)
+{
+	/* Sets up res.ngh, in residue order, for prune_pv(). Two residues with atoms within PRUNE_NGH_DIST have
+	 * bounding spheres within PRUNE_NGH_DIST of each other, so the sphere centers are binned in cells of
+	 * PRUNE_NGH_DIST + 2*PRUNE_GRID_RAD, and only residues in adjacent cells go to the atom test.
+	 * Needs r_min, r_max and i_res_prot from setup_vdw_fast().
+	 */
+	int i_res, j_res, i_conf, i_atom, k, ix, iy, iz, jx, jy, jz, n_cell;
+	int nx, ny, nz, n_pair = 0, max_pair = 0;
+	int *cell, *head, *next, *pair_i = NULL, *pair_j = NULL;
+	char *has_atom, *pair_ngh;
+	VECTOR *center, g_min, g_max;
+	float *rad;
+	float cell_size = PRUNE_NGH_DIST + 2.*PRUNE_GRID_RAD;
+
+	center   = (VECTOR *) malloc(prot.n_res*sizeof(VECTOR));
+	rad      = (float *) malloc(prot.n_res*sizeof(float));
+	has_atom = (char *) calloc(prot.n_res, sizeof(char));
+	cell     = (int *) malloc(prot.n_res*sizeof(int));
+	next     = (int *) malloc(prot.n_res*sizeof(int));
+	if (!center || !rad || !has_atom || !cell || !next) {
+		printf("   FATAL: memory error in prune_pv_ngh()\n");
+		exit(-1);
+	}
+
+	g_min.x = g_min.y = g_min.z = 0.;
+	g_max = g_min;
+	k = 0;
+	for (i_res=0; i_res<prot.n_res; i_res++) {
+		prot.res[i_res].n_ngh = 0;
+		prot.res[i_res].ngh = NULL;
+		for (i_conf=0; i_conf<prot.res[i_res].n_conf && !has_atom[i_res]; i_conf++) {
+			for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
+				if (prot.res[i_res].conf[i_conf].atom[i_atom].on) {
+					has_atom[i_res] = 1;
+					break;
+				}
+			}
+		}
+		cell[i_res] = -1;
+		if (!has_atom[i_res]) continue; /* r_min, r_max not set */
+		center[i_res] = vector_rescale(vector_vplusv(prot.res[i_res].r_min, prot.res[i_res].r_max), 0.5);
+		rad[i_res] = 0.5*dvv(prot.res[i_res].r_min, prot.res[i_res].r_max);
+		if (rad[i_res] > PRUNE_GRID_RAD) continue;
+		if (!k) g_min = g_max = center[i_res];
+		if (center[i_res].x < g_min.x) g_min.x = center[i_res].x;
+		if (center[i_res].y < g_min.y) g_min.y = center[i_res].y;
+		if (center[i_res].z < g_min.z) g_min.z = center[i_res].z;
+		if (center[i_res].x > g_max.x) g_max.x = center[i_res].x;
+		if (center[i_res].y > g_max.y) g_max.y = center[i_res].y;
+		if (center[i_res].z > g_max.z) g_max.z = center[i_res].z;
+		cell[i_res] = 0;
+		k++;
+	}
+
+	nx = (int) ((g_max.x-g_min.x)/cell_size) + 1;
+	ny = (int) ((g_max.y-g_min.y)/cell_size) + 1;
+	nz = (int) ((g_max.z-g_min.z)/cell_size) + 1;
+	n_cell = nx*ny*nz;
+	head = (int *) malloc(n_cell*sizeof(int));
+	if (!head) {
+		printf("   FATAL: memory error in prune_pv_ngh()\n");
+		exit(-1);
+	}
+	for (k=0; k<n_cell; k++) head[k] = -1;
+	for (i_res=prot.n_res-1; i_res>=0; i_res--) {
+		if (cell[i_res] < 0) continue;
+		ix = (int) ((center[i_res].x-g_min.x)/cell_size);
+		iy = (int) ((center[i_res].y-g_min.y)/cell_size);
+		iz = (int) ((center[i_res].z-g_min.z)/cell_size);
+		cell[i_res] = (ix*ny + iy)*nz + iz;
+		next[i_res] = head[cell[i_res]];
+		head[cell[i_res]] = i_res;
+	}
+
+	/* candidate pairs: binned residues meet the later ones in the 27 cells around them,
+	 * unbinned residues meet all binned ones and the later unbinned ones
+	 */
+	for (i_res=0; i_res<prot.n_res; i_res++) {
+		if (!has_atom[i_res]) continue;
+		if (cell[i_res] >= 0) {
+			ix = cell[i_res]/(ny*nz);
+			iy = cell[i_res]/nz%ny;
+			iz = cell[i_res]%nz;
+			for (jx=ix-1; jx<=ix+1; jx++) {
+				if (jx < 0 || jx >= nx) continue;
+				for (jy=iy-1; jy<=iy+1; jy++) {
+					if (jy < 0 || jy >= ny) continue;
+					for (jz=iz-1; jz<=iz+1; jz++) {
+						if (jz < 0 || jz >= nz) continue;
+						for (j_res=head[(jx*ny + jy)*nz + jz]; j_res>=0; j_res=next[j_res]) {
+							if (j_res <= i_res) continue;
+							add_prune_pair(i_res, j_res, center, rad, &pair_i, &pair_j, &n_pair, &max_pair);
+						}
+					}
+				}
+			}
+		}
+		else {
+			for (j_res=0; j_res<prot.n_res; j_res++) {
+				if (j_res == i_res || !has_atom[j_res]) continue;
+				if (cell[j_res] < 0 && j_res < i_res) continue;
+				add_prune_pair(i_res, j_res, center, rad, &pair_i, &pair_j, &n_pair, &max_pair);
+			}
+		}
+	}
+	/* the atom level test of each candidate pair */
+	pair_ngh = (char *) malloc(n_pair + 1);
+	if (!pair_ngh) {
+		printf("   FATAL: memory error in prune_pv_ngh()\n");
+		exit(-1);
+	}
+#pragma omp parallel for schedule(dynamic)
+	for (k=0; k<n_pair; k++) {
+		pair_ngh[k] = prune_ngh_pair(prot, pair_i[k], pair_j[k]);
+	}
+
+	for (k=0; k<n_pair; k++) {
+		if (!pair_ngh[k]) continue;
+		prot.res[pair_i[k]].n_ngh++;
+		prot.res[pair_j[k]].n_ngh++;
+	}
+	for (i_res=0; i_res<prot.n_res; i_res++) {
+		if (!prot.res[i_res].n_ngh) continue;
+		prot.res[i_res].ngh = (RES **) malloc(prot.res[i_res].n_ngh*sizeof(RES *));
+		if (!prot.res[i_res].ngh) {
+			printf("   FATAL: memory error in prune_pv_ngh()\n");
+			exit(-1);
+		}
+		prot.res[i_res].n_ngh = 0;
+	}
+	for (k=0; k<n_pair; k++) {
+		if (!pair_ngh[k]) continue;
+		prot.res[pair_i[k]].ngh[prot.res[pair_i[k]].n_ngh++] = &prot.res[pair_j[k]];
+		prot.res[pair_j[k]].ngh[prot.res[pair_j[k]].n_ngh++] = &prot.res[pair_i[k]];
+	}
+	for (i_res=0; i_res<prot.n_res; i_res++) {
+		if (prot.res[i_res].n_ngh > 1) qsort(prot.res[i_res].ngh, prot.res[i_res].n_ngh, sizeof(RES *), cmp_res_ptr);
+	}
+
+	free(center);
+	free(rad);
+	free(has_atom);
+	free(cell);
+	free(next);
+	free(head);
+	free(pair_i);
+	free(pair_j);
+	free(pair_ngh);
+}
+
+static double prune_ran(long *seed)
+{
+	/* Park-Miller minimal standard generator, seed in [1, 2147483646]. It keeps no static state
+	 * as ran2() does, so residues pruned in parallel each have their own stream.
+	 */
+	long k = *seed/127773;
+	*seed = 16807*(*seed - k*127773) - 2836*k;
+	if (*seed < 0) *seed += 2147483647;
+	return *seed/2147483647.;
+}
+
+static int prune_pv_res(const PROT &prot, int ir, float cutoff_geo, float cutoff_ele, float cutoff_vdw, long *seed)
+{
+	/* one pruning pass over the conformers of residue ir, returns 1 if a conformer was turned off */
+	int ic, jc;
+	int deleting = 0;
+
+	for (ic=1; ic<prot.res[ir].n_conf-1; ic++) {
+		if (!prot.res[ir].conf[ic].on) continue;
+		//if (!prot.res[ir].conf[ic].history[2] == 'E') continue; /* do not compare exposed conformers, they have too few interactions to distinguish */
+		for (jc=ic+1; jc<prot.res[ir].n_conf; jc++) {
+			if (!prot.res[ir].conf[jc].on) continue;
+			//if (!prot.res[ir].conf[jc].history[2] == 'E') continue; /* do not compare exposed conformers, they have too few interactions to distinguish */
+
+			//if (prot.res[ir].conf[jc].history[2] == 'O') continue;
+			if (strcmp(prot.res[ir].conf[ic].confName, prot.res[ir].conf[jc].confName)) continue;
+			if (fabs(prot.res[ir].conf[ic].E_self-prot.res[ir].conf[jc].E_self) > cutoff_vdw) continue;
+			if (over_geo(prot.res[ir].conf[ic], prot.res[ir].conf[jc], cutoff_geo)) continue;
+			if (over_ele(prot, ir, ic, jc, cutoff_ele)) continue;
+			if (over_vdw(prot, ir, ic, jc, cutoff_vdw)) continue;
+			//printf("Self energies of the kept and pruned conformers are %8.3f and %8.3f\n", prot.res[ir].conf[ic].E_self,prot.res[ir].conf[jc].E_self);
+			//prot.res[ir].conf[jc].on = 0;
+
+			deleting = 1;
+			if (prot.res[ir].conf[ic].history[2] == 'O' && prot.res[ir].conf[jc].history[2] == 'O') {
+				if (prune_ran(seed) < 0.5) prot.res[ir].conf[ic].on = 0;
+				else prot.res[ir].conf[jc].on = 0;
+				break;
+			}
+			else if (prot.res[ir].conf[ic].history[2] != 'O' && prot.res[ir].conf[jc].history[2] != 'O') {
+				if (prune_ran(seed) < 0.5) prot.res[ir].conf[ic].on = 0;
+				else prot.res[ir].conf[jc].on = 0;
+				break;
+			}
+			else if (prot.res[ir].conf[ic].history[2] != 'O') {
+				prot.res[ir].conf[ic].on = 0;
+				break;
+			}
+			else {
+				prot.res[ir].conf[jc].on = 0;
+				break;
+			}
+		}
+	}
+
+	return deleting;
+}
+
+int prune_pv(const PROT &prot, float c1, float c2, float c3)
 {
 	int n = 0; /* number of conformers deleted */
 	float cutoff_geo = c1;
 	float cutoff_ele = c2;
 	float cutoff_vdw = c3;
-	int ir, ic, ia, jc;
+	int ir, ic, ia;
 	int deleting;
-	int i_res, j_res, i_conf, j_conf, i_atom, j_atom;
-	long    idum;
+	int i_res, j_res;
+	int n_color, *color, *taken, *order, *color_start;
+	long    idum, *seed;
 	idum = time(NULL);
-	int i;
+	int i, j;
 
 	for (i=0;i<500;i++) {
 		ran2(&idum);
@@ -4756,44 +5301,37 @@ int prune_pv(PROT prot, float c1, float c2, float c3)
 	}
 
 	setup_vdw_fast(prot);
-	for (i_res = 0; i_res < prot.n_res; i_res++) {
-		prot.res[i_res].n_ngh = 0;
-		prot.res[i_res].ngh = NULL;
-
-		for (j_res = 0; j_res< prot.n_res; j_res++) {
-			int found;
-			if (i_res == j_res) continue;
-
-			/* check if distance within the threshold */
-			if (out_of_range(prot.res[i_res].r_min,prot.res[i_res].r_max,prot.res[j_res].r_min,prot.res[j_res].r_max,36.)) continue;  /* 8 away */
-			found = 0;
-			for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
-				for (j_conf=0; j_conf<prot.res[j_res].n_conf; j_conf++) {
-
-					for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
-						if (!prot.res[i_res].conf[i_conf].atom[i_atom].on) continue;
-						for (j_atom=0; j_atom<prot.res[j_res].conf[j_conf].n_atom; j_atom++) {
-							if (!prot.res[j_res].conf[j_conf].atom[j_atom].on) continue;
-
-							if (ddvv(prot.res[i_res].conf[i_conf].atom[i_atom].xyz,prot.res[j_res].conf[j_conf].atom[j_atom].xyz) < 64.) { /* 8 away */
-								found = 1;
-							break;
-							}
-						}
-						if (found) break;
-					}
-					if (found) break;
-				}
-				if (found) break;
-			}
-			if (!found) continue;
+	prune_pv_ngh(prot);
 
-			prot.res[i_res].n_ngh++;
-			prot.res[i_res].ngh = (RES **) realloc(prot.res[i_res].ngh, prot.res[i_res].n_ngh * sizeof(RES *));
-			prot.res[i_res].ngh[prot.res[i_res].n_ngh-1] = &prot.res[j_res];
+	/* Residues read only the on flags of their neighbors and write only their own, so residues of one color
+	 * (no two of them neighbors) are pruned in parallel. Each residue draws from its own random stream,
+	 * seeded in residue order from idum, so the result does not depend on the number of threads.
+	 */
+	color = (int *) malloc(prot.n_res*sizeof(int));
+	taken = (int *) malloc((prot.n_res+1)*sizeof(int));
+	order = (int *) malloc(prot.n_res*sizeof(int));
+	color_start = (int *) calloc(prot.n_res+2, sizeof(int));
+	seed  = (long *) malloc(prot.n_res*sizeof(long));
+	if (!color || !taken || !order || !color_start || !seed) {
+		printf("   FATAL: memory error in prune_pv()\n");
+		exit(-1);
+	}
+	n_color = 0;
+	for (ir=0; ir<=prot.n_res; ir++) taken[ir] = -1;
+	for (ir=0; ir<prot.n_res; ir++) {
+		for (i=0; i<prot.res[ir].n_ngh; i++) {
+			j_res = prot.res[ir].ngh[i]->i_res_prot;
+			if (j_res < ir) taken[color[j_res]] = ir;
 		}
+		for (i=0; taken[i] == ir; i++);
+		color[ir] = i;
+		if (i+1 > n_color) n_color = i+1;
+		color_start[i+1]++;
+		seed[ir] = 1 + (long) (ran2(&idum)*2147483645.);
 	}
-
+	for (i=0; i<n_color; i++) color_start[i+1] += color_start[i];
+	for (i=0; i<n_color; i++) taken[i] = color_start[i];
+	for (ir=0; ir<prot.n_res; ir++) order[taken[color[ir]]++] = ir;
 
 	/* get pairwise vector, ele pairwise + vdw pairwise
 	 * We may want to keep the first generation conformers, non-rotamers,
@@ -4804,46 +5342,18 @@ int prune_pv(PROT prot, float c1, float c2, float c3)
 	deleting = 1;
 	while (deleting) {
 		deleting = 0;
-		for (ir=0; ir<prot.n_res; ir++) {
-			for (ic=1; ic<prot.res[ir].n_conf-1; ic++) {
-				if (!prot.res[ir].conf[ic].on) continue;
-				//if (!prot.res[ir].conf[ic].history[2] == 'E') continue; /* do not compare exposed conformers, they have too few interactions to distinguish */
-				for (jc=ic+1; jc<prot.res[ir].n_conf; jc++) {
-					if (!prot.res[ir].conf[jc].on) continue;
-					//if (!prot.res[ir].conf[jc].history[2] == 'E') continue; /* do not compare exposed conformers, they have too few interactions to distinguish */
-
-					//if (prot.res[ir].conf[jc].history[2] == 'O') continue;
-					if (strcmp(prot.res[ir].conf[ic].confName, prot.res[ir].conf[jc].confName)) continue;
-					if (fabs(prot.res[ir].conf[ic].E_self-prot.res[ir].conf[jc].E_self) > cutoff_vdw) continue;
-					if (over_geo(prot.res[ir].conf[ic], prot.res[ir].conf[jc], cutoff_geo)) continue;
-					if (over_ele(prot, ir, ic, jc, cutoff_ele)) continue;
-					if (over_vdw(prot, ir, ic, jc, cutoff_vdw)) continue;
-					//printf("Self energies of the kept and pruned conformers are %8.3f and %8.3f\n", prot.res[ir].conf[ic].E_self,prot.res[ir].conf[jc].E_self);
-					//prot.res[ir].conf[jc].on = 0;
-
-					deleting = 1;
-					if (prot.res[ir].conf[ic].history[2] == 'O' && prot.res[ir].conf[jc].history[2] == 'O') {
-						if (ran2(&idum) < 0.5) prot.res[ir].conf[ic].on = 0;
-						else prot.res[ir].conf[jc].on = 0;
-						break;
-					}
-					else if (prot.res[ir].conf[ic].history[2] != 'O' && prot.res[ir].conf[jc].history[2] != 'O') {
-						if (ran2(&idum) < 0.5) prot.res[ir].conf[ic].on = 0;
-						else prot.res[ir].conf[jc].on = 0;
-						break;
-					}
-					else if (prot.res[ir].conf[ic].history[2] != 'O') {
-						prot.res[ir].conf[ic].on = 0;
-						break;
-					}
-					else {
-						prot.res[ir].conf[jc].on = 0;
-						break;
-					}
-				}
+		for (i=0; i<n_color; i++) {
+#pragma omp parallel for schedule(dynamic) reduction(|:deleting)
+			for (j=color_start[i]; j<color_start[i+1]; j++) {
+				deleting |= prune_pv_res(prot, order[j], cutoff_geo, cutoff_ele, cutoff_vdw, &seed[order[j]]);
 			}
 		}
 	}
+	free(color);
+	free(taken);
+	free(order);
+	free(color_start);
+	free(seed);
 
 	/* clean up neighbor list */
 	for (i_res = 0; i_res < prot.n_res; i_res++) {
@@ -4881,7 +5391,7 @@ for (ia=0; ia<conf1.n_atom; ia++) {
 return 0;
 }
 
-int over_ele(PROT prot, int i_res, int i_conf, int j_conf, float cutoff)
+int over_ele(const PROT &prot, int i_res, int i_conf, int j_conf, float cutoff)
 {
 	int k_res, k_conf, i_ngh;
 	float Ei, Ej;
@@ -4901,7 +5411,7 @@ int over_ele(PROT prot, int i_res, int i_conf, int j_conf, float cutoff)
 	return 0;
 }
 
-int over_vdw(PROT prot, int i_res, int i_conf, int j_conf, float cutoff)
+int over_vdw(const PROT &prot, int i_res, int i_conf, int j_conf, float cutoff)
 {
 	int k_res, k_conf, i_ngh;
 	float Ei, Ej;
@@ -4921,7 +5431,7 @@ int over_vdw(PROT prot, int i_res, int i_conf, int j_conf, float cutoff)
 	return 0;
 }
 
-int label_exposed(PROT prot)
+int label_exposed(const PROT &prot)
 {
 	int kr, kc, i;
 	float max_sas;
@@ -4988,7 +5498,7 @@ int label_exposed(PROT prot)
 			return 0;
 }
 
-float max_confSAS(PROT prot, int ir, int ic)
+float max_confSAS(const PROT &prot, int ir, int ic)
 {  int nconf,i, kc, ka;
 int C;
 char C_str[5];
@@ -5063,7 +5573,7 @@ for (kc=prot.res[ir].n_conf-1; kc >= nconf; kc--) {
 return max_sas;
 }
 
-int rebuild_sc(PROT prot) {
+int rebuild_sc(const PROT &prot) {
 	int i_res;
 	for (i_res=0; i_res<prot.n_res; ++i_res) {
 		char copy_atoms[MAXCHAR_LINE];
@@ -5112,7 +5622,7 @@ int rebuild_sc(PROT prot) {
 	return 0;
 }
 
-void del_non_common_h(PROT prot)
+void del_non_common_h(const PROT &prot)
 {
 	int i_res, i_conf, i_atom;
 	for (i_res=0; i_res<prot.n_res; ++i_res) {
@@ -5156,7 +5666,7 @@ void del_non_common_h(PROT prot)
 	}
 }
 
-int rand_conf_prune(PROT prot)
+int rand_conf_prune(const PROT &prot)
 {
 	int i_res, i_conf;
 	idum = time(NULL);
@@ -5186,7 +5696,7 @@ int rand_conf_prune(PROT prot)
 	return 0;
 }
 
-int write_pdb_headlist(const char *fn, PROT prot)
+int write_pdb_headlist(const char *fn, const PROT &prot)
 {
 	FILE *fp;
 	char pdb_name[100], hd_name[100];
@@ -7,7 +7,7 @@
 
 #define PROBE_RADIUS 1.4
 
-int get_scored_atoms(PROT prot, IPECE *ipece);
+int get_scored_atoms(const PROT &prot, IPECE *ipece);
 int free_scored_atoms(IPECE *ipece);
 extern long idum;
 
@@ -199,7 +199,7 @@ int mem_position(PROT *prot_p, IPECE *ipece)
     return 0;
 }
 
-int get_scored_atoms(PROT prot, IPECE *ipece)
+int get_scored_atoms(const PROT &prot, IPECE *ipece)
 {
     int i_res, i_conf, i_atom;
     int exp_dist_ngrid;  /* number of grids to be searched for surface, see the description in the later code */
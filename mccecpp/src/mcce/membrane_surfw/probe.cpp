@@ -3,7 +3,7 @@
 #include <string.h>
 #include "mcce.h"
 
-int probe(PROT prot, IPECE *ipece)
+int probe(const PROT &prot, IPECE *ipece)
 {
     int i_res, i_conf, i_atom;
     int i_probe, label_updated;
@@ -276,7 +276,7 @@ int probe(PROT prot, IPECE *ipece)
 }
 
 /* Initialize a grid box using the current position of the protein */
-int create_grid_box(PROT prot, IPECE *ipece)
+int create_grid_box(const PROT &prot, IPECE *ipece)
 {
     int i_grid, j_grid, k_grid;
     int i_res, i_conf, i_atom;
@@ -6,29 +6,70 @@
 #define  TRUE     1
 #define  FALSE    0
 
+typedef struct {          /* what the grid keeps of an atom */
+    VECTOR xyz;
+    float  rad2;          /* vdw_rad * vdw_rad */
+    const ATOM *atom;     /* the atom it stands for, so mkacc() can skip the atom it is working on */
+} GRID_ATOM;
+
 typedef struct {
     INT_VECT gsize;
     //INT_VECT gindex;
     VECTOR xyz_min, xyz_max;
     float  PROBE_RAD;
     float  grid_interval;
-    CONF   ***grid;
+    int    *box;          /* box (ix*gsize.y + iy)*gsize.z + iz holds atom[box[i]] to atom[box[i+1]-1] */
+                          /* a slot with rad2 < 0 is free, it buries nothing */
+    GRID_ATOM *atom;
+    int    n_atom, n_alloc;
+    GRID_ATOM *extra;     /* atoms kept out of the boxes, mkacc() checks them when they are in a box next to the point */
+    INT_VECT  *extra_box;
+    int    n_extra, n_extra_alloc;
 } GRID;  /* using a structure to pass grid space data instead of using global variables - Yifan */
 
-int  insAtomToConf(CONF *conf, int ins);
 void calc_gsize(GRID* grid_p);
-void alloc_3d_array (int x_size, int y_size, int z_size, GRID* grid_p);
-void free_3d_array(int x_size, int y_size, int z_size, GRID* grid_p);
-int  fill_grid(PROT prot, GRID* grid_p);
+void alloc_grid(GRID* grid_p);
+void free_grid(GRID* grid_p);
+int  fill_grid(const PROT &prot, GRID* grid_p);
 int  mkacc(ATOM *atom, GRID* grid_p);
-float get_sas_res(ATOM atom, RES res);
-void get_pdb_size(PROT prot, GRID* grid_p);
+float get_sas_res(const ATOM &atom, const RES &res);
+void get_pdb_size(const PROT &prot, GRID* grid_p);
 void extend_grid(GRID* grid_p);
-void set_vdw_rad(PROT prot, float probe_rad); 
-void reset_atom_rad(PROT prot, float probe_rad);
-void trim_conf(PROT prot);
+void set_vdw_rad(const PROT &prot, float probe_rad); 
+void reset_atom_rad(const PROT &prot, float probe_rad);
+void trim_conf(const PROT &prot);
 void copy_sas(PROT src, PROT target);
-int surfw_res(PROT prot, int ir, float probe_rad);
+int surfw_res(const PROT &prot, int ir, float probe_rad);
+
+typedef struct {
+    const ATOM *atom;     /* source atom, compared but never dereferenced */
+    VECTOR xyz;
+    float  vdw_rad;       /* 0 radius atoms only count in the extent */
+} SAS_REC;
+
+typedef struct {
+    int     n, n_alloc;
+    SAS_REC *rec;
+} SAS_SEG;
+
+typedef struct {          /* grid of the environment, kept from one surfw_res() call to the next */
+    int     ready;
+    int     n_res;
+    GRID    grid;
+    VECTOR  raw_min, raw_max;  /* extent the grid was drawn for, before extend_grid() */
+    VECTOR  env_min;      /* lower corner of the environment in the current call */
+    int     origin_free;  /* no radius reaches past the next box, results do not depend on the grid origin */
+    SAS_SEG *seg;         /* atoms each residue has in the grid */
+    SAS_SEG freed;        /* atoms taken out in this call, a new sort keeps their slots free */
+} SAS_ENV;
+
+static SAS_ENV sas_env;
+
+static void sort_grid(GRID *grid_p, const GRID_ATOM *atom, int n);
+static void grid_add_extra(GRID *grid_p, const ATOM *atom_p);
+static void sas_env_sync(const PROT &prot, int i_res, float probe_rad);
+static GRID *sas_conf_in(const PROT &prot, int i_res, int i_conf, GRID *own);
+static void sas_conf_out(GRID *grid_p, GRID *own);
 
 /* preset level 1: i = j = 2, 122 uniformly distributed points on a sphere */
 #define   num_pts 122.
@@ -158,7 +199,7 @@ float point_preset[][3] = {
 };
 float area_coeff = 4. * 3.1415926 / num_pts;
 
-int surfw(PROT protein, float probe_rad)
+int surfw(const PROT &protein, float probe_rad)
 {
   int   i, j, k;
   int i_res, i_conf;
@@ -191,7 +232,7 @@ int surfw(PROT protein, float probe_rad)
 
   set_vdw_rad(prot, grid.PROBE_RAD);
 
-  alloc_3d_array(grid.gsize.x, grid.gsize.y, grid.gsize.z, &grid);
+  alloc_grid(&grid);
   /* end drawing the grid */
 
   fill_grid(prot, &grid);
@@ -252,7 +293,7 @@ int surfw(PROT protein, float probe_rad)
   }
   */
 
-  free_3d_array(grid.gsize.x, grid.gsize.y, grid.gsize.z, &grid);
+  free_grid(&grid);
   copy_sas(prot, protein);
   del_prot(&prot);
   return 0;
@@ -260,7 +301,7 @@ int surfw(PROT protein, float probe_rad)
 }
 
 /* remove all conformers other than conform 0 and 1 */
-void trim_conf(PROT prot) {
+void trim_conf(const PROT &prot) {
   int i, j;
 
   for (i = 0; i < prot.n_res; i++) {
@@ -276,7 +317,7 @@ void trim_conf(PROT prot) {
 /* calculate ASA of the given atom using the given res as the boundary condition - Yifan*/
 /* used to estimate ASA of a residue/conformer when it is fully exposed */
 /* for multi-conformation, conf[].on flag is used to control which conformer is used for the boundary condition */
-float get_sas_res(ATOM atom, RES res)
+float get_sas_res(const ATOM &atom, const RES &res)
 {
     int j, k, m;
     int count;
@@ -303,7 +344,7 @@ float get_sas_res(ATOM atom, RES res)
                 if (!res.conf[j].atom[k].on) continue;
                 if (res.conf[j].atom[k].vdw_rad < 1e-4) continue; /* ignore 0 radius atoms -Yifan*/
                 if (status != TRUE) continue;
-                if (!memcmp(&atom, &(res.conf[j].atom[k]), sizeof(ATOM))) continue;
+                if (&atom == &(res.conf[j].atom[k])) continue;
                 
                 distance2 = ddvv(point, res.conf[j].atom[k].xyz);
                 if (distance2 < res.conf[j].atom[k].vdw_rad * res.conf[j].atom[k].vdw_rad) {
@@ -337,7 +378,7 @@ void copy_sas(PROT src, PROT target)
 }
 
 /* calculate ASA of all conformers, assuming the rest of the protein occupied in the first conformer -Yifan */
-int sas_native(PROT prot)
+int sas_native(const PROT &prot)
 {
     int ir, ic;
     
@@ -351,21 +392,28 @@ int sas_native(PROT prot)
     for (ir=0; ir<prot.n_res; ir++) {
         surfw_res(prot, ir, env.radius_probe);
     }
+    sas_env_free();
     
     return 0;
 }
 
 /* calculate conf[].sas and atom[].sas (absolute value) for all conformers in k_res -Yifan */
-int surfw_res(PROT prot, int i_res, float probe_rad)
+/* the rest of the protein is kept in sas_env.grid, only the conformer being scored goes in and out */
+int surfw_res(const PROT &prot, int i_res, float probe_rad)
 {
     int   i_conf, j_conf, i_atom;
     GRID  grid;
+    GRID  *grid_p;
     
     grid.PROBE_RAD  = probe_rad;       /* get parameters */
     grid.grid_interval = grid.PROBE_RAD + ATOM_RAD;
     
     set_vdw_rad(prot, grid.PROBE_RAD);
     
+    /* the environment is the protein with conformer 0 of this residue */
+    for (j_conf = 1; j_conf < prot.res[i_res].n_conf; j_conf++) prot.res[i_res].conf[j_conf].on = 0;
+    sas_env_sync(prot, i_res, grid.PROBE_RAD);
+    
     /* make the surface for each atom */
     for (i_conf = 1; i_conf < prot.res[i_res].n_conf; i_conf++) {
         float solution_sas;
@@ -375,23 +423,16 @@ int surfw_res(PROT prot, int i_res, float probe_rad)
             else prot.res[i_res].conf[j_conf].on = 0;
         }
         
-        get_pdb_size(prot, &grid);
-        extend_grid(&grid);
-        calc_gsize(&grid);
-        //grid.gindex.x = grid.gsize.x - 1;
-        //grid.gindex.y = grid.gsize.y - 1;
-        //grid.gindex.z = grid.gsize.z - 1;
-        alloc_3d_array(grid.gsize.x, grid.gsize.y, grid.gsize.z, &grid);
-        fill_grid(prot, &grid);
+        grid_p = sas_conf_in(prot, i_res, i_conf, &grid);
         
         prot.res[i_res].conf[i_conf].sas = 0.;
         for (i_atom = 0; i_atom < prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
             if (!(prot.res[i_res].conf[i_conf].atom[i_atom].on)) continue;
             if (prot.res[i_res].conf[i_conf].atom[i_atom].vdw_rad < 1e-4) continue; /* ignore 0 radius atoms -Yifan*/
-            mkacc(&(prot.res[i_res].conf[i_conf].atom[i_atom]), &grid);
+            mkacc(&(prot.res[i_res].conf[i_conf].atom[i_atom]), grid_p);
             prot.res[i_res].conf[i_conf].sas += prot.res[i_res].conf[i_conf].atom[i_atom].sas;
         }
-        free_3d_array(grid.gsize.x, grid.gsize.y, grid.gsize.z, &grid);
+        sas_conf_out(grid_p, &grid);
         
         /* calculate the faction of exposure - added Yifan */
         solution_sas = 0.;
@@ -413,6 +454,316 @@ int surfw_res(PROT prot, int i_res, float probe_rad)
     
 }
 
+static void sas_rec_copy(SAS_SEG *seg, const SAS_REC *rec)
+{
+    if (seg->n >= seg->n_alloc) {
+        seg->n_alloc = seg->n_alloc ? 2 * seg->n_alloc : 64;
+        if (!(seg->rec = (SAS_REC *) realloc(seg->rec, seg->n_alloc * sizeof(SAS_REC)))) {
+            printf("   FATAL: memory error in sas_rec_copy()\n");
+            exit(-1);
+        }
+    }
+    seg->rec[seg->n] = *rec;
+    seg->n++;
+}
+
+static void sas_rec_add(SAS_SEG *seg, const ATOM *atom_p)
+{
+    SAS_REC rec;
+    
+    rec.atom    = atom_p;
+    rec.xyz     = atom_p->xyz;
+    rec.vdw_rad = atom_p->vdw_rad;
+    sas_rec_copy(seg, &rec);
+}
+
+/* check a residue still has in the grid what it has on in the protein, and widen the extent */
+static int sas_seg_same(const PROT &prot, int i_res, SAS_SEG *seg, VECTOR *min, VECTOR *max, float *rad_max)
+{
+    int j, k, n;
+    int same;
+    ATOM *atom_p;
+    
+    n = 0;
+    same = 1;
+    for (j = 0; j < prot.res[i_res].n_conf; j++) {
+        if (!prot.res[i_res].conf[j].on) continue;
+        for (k = 0; k < prot.res[i_res].conf[j].n_atom; k++) {
+            atom_p = &prot.res[i_res].conf[j].atom[k];
+            if (!atom_p->on) continue;
+            
+            if (min->x > atom_p->xyz.x) min->x = atom_p->xyz.x;
+            if (max->x < atom_p->xyz.x) max->x = atom_p->xyz.x;
+            if (min->y > atom_p->xyz.y) min->y = atom_p->xyz.y;
+            if (max->y < atom_p->xyz.y) max->y = atom_p->xyz.y;
+            if (min->z > atom_p->xyz.z) min->z = atom_p->xyz.z;
+            if (max->z < atom_p->xyz.z) max->z = atom_p->xyz.z;
+            if (*rad_max < atom_p->vdw_rad) *rad_max = atom_p->vdw_rad;
+            
+            if (same) {
+                if (n >= seg->n || seg->rec[n].atom != atom_p || seg->rec[n].vdw_rad != atom_p->vdw_rad ||
+                    memcmp(&seg->rec[n].xyz, &atom_p->xyz, sizeof(VECTOR))) same = 0;
+            }
+            n++;
+        }
+    }
+    if (n != seg->n) same = 0;
+    
+    return same;
+}
+
+static void sas_seg_fill(const PROT &prot, int i_res, SAS_SEG *seg)
+{
+    int j, k;
+    
+    seg->n = 0;
+    for (j = 0; j < prot.res[i_res].n_conf; j++) {
+        if (!prot.res[i_res].conf[j].on) continue;
+        for (k = 0; k < prot.res[i_res].conf[j].n_atom; k++) {
+            if (!prot.res[i_res].conf[j].atom[k].on) continue;
+            sas_rec_add(seg, &prot.res[i_res].conf[j].atom[k]);
+        }
+    }
+}
+
+static int grid_box(const GRID *grid_p, VECTOR xyz)
+{
+    int ix, iy, iz;
+    
+    ix = (int) ((xyz.x - grid_p->xyz_min.x) / grid_p->grid_interval);
+    iy = (int) ((xyz.y - grid_p->xyz_min.y) / grid_p->grid_interval);
+    iz = (int) ((xyz.z - grid_p->xyz_min.z) / grid_p->grid_interval);
+    if (ix < 0 || iy < 0 || iz < 0 || ix >= grid_p->gsize.x || iy >= grid_p->gsize.y || iz >= grid_p->gsize.z) return -1;
+    return (ix * grid_p->gsize.y + iy) * grid_p->gsize.z + iz;
+}
+
+/* free the slots the atoms of seg hold in sas_env.grid, -1 if one is not where it should be */
+static int sas_env_take(const SAS_SEG *seg)
+{
+    int j, l, b;
+    GRID *grid_p = &sas_env.grid;
+    
+    for (j = 0; j < seg->n; j++) {
+        if (seg->rec[j].vdw_rad < 1e-4) continue;
+        if ((b = grid_box(grid_p, seg->rec[j].xyz)) < 0) return -1;
+        for (l = grid_p->box[b]; l < grid_p->box[b+1]; l++) {
+            if (grid_p->atom[l].atom == seg->rec[j].atom && grid_p->atom[l].rad2 >= 0.) break;
+        }
+        if (l == grid_p->box[b+1]) return -1;
+        grid_p->atom[l].rad2 = -1.;
+        grid_p->atom[l].atom = NULL;
+    }
+    return 0;
+}
+
+/* put the atoms of seg in free slots of their boxes, -1 when a box has none left */
+static int sas_env_put(const SAS_SEG *seg)
+{
+    int j, l, b;
+    GRID *grid_p = &sas_env.grid;
+    
+    for (j = 0; j < seg->n; j++) {
+        if (seg->rec[j].vdw_rad < 1e-4) continue;
+        if ((b = grid_box(grid_p, seg->rec[j].xyz)) < 0) return -1;
+        for (l = grid_p->box[b]; l < grid_p->box[b+1]; l++) {
+            if (grid_p->atom[l].rad2 < 0.) break;
+        }
+        if (l == grid_p->box[b+1]) return -1;
+        grid_p->atom[l].xyz  = seg->rec[j].xyz;
+        grid_p->atom[l].rad2 = seg->rec[j].vdw_rad * seg->rec[j].vdw_rad;
+        grid_p->atom[l].atom = seg->rec[j].atom;
+    }
+    return 0;
+}
+
+/* put the atoms of all residues into the boxes of sas_env.grid, with a free slot where each atom
+ * taken out in this call was, so the residue being scored finds room when it goes back in */
+static void sas_env_fill()
+{
+    int i, j, n;
+    GRID_ATOM *atom;
+    
+    n = sas_env.freed.n;
+    for (i = 0; i < sas_env.n_res; i++) n += sas_env.seg[i].n;
+    if (!(atom = (GRID_ATOM *) malloc((n + 1) * sizeof(GRID_ATOM)))) {
+        printf("   FATAL: memory error in sas_env_fill()\n");
+        exit(-1);
+    }
+    
+    n = 0;
+    for (i = 0; i < sas_env.n_res; i++) {
+        for (j = 0; j < sas_env.seg[i].n; j++) {
+            if (sas_env.seg[i].rec[j].vdw_rad < 1e-4) continue; /* ignore 0 radius atoms -Yifan*/
+            atom[n].xyz  = sas_env.seg[i].rec[j].xyz;
+            atom[n].rad2 = sas_env.seg[i].rec[j].vdw_rad * sas_env.seg[i].rec[j].vdw_rad;
+            atom[n].atom = sas_env.seg[i].rec[j].atom;
+            n++;
+        }
+    }
+    for (j = 0; j < sas_env.freed.n; j++) {
+        if (grid_box(&sas_env.grid, sas_env.freed.rec[j].xyz) < 0) continue; /* off a grid drawn anew */
+        atom[n].xyz  = sas_env.freed.rec[j].xyz;
+        atom[n].rad2 = -1.;
+        atom[n].atom = NULL;
+        n++;
+    }
+    sort_grid(&sas_env.grid, atom, n);
+    free(atom);
+}
+
+/* release the environment grid, callers that are done with the protein call it */
+void sas_env_free()
+{
+    int i;
+    
+    if (sas_env.ready) free_grid(&sas_env.grid);
+    for (i = 0; i < sas_env.n_res; i++) free(sas_env.seg[i].rec);
+    free(sas_env.seg);
+    free(sas_env.freed.rec);
+    memset(&sas_env, 0, sizeof(SAS_ENV));
+}
+
+/* bring the environment grid up to date with the on flags and coordinates in prot.
+ * Residues that changed since the last call are read again and swapped in place: their old atoms
+ * leave free slots, the new ones go into free slots of their boxes, and the grid is only sorted again
+ * when a box has no free slot left. It is only redrawn when i_res can reach past its corners. mkacc() looks one box around a point, so with a radius over grid_interval
+ * the grid origin decides what buries a point and the grid has to start at the corner of the
+ * environment, as the grid drawn for each conformer did */
+static void sas_env_sync(const PROT &prot, int i_res, float probe_rad)
+{
+    int i, j, k;
+    int *same;
+    int fits, resort;
+    VECTOR min, max;
+    float rad_max, interval;
+    ATOM *atom_p;
+    
+    if (sas_env.ready && (sas_env.n_res != prot.n_res || sas_env.grid.PROBE_RAD != probe_rad)) sas_env_free();
+    if (!sas_env.seg) {
+        sas_env.n_res = prot.n_res;
+        if (!(sas_env.seg = (SAS_SEG *) calloc(prot.n_res, sizeof(SAS_SEG)))) {
+            printf("   FATAL: memory error in sas_env_sync()\n");
+            exit(-1);
+        }
+    }
+    if (!(same = (int *) malloc(prot.n_res * sizeof(int)))) {
+        printf("   FATAL: memory error in sas_env_sync()\n");
+        exit(-1);
+    }
+    
+    min.x = min.y = min.z =  1.0E20;
+    max.x = max.y = max.z = -1.0E20;
+    rad_max = 0.;
+    for (i = 0; i < prot.n_res; i++) same[i] = sas_seg_same(prot, i, &sas_env.seg[i], &min, &max, &rad_max);
+    sas_env.env_min = min;
+    
+    /* any conformer of i_res may go in later */
+    for (j = 1; j < prot.res[i_res].n_conf; j++) {
+        for (k = 0; k < prot.res[i_res].conf[j].n_atom; k++) {
+            atom_p = &prot.res[i_res].conf[j].atom[k];
+            if (!atom_p->on) continue;
+            if (max.x < atom_p->xyz.x) max.x = atom_p->xyz.x;
+            if (max.y < atom_p->xyz.y) max.y = atom_p->xyz.y;
+            if (max.z < atom_p->xyz.z) max.z = atom_p->xyz.z;
+            if (rad_max < atom_p->vdw_rad) rad_max = atom_p->vdw_rad;
+        }
+    }
+    interval = probe_rad + ATOM_RAD;
+    sas_env.origin_free = rad_max <= interval;
+    if (sas_env.origin_free) {
+        for (j = 1; j < prot.res[i_res].n_conf; j++) {
+            for (k = 0; k < prot.res[i_res].conf[j].n_atom; k++) {
+                atom_p = &prot.res[i_res].conf[j].atom[k];
+                if (!atom_p->on) continue;
+                if (min.x > atom_p->xyz.x) min.x = atom_p->xyz.x;
+                if (min.y > atom_p->xyz.y) min.y = atom_p->xyz.y;
+                if (min.z > atom_p->xyz.z) min.z = atom_p->xyz.z;
+            }
+        }
+    }
+    
+    if (sas_env.ready) {
+        if (sas_env.origin_free)
+            fits = min.x >= sas_env.raw_min.x && min.y >= sas_env.raw_min.y && min.z >= sas_env.raw_min.z;
+        else
+            fits = !memcmp(&min, &sas_env.raw_min, sizeof(VECTOR));
+        if (!fits || max.x > sas_env.raw_max.x || max.y > sas_env.raw_max.y || max.z > sas_env.raw_max.z) {
+            free_grid(&sas_env.grid);
+            sas_env.ready = 0;
+        }
+    }
+    
+    /* all changed residues go out before any goes back in, so a residue finds the slots it left */
+    resort = !sas_env.ready;
+    sas_env.freed.n = 0;
+    for (i = 0; i < prot.n_res; i++) {
+        if (same[i]) continue;
+        for (j = 0; j < sas_env.seg[i].n; j++) {
+            if (sas_env.seg[i].rec[j].vdw_rad >= 1e-4) sas_rec_copy(&sas_env.freed, &sas_env.seg[i].rec[j]);
+        }
+        if (!resort && sas_env_take(&sas_env.seg[i])) resort = 1;
+        sas_seg_fill(prot, i, &sas_env.seg[i]);
+    }
+    for (i = 0; i < prot.n_res && !resort; i++) {
+        if (same[i]) continue;
+        if (sas_env_put(&sas_env.seg[i])) resort = 1;
+    }
+    
+    if (!sas_env.ready) {
+        sas_env.grid.PROBE_RAD = probe_rad;
+        sas_env.grid.grid_interval = interval;
+        sas_env.raw_min = sas_env.grid.xyz_min = min;
+        sas_env.raw_max = sas_env.grid.xyz_max = max;
+        extend_grid(&sas_env.grid);
+        calc_gsize(&sas_env.grid);
+        alloc_grid(&sas_env.grid);
+        sas_env.ready = 1;
+    }
+    if (resort) sas_env_fill();
+    
+    free(same);
+}
+
+/* add the atoms of i_conf to the environment grid. When the grid origin matters, a conformer that
+ * reaches below the lower corner of the environment gets a grid of its own in *own as before */
+static GRID *sas_conf_in(const PROT &prot, int i_res, int i_conf, GRID *own)
+{
+    int k;
+    ATOM *atom_p;
+    
+    if (!sas_env.origin_free) {
+        for (k = 0; k < prot.res[i_res].conf[i_conf].n_atom; k++) {
+            atom_p = &prot.res[i_res].conf[i_conf].atom[k];
+            if (!atom_p->on) continue;
+            if (atom_p->xyz.x < sas_env.env_min.x || atom_p->xyz.y < sas_env.env_min.y || atom_p->xyz.z < sas_env.env_min.z) break;
+        }
+        if (k < prot.res[i_res].conf[i_conf].n_atom) {
+            get_pdb_size(prot, own);
+            extend_grid(own);
+            calc_gsize(own);
+            alloc_grid(own);
+            fill_grid(prot, own);
+            return own;
+        }
+    }
+    
+    sas_env.grid.n_extra = 0;
+    for (k = 0; k < prot.res[i_res].conf[i_conf].n_atom; k++) {
+        atom_p = &prot.res[i_res].conf[i_conf].atom[k];
+        if (!atom_p->on) continue;
+        if (atom_p->vdw_rad < 1e-4) continue; /* ignore 0 radius atoms -Yifan*/
+        grid_add_extra(&sas_env.grid, atom_p);
+    }
+    return &sas_env.grid;
+}
+
+/* undo sas_conf_in() */
+static void sas_conf_out(GRID *grid_p, GRID *own)
+{
+    if (grid_p == own) free_grid(own);
+    else sas_env.grid.n_extra = 0;
+}
+
 /* calculate number of grids in the x, y, z axis */
 void calc_gsize(GRID* grid_p)
 {
@@ -427,47 +778,43 @@ int mkacc(ATOM *atom, GRID* grid_p)
 {
     VECTOR point;
     int i, j, k, l, m;
-    float d_square;
+    int b;
+    double dx, dy, dz;
     int count;
     int ix, iy, iz;
-    int ax, ay, az;         /* the grid index of this atom */
     int status;
-    
+    const GRID_ATOM *grid_atom;
+    const GRID_ATOM *buried_by;     /* the atom that buried the last point, it often buries the next one too */
+    INT_VECT buried_box;
+
     count = num_pts;
-    
-    ax = (int) ((atom -> xyz.x - grid_p->xyz_min.x) / grid_p->grid_interval);
-    ay = (int) ((atom -> xyz.y - grid_p->xyz_min.y) / grid_p->grid_interval);
-    az = (int) ((atom -> xyz.z - grid_p->xyz_min.z) / grid_p->grid_interval);
-    
+    buried_by = NULL;
+
     /* loop over each point */
-    
+
     for (m = 0; m < num_pts; m++) {
         status = TRUE;
-        
+
         point.x = point_preset[m][0] * atom ->vdw_rad + atom -> xyz.x;
         point.y = point_preset[m][1] * atom ->vdw_rad + atom -> xyz.y;
         point.z = point_preset[m][2] * atom ->vdw_rad + atom -> xyz.z;
-        
+
         /* find out which grid this point belongs to */
         ix = (int) ((point.x - grid_p->xyz_min.x) / grid_p->grid_interval);
         iy = (int) ((point.y - grid_p->xyz_min.y) / grid_p->grid_interval);
         iz = (int) ((point.z - grid_p->xyz_min.z) / grid_p->grid_interval);
-        
-        if (grid_p->grid[ix][iy][iz].n_atom >= 1) {
-            for (l = 0; l < grid_p->grid[ix][iy][iz].n_atom; l++) {
-                if (grid_p->grid[ix][iy][iz].atom[l].on &&
-                    status == TRUE &&
-                    (ix != ax || iy != ay || iz != az ||
-                        memcmp(atom, &(grid_p->grid[ix][iy][iz].atom[l]), sizeof(ATOM)))) {
-                d_square = ddvv(point, grid_p->grid[ix][iy][iz].atom[l].xyz);
-                if (d_square < grid_p->grid[ix][iy][iz].atom[l].vdw_rad * grid_p->grid[ix][iy][iz].atom[l].vdw_rad) {
-                    status = FALSE;
-                    count --;
-                }
-                        }
+
+        /* only an atom in a box next to the point counts, as in the search below */
+        if (buried_by && abs(buried_box.x - ix) <= 1 && abs(buried_box.y - iy) <= 1 && abs(buried_box.z - iz) <= 1) {
+            dx = buried_by->xyz.x - point.x;
+            dy = buried_by->xyz.y - point.y;
+            dz = buried_by->xyz.z - point.z;
+            if (dx*dx+dy*dy+dz*dz < buried_by->rad2) {
+                count --;
+                continue;
             }
         }
-        
+
         for (i = ix - 1; i <= ix + 1; i++) {
             if (i<0) continue;
             if (i>=grid_p->gsize.x) continue;
@@ -480,22 +827,47 @@ int mkacc(ATOM *atom, GRID* grid_p)
                     if (k<0) continue;
                     if (k>=grid_p->gsize.z) continue;
                     if (status == FALSE) break;
-                    for (l = 0; l < grid_p->grid[i][j][k].n_atom; l++) {
-                        if (grid_p->grid[i][j][k].atom[l].on && status == TRUE) {
-                            if (i != ax || j != ay || k != az || memcmp(atom, &(grid_p->grid[i][j][k].atom[l]), sizeof(ATOM))) {
-                                d_square = ddvv(point, grid_p->grid[i][j][k].atom[l].xyz);
-                                if (d_square < grid_p->grid[i][j][k].atom[l].vdw_rad * grid_p->grid[i][j][k].atom[l].vdw_rad) {
-                                    status = FALSE;
-                                    count --;
-                                }
-                            }
+                    b = (i * grid_p->gsize.y + j) * grid_p->gsize.z + k;
+                    for (l = grid_p->box[b]; l < grid_p->box[b+1]; l++) {
+                        grid_atom = &grid_p->atom[l];
+                        if (grid_atom->atom == atom) continue;
+                        /* ddvv(), spelled out */
+                        dx = grid_atom->xyz.x - point.x;
+                        dy = grid_atom->xyz.y - point.y;
+                        dz = grid_atom->xyz.z - point.z;
+                        if (dx*dx+dy*dy+dz*dz < grid_atom->rad2) {
+                            status = FALSE;
+                            buried_by = grid_atom;
+                            buried_box.x = i;
+                            buried_box.y = j;
+                            buried_box.z = k;
+                            break;
                         }
                     }
                 }
             }
         }
+
+        for (l = 0; l < grid_p->n_extra; l++) {
+            if (status == FALSE) break;
+            if (abs(grid_p->extra_box[l].x - ix) > 1) continue;
+            if (abs(grid_p->extra_box[l].y - iy) > 1) continue;
+            if (abs(grid_p->extra_box[l].z - iz) > 1) continue;
+            grid_atom = &grid_p->extra[l];
+            if (grid_atom->atom == atom) continue;
+            dx = grid_atom->xyz.x - point.x;
+            dy = grid_atom->xyz.y - point.y;
+            dz = grid_atom->xyz.z - point.z;
+            if (dx*dx+dy*dy+dz*dz < grid_atom->rad2) {
+                status = FALSE;
+                buried_by = grid_atom;
+                buried_box = grid_p->extra_box[l];
+            }
+        }
+
+        if (status == FALSE) count --;
     }
-    
+
     atom->sas = area_coeff * atom->vdw_rad * atom->vdw_rad * (float) count;
     //atom->sas = (float) count/num_pts;
     //printf("%s %s%4d %4d %8.3f %8.3f\n",atom->name,atom->resName,atom->resSeq,count,atom->vdw_rad,atom->sas);
@@ -503,7 +875,7 @@ int mkacc(ATOM *atom, GRID* grid_p)
 }
 
 /* find minimum and maximum x,y,z of the whole prot */
-void get_pdb_size(PROT prot, GRID* grid_p)
+void get_pdb_size(const PROT &prot, GRID* grid_p)
 {
     int i, j, k;
     
@@ -546,82 +918,128 @@ void get_pdb_size(PROT prot, GRID* grid_p)
     return;
 }
 
-/* malloc a 3-D array of size x_size * y_size * z_size, and set array[i][j][k] to 0 */
-void alloc_3d_array (int x_size, int y_size, int z_size, GRID* grid_p)
+/* malloc the box offsets of a grid of gsize.x * gsize.y * gsize.z boxes, all empty */
+void alloc_grid(GRID* grid_p)
 {
-    int i, j, k;
-    
-    grid_p->grid = (CONF ***)calloc(x_size, sizeof(CONF **)); /* cast "void *" to "CONF ***" */
-    
-    for (i = 0; i < x_size; i++) {
-        grid_p->grid[i] = (CONF **) calloc( y_size, sizeof(CONF *) );
+    if (!(grid_p->box = (int *) calloc(grid_p->gsize.x * grid_p->gsize.y * grid_p->gsize.z + 1, sizeof(int)))) {
+        printf("   FATAL: memory error in alloc_grid()\n");
+        exit(-1);
     }
-    for (i = 0; i < x_size; i++) {
-        for (j = 0; j < y_size; j++) {
-            grid_p->grid[i][j] = (CONF *) calloc(z_size, sizeof(CONF));
-        }
+    grid_p->atom = NULL;
+    grid_p->n_atom = grid_p->n_alloc = 0;
+    grid_p->extra = NULL;
+    grid_p->extra_box = NULL;
+    grid_p->n_extra = grid_p->n_extra_alloc = 0;
+
+    return;
+}
+
+void free_grid(GRID* grid_p)
+{
+    free(grid_p->box);
+    free(grid_p->atom);
+    free(grid_p->extra);
+    free(grid_p->extra_box);
+
+    return;
+}
+
+/* lay out n atoms box by box, a counting sort on the box index */
+static void sort_grid(GRID *grid_p, const GRID_ATOM *atom, int n)
+{
+    int i, b, n_box;
+    int ix, iy, iz;
+    int *i_box;
+
+    n_box = grid_p->gsize.x * grid_p->gsize.y * grid_p->gsize.z;
+    if (n > grid_p->n_alloc) {
+        grid_p->n_alloc = n;
+        free(grid_p->atom);
+        grid_p->atom = (GRID_ATOM *) malloc(n * sizeof(GRID_ATOM));
     }
-    
-    for (i = 0; i < x_size; i++) {
-        for (j = 0; j < y_size; j++) {
-            for (k = 0; k < z_size; k++) {
-                /*
-                grid[i][j][k].n_atom = 0;
-                grid[i][j][k].atom = NULL;
-                */
-                memset(&grid_p->grid[i][j][k], 0, sizeof(CONF));    
-            }
-        }
+    if (!(i_box = (int *) malloc((n + 1) * sizeof(int))) || (n && !grid_p->atom)) {
+        printf("   FATAL: memory error in sort_grid()\n");
+        exit(-1);
     }
-    return;
+
+    memset(grid_p->box, 0, (n_box + 1) * sizeof(int));
+    for (i = 0; i < n; i++) {
+        ix = (int) ((atom[i].xyz.x - grid_p->xyz_min.x) / grid_p->grid_interval);
+        iy = (int) ((atom[i].xyz.y - grid_p->xyz_min.y) / grid_p->grid_interval);
+        iz = (int) ((atom[i].xyz.z - grid_p->xyz_min.z) / grid_p->grid_interval);
+        i_box[i] = (ix * grid_p->gsize.y + iy) * grid_p->gsize.z + iz;
+        grid_p->box[i_box[i] + 1]++;
+    }
+    for (b = 0; b < n_box; b++) grid_p->box[b + 1] += grid_p->box[b];
+
+    /* box[b] walks to the end of box b, which is where box b+1 starts */
+    for (i = 0; i < n; i++) grid_p->atom[grid_p->box[i_box[i]]++] = atom[i];
+    for (b = n_box; b > 0; b--) grid_p->box[b] = grid_p->box[b - 1];
+    grid_p->box[0] = 0;
+    grid_p->n_atom = n;
+
+    free(i_box);
 }
 
-void free_3d_array(int x_size, int y_size, int z_size, GRID* grid_p)
+/* keep one atom next to the boxes, until the caller sets n_extra back to 0 */
+static void grid_add_extra(GRID *grid_p, const ATOM *atom_p)
 {
-    int i, j, k;
-    
-    for (i = 0; i < x_size; i++) {
-        for (j = 0; j < y_size; j++) {
-            for (k = 0; k < z_size; k++) {
-                if (grid_p->grid[i][j][k].atom)
-                    free(grid_p->grid[i][j][k].atom);
-            }
-            free(grid_p->grid[i][j]);
+    GRID_ATOM *extra;
+
+    if (grid_p->n_extra >= grid_p->n_extra_alloc) {
+        grid_p->n_extra_alloc = grid_p->n_extra_alloc ? 2 * grid_p->n_extra_alloc : 64;
+        grid_p->extra = (GRID_ATOM *) realloc(grid_p->extra, grid_p->n_extra_alloc * sizeof(GRID_ATOM));
+        grid_p->extra_box = (INT_VECT *) realloc(grid_p->extra_box, grid_p->n_extra_alloc * sizeof(INT_VECT));
+        if (!grid_p->extra || !grid_p->extra_box) {
+            printf("   FATAL: memory error in grid_add_extra()\n");
+            exit(-1);
         }
-        free(grid_p->grid[i]);
     }
-    free(grid_p->grid);
-    
-    return;
+    extra = &grid_p->extra[grid_p->n_extra];
+    extra->xyz  = atom_p->xyz;
+    extra->rad2 = atom_p->vdw_rad * atom_p->vdw_rad;
+    extra->atom = atom_p;
+    grid_p->extra_box[grid_p->n_extra].x = (int) ((atom_p->xyz.x - grid_p->xyz_min.x) / grid_p->grid_interval);
+    grid_p->extra_box[grid_p->n_extra].y = (int) ((atom_p->xyz.y - grid_p->xyz_min.y) / grid_p->grid_interval);
+    grid_p->extra_box[grid_p->n_extra].z = (int) ((atom_p->xyz.z - grid_p->xyz_min.z) / grid_p->grid_interval);
+    grid_p->n_extra++;
 }
 
-int fill_grid(PROT prot, GRID* grid_p)
+int fill_grid(const PROT &prot, GRID* grid_p)
 {
-    int ix, iy, iz;                  /* x, y, z grid index for an atom */
-    int i, j, k;
-    //int iConf;
-    int ins_pos;
-    
+    int i, j, k, n;
+    GRID_ATOM *atom;
+
+    n = 0;
+    for (i = 0; i < prot.n_res; i++) {
+        for (j = 0; j < prot.res[i].n_conf; j++) {
+            if (!prot.res[i].conf[j].on) continue;
+            n += prot.res[i].conf[j].n_atom;
+        }
+    }
+    if (!(atom = (GRID_ATOM *) malloc((n + 1) * sizeof(GRID_ATOM)))) {
+        printf("   FATAL: memory error in fill_grid()\n");
+        exit(-1);
+    }
+
     /* put each atom into approriate grid box */
+    n = 0;
     for (i = 0; i < prot.n_res; i++) {
-        //iConf = 0;
         for (j = 0; j < prot.res[i].n_conf; j++) {
             if (!prot.res[i].conf[j].on) continue;
             for (k = 0; k < prot.res[i].conf[j].n_atom; k++) {
                 if (!prot.res[i].conf[j].atom[k].on) continue;
                 if (prot.res[i].conf[j].atom[k].vdw_rad < 1e-4) continue; /* ignore 0 radius atoms -Yifan*/
-                ix = (int) ((prot.res[i].conf[j].atom[k].xyz.x - grid_p->xyz_min.x) / grid_p->grid_interval);
-                iy = (int) ((prot.res[i].conf[j].atom[k].xyz.y - grid_p->xyz_min.y) / grid_p->grid_interval);
-                iz = (int) ((prot.res[i].conf[j].atom[k].xyz.z - grid_p->xyz_min.z) / grid_p->grid_interval);
-                
-                ins_pos = insAtomToConf(&(grid_p->grid[ix][iy][iz]), grid_p->grid[ix][iy][iz].n_atom);
-                //grid[ix][iy][iz].atom[ins_pos] = prot.res[i].conf[j].atom[k];
-                memcpy( &(grid_p->grid[ix][iy][iz].atom[ins_pos]), &(prot.res[i].conf[j].atom[k]), sizeof(ATOM) );
+                atom[n].xyz  = prot.res[i].conf[j].atom[k].xyz;
+                atom[n].rad2 = prot.res[i].conf[j].atom[k].vdw_rad * prot.res[i].conf[j].atom[k].vdw_rad;
+                atom[n].atom = &prot.res[i].conf[j].atom[k];
+                n++;
             }
-            //iConf++;
         }
     }
-    
+    sort_grid(grid_p, atom, n);
+    free(atom);
+
     return 0;
 }
 
@@ -637,7 +1055,7 @@ void extend_grid(GRID* grid_p)
     return;
 }
 
-void set_vdw_rad(PROT prot, float probe_rad)
+void set_vdw_rad(const PROT &prot, float probe_rad)
 {
     
     int i, j, k;
@@ -654,7 +1072,7 @@ void set_vdw_rad(PROT prot, float probe_rad)
     return;
 }
 
-void reset_atom_rad(PROT prot, float probe_rad)
+void reset_atom_rad(const PROT &prot, float probe_rad)
 {
     int i, j, k;
     
@@ -670,30 +1088,8 @@ void reset_atom_rad(PROT prot, float probe_rad)
     return;
 }
 
-int insAtomToConf(CONF *conf, int ins)
-{ if (ins > conf->n_atom) {
-    printf("insAtomToConf(): off range insertion.\n");
-    return USERERR;
-    }
-    
-    /* resize the memory */
-    if (!(conf->atom = (ATOM *) realloc(conf->atom, (conf->n_atom + 1) * sizeof(ATOM)))) {
-        printf("insAtomToConf(): Fails resizing memory.\n");
-        return USERERR;
-    }
-    conf->n_atom ++;
-    
-    /* move contents after position "ins" forward by 1 */
-    memmove(conf->atom+ins+1, conf->atom+ins, (conf->n_atom - ins - 1) * sizeof(ATOM));
-    
-    /* reset the new slot */
-    memset(conf->atom+ins, 0, sizeof(ATOM));
-    
-    return ins;
-}
-
 /* calculation ASA of terminal N and O atoms of ionizable residues - added Yifan*/
-int sas_ionizable(PROT prot, float probe_rad)
+int sas_ionizable(const PROT &prot, float probe_rad)
 {
     int i_res, i_conf, i_atom;
     float score;
@@ -717,6 +1113,9 @@ int sas_ionizable(PROT prot, float probe_rad)
     
     /* calculate ASA for all residues */
     for (i_res=0; i_res<prot.n_res; i_res++) {
+        GRID *grid_p;
+        for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) prot.res[i_res].conf[i_conf].on = 0;
+        sas_env_sync(prot, i_res, grid.PROBE_RAD);
         for (i_conf=1; i_conf<prot.res[i_res].n_conf; i_conf++) {
             int j_conf;
             float solution_sas;
@@ -744,11 +1143,7 @@ int sas_ionizable(PROT prot, float probe_rad)
             }
             
             /* make the surface for each atom */
-            get_pdb_size(prot, &grid);
-            extend_grid(&grid);
-            calc_gsize(&grid);
-            alloc_3d_array(grid.gsize.x, grid.gsize.y, grid.gsize.z, &grid);
-            fill_grid(prot, &grid);
+            grid_p = sas_conf_in(prot, i_res, i_conf, &grid);
             
             prot.res[i_res].conf[i_conf].sas = 0.;
             solution_sas = 0.;
@@ -761,14 +1156,14 @@ int sas_ionizable(PROT prot, float probe_rad)
                 else {
                     if ( atom_p->name[1] != 'O' && atom_p->name[1] != 'N' ) continue; /* skip atoms not O or N */
                 }
-                mkacc(atom_p, &grid);
+                mkacc(atom_p, grid_p);
                 prot.res[i_res].conf[i_conf].sas += prot.res[i_res].conf[i_conf].atom[i_atom].sas;
                 solution_sas += get_sas_res(prot.res[i_res].conf[i_conf].atom[i_atom], prot.res[i_res]);
             }
             if (solution_sas > 1e-3) {
                 prot.res[i_res].conf[i_conf].sas_fraction = prot.res[i_res].conf[i_conf].sas/solution_sas;
             }
-            free_3d_array(grid.gsize.x, grid.gsize.y, grid.gsize.z, &grid);
+            sas_conf_out(grid_p, &grid);
         }
         
         /* reset control flags in this residue */
@@ -776,6 +1171,7 @@ int sas_ionizable(PROT prot, float probe_rad)
         for (i_conf=2; i_conf<prot.res[i_res].n_conf; i_conf++) prot.res[i_res].conf[i_conf].on = 0;
         
     }
+    sas_env_free();
     
     reset_atom_rad(prot, grid.PROBE_RAD);
     
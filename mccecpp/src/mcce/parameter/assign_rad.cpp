@@ -1,7 +1,7 @@
 #include <stdio.h>
 #include "mcce.h"
 
-int assign_rad(PROT prot)
+int assign_rad(const PROT &prot)
 {
     int i, j, k;
     float r;
@@ -32,7 +32,7 @@ int assign_rad(PROT prot)
     return 0;
 }
 
-int assign_vdw_param(PROT &prot)
+int assign_vdw_param(const PROT &prot)
 {  int i, j, k;
    float val;
    FILE *debug_fp;
@@ -99,6 +99,8 @@ int assign_vdw_param(PROT &prot)
                        param_sav("VDW_EPS", prot.res[i].conf[j].confName, prot.res[i].conf[j].atom[k].name, &prot.res[i].conf[j].atom[k].vdw_eps, sizeof(float));
                    }
                    else prot.res[i].conf[j].atom[k].vdw_eps = val;
+
+                   vdw_type(&prot.res[i].conf[j].atom[k]);
                    
                }
            }
@@ -3,29 +3,30 @@
  *        db_open - open mcce parameter database
  *
  * SYNOPSIS
- *        #include <gdbm.h>
  *        #include <mcce.h>
  *
  *        int db_open();
  *
  * DESCRIPTION
  *        The db_open() function opens a paramter database for fast access to the
- *        parameter entries with the support  of  standard gdbm library.  If this
- *        function is called  while the database is  already open,  it prints out
- *        a warning message and use the existing database.  Use "-lgdbm"   option
- *        to  compile  these programs,  just  like  use "-lm" to compile programs
- *        calling math functions.
+ *        parameter entries.  The database is a hash table in memory, the key of
+ *        an entry is key1, key2 and key3 stripped and joined,  and the value is
+ *        kept in a buffer owned by the entry.   If this function is called while
+ *        the database is already open,  it prints out a warning message and use
+ *        the existing database.
+ *
+ *        Lookups do not allocate,  and param_ptr() and param_id()/param_value()
+ *        give the stored value in place. A loop that looks up the same entry over
+ *        and over can keep the id of param_id(),  ids stay valid until db_close().
  *
  * RETURN VALUE
- *        The returned integer is the status, 0 is success, other numbers are the
- *        error code defined by gdbm.h.
+ *        The returned integer is the status, 0 is success.
  *
  * SEE ALSO
- *        db_close, iatom, param_get, param_sav
+ *        db_close, iatom, param_get, param_sav, param_ptr, param_id
  *
  * EXAMPLE
  *       #include <stdio.h>
- *       #include <gdbm.h>
  *       #include "mcce.h"
  *
  *       int main()
@@ -52,6 +53,8 @@
  *          param_get("PKA", "ASP-", "", &ret_pKa);
  *          printf("%.2f\n",ret_pKa);
  *
+ *          printf("%.2f\n", *(const float *) param_ptr("PKA", "ASP-", ""));
+ *
  *          db_close();
  *          return 0;
  *       }
@@ -60,94 +63,219 @@
  *        Junjun Mao, 06/02/2003
  *******************************************************************************/
 
-#include <gdbm.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "mcce.h"
 
-static GDBM_FILE param_db;
-char gdbm_file[256];
+#define PARAM_RAW     0
+#define PARAM_STRINGS 1    /* value is a STRINGS, its strings live outside the entry */
+
+typedef struct {
+	char         *key;
+	unsigned int hash;
+	void         *value;
+	int          size;
+	int          kind;
+	int          tag;      /* param_tag at the last save, marks entries that go to the snapshot */
+} PARAM_ENTRY;
+
+static PARAM_ENTRY *param_entry;    /* entries in the order they were saved, the id is the index */
+static int         n_entry, n_entry_alloc;
+static int         *param_slot;     /* open addressing table of entry ids, -1 is empty */
+static int         n_slot;          /* power of 2, at least twice n_entry */
+static int         param_tag;       /* 1 while loading the sources of a snapshot */
+
+/* join the 3 keys with the leading and ending spaces stripped, return the length */
+static int param_key(char *key, const char *key1, const char *key2, const char *key3)
+{
+	const char *k[3];
+	const char *b, *e;
+	int i, len = 0;
+
+	k[0] = key1; k[1] = key2; k[2] = key3;
+	for (i=0; i<3; i++) {
+		b = k[i];
+		while (*b == ' ' || *b == '\t') b++;
+		e = b + strlen(b);
+		while (e > b && (e[-1] == ' ' || e[-1] == '\t')) e--;
+		if (len + (e-b) >= MAXCHAR_LINE) return -1;
+		memcpy(key+len, b, e-b);
+		len += e-b;
+	}
+	key[len] = '\0';
+
+	return len;
+}
+
+static unsigned int param_hash(const char *key, int len)
+{
+	unsigned int h = 2166136261u;   /* FNV-1a */
+	int i;
+
+	for (i=0; i<len; i++) {
+		h ^= (unsigned char) key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* slot of the key, either holding its entry or the empty slot it would go to */
+static int param_find(const char *key, unsigned int hash)
+{
+	int i_slot = hash & (n_slot-1);
+
+	while (param_slot[i_slot] >= 0) {
+		if (param_entry[param_slot[i_slot]].hash == hash && !strcmp(param_entry[param_slot[i_slot]].key, key)) break;
+		i_slot = (i_slot+1) & (n_slot-1);
+	}
+	return i_slot;
+}
+
+static int param_rehash(int size)
+{
+	int i, i_slot;
+
+	free(param_slot);
+	if (!(param_slot = (int *) malloc(size*sizeof(int)))) {
+		printf("   FATAL: memory error in param_rehash()\n");
+		return USERERR;
+	}
+	n_slot = size;
+	for (i=0; i<n_slot; i++) param_slot[i] = -1;
+	for (i=0; i<n_entry; i++) {
+		i_slot = param_find(param_entry[i].key, param_entry[i].hash);
+		param_slot[i_slot] = i;
+	}
+	return 0;
+}
 
 int db_open()
 {
-    GDBM_FILE temp_db;
-    
-    //remove(DUMMY_GDBM);
-
-    strcpy(gdbm_file, DUMMY_GDBM);
-    mkstemp(gdbm_file);
-    
-    /* open the param database */
-    temp_db = gdbm_open(gdbm_file, 16*1024, GDBM_WRCREAT, 0666, 0);
-    
-    if (gdbm_errno == 0)          /* success, accept temp_db */
-        param_db = temp_db;
-    else if (gdbm_errno == 10)    /* open existing database, use old param_db */
-        printf("   db_open(): Warning, database is already open.\n");
-    
-    return gdbm_errno;
+	if (param_slot) {
+		printf("   db_open(): Warning, database is already open.\n");
+		return 0;
+	}
+
+	n_entry = n_entry_alloc = 0;
+	param_entry = NULL;
+	return param_rehash(16*1024);
 }
 
 
 int db_close()
 {
-	gdbm_close(param_db);   /* close the param database */
-	remove(gdbm_file);     /* delete temporary file */
+	int i;
+
+	for (i=0; i<n_entry; i++) {
+		free(param_entry[i].key);
+		free(param_entry[i].value);
+	}
+	free(param_entry);
+	free(param_slot);
+	param_entry = NULL;
+	param_slot = NULL;
+	n_entry = n_entry_alloc = n_slot = 0;
 	return 0;
 }
 
 
-int iatom(const char *conf_name, const char *atom_name)
+int param_id(const char *key1, const char *key2, const char *key3)
+/* id of the entry, -1 if it is not in the database */
 {
-	datum pkey, pvalue;
 	char key[MAXCHAR_LINE];
-	char sbuff[MAXCHAR_LINE];
-	int i_atom;
-
-	/* construct the atom key */
-	strcpy(key, "IATOM");
-	strip(sbuff, conf_name); strcat(key, sbuff);
-	strip(sbuff, atom_name); strcat(key, sbuff);
-	pkey.dptr = key;
-	pkey.dsize = strlen(key);
-
-	/* find the atom in the database */
-	if (gdbm_exists(param_db, pkey)) {        /* existing key */
-		pvalue = gdbm_fetch(param_db, pkey);
-		/* cast generic pointer pvalue.dptr to integer pointer by (int *), then
-		 * dereference the pointer to an integer by *,   so the return value is
-		 * an integer */
-		i_atom = * (int *) pvalue.dptr;
-		free(pvalue.dptr);
-		return  i_atom;
-	}
+	int len;
+
+	if (!param_slot) return -1;
+	if ((len = param_key(key, key1, key2, key3)) < 0) return -1;
+	return param_slot[param_find(key, param_hash(key, len))];
+}
+
+
+const void *param_value(int id)
+{
+	if (id < 0 || id >= n_entry) return NULL;
+	return param_entry[id].value;
+}
+
+
+const void *param_ptr(const char *key1, const char *key2, const char *key3)
+/* the stored value in place, NULL if it is not in the database */
+{
+	return param_value(param_id(key1, key2, key3));
+}
+
+
+int iatom(const char *conf_name, const char *atom_name)
+{
+	const int *i_atom;
+
+	if ((i_atom = (const int *) param_ptr("IATOM", conf_name, atom_name))) return *i_atom;
 	else return -1;                           /* not in the database */
 }
 
 
 int param_sav(const char *key1, const char *key2, const char *key3, void *value, int s)
 {
-	datum pkey, pvalue;
 	char key[MAXCHAR_LINE];
-	char sbuff[MAXCHAR_LINE];
+	int len, i_slot;
+	unsigned int hash;
+	PARAM_ENTRY *entry;
+
+	if (!param_slot && db_open()) return -1;
 
 	/* convert 3 key strings to one key, leading and ending spaces stripped */
-	strip(key, key1);
-	strip(sbuff, key2); strcat(key, sbuff);
-	strip(sbuff, key3); strcat(key, sbuff);
-
-	/* condtruct key, value pair */
-	pkey.dptr = key;
-	pkey.dsize = strlen(key);
-	pvalue.dptr = (char *) value;
-	pvalue.dsize = s;    /* The data size is passed in rather measured by strlen().
+	if ((len = param_key(key, key1, key2, key3)) < 0) return -1;
+	hash = param_hash(key, len);
+	i_slot = param_find(key, hash);
+
+	if (param_slot[i_slot] >= 0) {                /* replace */
+		entry = &param_entry[param_slot[i_slot]];
+		if (entry->size != s) {
+			free(entry->value);
+			if (!(entry->value = malloc(s))) return -1;
+			entry->size = s;
+		}
+	}
+	else {                                        /* new entry */
+		if (n_entry == n_entry_alloc) {
+			n_entry_alloc = n_entry_alloc? 2*n_entry_alloc : 4096;
+			if (!(entry = (PARAM_ENTRY *) realloc(param_entry, n_entry_alloc*sizeof(PARAM_ENTRY)))) return -1;
+			param_entry = entry;
+		}
+		entry = &param_entry[n_entry];
+		if (!(entry->key = (char *) malloc(len+1)) || !(entry->value = malloc(s))) return -1;
+		memcpy(entry->key, key, len+1);
+		entry->hash = hash;
+		entry->size = s;
+		param_slot[i_slot] = n_entry;
+		n_entry++;
+		if (2*n_entry > n_slot && param_rehash(2*n_slot)) return -1;
+	}
+
+	/* The data size is passed in rather measured by strlen().
 	 * When a generic pointer was passed in, the variable type
 	 * was lost.     It became not reliable to detect the data
 	 * length by the terminating NULL character,  thought most
 	 * time strlen(value) would return the right size. */
+	memcpy(entry->value, value, s);
+	entry->kind = PARAM_RAW;
+	entry->tag  = param_tag;
 
-	return gdbm_store(param_db, pkey, pvalue, GDBM_REPLACE);
+	return 0;
+}
+
+
+static int param_sav_strings(const char *key1, const char *key2, const char *key3, STRINGS *value)
+{
+	int id;
+
+	if (param_sav(key1, key2, key3, value, sizeof(STRINGS))) return -1;
+	id = param_id(key1, key2, key3);
+	param_entry[id].kind = PARAM_STRINGS;
+	return 0;
 }
 
 
@@ -157,51 +285,16 @@ int param_get(const char *key1, const char *key2, const char *key3, void *value)
  *          boundary writing.
  */
 {
-	datum pkey, pvalue;
-	char key[MAXCHAR_LINE];
-	char sbuff[MAXCHAR_LINE];
+	int id;
 
-	/* convert 3 key strings to one key, leading and ending spaces stripped */
-	strip(key, key1);
-	strip(sbuff, key2); strcat(key, sbuff);
-	strip(sbuff, key3); strcat(key, sbuff);
-
-	/* make the key string to be the database search key */
-	pkey.dptr = key;
-	pkey.dsize = strlen(key);
-
-	/* get the value */
-	if (!gdbm_exists(param_db, pkey)) return -1; /* failure */
-	else {                                       /* success */
-		pvalue = gdbm_fetch(param_db, pkey);
-		memcpy(value, pvalue.dptr, pvalue.dsize);
-		free(pvalue.dptr);
-		return 0;
-	}
+	if ((id = param_id(key1, key2, key3)) < 0) return -1; /* failure */
+	memcpy(value, param_entry[id].value, param_entry[id].size);
+	return 0;
 }
 
 int param_exist(const char *key1, const char *key2, const char *key3)
 {
-    datum pkey;
-    char key[MAXCHAR_LINE];
-    char sbuff[MAXCHAR_LINE];
-
-    /* convert 3 key strings to one key, leading and ending spaces stripped */
-    strip(key, key1);
-    strip(sbuff, key2); strcat(key, sbuff);
-    strip(sbuff, key3); strcat(key, sbuff);
-
-    /* make the key string to be the database search key */
-    pkey.dptr = key;
-    pkey.dsize = strlen(key);
-
-    /* get the value */
-    if (!gdbm_exists(param_db, pkey)) {
-        return 0; /* failure */
-    }
-    else {
-        return 1;  /* success */
-    }
+	return param_id(key1, key2, key3) >= 0;
 }
 
 
@@ -382,7 +475,7 @@ int load_param(char *fname)
 				value.strings[Counter][5] = '\0';
 			}
 			/* save this STRINGS structure */
-			param_sav(key1, key2, key3, &value, sizeof(value));
+			param_sav_strings(key1, key2, key3, &value);
 		}
 		else if (!strcmp(key1, "PROTON   ") ||
 				!strcmp(key1, "IATOM    ") ||
@@ -485,7 +578,7 @@ int load_param(char *fname)
 				value.strings[Counter][4] = '\0';
 			}
 			/* save this STRINGS structure */
-			param_sav(key1, key2, key3, &value, sizeof(value));
+			param_sav_strings(key1, key2, key3, &value);
 		}
 		else {         /* others, convert STRING structure */
 			strcpy(sbuff, line+LEN_KEY1+LEN_KEY2+LEN_KEY3);
@@ -592,3 +685,264 @@ int load_all_param(char *dirname)
 	free_strings(&files);
 	return 0;
 }
+
+
+/*******************************************************************************
+ * NAME
+ *        load_all_param_cached - load the tpl directory and the extra file
+ *                                through a snapshot of the parsed entries
+ *
+ * SYNOPSIS
+ *        #include <mcce.h>
+ *
+ *        int load_all_param_cached(char *dirname, char *extra, char *cache_dir)
+ *
+ * DESCRIPTION
+ *        Parsing every tpl file is the bulk of the start up time of a short job.
+ *        The entries loaded from dirname and extra are kept in a binary snapshot
+ *        param_<hash>.cache in cache_dir, where hash is taken over the names and
+ *        the contents of the tpl files, so an edited file simply misses the old
+ *        snapshot.  A snapshot is read with one read and its entries are put in
+ *        the database as they are,  without check_tpl() and the line parser.  On
+ *        a miss the files are loaded as load_all_param() and load_param() would,
+ *        and the snapshot is written for the next run.   A snapshot that can not
+ *        be written is not an error.
+ *
+ *        Entries already in the database, for example from new.tpl, are not part
+ *        of the snapshot. They are replaced by the snapshot like they would be by
+ *        the tpl files.
+ *
+ * RETURN VALUE
+ *        Return integer 0 on success or USERERR on failure.
+ *******************************************************************************/
+
+#define PARAM_CACHE_MAGIC   "MCCEPRM"
+#define PARAM_CACHE_VERSION 1
+
+typedef struct {
+	char               magic[8];
+	int                version;
+	int                n_entry;
+	unsigned long long hash;
+	long long          size;         /* bytes of entries after the head */
+} PARAM_CACHE_HEAD;
+
+static int is_tpl(const char *name)
+{
+	int len = strlen(name);
+	return len > 4 && !strcmp(name+len-4, ".tpl");
+}
+
+static unsigned long long hash_bytes(unsigned long long h, const void *data, size_t n)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	size_t i;
+
+	for (i=0; i<n; i++) {   /* FNV-1a, 64 bit */
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static unsigned long long hash_file(unsigned long long h, const char *fname)
+{
+	FILE *fp;
+	char buf[65536];
+	size_t n;
+
+	h = hash_bytes(h, fname, strlen(fname)+1);
+	if (!(fp = fopen(fname, "r"))) return hash_bytes(h, "-", 1);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) h = hash_bytes(h, buf, n);
+	fclose(fp);
+	return h;
+}
+
+/* hash of everything that decides the loaded entries, in loading order */
+static unsigned long long param_sources_hash(char *dirname, char *extra)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	int i, layout[4];
+	STRINGS files;
+	char fullname[256];
+
+	layout[0] = PARAM_CACHE_VERSION;
+	layout[1] = sizeof(CONNECT);
+	layout[2] = sizeof(TORS);
+	layout[3] = sizeof(SWAP_RULE);
+	h = hash_bytes(h, layout, sizeof(layout));
+
+	files = get_files(dirname);
+	for (i=0; i<files.n; i++) {
+		if (!is_tpl(files.strings[i])) continue;
+		sprintf(fullname, "%s/%s", dirname, files.strings[i]);
+		h = hash_file(h, fullname);
+	}
+	free_strings(&files);
+
+	return hash_file(h, extra);
+}
+
+/* walk the entries of a snapshot body, checking every length against the end of the buffer.
+ * Entries are only saved when load is set, returns the number of entries that are intact */
+static int param_cache_walk(char *buf, char *end, int n, int load)
+{
+	char *p;
+	int i, k, key_len, size, kind, len;
+	char key[MAXCHAR_LINE];
+	STRINGS strings;
+
+	p = buf;
+	for (i=0; i<n; i++) {
+		if (end-p < 3*(int)sizeof(int)) break;
+		memcpy(&key_len, p, sizeof(int)); p += sizeof(int);
+		memcpy(&size,    p, sizeof(int)); p += sizeof(int);
+		memcpy(&kind,    p, sizeof(int)); p += sizeof(int);
+		if (key_len < 0 || key_len >= MAXCHAR_LINE || size < 0 || end-p < key_len) break;
+		memcpy(key, p, key_len); key[key_len] = '\0'; p += key_len;
+
+		if (kind == PARAM_STRINGS) {
+			if (end-p < (int)sizeof(int)) break;
+			memcpy(&strings.n, p, sizeof(int)); p += sizeof(int);
+			if (strings.n < 0 || strings.n > (end-p)/(int)sizeof(int)) break;
+			if (load && !(strings.strings = (char **) malloc((strings.n+1)*sizeof(char *)))) {
+				printf("   FATAL: memory error in param_cache_walk()\n");
+				exit(-1);
+			}
+			for (k=0; k<strings.n; k++) {
+				if (end-p < (int)sizeof(int)) break;
+				memcpy(&len, p, sizeof(int)); p += sizeof(int);
+				if (len < 1 || end-p < len || p[len-1] != '\0') break;
+				if (load) {
+					if (!(strings.strings[k] = (char *) malloc(len))) {
+						printf("   FATAL: memory error in param_cache_walk()\n");
+						exit(-1);
+					}
+					memcpy(strings.strings[k], p, len);
+				}
+				p += len;
+			}
+			if (k < strings.n) break;
+			if (load) param_sav_strings(key, "", "", &strings);
+		}
+		else {
+			if (end-p < size) break;
+			if (load) param_sav(key, "", "", p, size);
+			p += size;
+		}
+	}
+
+	return i;
+}
+
+static int param_cache_read(const char *fname, unsigned long long hash)
+{
+	FILE *fp;
+	PARAM_CACHE_HEAD head;
+	char *buf;
+	int n;
+
+	if (!(fp = fopen(fname, "r"))) return -1;
+	if (fread(&head, sizeof(head), 1, fp) != 1 || strncmp(head.magic, PARAM_CACHE_MAGIC, 8)
+		|| head.version != PARAM_CACHE_VERSION || head.hash != hash || head.size < 0 || head.n_entry < 0) {
+		fclose(fp);
+		return -1;
+	}
+	if (!(buf = (char *) malloc(head.size+1)) || fread(buf, 1, head.size, fp) != (size_t) head.size) {
+		free(buf);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	/* check the whole snapshot before loading any of it, a damaged one is parsed again from the files */
+	if ((n = param_cache_walk(buf, buf + head.size, head.n_entry, 0)) < head.n_entry) {
+		printf("   WARNING: parameter snapshot %s is damaged at entry %d, reading parameter files instead\n", fname, n);
+		free(buf);
+		return USERERR;
+	}
+	param_cache_walk(buf, buf + head.size, head.n_entry, 1);
+	free(buf);
+
+	return 0;
+}
+
+static void param_cache_write(const char *fname, unsigned long long hash)
+{
+	FILE *fp;
+	PARAM_CACHE_HEAD head;
+	char tmp_name[MAXCHAR_LINE];
+	int i, k, key_len, len, fd;
+	STRINGS *strings;
+
+	if (snprintf(tmp_name, sizeof(tmp_name), "%s.XXXXXX", fname) >= (int) sizeof(tmp_name)) return;
+	if ((fd = mkstemp(tmp_name)) < 0) return;
+	fchmod(fd, 0644);      /* shared by the runs of other users */
+	if (!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		remove(tmp_name);
+		return;
+	}
+
+	memset(&head, 0, sizeof(head));
+	strcpy(head.magic, PARAM_CACHE_MAGIC);
+	head.version = PARAM_CACHE_VERSION;
+	head.hash = hash;
+	fwrite(&head, sizeof(head), 1, fp);
+
+	for (i=0; i<n_entry; i++) {
+		if (!param_entry[i].tag) continue;
+		key_len = strlen(param_entry[i].key);
+		head.size += fwrite(&key_len, 1, sizeof(int), fp);
+		head.size += fwrite(&param_entry[i].size, 1, sizeof(int), fp);
+		head.size += fwrite(&param_entry[i].kind, 1, sizeof(int), fp);
+		head.size += fwrite(param_entry[i].key, 1, key_len, fp);
+		if (param_entry[i].kind == PARAM_STRINGS) {
+			strings = (STRINGS *) param_entry[i].value;
+			head.size += fwrite(&strings->n, 1, sizeof(int), fp);
+			for (k=0; k<strings->n; k++) {
+				len = strlen(strings->strings[k])+1;
+				head.size += fwrite(&len, 1, sizeof(int), fp);
+				head.size += fwrite(strings->strings[k], 1, len, fp);
+			}
+		}
+		else head.size += fwrite(param_entry[i].value, 1, param_entry[i].size, fp);
+		head.n_entry++;
+	}
+
+	/* the head goes in last, a snapshot cut short never matches */
+	rewind(fp);
+	fwrite(&head, sizeof(head), 1, fp);
+	if (fclose(fp) || rename(tmp_name, fname)) remove(tmp_name);
+}
+
+int load_all_param_cached(char *dirname, char *extra, char *cache_dir)
+{
+	FILE *fp;
+	unsigned long long hash;
+	char fname[MAXCHAR_LINE];
+	int err = 0;
+
+	hash = param_sources_hash(dirname, extra);
+	sprintf(fname, "%s/param_%016llx.cache", cache_dir, hash);
+
+	param_tag = 1;
+	if (!param_cache_read(fname, hash)) {
+		printf("   Parameters loaded from snapshot \"%s\".\n", fname);
+		param_tag = 0;
+		return 0;
+	}
+
+	if (load_all_param(dirname)) err = USERERR;
+	else if ((fp=fopen(extra, "r"))) {
+		fclose(fp);
+		if (load_param(extra)) {
+			printf("   FATAL: load_all_param_cached(): Failed loading file \"%s\".\n", extra);
+			err = USERERR;
+		}
+	}
+	if (!err) param_cache_write(fname, hash);
+	param_tag = 0;
+
+	return err;
+}
@@ -3,7 +3,7 @@
 #include <stdlib.h>
 #include "mcce.h"
 
-int write_pdb(FILE *stream, PROT prot)
+int write_pdb(FILE *stream, const PROT &prot)
 {  int i, j, k, iConf, c;
    c = 0;
    for (i=0; i<prot.n_res; i++) {
@@ -33,7 +33,7 @@ int write_pdb(FILE *stream, PROT prot)
    return 0;
 }
 
-int write_full_header(FILE *stream, int i, int j, int *c, int *iConf, PROT prot) {
+int write_full_header(FILE *stream, int i, int j, int *c, int *iConf, const PROT &prot) {
 	int k;
 	float x,y,z;//use temporary float variables since the ATOM structure has xyz as "DOUBLE" which are not necessary
 	//write out all the atoms
@@ -60,7 +60,7 @@ int write_full_header(FILE *stream, int i, int j, int *c, int *iConf, PROT prot)
 	return 0;
 }
 
-int write_coordinates(FILE* stream, int i, int j, int *iConf, PROT prot) {
+int write_coordinates(FILE* stream, int i, int j, int *iConf, const PROT &prot) {
 	int k;
 	float x,y,z;
 	//for all conformers of the same residue, the properties that change from one conformer to another are:
@@ -77,7 +77,7 @@ int write_coordinates(FILE* stream, int i, int j, int *iConf, PROT prot) {
 	return 0;
 }
 
-int number_atoms(int i, int j, PROT prot) {
+int number_atoms(int i, int j, const PROT &prot) {
 	//compute the total number of atoms of the backbone to be written out
         int nb_atoms = 0;
 	int k;
@@ -88,7 +88,7 @@ int number_atoms(int i, int j, PROT prot) {
 	return nb_atoms;
 }
 
-int write_pdb_binary(FILE *stream, PROT prot) {
+int write_pdb_binary(FILE *stream, const PROT &prot) {
 	int i, j, iConf, c, nb_atoms;
    	c = 0;
 	nb_atoms = 0;
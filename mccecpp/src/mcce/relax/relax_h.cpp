@@ -43,7 +43,7 @@ int counter;
 float **factor_matrix;
 float **pair_vdw;
 
-int relax(int n_relax, RELAX_ATOM **relax_atoms, PROT prot);
+int relax(int n_relax, RELAX_ATOM **relax_atoms, const PROT &prot);
 int water_orient(VECTOR v0, VECTOR v1, VECTOR v2, float *theta, float *phi, float *psi);
 extern int rm_comment(char *target, char *str);
 
@@ -1147,7 +1147,7 @@ int relax_h(PROT prot)
     return 0;
 }
 
-int relax(int n_relax, RELAX_ATOM **relax_atoms, PROT prot)
+int relax(int n_relax, RELAX_ATOM **relax_atoms, const PROT &prot)
 {
     float       phi_step = env.relax_phi;
     int         i_iter;
@@ -1371,7 +1371,7 @@ int water_orient(VECTOR v0, VECTOR v1, VECTOR v2, float *theta, float *phi, floa
     return 0;
 }
 
-void load_headlst(PROT prot) {
+void load_headlst(const PROT &prot) {
     int  i_res;
     FILE *fp;
     char sbuff[MAXCHAR_LINE], sbuff2[MAXCHAR_LINE];
@@ -1445,7 +1445,7 @@ void load_headlst(PROT prot) {
     }
 }
 
-void write_headlst(PROT prot) {
+void write_headlst(const PROT &prot) {
     FILE *fp;
     int i_res;
     char do_rot,do_sw,opt_hyd;
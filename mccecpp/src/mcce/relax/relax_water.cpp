@@ -5,7 +5,7 @@
 #include "mcce.h"
 #define  RELAX_THR2 env.water_relax_thr * env.water_relax_thr
 
-int relax_water(PROT prot) {
+int relax_water(const PROT &prot) {
     int i_res,i_conf,i_atom,j_res,j_conf,j_atom,k_res,k_conf,k_atom;
     int n_conf, add, counter;
     FILE *debug_fp;
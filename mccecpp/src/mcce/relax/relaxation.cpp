@@ -7,6 +7,15 @@
 #define  PRINT_THR        9
 #define  contact2        16
 #define  CONVERGED_R     1e-5
+#define  CUTOFF_NEAR      1     /* as in coulomb_frc() */
+
+/* a neighbor list packed for the force kernels */
+typedef struct {
+    int    n;
+    int    *idx;         /* index in relax_atoms */
+    float  *c6, *c12;    /* LJ coefficients, in LJ lists */
+    double *q;           /* -331.5*crg_i*crg_j, in charge lists */
+} FRC_LIST;
 
 typedef struct RELAX_STRUCT{
     int    i_relax;
@@ -28,6 +37,12 @@ typedef struct RELAX_STRUCT{
     struct RELAX_STRUCT **ngh;
     int    n_ngh14;
     struct RELAX_STRUCT **ngh14;
+    FRC_LIST ngh_lj;                 /* Verlet list, members of ngh within VDW_CUTOFF_FAR + skin at r_lj */
+    FRC_LIST ngh_crg;                /* charged members of ngh */
+    FRC_LIST ngh14_lj, ngh14_crg;    /* ngh14, and its charged members */
+    float  *ngh_c6, *ngh_c12;        /* LJ coefficients of ngh, ngh_lj is made from them */
+    char   packed;                   /* the lists above are made */
+    VECTOR r_lj;                     /* r when ngh_lj was made */
     int    n_constr;
     struct RELAX_STRUCT **constr_list;
     double  *constr_dsq;
@@ -42,25 +57,64 @@ typedef struct RELAX_STRUCT{
     int    moved;
 } RELAX;
 
-void relaxation_setup(PROT prot);
+typedef struct {
+    int    i_res, i_conf, j_res, j_conf;
+    CONF   *iconf_p, *jconf_p;     /* as the pair was found, for the log */
+    float  pair_vdw, pair_vdw_hv;
+    float  relaxed_pair_vdw, relaxed_pair_vdw_hv;
+    char   relaxed;                /* passed the screen and was minimized */
+    char   failed;                 /* shake did not converge at the smallest time step */
+    int    n_trial;
+    int    n_relax;
+    RELAX  *relax_atoms;           /* working copy between setup and commit */
+} RELAX_PAIR;
+
+typedef struct {
+    int   n_relaxed;
+    int   n_pair_failed;
+    float sum_pair_vdw_failed, sum_pair_vdw_hv_failed;
+    float max_pair_vdw_failed, max_pair_vdw_hv_failed;
+    float sumsq_pair_vdw_failed, sumsq_pair_vdw_hv_failed;
+    int   n_pair_success;
+    float sum_pair_vdw_success, sum_pair_vdw_hv_success;
+    float max_pair_vdw_success, max_pair_vdw_hv_success;
+    float sumsq_pair_vdw_success, sumsq_pair_vdw_hv_success;
+} RELAX_TALLY;
+
+void relaxation_setup(const PROT &prot);
 void complete_constr(int i_res, int i_conf, int j_res, int j_conf);
 //int  in_relax_list(int ia);
-void setup_nghlst(PROT prot);
-void get_frc(float tors_scale, PROT prot);
+void setup_nghlst(const PROT &prot);
+void get_frc(float tors_scale, const PROT &prot);
+static void update_ngh_lj();
+static void lj_coef(RELAX *atom1, RELAX *atom2, float *C6, float *C12);
+static void alloc_frc_list(FRC_LIST *list, int n_max, int lj);
+static void free_frc_list(FRC_LIST *list);
+static void lj_frc_packed(VECTOR r, FRC_LIST *list, double *x, double *y, double *z, double *fx, double *fy, double *fz);
+static void crg_frc_packed(VECTOR r, FRC_LIST *list, double *x, double *y, double *z, double *fx, double *fy, double *fz);
+static void free_relax_atoms();
+static int  relax_pair_screen(RELAX_PAIR *pair, const PROT &prot);
+static void relax_pair_setup(RELAX_PAIR *pair, const PROT &prot);
+static void relax_pair_run(RELAX_PAIR *pair, const PROT &prot);
+static void relax_pair_commit(RELAX_PAIR *pair, const PROT &prot);
+static void relax_pair_tally(RELAX_PAIR *pair, RELAX_TALLY *tally);
+static void relax_pairs(RELAX_PAIR *pairs, int n_pairs, const PROT &prot);
+static void setup_res_bonded(const PROT &prot);
+static void free_res_bonded(const PROT &prot);
 void get_rp();
 int  shake();
 void add_conf2relax(CONF *conf_p, int fix);
 void add_atom2relax(int ia, int fix);
 int res_in_relax(int i_res);
-int pick_sidechain(int i_res, PROT prot);
-void collect_ngh(int i_res, PROT prot);
-int closer_than(int i_res, int i_conf, int j_res, int j_conf, PROT prot, float crg_thr, float dist_thr);
-int write_relax_pdb(char *relax_pdb_filename, PROT prot);
-extern int ionization(PROT prot);
+int pick_sidechain(int i_res, const PROT &prot);
+void collect_ngh(int i_res, const PROT &prot);
+int closer_than(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot, float crg_thr, float dist_thr);
+int write_relax_pdb(char *relax_pdb_filename, const PROT &prot);
+extern int ionization(const PROT &prot);
 //extern int rm_dupconf_res(PROT prot, int i_res, float prune_thr);
-extern int rm_dupconf(PROT prot, float prune_thr);
-extern int rm_dupconf_hv(PROT prot);
-extern int delete_h(PROT prot);
+extern int rm_dupconf(const PROT &prot, float prune_thr);
+extern int rm_dupconf_hv(const PROT &prot);
+extern int delete_h(const PROT &prot);
 
 int     na;
 RELAX   *all_atoms;
@@ -76,22 +130,31 @@ int     n_pair_trial=0, n_pair_converged=0;
 //float   C6_matrix[N_ELEM_MAX][N_ELEM_MAX];
 //float   C12_matrix[N_ELEM_MAX][N_ELEM_MAX];
 static float   DTSQ, CONSTRAINT2, CONSTRAINT_FRC;
+/* each thread minimizes its own pair in relax_pairs() */
+#pragma omp threadprivate(n_relax, relax_atoms, DTSQ)
+/* packed coordinates and forces of get_frc(), kept per thread and grown as needed */
+static double  *frc_buf;
+static int     n_frc_buf;
+#pragma omp threadprivate(frc_buf, n_frc_buf)
+static int     **res_bonded, *n_res_bonded;
 extern  long    idum;
 
 //float   stepwise2_max;
 
-int relaxation(PROT prot)
+int relaxation(const PROT &prot)
 {   
-    int n_pair_relaxed, i_cycle, done;
+    int i_cycle;
     int i_res, i_conf, j_res, j_conf;
-    int i_relax, ia, i_relax_step;
-    float pair_vdw, pair_vdw_hv;
+    int ia;
     RES  *ires_p, *jres_p;
     CONF *iconf_p, *jconf_p;
     FILE *progress_fp;
     float dsq,dsq_max,sum_dsq;
     int   n_movable;
     time_t   timer_start, timer_end;
+    RELAX_PAIR  pair, *pairs = NULL;
+    int   n_pairs, n_pairs_max = 0, k_pair;
+    RELAX_TALLY tally;
     
     zero.x = 0.; zero.y = 0.; zero.z = 0.;
     //stepwise2_max = 0.;
@@ -103,39 +166,30 @@ int relaxation(PROT prot)
     printf("   Start setting up for relaxation.\n"); fflush(stdout);
     relaxation_setup(prot);
     id_conf(prot);
+    if (!env.hv_relax_include_ngh) setup_res_bonded(prot);
     printf("   Setup for relaxation done.\n"); fflush(stdout);
     
-    n_pair_relaxed = 1;
+    tally.n_relaxed = 1;
     i_cycle = 0;
     //int outSeq = 0;
     printf("   Start relaxation.\n"); fflush(stdout);
-    while (n_pair_relaxed) {
+    while (tally.n_relaxed) {
         i_cycle++;
         if (i_cycle > env.hv_relax_ncycle) break;
         
         timer_start = time(NULL);
         setup_vdw_fast(prot);
         
-        n_pair_relaxed = 0;
         n_pair_converged = 0;
         n_pair_trial = 0;
         
-        int n_pair_failed = 0;
-        float sum_pair_vdw_failed = 0.;
-        float sum_pair_vdw_hv_failed = 0.;
-        float max_pair_vdw_failed = -9999.;
-        float max_pair_vdw_hv_failed = -9999.;
-        float sumsq_pair_vdw_failed = 0.;
-        float sumsq_pair_vdw_hv_failed = 0.;
-
-        int n_pair_success = 0;
-        float sum_pair_vdw_success = 0.;
-        float sum_pair_vdw_hv_success = 0.;
-        float max_pair_vdw_success = -9999.;
-        float max_pair_vdw_hv_success = -9999.;
-        float sumsq_pair_vdw_success = 0.;
-        float sumsq_pair_vdw_hv_success = 0.;
+        memset(&tally, 0, sizeof(RELAX_TALLY));
+        tally.max_pair_vdw_failed = -9999.;
+        tally.max_pair_vdw_hv_failed = -9999.;
+        tally.max_pair_vdw_success = -9999.;
+        tally.max_pair_vdw_hv_success = -9999.;
         
+        n_pairs = 0;
         for (i_res=0; i_res<prot.n_res; i_res++) {
             ires_p = &prot.res[i_res];
             for (j_res=0; j_res<prot.n_res; j_res++) {
@@ -146,7 +200,6 @@ int relaxation(PROT prot)
                     if (!prot.res[i_res].conf[i_conf].n_atom) continue;
                     iconf_p = &prot.res[i_res].conf[i_conf];
                     for (j_conf=0; j_conf<prot.res[j_res].n_conf; j_conf++) {
-                        char relax_flag = 't';
                         if (!prot.res[j_res].conf[j_conf].n_atom) continue;
                         jconf_p = &prot.res[j_res].conf[j_conf];
                         if (i_res == j_res && i_conf == j_conf) continue; /* same conformer */
@@ -159,290 +212,32 @@ int relaxation(PROT prot)
                             if (!strncmp(prot.res[j_res].conf[j_conf].history+2, "O000", 4))
                                 continue;
                         
-                        pair_vdw    = vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 0)
-                        +vdw_conf_fast(i_res, i_conf, i_res, i_conf, prot, 0)
-                        +torsion_conf(&prot.res[i_res].conf[i_conf])
-                        +vdw_conf_fast(j_res, j_conf, j_res, j_conf, prot, 0)
-                        +torsion_conf(&prot.res[j_res].conf[j_conf]);
-                        
-                        pair_vdw_hv = vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 1)
-                        +vdw_conf_fast(i_res, i_conf, i_res, i_conf, prot, 1)
-                        +torsion_conf(&prot.res[i_res].conf[i_conf])
-                        +vdw_conf_fast(j_res, j_conf, j_res, j_conf, prot, 1)
-                        +torsion_conf(&prot.res[j_res].conf[j_conf]);
-                        
-                        if (i_conf*j_conf != 0) {/* both are sidechain (if one of them is backbone then always relax */
-                            if (vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 1) > env.hv_relax_hv_vdw_thr) {
-                                /* for sidechains, do not relax if heavy atom clashes */
-                                relax_flag = 'f';
-                            }
-                        }
-                        
-                        if (coulomb_conf(i_res, i_conf, j_res, j_conf, prot) < env.hv_relax_elec_thr) {
-                            /* If there is a favorable electrostatic interaction,
-                            check the distance between two conf, but do not check vdw crash */
-                            
-                            /* if the charge region of two conf are too far away, no relaxation*/
-                            if ( !closer_than(i_res, i_conf, j_res, j_conf, prot, env.hv_relax_elec_crg_thr, env.hv_relax_elec_dist_thr) ) {
-                                relax_flag = 'f';
-                            }
-                        }
-                        else {
-                            if (vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 0) < env.hv_relax_vdw_thr) {
-                                relax_flag = 'f';
-                            }
-                        }
-                        
-                        if (i_res == j_res) {
-                            if (i_conf != 0 && prot.res[i_res].conf[i_conf].history[2] == 'E') relax_flag = 't';
-                            if (j_conf != 0 && prot.res[j_res].conf[j_conf].history[2] == 'E') relax_flag = 't';
-                        }
-                        
-                        //printf("%d, %d, %d, %d\n",i_res,i_conf,j_res,j_conf);
-                        
-                        /*
-                        if (pair_vdw >= 100.) {
-                            progress_fp = fopen(env.progress_log,"a");
-                            if (progress_fp) {
-                                fprintf(progress_fp, "   Relaxation: this pair %s-%s has a large vdw pairwise, pair_vdw = %6.3f, pair_vdw_hv = %6.3f\n", iconf_p->uniqID, jconf_p->uniqID, pair_vdw, pair_vdw_hv);
-                                fclose(progress_fp);
-                            }
-                        }
-                        int pr_toggle = 0;
-                        if (vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 0) > 5.) {
-                            pr_toggle = 1;
-                        }
-                        */
-                        
-                        if (relax_flag == 'f') continue;
-                        
-                        /* setup relax_atoms */
-                        n_relax=0;
-                        relax_atoms = NULL;
-                        n_relax_res = 0;
-                        
-                        add_conf2relax(&prot.res[i_res].conf[0], 0);
-                        if (i_conf) add_conf2relax(&prot.res[i_res].conf[i_conf], 0);
-                        
-                        if (i_res != j_res) {
-                            add_conf2relax(&prot.res[j_res].conf[0], 0);
-                            if (j_conf) add_conf2relax(&prot.res[j_res].conf[j_conf], 0);
-                        }
-                        else if (j_conf && i_conf != j_conf) {
-                            add_conf2relax(&prot.res[j_res].conf[j_conf], 0);
-                        }
-                        if (env.hv_relax_include_ngh) {
-                            /* complete i_res and j_res if their sidechain is not in relax */
-                            if (!res_in_relax(i_res)) {
-                                if (prot.res[i_res].n_conf > 1) {
-                                    i_conf = pick_sidechain(i_res, prot);
-                                    add_conf2relax(&prot.res[i_res].conf[i_conf], 1);
-                                }
-                                else {
-                                    n_relax_res++;
-                                    relax_res[n_relax_res-1] = i_res;
-                                    relax_conf[n_relax_res-1] = 0;
-                                }
-                            }
-                            if (!res_in_relax(j_res)) {
-                                if (prot.res[j_res].n_conf > 1) {
-                                    j_conf = pick_sidechain(j_res, prot);
-                                    add_conf2relax(&prot.res[j_res].conf[j_conf], 1);
-                                }
-                                else {
-                                    n_relax_res++;
-                                    relax_res[n_relax_res-1] = j_res;
-                                    relax_conf[n_relax_res-1] = 0;
-                                }
-                            }
-                            /* collect ngh */
-                            collect_ngh(i_res, prot);
-                            if (i_res!=j_res) collect_ngh(j_res, prot);
-                        }
-                        complete_constr(i_res, i_conf, j_res, j_conf);
-                        setup_nghlst(prot);
-                        
-                        for (i_relax =0; i_relax<n_relax; i_relax++) {
-                            int j_relax;
-                            for (j_relax =0; j_relax<n_relax; j_relax++) {
-                                if (i_relax == j_relax) continue;
-                                if (relax_atoms[i_relax].atom_p == relax_atoms[j_relax].atom_p) {
-                                    printf("\nError! same atoms in relaxation.\n");
-                                    printf("%d,%d\n",relax_atoms[i_relax].atom_p->i_res_prot,relax_atoms[i_relax].atom_p->i_conf_res);
-                                    printf("%d,%d,%d,%d\n",i_res,i_conf,j_res,j_conf);
-                                }
-                                if (relax_atoms[i_relax].atom_p->i_res_prot == relax_atoms[j_relax].atom_p->i_res_prot) {
-                                    if (relax_atoms[i_relax].atom_p->i_conf_res != relax_atoms[j_relax].atom_p->i_conf_res) {
-                                        if (relax_atoms[i_relax].atom_p->i_conf_res * relax_atoms[j_relax].atom_p->i_conf_res) {
-                                            printf("\nError! different side chain.\n");
-                                        }
-                                    }
-                                }
-                            }
-                        }
+                        memset(&pair, 0, sizeof(RELAX_PAIR));
+                        pair.i_res = i_res; pair.i_conf = i_conf; pair.iconf_p = iconf_p;
+                        pair.j_res = j_res; pair.j_conf = j_conf; pair.jconf_p = jconf_p;
                         
-                        /* start relaxation */
-                        DTSQ = 10.*env.hv_relax_dt*env.hv_relax_dt*0.4187e-6;
-                        done = 0;
-                        while (!done) {
-                            n_pair_trial++;
-                            i_relax_step = env.hv_relax_niter;
-                            while (i_relax_step) {
-                                float tors_scale = 1.+(env.hv_tors_scale - 1.)*(float)(i_relax_step-1)/(float)env.hv_relax_niter;
-                                
-                                get_frc(tors_scale, prot);
-                                get_rp();
-                                if (shake()) break;
-                                
-                                for (i_relax =0; i_relax<n_relax; i_relax++) {
-                                    /*
-                                    if (ddvv(relax_atoms[i_relax].r,relax_atoms[i_relax].r_p) > stepwise2_max) {
-                                        stepwise2_max = ddvv(relax_atoms[i_relax].r,relax_atoms[i_relax].r_p);
-                                        printf("stepwise %6.3f\n",sqrt(stepwise2_max));
-                                    }
-                                    */
-                                    //printf("%d, %s, %13.10f\n",i_relax_step, relax_atoms[i_relax].atom_p->name, dvv(relax_atoms[i_relax].r, relax_atoms[i_relax].r_p));
-                                    relax_atoms[i_relax].r = relax_atoms[i_relax].r_p;
-                                }
-                                
-                                int converged = 1;
-                                for (i_relax =0; i_relax<n_relax; i_relax++) {
-                                    if (converged) {
-                                        if (dvv(relax_atoms[i_relax].r, relax_atoms[i_relax].atom_p->xyz) > CONVERGED_R*env.hv_relax_dt*(env.hv_relax_niter-i_relax_step)) converged = 0;
-                                    }
-                                }                                
-                                if (converged) {
-                                    //printf("%d\n",i_relax_step);
-                                    i_relax_step = 0;
-                                }
-                                else {
-                                    i_relax_step--;
+                        if (!env.hv_relax_include_ngh) {
+                            /* queued, relax_pairs() runs them after the scan */
+                            if (n_pairs == n_pairs_max) {
+                                n_pairs_max = n_pairs_max ? 2*n_pairs_max : 1024;
+                                pairs = (RELAX_PAIR *) realloc(pairs, n_pairs_max*sizeof(RELAX_PAIR));
+                                if (!pairs) {
+                                    printf("   FATAL: memory error in relaxation()\n");
+                                    exit(-1);
                                 }
                             }
-                            if (i_relax_step) {
-                                /*
-                                progress_fp = fopen(env.progress_log,"a");
-                                if (progress_fp) {
-                                    fprintf(progress_fp, "   Relaxation: this pair %s-%s failed in shake convergence, pair_vdw = %6.3f, pair_vdw_hv = %6.3f\n", iconf_p->uniqID, jconf_p->uniqID, pair_vdw, pair_vdw_hv);
-                                    fclose(progress_fp);
-                                }
-
-                                char pair_pr[160];
-                                sprintf(pair_pr,"%s-%s.pdb",iconf_p->uniqID, jconf_p->uniqID);
-                                FILE *pair_fp = fopen(pair_pr,"w");
-                                if (pair_fp) {
-                                    for (i_relax =0; i_relax<n_relax; i_relax++) {
-                                        int i_res_pr, i_conf_pr, i_atom_pr;
-                                        i_res_pr = relax_atoms[i_relax].atom_p->i_res_prot;
-                                        i_conf_pr = relax_atoms[i_relax].atom_p->i_conf_res;
-                                        i_atom_pr = relax_atoms[i_relax].atom_p->i_atom_conf;
-                                        fprintf(pair_fp,"ATOM        %4s%c%3s %c%04d%c%03d%8.3f%8.3f%8.3f %8.3f%8.3f%8.3f\n",
-                                        prot.res[i_res_pr].conf[i_conf_pr].atom[i_atom_pr].name,
-                                        prot.res[i_res_pr].conf[i_conf_pr].altLoc,
-                                        prot.res[i_res_pr].resName,
-                                        prot.res[i_res_pr].chainID,
-                                        prot.res[i_res_pr].resSeq,
-                                        prot.res[i_res_pr].iCode,
-                                        i_conf_pr,
-                                        prot.res[i_res_pr].conf[i_conf_pr].atom[i_atom_pr].xyz.x,
-                                        prot.res[i_res_pr].conf[i_conf_pr].atom[i_atom_pr].xyz.y,
-                                        prot.res[i_res_pr].conf[i_conf_pr].atom[i_atom_pr].xyz.z,
-                                        relax_atoms[i_relax].r.x,
-                                        relax_atoms[i_relax].r.y,
-                                        relax_atoms[i_relax].r.z);
-                                    }
-                                    fclose(pair_fp);
-                                }
-                                */
-
-                                if (DTSQ < 1e-10) {
-                                    /* relaxation failed */
-                                    n_pair_failed++;
-                                    
-                                    sum_pair_vdw_failed += pair_vdw;
-                                    sum_pair_vdw_hv_failed += pair_vdw_hv;
-
-                                    sumsq_pair_vdw_failed += pair_vdw*pair_vdw;
-                                    sumsq_pair_vdw_hv_failed += pair_vdw_hv*pair_vdw_hv;
-                                    
-                                    if (pair_vdw > max_pair_vdw_failed) max_pair_vdw_failed = pair_vdw;
-                                    if (pair_vdw_hv > max_pair_vdw_hv_failed) max_pair_vdw_hv_failed = pair_vdw_hv;
-
-                                    for (i_relax =0; i_relax<n_relax; i_relax++) {
-                                        relax_atoms[i_relax].r = relax_atoms[i_relax].atom_p->xyz;
-                                    }
-
-                                    break;
-                                }
-                                DTSQ = DTSQ /2.;
-                                for (i_relax =0; i_relax<n_relax; i_relax++) {
-                                    relax_atoms[i_relax].r = relax_atoms[i_relax].atom_p->xyz;
-                                }
-                            }
-                            else
-                                done = 1;
-                        }
-                        
-                        /* success */
-                        n_pair_success++;
-                        
-                        sum_pair_vdw_success += pair_vdw;
-                        sum_pair_vdw_hv_success += pair_vdw_hv;
-                        
-                        sumsq_pair_vdw_success += pair_vdw*pair_vdw;
-                        sumsq_pair_vdw_hv_success += pair_vdw_hv*pair_vdw_hv;
-                        
-                        if (pair_vdw > max_pair_vdw_success) max_pair_vdw_success = pair_vdw;
-                        if (pair_vdw_hv > max_pair_vdw_hv_success) max_pair_vdw_hv_success = pair_vdw_hv;
-                        
-                        for (i_relax =0; i_relax<n_relax; i_relax++) {
-                            relax_atoms[i_relax].atom_p->xyz = relax_atoms[i_relax].r;
-                        }
-                        for (i_relax =0; i_relax<n_relax; i_relax++) {
-                            ia = relax_atoms[i_relax].atom_p->i_atom_prot;
-                            all_atoms[ia].i_relax = -1;
-                        }
-
-                        float relaxed_pair_vdw    = vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 0)
-                        +vdw_conf_fast(i_res, i_conf, i_res, i_conf, prot, 0)
-                        +torsion_conf(&prot.res[i_res].conf[i_conf])
-                        +vdw_conf_fast(j_res, j_conf, j_res, j_conf, prot, 0)
-                        +torsion_conf(&prot.res[j_res].conf[j_conf]);
-                        
-                        float relaxed_pair_vdw_hv = vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 1)
-                        +vdw_conf_fast(i_res, i_conf, i_res, i_conf, prot, 1)
-                        +torsion_conf(&prot.res[i_res].conf[i_conf])
-                        +vdw_conf_fast(j_res, j_conf, j_res, j_conf, prot, 1)
-                        +torsion_conf(&prot.res[j_res].conf[j_conf]);
-
-                        if (pair_vdw > 100.) {
-                            progress_fp = fopen(env.progress_log,"a");
-                            fprintf(progress_fp,"   Relaxation: pair %s-%s before relaxation pair_vdw = %8.1f, pair_vdw_hv = %8.1f\n",iconf_p->uniqID, jconf_p->uniqID, pair_vdw, pair_vdw_hv);
-                            fprintf(progress_fp,"   Relaxation: pair %s-%s after             pair_vdw = %8.1f, pair_vdw_hv = %8.1f\n",iconf_p->uniqID, jconf_p->uniqID, relaxed_pair_vdw, relaxed_pair_vdw_hv);
-                            fclose(progress_fp);
+                            pairs[n_pairs++] = pair;
+                            continue;
                         }
                         
-                        
-                        /*
-                        if (pr_toggle) {
-                            progress_fp = fopen(env.progress_log,"a");
-                            if (progress_fp) {
-                                fprintf(progress_fp, "   Relaxation: this pair %s-%s before relaxation pair_vdw = %6.3f, pair_vdw_hv = %6.3f, after pair_vdw = %6.3f, pair_vdw_hv = %6.3f\n", iconf_p->uniqID, jconf_p->uniqID, pair_vdw, pair_vdw_hv, relaxed_pair_vdw, relaxed_pair_vdw_hv);
-                                fclose(progress_fp);
-                            }
-                        }
-                        */
-                        for (i_relax =0; i_relax<n_relax; i_relax++) {
-                            free(relax_atoms[i_relax].ngh);
-                            free(relax_atoms[i_relax].ngh14);
-                            free(relax_atoms[i_relax].constr_list);
-                            free(relax_atoms[i_relax].constr_dsq);
-                            free(relax_atoms[i_relax].rotate1_lst);
-                            free(relax_atoms[i_relax].rotate2_lst);
-                        }
-                        free(relax_atoms);
-                        n_pair_relaxed++;
-                        n_pair_converged++;
+                        /* the side chains of neighbors are picked with ran2(), so these pairs go one by one in order */
+                        if (!relax_pair_screen(&pair, prot)) continue;
+                        relax_pair_setup(&pair, prot);
+                        i_conf = pair.i_conf;
+                        j_conf = pair.j_conf;
+                        relax_pair_run(&pair, prot);
+                        relax_pair_commit(&pair, prot);
+                        relax_pair_tally(&pair, &tally);
                         
                         /* done with this pair of conformers */
                     }
@@ -450,6 +245,13 @@ int relaxation(PROT prot)
             }
         }
         
+        if (!env.hv_relax_include_ngh) {
+            relax_pairs(pairs, n_pairs, prot);
+            for (k_pair=0; k_pair<n_pairs; k_pair++) {
+                if (pairs[k_pair].relaxed) relax_pair_tally(&pairs[k_pair], &tally);
+            }
+        }
+        
         dsq_max = 0;
         sum_dsq = 0.;
         n_movable = 0;
@@ -460,21 +262,23 @@ int relaxation(PROT prot)
             n_movable++;
             if (dsq > dsq_max) dsq_max = dsq;
         }
-        float avg_pair_vdw_failed = sum_pair_vdw_failed/(float)n_pair_failed;
-        float dev_pair_vdw_failed = sqrt(sumsq_pair_vdw_failed/(float)n_pair_failed - avg_pair_vdw_failed*avg_pair_vdw_failed);
-        float avg_pair_vdw_success = sum_pair_vdw_success/(float)n_pair_success;
-        float dev_pair_vdw_success = sqrt(sumsq_pair_vdw_success/(float)n_pair_success - avg_pair_vdw_success*avg_pair_vdw_success);
+        float avg_pair_vdw_failed = tally.sum_pair_vdw_failed/(float)tally.n_pair_failed;
+        float dev_pair_vdw_failed = sqrt(tally.sumsq_pair_vdw_failed/(float)tally.n_pair_failed - avg_pair_vdw_failed*avg_pair_vdw_failed);
+        float avg_pair_vdw_success = tally.sum_pair_vdw_success/(float)tally.n_pair_success;
+        float dev_pair_vdw_success = sqrt(tally.sumsq_pair_vdw_success/(float)tally.n_pair_success - avg_pair_vdw_success*avg_pair_vdw_success);
         
         timer_end = time(NULL);
         progress_fp = fopen(env.progress_log, "a");
         if (progress_fp) {
-            fprintf(progress_fp, "   Relaxation Cycle = %3d, n_relaxed = %5d, shake convergence rate = %6.2f %%, success rate = %6.2f %%\n",i_cycle,n_pair_relaxed, 100.*(float)n_pair_converged/(float)n_pair_trial, 100.*(float)n_pair_converged/(float)n_pair_relaxed); fflush(stdout);
+            fprintf(progress_fp, "   Relaxation Cycle = %3d, n_relaxed = %5d, shake convergence rate = %6.2f %%, success rate = %6.2f %%\n",i_cycle,tally.n_relaxed, 100.*(float)n_pair_converged/(float)n_pair_trial, 100.*(float)n_pair_converged/(float)tally.n_relaxed); fflush(stdout);
             fprintf(progress_fp, "   Relaxation Cycle = %3d, rmsd = %6.3f, max displacement = %6.3f, time used %ld seconds\n",i_cycle,sqrt(sum_dsq/(float)n_movable),sqrt(dsq_max),timer_end-timer_start); fflush(stdout);
-            fprintf(progress_fp, "   Relaxation Cycle = %3d, # of failed  = %5d, avg_failed_vdw  = %6.3f, deviation = %6.3f, maximum = %6.3f\n",i_cycle,n_pair_failed,avg_pair_vdw_failed,dev_pair_vdw_failed,max_pair_vdw_failed); fflush(stdout);
-            fprintf(progress_fp, "   Relaxation Cycle = %3d, # of success = %5d, avg_success_vdw = %6.3f, deviation = %6.3f, maximum = %6.3f\n",i_cycle,n_pair_success,avg_pair_vdw_success,dev_pair_vdw_success,max_pair_vdw_success); fflush(stdout);
+            fprintf(progress_fp, "   Relaxation Cycle = %3d, # of failed  = %5d, avg_failed_vdw  = %6.3f, deviation = %6.3f, maximum = %6.3f\n",i_cycle,tally.n_pair_failed,avg_pair_vdw_failed,dev_pair_vdw_failed,tally.max_pair_vdw_failed); fflush(stdout);
+            fprintf(progress_fp, "   Relaxation Cycle = %3d, # of success = %5d, avg_success_vdw = %6.3f, deviation = %6.3f, maximum = %6.3f\n",i_cycle,tally.n_pair_success,avg_pair_vdw_success,dev_pair_vdw_success,tally.max_pair_vdw_success); fflush(stdout);
             fclose(progress_fp);
         }
     }
+    free(pairs);
+    if (!env.hv_relax_include_ngh) free_res_bonded(prot);
 
     for (i_res=0; i_res<prot.n_res; i_res++) {
         free_connect_res(prot, i_res);
@@ -483,7 +287,518 @@ int relaxation(PROT prot)
     return 0;
 }
 
-int initial_relaxation(PROT prot)
+static int relax_pair_screen(RELAX_PAIR *pair, const PROT &prot) {
+    /* returns 1 if the pair needs relaxation, pair_vdw and pair_vdw_hv are kept for the log */
+    int i_res = pair->i_res, i_conf = pair->i_conf, j_res = pair->j_res, j_conf = pair->j_conf;
+    char relax_flag = 't';
+    
+    /* each term once, they are reused below */
+    float tors_i = torsion_conf(&prot.res[i_res].conf[i_conf]);
+    float tors_j = torsion_conf(&prot.res[j_res].conf[j_conf]);
+    float vdw_ij = vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 0);
+    float vdw_ij_hv = vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 1);
+    
+    pair->pair_vdw    = vdw_ij
+    +vdw_conf_fast(i_res, i_conf, i_res, i_conf, prot, 0)
+    +tors_i
+    +vdw_conf_fast(j_res, j_conf, j_res, j_conf, prot, 0)
+    +tors_j;
+    
+    pair->pair_vdw_hv = vdw_ij_hv
+    +vdw_conf_fast(i_res, i_conf, i_res, i_conf, prot, 1)
+    +tors_i
+    +vdw_conf_fast(j_res, j_conf, j_res, j_conf, prot, 1)
+    +tors_j;
+    
+    if (i_conf*j_conf != 0) {/* both are sidechain (if one of them is backbone then always relax */
+        if (vdw_ij_hv > env.hv_relax_hv_vdw_thr) {
+            /* for sidechains, do not relax if heavy atom clashes */
+            relax_flag = 'f';
+        }
+    }
+    
+    if (coulomb_conf(i_res, i_conf, j_res, j_conf, prot) < env.hv_relax_elec_thr) {
+        /* If there is a favorable electrostatic interaction,
+        check the distance between two conf, but do not check vdw crash */
+        
+        /* if the charge region of two conf are too far away, no relaxation*/
+        if ( !closer_than(i_res, i_conf, j_res, j_conf, prot, env.hv_relax_elec_crg_thr, env.hv_relax_elec_dist_thr) ) {
+            relax_flag = 'f';
+        }
+    }
+    else {
+        if (vdw_ij < env.hv_relax_vdw_thr) {
+            relax_flag = 'f';
+        }
+    }
+    
+    if (i_res == j_res) {
+        if (i_conf != 0 && prot.res[i_res].conf[i_conf].history[2] == 'E') relax_flag = 't';
+        if (j_conf != 0 && prot.res[j_res].conf[j_conf].history[2] == 'E') relax_flag = 't';
+    }
+    
+    return relax_flag == 't';
+}
+
+static void relax_pair_setup(RELAX_PAIR *pair, const PROT &prot) {
+    /* collects the atoms of a pair, its working copy is handed to the pair.
+     * With neighbors included, i_conf and j_conf of the pair may be replaced by picked side chains.
+     */
+    int i_res = pair->i_res, i_conf = pair->i_conf, j_res = pair->j_res, j_conf = pair->j_conf;
+    int i_relax, ia;
+    
+    /* setup relax_atoms */
+    n_relax=0;
+    relax_atoms = NULL;
+    n_relax_res = 0;
+    
+    add_conf2relax(&prot.res[i_res].conf[0], 0);
+    if (i_conf) add_conf2relax(&prot.res[i_res].conf[i_conf], 0);
+    
+    if (i_res != j_res) {
+        add_conf2relax(&prot.res[j_res].conf[0], 0);
+        if (j_conf) add_conf2relax(&prot.res[j_res].conf[j_conf], 0);
+    }
+    else if (j_conf && i_conf != j_conf) {
+        add_conf2relax(&prot.res[j_res].conf[j_conf], 0);
+    }
+    if (env.hv_relax_include_ngh) {
+        /* complete i_res and j_res if their sidechain is not in relax */
+        if (!res_in_relax(i_res)) {
+            if (prot.res[i_res].n_conf > 1) {
+                i_conf = pick_sidechain(i_res, prot);
+                add_conf2relax(&prot.res[i_res].conf[i_conf], 1);
+            }
+            else {
+                n_relax_res++;
+                relax_res[n_relax_res-1] = i_res;
+                relax_conf[n_relax_res-1] = 0;
+            }
+        }
+        if (!res_in_relax(j_res)) {
+            if (prot.res[j_res].n_conf > 1) {
+                j_conf = pick_sidechain(j_res, prot);
+                add_conf2relax(&prot.res[j_res].conf[j_conf], 1);
+            }
+            else {
+                n_relax_res++;
+                relax_res[n_relax_res-1] = j_res;
+                relax_conf[n_relax_res-1] = 0;
+            }
+        }
+        /* collect ngh */
+        collect_ngh(i_res, prot);
+        if (i_res!=j_res) collect_ngh(j_res, prot);
+    }
+    complete_constr(i_res, i_conf, j_res, j_conf);
+    setup_nghlst(prot);
+    
+    for (i_relax =0; i_relax<n_relax; i_relax++) {
+        int j_relax;
+        for (j_relax =0; j_relax<n_relax; j_relax++) {
+            if (i_relax == j_relax) continue;
+            if (relax_atoms[i_relax].atom_p == relax_atoms[j_relax].atom_p) {
+                printf("\nError! same atoms in relaxation.\n");
+                printf("%d,%d\n",relax_atoms[i_relax].atom_p->i_res_prot,relax_atoms[i_relax].atom_p->i_conf_res);
+                printf("%d,%d,%d,%d\n",i_res,i_conf,j_res,j_conf);
+            }
+            if (relax_atoms[i_relax].atom_p->i_res_prot == relax_atoms[j_relax].atom_p->i_res_prot) {
+                if (relax_atoms[i_relax].atom_p->i_conf_res != relax_atoms[j_relax].atom_p->i_conf_res) {
+                    if (relax_atoms[i_relax].atom_p->i_conf_res * relax_atoms[j_relax].atom_p->i_conf_res) {
+                        printf("\nError! different side chain.\n");
+                    }
+                }
+            }
+        }
+    }
+    
+    /* the lists are made, all_atoms is free for the next pair */
+    for (i_relax =0; i_relax<n_relax; i_relax++) {
+        ia = relax_atoms[i_relax].atom_p->i_atom_prot;
+        all_atoms[ia].i_relax = -1;
+    }
+    
+    pair->i_conf = i_conf;
+    pair->j_conf = j_conf;
+    pair->relax_atoms = relax_atoms;
+    pair->n_relax = n_relax;
+    pair->relaxed = 1;
+}
+
+static void relax_pair_run(RELAX_PAIR *pair, const PROT &prot) {
+    /* minimizes the working copy of a pair, it touches nothing else so pairs can run in parallel */
+    int i_relax, i_relax_step, done;
+    
+    relax_atoms = pair->relax_atoms;
+    n_relax = pair->n_relax;
+    pair->failed = 0;
+    pair->n_trial = 0;
+    
+    /* start relaxation */
+    DTSQ = 10.*env.hv_relax_dt*env.hv_relax_dt*0.4187e-6;
+    done = 0;
+    while (!done) {
+        pair->n_trial++;
+        i_relax_step = env.hv_relax_niter;
+        while (i_relax_step) {
+            float tors_scale = 1.+(env.hv_tors_scale - 1.)*(float)(i_relax_step-1)/(float)env.hv_relax_niter;
+            
+            get_frc(tors_scale, prot);
+            get_rp();
+            if (shake()) break;
+            
+            for (i_relax =0; i_relax<n_relax; i_relax++) {
+                relax_atoms[i_relax].r = relax_atoms[i_relax].r_p;
+            }
+            
+            int converged = 1;
+            for (i_relax =0; i_relax<n_relax; i_relax++) {
+                if (converged) {
+                    if (dvv(relax_atoms[i_relax].r, relax_atoms[i_relax].atom_p->xyz) > CONVERGED_R*env.hv_relax_dt*(env.hv_relax_niter-i_relax_step)) converged = 0;
+                }
+            }                                
+            if (converged) {
+                i_relax_step = 0;
+            }
+            else {
+                i_relax_step--;
+            }
+        }
+        if (i_relax_step) {
+            if (DTSQ < 1e-10) {
+                /* relaxation failed */
+                pair->failed = 1;
+                for (i_relax =0; i_relax<n_relax; i_relax++) {
+                    relax_atoms[i_relax].r = relax_atoms[i_relax].atom_p->xyz;
+                }
+                break;
+            }
+            DTSQ = DTSQ /2.;
+            for (i_relax =0; i_relax<n_relax; i_relax++) {
+                relax_atoms[i_relax].r = relax_atoms[i_relax].atom_p->xyz;
+            }
+        }
+        else
+            done = 1;
+    }
+}
+
+static void relax_pair_commit(RELAX_PAIR *pair, const PROT &prot) {
+    /* writes the relaxed coordinates of a pair back to prot and frees its working copy */
+    int i_res = pair->i_res, i_conf = pair->i_conf, j_res = pair->j_res, j_conf = pair->j_conf;
+    int i_relax;
+    
+    relax_atoms = pair->relax_atoms;
+    n_relax = pair->n_relax;
+    for (i_relax =0; i_relax<n_relax; i_relax++) {
+        relax_atoms[i_relax].atom_p->xyz = relax_atoms[i_relax].r;
+    }
+    
+    if (pair->pair_vdw > 100.) {
+        /* only reported */
+        float tors_i = torsion_conf(&prot.res[i_res].conf[i_conf]);
+        float tors_j = torsion_conf(&prot.res[j_res].conf[j_conf]);
+        pair->relaxed_pair_vdw    = vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 0)
+        +vdw_conf_fast(i_res, i_conf, i_res, i_conf, prot, 0)
+        +tors_i
+        +vdw_conf_fast(j_res, j_conf, j_res, j_conf, prot, 0)
+        +tors_j;
+        
+        pair->relaxed_pair_vdw_hv = vdw_conf_fast(i_res, i_conf, j_res, j_conf, prot, 1)
+        +vdw_conf_fast(i_res, i_conf, i_res, i_conf, prot, 1)
+        +tors_i
+        +vdw_conf_fast(j_res, j_conf, j_res, j_conf, prot, 1)
+        +tors_j;
+    }
+    
+    free_relax_atoms();
+    pair->relax_atoms = NULL;
+}
+
+static void relax_pair_tally(RELAX_PAIR *pair, RELAX_TALLY *tally) {
+    /* counts a relaxed pair in the cycle statistics, in the order the pairs were found */
+    FILE *progress_fp;
+    float pair_vdw = pair->pair_vdw, pair_vdw_hv = pair->pair_vdw_hv;
+    
+    if (pair->failed) {
+        tally->n_pair_failed++;
+        
+        tally->sum_pair_vdw_failed += pair_vdw;
+        tally->sum_pair_vdw_hv_failed += pair_vdw_hv;
+        
+        tally->sumsq_pair_vdw_failed += pair_vdw*pair_vdw;
+        tally->sumsq_pair_vdw_hv_failed += pair_vdw_hv*pair_vdw_hv;
+        
+        if (pair_vdw > tally->max_pair_vdw_failed) tally->max_pair_vdw_failed = pair_vdw;
+        if (pair_vdw_hv > tally->max_pair_vdw_hv_failed) tally->max_pair_vdw_hv_failed = pair_vdw_hv;
+    }
+    
+    /* success */
+    tally->n_pair_success++;
+    
+    tally->sum_pair_vdw_success += pair_vdw;
+    tally->sum_pair_vdw_hv_success += pair_vdw_hv;
+    
+    tally->sumsq_pair_vdw_success += pair_vdw*pair_vdw;
+    tally->sumsq_pair_vdw_hv_success += pair_vdw_hv*pair_vdw_hv;
+    
+    if (pair_vdw > tally->max_pair_vdw_success) tally->max_pair_vdw_success = pair_vdw;
+    if (pair_vdw_hv > tally->max_pair_vdw_hv_success) tally->max_pair_vdw_hv_success = pair_vdw_hv;
+    
+    if (pair_vdw > 100.) {
+        progress_fp = fopen(env.progress_log,"a");
+        fprintf(progress_fp,"   Relaxation: pair %s-%s before relaxation pair_vdw = %8.1f, pair_vdw_hv = %8.1f\n",pair->iconf_p->uniqID, pair->jconf_p->uniqID, pair_vdw, pair_vdw_hv);
+        fprintf(progress_fp,"   Relaxation: pair %s-%s after             pair_vdw = %8.1f, pair_vdw_hv = %8.1f\n",pair->iconf_p->uniqID, pair->jconf_p->uniqID, pair->relaxed_pair_vdw, pair->relaxed_pair_vdw_hv);
+        fclose(progress_fp);
+    }
+    
+    tally->n_relaxed++;
+    n_pair_converged++;
+    n_pair_trial += pair->n_trial;
+}
+
+static void setup_res_bonded(const PROT &prot) {
+    /* res_bonded[i_res] lists i_res and the residues its atoms have 1-2, 1-3 or 1-4 partners in,
+     * which is all a pair of i_res can read or move.
+     */
+    int ia, i_res, i_conf, i_atom, i_connect, k, k_res, n_connect;
+    ATOM **connect;
+    
+    res_bonded = (int **) malloc(prot.n_res*sizeof(int *));
+    n_res_bonded = (int *) malloc(prot.n_res*sizeof(int));
+    if (!res_bonded || !n_res_bonded) {
+        printf("   FATAL: memory error in setup_res_bonded()\n");
+        exit(-1);
+    }
+    for (i_res=0; i_res<prot.n_res; i_res++) {
+        res_bonded[i_res] = (int *) malloc(sizeof(int));
+        if (!res_bonded[i_res]) {
+            printf("   FATAL: memory error in setup_res_bonded()\n");
+            exit(-1);
+        }
+        res_bonded[i_res][0] = i_res;
+        n_res_bonded[i_res] = 1;
+    }
+    
+    for (ia=0; ia<na; ia++) {
+        i_res = all_atoms[ia].atom_p->i_res_prot;
+        i_conf = all_atoms[ia].atom_p->i_conf_res;
+        i_atom = all_atoms[ia].atom_p->i_atom_conf;
+        for (k=0; k<3; k++) {
+            if (k == 0) {
+                n_connect = prot.res[i_res].n_connect12[i_conf][i_atom];
+                connect = prot.res[i_res].connect12[i_conf][i_atom];
+            }
+            else if (k == 1) {
+                n_connect = prot.res[i_res].n_connect13[i_conf][i_atom];
+                connect = prot.res[i_res].connect13[i_conf][i_atom];
+            }
+            else {
+                n_connect = prot.res[i_res].n_connect14[i_conf][i_atom];
+                connect = prot.res[i_res].connect14[i_conf][i_atom];
+            }
+            for (i_connect=0; i_connect<n_connect; i_connect++) {
+                int i_bonded;
+                k_res = connect[i_connect]->i_res_prot;
+                for (i_bonded=0; i_bonded<n_res_bonded[i_res]; i_bonded++) {
+                    if (res_bonded[i_res][i_bonded] == k_res) break;
+                }
+                if (i_bonded < n_res_bonded[i_res]) continue;
+                
+                n_res_bonded[i_res]++;
+                res_bonded[i_res] = (int *) realloc(res_bonded[i_res], n_res_bonded[i_res]*sizeof(int));
+                if (!res_bonded[i_res]) {
+                    printf("   FATAL: memory error in setup_res_bonded()\n");
+                    exit(-1);
+                }
+                res_bonded[i_res][n_res_bonded[i_res]-1] = k_res;
+            }
+        }
+    }
+}
+
+static void free_res_bonded(const PROT &prot) {
+    int i_res;
+    
+    for (i_res=0; i_res<prot.n_res; i_res++) free(res_bonded[i_res]);
+    free(res_bonded);
+    free(n_res_bonded);
+    res_bonded = NULL;
+    n_res_bonded = NULL;
+}
+
+static int release_pair(int k_pair, const int *pair_start, const int *pair_res, const int *res_start,
+                        const int *res_queue, int *res_head, int *n_head, int *ready, int n_ready) {
+    /* takes a done pair off the queues of its residues, adds the pairs now heading all theirs to ready */
+    int i_res, k_res, j_pair;
+    
+    for (i_res=pair_start[k_pair]; i_res<pair_start[k_pair+1]; i_res++) {
+        k_res = pair_res[i_res];
+        if (++res_head[k_res] == res_start[k_res+1]) continue;
+        j_pair = res_queue[res_head[k_res]];
+        if (++n_head[j_pair] == pair_start[j_pair+1] - pair_start[j_pair]) ready[n_ready++] = j_pair;
+    }
+    return n_ready;
+}
+
+static void relax_pairs(RELAX_PAIR *pairs, int n_pairs, const PROT &prot) {
+    /* Relaxes the queued pairs as if one by one color by color, in pair order within a color.
+     * A pair reads and moves only the residues of res_bonded of i_res and j_res. The pairs are colored
+     * greedily in order, each taking the first color none of its residues has been given yet, and every
+     * residue queues its pairs in color order. A pair is taken when it heads the queues of all its residues,
+     * so the pairs of a round share no residue and see the coordinates every pair before them left.
+     * A round is screened and set up here, minimized in parallel on the working copies, and committed in
+     * order; a pair screened out lets the next ones on its residues in at once. The result does not depend
+     * on the number of threads.
+     */
+    int *pair_start, *pair_res, *res_start, *res_queue, *res_head, *res_mark;
+    int *color, *taken, *order, *color_start, *n_head, *ready, *run;
+    int **res_color, *n_res_color;
+    int n_color = 0, n_ready, n_run;
+    int k_pair, i_pair, i_res, i_list, i_bonded, k_res, c, pass;
+    
+    if (!n_pairs) return;
+    pair_start = (int *) calloc(n_pairs+1, sizeof(int));
+    res_start = (int *) calloc(prot.n_res+1, sizeof(int));
+    res_head = (int *) malloc(prot.n_res*sizeof(int));
+    res_mark = (int *) malloc(prot.n_res*sizeof(int));
+    res_color = (int **) calloc(prot.n_res, sizeof(int *));
+    n_res_color = (int *) calloc(prot.n_res, sizeof(int));
+    color = (int *) malloc(n_pairs*sizeof(int));
+    taken = (int *) malloc((n_pairs+1)*sizeof(int));
+    order = (int *) malloc(n_pairs*sizeof(int));
+    color_start = (int *) calloc(n_pairs+2, sizeof(int));
+    n_head = (int *) calloc(n_pairs, sizeof(int));
+    ready = (int *) malloc(n_pairs*sizeof(int));
+    run = (int *) malloc(n_pairs*sizeof(int));
+    if (!pair_start || !res_start || !res_head || !res_mark || !res_color || !n_res_color || !color
+        || !taken || !order || !color_start || !n_head || !ready || !run) {
+        printf("   FATAL: memory error in relax_pairs()\n");
+        exit(-1);
+    }
+    
+    /* the residues of each pair, once each; counted on the first pass and stored on the second */
+    pair_res = res_queue = NULL;
+    for (pass=0; pass<2; pass++) {
+        for (k_res=0; k_res<prot.n_res; k_res++) res_mark[k_res] = -1;
+        for (k_pair=0; k_pair<n_pairs; k_pair++) {
+            i_res = pass ? pair_start[k_pair] : 0;
+            for (i_list=0; i_list<2; i_list++) {
+                int j_res = i_list ? pairs[k_pair].j_res : pairs[k_pair].i_res;
+                for (i_bonded=0; i_bonded<n_res_bonded[j_res]; i_bonded++) {
+                    k_res = res_bonded[j_res][i_bonded];
+                    if (res_mark[k_res] == k_pair) continue;
+                    res_mark[k_res] = k_pair;
+                    if (pass) pair_res[i_res++] = k_res;
+                    else pair_start[k_pair+1]++;
+                }
+            }
+        }
+        if (!pass) {
+            for (k_pair=0; k_pair<n_pairs; k_pair++) pair_start[k_pair+1] += pair_start[k_pair];
+            pair_res = (int *) malloc((pair_start[n_pairs]+1)*sizeof(int));
+            res_queue = (int *) malloc((pair_start[n_pairs]+1)*sizeof(int));
+            if (!pair_res || !res_queue) {
+                printf("   FATAL: memory error in relax_pairs()\n");
+                exit(-1);
+            }
+        }
+    }
+    
+    /* res_color[k_res] keeps the colors given to the residue, a color is free for a pair if none of
+     * its residues has it, and so it is new to all of them
+     */
+    for (c=0; c<=n_pairs; c++) taken[c] = -1;
+    for (k_pair=0; k_pair<n_pairs; k_pair++) {
+        for (i_res=pair_start[k_pair]; i_res<pair_start[k_pair+1]; i_res++) {
+            k_res = pair_res[i_res];
+            for (c=0; c<n_res_color[k_res]; c++) taken[res_color[k_res][c]] = k_pair;
+        }
+        for (c=0; taken[c] == k_pair; c++);
+        color[k_pair] = c;
+        if (c+1 > n_color) n_color = c+1;
+        color_start[c+1]++;
+        
+        for (i_res=pair_start[k_pair]; i_res<pair_start[k_pair+1]; i_res++) {
+            k_res = pair_res[i_res];
+            n_res_color[k_res]++;
+            res_color[k_res] = (int *) realloc(res_color[k_res], n_res_color[k_res]*sizeof(int));
+            if (!res_color[k_res]) {
+                printf("   FATAL: memory error in relax_pairs()\n");
+                exit(-1);
+            }
+            res_color[k_res][n_res_color[k_res]-1] = c;
+        }
+    }
+    for (c=0; c<n_color; c++) color_start[c+1] += color_start[c];
+    for (c=0; c<n_color; c++) taken[c] = color_start[c];
+    for (k_pair=0; k_pair<n_pairs; k_pair++) order[taken[color[k_pair]]++] = k_pair;
+    
+    /* the pairs of each residue in color order, a pair is ready when it heads all its queues */
+    for (k_pair=0; k_pair<n_pairs; k_pair++) {
+        for (i_res=pair_start[k_pair]; i_res<pair_start[k_pair+1]; i_res++) res_start[pair_res[i_res]+1]++;
+    }
+    for (k_res=0; k_res<prot.n_res; k_res++) res_start[k_res+1] += res_start[k_res];
+    for (k_res=0; k_res<prot.n_res; k_res++) res_head[k_res] = res_start[k_res];
+    for (i_pair=0; i_pair<n_pairs; i_pair++) {
+        k_pair = order[i_pair];
+        for (i_res=pair_start[k_pair]; i_res<pair_start[k_pair+1]; i_res++) res_queue[res_head[pair_res[i_res]]++] = k_pair;
+    }
+    for (k_res=0; k_res<prot.n_res; k_res++) {
+        res_head[k_res] = res_start[k_res];
+        if (res_start[k_res] < res_start[k_res+1]) n_head[res_queue[res_start[k_res]]]++;
+    }
+    n_ready = 0;
+    for (i_pair=0; i_pair<n_pairs; i_pair++) {
+        k_pair = order[i_pair];
+        if (n_head[k_pair] == pair_start[k_pair+1] - pair_start[k_pair]) ready[n_ready++] = k_pair;
+    }
+    
+    /* ready[] holds the pairs of a round, a pair screened out lets the next ones in at once */
+    while (n_ready) {
+        n_run = 0;
+        for (i_pair=0; i_pair<n_ready; i_pair++) {
+            k_pair = ready[i_pair];
+            if (relax_pair_screen(&pairs[k_pair], prot)) {
+                relax_pair_setup(&pairs[k_pair], prot);
+                run[n_run++] = k_pair;
+            }
+            else {
+                n_ready = release_pair(k_pair, pair_start, pair_res, res_start, res_queue, res_head, n_head, ready, n_ready);
+            }
+        }
+        
+#pragma omp parallel for schedule(dynamic)
+        for (i_pair=0; i_pair<n_run; i_pair++) {
+            relax_pair_run(&pairs[run[i_pair]], prot);
+        }
+        
+        n_ready = 0;
+        for (i_pair=0; i_pair<n_run; i_pair++) {
+            relax_pair_commit(&pairs[run[i_pair]], prot);
+            n_ready = release_pair(run[i_pair], pair_start, pair_res, res_start, res_queue, res_head, n_head, ready, n_ready);
+        }
+    }
+    
+    for (k_res=0; k_res<prot.n_res; k_res++) free(res_color[k_res]);
+    free(res_color);
+    free(n_res_color);
+    free(pair_start);
+    free(pair_res);
+    free(res_start);
+    free(res_queue);
+    free(res_head);
+    free(res_mark);
+    free(color);
+    free(taken);
+    free(order);
+    free(color_start);
+    free(n_head);
+    free(ready);
+    free(run);
+}
+
+int initial_relaxation(const PROT &prot)
 {
     FILE *fp;
     int i_cycle, done;
@@ -1122,6 +1437,12 @@ int initial_relaxation(PROT prot)
         for (i_relax =0; i_relax<n_relax; i_relax++) {
             free(relax_atoms[i_relax].ngh);
             free(relax_atoms[i_relax].ngh14);
+            free_frc_list(&relax_atoms[i_relax].ngh_lj);
+            free_frc_list(&relax_atoms[i_relax].ngh_crg);
+            free_frc_list(&relax_atoms[i_relax].ngh14_lj);
+            free_frc_list(&relax_atoms[i_relax].ngh14_crg);
+            free(relax_atoms[i_relax].ngh_c6);
+            free(relax_atoms[i_relax].ngh_c12);
             free(relax_atoms[i_relax].constr_list);
             free(relax_atoms[i_relax].constr_dsq);
         }
@@ -1160,7 +1481,7 @@ int initial_relaxation(PROT prot)
     return 0;
 }
 
-void relaxation_setup(PROT prot)
+void relaxation_setup(const PROT &prot)
 {
     int i_res, i_conf, i_atom;
     int ia, ja, i_connect, i_const, n_connect12, n_connect13;
@@ -1408,81 +1729,78 @@ void relaxation_setup(PROT prot)
     }
 }
 
-void get_frc(float tors_scale, PROT prot) {
-    int i_relax, i_ngh;
+void get_frc(float tors_scale, const PROT &prot) {
+    int i_relax, i_ngh, n_max;
     int i_rotate;
-    float C6,C12, dsq, phi;
+    float dsq, phi;
     VECTOR atom0_r, atom1_r, atom2_r, atom3_r, k, torq, r, r_p;
+    double *x, *y, *z, *fx, *fy, *fz;
     
     for (i_relax=0;i_relax<n_relax;i_relax++) {
         relax_atoms[i_relax].lj_frc = zero;
         relax_atoms[i_relax].elec_frc = zero;
         relax_atoms[i_relax].torsion_frc = zero;
     }
+    update_ngh_lj();
+    
+    /* packed coordinates for the kernels, and room for the forces of the longest list */
+    n_max = 0;
+    for (i_relax=0;i_relax<n_relax;i_relax++) {
+        if (!relax_atoms[i_relax].movable) continue;
+        if (relax_atoms[i_relax].ngh_lj.n > n_max) n_max = relax_atoms[i_relax].ngh_lj.n;
+        if (relax_atoms[i_relax].ngh_crg.n > n_max) n_max = relax_atoms[i_relax].ngh_crg.n;
+        if (relax_atoms[i_relax].ngh14_lj.n > n_max) n_max = relax_atoms[i_relax].ngh14_lj.n;
+    }
+    if (3*n_relax + 3*n_max + 1 > n_frc_buf) {
+        n_frc_buf = 3*n_relax + 3*n_max + 1;
+        frc_buf = (double *) realloc(frc_buf, n_frc_buf*sizeof(double));
+        if (!frc_buf) {
+            printf("   FATAL: memory error in get_frc()\n");
+            exit(-1);
+        }
+    }
+    x = frc_buf;
+    y = x + n_relax; z = y + n_relax;
+    fx = z + n_relax; fy = fx + n_max; fz = fy + n_max;
+    for (i_relax=0;i_relax<n_relax;i_relax++) {
+        x[i_relax] = relax_atoms[i_relax].r.x;
+        y[i_relax] = relax_atoms[i_relax].r.y;
+        z[i_relax] = relax_atoms[i_relax].r.z;
+    }
     
     for (i_relax=0;i_relax<n_relax;i_relax++) {
         if (relax_atoms[i_relax].movable) {
+            RELAX *atom_i = &relax_atoms[i_relax];
             
-            /* LJ interactions */
-            //printf("%s\n",relax_atoms[i_relax].atom_p->name);
-            for (i_ngh=0; i_ngh<relax_atoms[i_relax].n_ngh; i_ngh++) {
-                float sig_min = relax_atoms[i_relax].atom_p->vdw_rad + relax_atoms[i_relax].ngh[i_ngh]->atom_p->vdw_rad;
-                float eps = sqrt(relax_atoms[i_relax].atom_p->vdw_eps*relax_atoms[i_relax].ngh[i_ngh]->atom_p->vdw_eps);
-                C12 = eps*pow(sig_min,12);
-                C6 = 2.*eps*pow(sig_min,6);
-                //printf("%11.6f, %11.6f, %11.6f, %11.6f\n",eps,sig_min,C12,C6);
-                
-                relax_atoms[i_relax].lj_frc = vector_vplusv(relax_atoms[i_relax].lj_frc,
-                    vdw_frc(relax_atoms[i_relax].r, relax_atoms[i_relax].ngh[i_ngh]->r, C6, C12));
-                //VECTOR frc = vdw_frc(relax_atoms[i_relax].r, relax_atoms[i_relax].ngh[i_ngh]->r, C6, C12);
-                //printf("   %s %11.6f%11.6f%11.6f\n",relax_atoms[i_relax].ngh[i_ngh]->atom_p->name, frc.x, frc.y, frc.z);
-                /* scaling using the parameter for later monte carlo */
-                //relax_atoms[i_relax].lj_frc = vector_rescale(relax_atoms[i_relax].lj_frc, env.scale_vdw);
-                /*
-                if (!strcmp(relax_atoms[i_relax].atom_p->name, "2HG ")) {
-                    printf("%2d, %s, %11.6f, %11.6f, %11.6f\n",i_ngh,relax_atoms[i_relax].ngh[i_ngh]->atom_p->name,relax_atoms[i_relax].lj_frc.x,relax_atoms[i_relax].lj_frc.y,relax_atoms[i_relax].lj_frc.z);
-                }
-                */
+            /* LJ interactions, the forces are added up in list order */
+            /* pairs off the Verlet list are beyond VDW_CUTOFF_FAR, where vdw_frc() is zero */
+            lj_frc_packed(atom_i->r, &atom_i->ngh_lj, x, y, z, fx, fy, fz);
+            for (i_ngh=0; i_ngh<atom_i->ngh_lj.n; i_ngh++) {
+                atom_i->lj_frc.x += fx[i_ngh];
+                atom_i->lj_frc.y += fy[i_ngh];
+                atom_i->lj_frc.z += fz[i_ngh];
             }
-            for (i_ngh=0; i_ngh<relax_atoms[i_relax].n_ngh14; i_ngh++) {
-                float sig_min = relax_atoms[i_relax].atom_p->vdw_rad + relax_atoms[i_relax].ngh14[i_ngh]->atom_p->vdw_rad;
-                float eps = sqrt(relax_atoms[i_relax].atom_p->vdw_eps*relax_atoms[i_relax].ngh14[i_ngh]->atom_p->vdw_eps);
-                C12 = eps*pow(sig_min,12);
-                C6 = 2.*eps*pow(sig_min,6);
-                
-                //C6 = C6_matrix[relax_atoms[i_relax].atom_p->i_elem][relax_atoms[i_relax].ngh14[i_ngh]->atom_p->i_elem];
-                //C12 = C12_matrix[relax_atoms[i_relax].atom_p->i_elem][relax_atoms[i_relax].ngh14[i_ngh]->atom_p->i_elem];
-                relax_atoms[i_relax].lj_frc = vector_vplusv(relax_atoms[i_relax].lj_frc,
-                    vector_rescale(vdw_frc(relax_atoms[i_relax].r, relax_atoms[i_relax].ngh14[i_ngh]->r, C6, C12), env.factor_14lj));
-                /* scaling using the parameter for later monte carlo */
-                //relax_atoms[i_relax].lj_frc = vector_rescale(relax_atoms[i_relax].lj_frc, env.scale_vdw);
-                /*
-                if (!strcmp(relax_atoms[i_relax].atom_p->name, "2HG ")) {
-                    printf("%2d, %s, %11.6f, %11.6f, %11.6f\n",i_ngh,relax_atoms[i_relax].ngh14[i_ngh]->atom_p->name,relax_atoms[i_relax].lj_frc.x,relax_atoms[i_relax].lj_frc.y,relax_atoms[i_relax].lj_frc.z);
-                }
-                */
+            lj_frc_packed(atom_i->r, &atom_i->ngh14_lj, x, y, z, fx, fy, fz);
+            for (i_ngh=0; i_ngh<atom_i->ngh14_lj.n; i_ngh++) {
+                atom_i->lj_frc.x += fx[i_ngh] * env.factor_14lj;
+                atom_i->lj_frc.y += fy[i_ngh] * env.factor_14lj;
+                atom_i->lj_frc.z += fz[i_ngh] * env.factor_14lj;
             }
             /* scaling using the parameter for later monte carlo */
             relax_atoms[i_relax].lj_frc = vector_rescale(relax_atoms[i_relax].lj_frc, env.scale_vdw);
             
-            /* Electrostatic interactions */
-            if (relax_atoms[i_relax].atom_p->crg > 1e-6 || relax_atoms[i_relax].atom_p->crg < -1e-6) {
-                for (i_ngh=0; i_ngh<relax_atoms[i_relax].n_ngh; i_ngh++) {
-                    if (fabs(relax_atoms[i_relax].ngh[i_ngh]->atom_p->crg) < 1e-6) continue;
-                    relax_atoms[i_relax].elec_frc = vector_vplusv(relax_atoms[i_relax].elec_frc,
-                        coulomb_frc(relax_atoms[i_relax].r,
-                            relax_atoms[i_relax].ngh[i_ngh]->r,
-                            relax_atoms[i_relax].atom_p->crg,
-                            relax_atoms[i_relax].ngh[i_ngh]->atom_p->crg));
-                }
-                for (i_ngh=0; i_ngh<relax_atoms[i_relax].n_ngh14; i_ngh++) {
-                    if (fabs(relax_atoms[i_relax].ngh14[i_ngh]->atom_p->crg) < 1e-6) continue;
-                    relax_atoms[i_relax].elec_frc = vector_vplusv(relax_atoms[i_relax].elec_frc,
-                        coulomb_frc(relax_atoms[i_relax].r,
-                            relax_atoms[i_relax].ngh14[i_ngh]->r,
-                            relax_atoms[i_relax].atom_p->crg,
-                            relax_atoms[i_relax].ngh14[i_ngh]->atom_p->crg));
-                }
+            /* Electrostatic interactions, the lists are empty if this atom has no charge */
+            crg_frc_packed(atom_i->r, &atom_i->ngh_crg, x, y, z, fx, fy, fz);
+            for (i_ngh=0; i_ngh<atom_i->ngh_crg.n; i_ngh++) {
+                atom_i->elec_frc.x += fx[i_ngh];
+                atom_i->elec_frc.y += fy[i_ngh];
+                atom_i->elec_frc.z += fz[i_ngh];
+            }
+            crg_frc_packed(atom_i->r, &atom_i->ngh14_crg, x, y, z, fx, fy, fz);
+            for (i_ngh=0; i_ngh<atom_i->ngh14_crg.n; i_ngh++) {
+                atom_i->elec_frc.x += fx[i_ngh];
+                atom_i->elec_frc.y += fy[i_ngh];
+                atom_i->elec_frc.z += fz[i_ngh];
             }
             
             /* Extra constraint from its original position */
@@ -1555,6 +1873,58 @@ void get_frc(float tors_scale, PROT prot) {
     }
 }
 
+static void lj_frc_packed(VECTOR r, FRC_LIST *list, double *x, double *y, double *z, double *fx, double *fy, double *fz) {
+    /* vdw_frc() of an atom at r with every atom of an LJ list, in the same arithmetic.
+     * There are no branches and no calls in the loop so it vectorizes (SSE2, or AVX with -mavx);
+     * each force is stored apart and the caller adds them in order, so the result is the same
+     * with or without vectorization.
+     */
+    int k, n = list->n;
+    const int *idx = list->idx;
+    const float *c6 = list->c6, *c12 = list->c12;
+    const float near2 = VDW_CUTOFF_NEAR*VDW_CUTOFF_NEAR, far2 = VDW_CUTOFF_FAR*VDW_CUTOFF_FAR;
+    
+#pragma omp simd
+    for (k=0; k<n; k++) {
+        double dx = x[idx[k]] - r.x;
+        double dy = y[idx[k]] - r.y;
+        double dz = z[idx[k]] - r.z;
+        float d2 = dx*dx+dy*dy+dz*dz;
+        float in = d2 > far2 ? 0.f : 1.f;
+        if (d2 < near2) d2 = near2;
+        float d4 = d2*d2;
+        float d8 = d4*d4;
+        float d14 = d8*d4*d2;
+        float a = in * (float) (-12.*c12[k]/d14);
+        float b = in * (float) (6.*c6[k]/d8);
+        fx[k] = dx*a + dx*b;
+        fy[k] = dy*a + dy*b;
+        fz[k] = dz*a + dz*b;
+    }
+}
+
+static void crg_frc_packed(VECTOR r, FRC_LIST *list, double *x, double *y, double *z, double *fx, double *fy, double *fz) {
+    /* coulomb_frc() of an atom at r with every atom of a charge list, see lj_frc_packed() */
+    int k, n = list->n;
+    const int *idx = list->idx;
+    const double *q = list->q;
+    const float near2 = CUTOFF_NEAR*CUTOFF_NEAR, epsilon = env.epsilon_coulomb;
+    
+#pragma omp simd
+    for (k=0; k<n; k++) {
+        double dx = x[idx[k]] - r.x;
+        double dy = y[idx[k]] - r.y;
+        double dz = z[idx[k]] - r.z;
+        float d2 = dx*dx+dy*dy+dz*dz;
+        if (d2 < near2) d2 = near2;
+        float d = sqrtf(d2);
+        float a = q[k]/(epsilon * d * d2);
+        fx[k] = dx*a;
+        fy[k] = dy*a;
+        fz[k] = dz*a;
+    }
+}
+
 /*
 DT is in pico sec;
 mass in a.u; (all atoms are asumed to be 1 a.u. in this relaxation function)
@@ -1777,7 +2147,7 @@ int in_relax_list(int ia) {
     return 0;
 }
 
-void setup_nghlst(PROT prot) {
+void setup_nghlst(const PROT &prot) {
     int i_relax, j_relax, ia, ja, i_constr, i_connect, i_ngh;
     int i_res, i_conf, i_atom, n_connect14;
     //float cutoff_far2  = VDW_CUTOFF_FAR  * VDW_CUTOFF_FAR;
@@ -1788,6 +2158,13 @@ void setup_nghlst(PROT prot) {
         relax_atoms[i_relax].ngh = NULL;
         relax_atoms[i_relax].n_ngh14 = 0;
         relax_atoms[i_relax].ngh14 = NULL;
+        memset(&relax_atoms[i_relax].ngh_lj, 0, sizeof(FRC_LIST));
+        memset(&relax_atoms[i_relax].ngh_crg, 0, sizeof(FRC_LIST));
+        memset(&relax_atoms[i_relax].ngh14_lj, 0, sizeof(FRC_LIST));
+        memset(&relax_atoms[i_relax].ngh14_crg, 0, sizeof(FRC_LIST));
+        relax_atoms[i_relax].ngh_c6 = NULL;
+        relax_atoms[i_relax].ngh_c12 = NULL;
+        relax_atoms[i_relax].packed = 0;
         relax_atoms[i_relax].n_constr = 0;
         relax_atoms[i_relax].constr_list = NULL;
         relax_atoms[i_relax].constr_dsq = NULL;
@@ -1889,8 +2266,147 @@ void setup_nghlst(PROT prot) {
     }
 }
 
+static void update_ngh_lj() {
+    /* Keeps the Verlet lists of the movable atoms: ngh_lj holds the members of ngh within
+     * VDW_CUTOFF_FAR + skin. They are remade when an atom moved more than half the skin since,
+     * so no pair left out can come within VDW_CUTOFF_FAR. With no skin ngh_lj is all of ngh.
+     * The LJ coefficients, ngh_crg and the ngh14 lists are made with the first list.
+     */
+    int i_relax, j_relax, i_ngh, rebuild = 0;
+    float skin = env.hv_relax_verlet_skin;
+    float half_skin2 = 0.25*skin*skin;
+    float list2 = (VDW_CUTOFF_FAR + skin)*(VDW_CUTOFF_FAR + skin);
+    RELAX *atom_i, *atom_j;
+    
+    for (i_relax=0; i_relax<n_relax; i_relax++) {
+        atom_i = &relax_atoms[i_relax];
+        if (!atom_i->movable || atom_i->packed) continue;
+        atom_i->packed = 1;
+        rebuild = 1;
+        
+        alloc_frc_list(&atom_i->ngh_lj, atom_i->n_ngh, 1);
+        alloc_frc_list(&atom_i->ngh14_lj, atom_i->n_ngh14, 1);
+        if (atom_i->n_ngh) {
+            atom_i->ngh_c6  = (float *) malloc(atom_i->n_ngh*sizeof(float));
+            atom_i->ngh_c12 = (float *) malloc(atom_i->n_ngh*sizeof(float));
+            if (!atom_i->ngh_c6 || !atom_i->ngh_c12) {
+                printf("   FATAL: memory error in update_ngh_lj()\n");
+                exit(-1);
+            }
+        }
+        for (i_ngh=0; i_ngh<atom_i->n_ngh; i_ngh++) {
+            lj_coef(atom_i, atom_i->ngh[i_ngh], &atom_i->ngh_c6[i_ngh], &atom_i->ngh_c12[i_ngh]);
+        }
+        for (i_ngh=0; i_ngh<atom_i->n_ngh14; i_ngh++) {
+            atom_j = atom_i->ngh14[i_ngh];
+            atom_i->ngh14_lj.idx[i_ngh] = atom_j - relax_atoms;
+            lj_coef(atom_i, atom_j, &atom_i->ngh14_lj.c6[i_ngh], &atom_i->ngh14_lj.c12[i_ngh]);
+        }
+        atom_i->ngh14_lj.n = atom_i->n_ngh14;
+        
+        if (fabs(atom_i->atom_p->crg) > 1e-6) {
+            alloc_frc_list(&atom_i->ngh_crg, atom_i->n_ngh, 0);
+            alloc_frc_list(&atom_i->ngh14_crg, atom_i->n_ngh14, 0);
+            for (i_ngh=0; i_ngh<atom_i->n_ngh; i_ngh++) {
+                atom_j = atom_i->ngh[i_ngh];
+                if (fabs(atom_j->atom_p->crg) < 1e-6) continue;
+                atom_i->ngh_crg.idx[atom_i->ngh_crg.n] = atom_j - relax_atoms;
+                atom_i->ngh_crg.q[atom_i->ngh_crg.n] = -331.5*atom_i->atom_p->crg*atom_j->atom_p->crg;
+                atom_i->ngh_crg.n++;
+            }
+            for (i_ngh=0; i_ngh<atom_i->n_ngh14; i_ngh++) {
+                atom_j = atom_i->ngh14[i_ngh];
+                if (fabs(atom_j->atom_p->crg) < 1e-6) continue;
+                atom_i->ngh14_crg.idx[atom_i->ngh14_crg.n] = atom_j - relax_atoms;
+                atom_i->ngh14_crg.q[atom_i->ngh14_crg.n] = -331.5*atom_i->atom_p->crg*atom_j->atom_p->crg;
+                atom_i->ngh14_crg.n++;
+            }
+        }
+    }
+    if (!rebuild) {
+        if (skin <= 0.) return;
+        for (i_relax=0; i_relax<n_relax; i_relax++) {
+            if (ddvv(relax_atoms[i_relax].r, relax_atoms[i_relax].r_lj) > half_skin2) {
+                rebuild = 1;
+                break;
+            }
+        }
+        if (!rebuild) return;
+    }
+    
+    for (i_relax=0; i_relax<n_relax; i_relax++) {
+        relax_atoms[i_relax].r_lj = relax_atoms[i_relax].r;
+    }
+    for (i_relax=0; i_relax<n_relax; i_relax++) {
+        atom_i = &relax_atoms[i_relax];
+        if (!atom_i->movable) continue;
+        atom_i->ngh_lj.n = 0;
+        for (i_ngh=0; i_ngh<atom_i->n_ngh; i_ngh++) {
+            j_relax = atom_i->ngh[i_ngh] - relax_atoms;
+            if (skin > 0. && ddvv(atom_i->r, relax_atoms[j_relax].r) > list2) continue;
+            atom_i->ngh_lj.idx[atom_i->ngh_lj.n] = j_relax;
+            atom_i->ngh_lj.c6[atom_i->ngh_lj.n]  = atom_i->ngh_c6[i_ngh];
+            atom_i->ngh_lj.c12[atom_i->ngh_lj.n] = atom_i->ngh_c12[i_ngh];
+            atom_i->ngh_lj.n++;
+        }
+    }
+}
+
+static void lj_coef(RELAX *atom1, RELAX *atom2, float *C6, float *C12) {
+    /* C6 and C12 of a pair as vdw_frc() takes them, made once per pair instead of every step */
+    float sig_min = atom1->atom_p->vdw_rad + atom2->atom_p->vdw_rad;
+    float eps = sqrt(atom1->atom_p->vdw_eps*atom2->atom_p->vdw_eps);
+    *C12 = eps*pow(sig_min,12);
+    *C6 = 2.*eps*pow(sig_min,6);
+}
+
+static void alloc_frc_list(FRC_LIST *list, int n_max, int lj) {
+    list->n = 0;
+    if (!n_max) return;
+    list->idx = (int *) malloc(n_max*sizeof(int));
+    if (lj) {
+        list->c6  = (float *) malloc(n_max*sizeof(float));
+        list->c12 = (float *) malloc(n_max*sizeof(float));
+    }
+    else {
+        list->q = (double *) malloc(n_max*sizeof(double));
+    }
+    if (!list->idx || (lj && (!list->c6 || !list->c12)) || (!lj && !list->q)) {
+        printf("   FATAL: memory error in alloc_frc_list()\n");
+        exit(-1);
+    }
+}
+
+static void free_frc_list(FRC_LIST *list) {
+    free(list->idx);
+    free(list->c6);
+    free(list->c12);
+    free(list->q);
+    memset(list, 0, sizeof(FRC_LIST));
+}
+
+static void free_relax_atoms() {
+    int i_relax;
+    
+    for (i_relax =0; i_relax<n_relax; i_relax++) {
+        free(relax_atoms[i_relax].ngh);
+        free(relax_atoms[i_relax].ngh14);
+        free_frc_list(&relax_atoms[i_relax].ngh_lj);
+        free_frc_list(&relax_atoms[i_relax].ngh_crg);
+        free_frc_list(&relax_atoms[i_relax].ngh14_lj);
+        free_frc_list(&relax_atoms[i_relax].ngh14_crg);
+        free(relax_atoms[i_relax].ngh_c6);
+        free(relax_atoms[i_relax].ngh_c12);
+        free(relax_atoms[i_relax].constr_list);
+        free(relax_atoms[i_relax].constr_dsq);
+        free(relax_atoms[i_relax].rotate1_lst);
+        free(relax_atoms[i_relax].rotate2_lst);
+    }
+    free(relax_atoms);
+}
+
 #define N_TRIAL_MAX     10
-int pick_sidechain(int i_res, PROT prot) {
+int pick_sidechain(int i_res, const PROT &prot) {
     int i_conf, j_relax_res, j_res, j_conf, i_conf_min;
     int clash = 1, n_trial = 0;
     float pair_vdw_hv, e, e_min;
@@ -1940,7 +2456,7 @@ int pick_sidechain(int i_res, PROT prot) {
     return i_conf;
 }
 
-void collect_ngh(int i_res, PROT prot) {
+void collect_ngh(int i_res, const PROT &prot) {
     int i_ngh, k_res, k_conf;
     /* collect ngh list of i_res */
     for (i_ngh=0;i_ngh<prot.res[i_res].n_ngh;i_ngh++) {
@@ -1970,7 +2486,7 @@ int res_in_relax(int i_res) {
     else return 0;
 }
 
-int closer_than(int i_res, int i_conf, int j_res, int j_conf, PROT prot, float crg_thr, float dist_thr)
+int closer_than(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot, float crg_thr, float dist_thr)
 {
     float d2 = dist_thr*dist_thr;
     int i_atom, j_atom;
@@ -1991,7 +2507,7 @@ int closer_than(int i_res, int i_conf, int j_res, int j_conf, PROT prot, float c
     return 0; /* can't find two charged atoms within dist_thr */
 }
 
-int write_relax_pdb(char *relax_pdb_filename, PROT prot) {
+int write_relax_pdb(char *relax_pdb_filename, const PROT &prot) {
     int i_relax;
     if (relax_pdb_filename) {
         FILE *relax_fp = fopen(relax_pdb_filename,"w");
@@ -16,6 +16,133 @@
 #include <math.h>
 
 
+/* Atoms of the conformers made by ins_conf() are carved out of blocks owned by the residue. A
+ * block never moves, so ATOM pointers stay valid like they did with one malloc per conformer.
+ * Arrays given back by del_conf() are kept on a free list by size and handed out again.
+ */
+#define ATOM_BLOCK_MIN  64      /* atoms in the first block of a residue */
+
+typedef struct ATOM_BLOCK {
+	struct ATOM_BLOCK *next;    /* older block */
+	int    max_atom;
+	int    n_atom;
+	ATOM   *atom;
+} ATOM_BLOCK;
+
+typedef struct {
+	int    n_atom;
+	ATOM   *head;               /* next array is kept in the first slot of each free array */
+} ATOM_FREE;
+
+struct ATOM_ARENA {
+	ATOM_BLOCK *block;
+	int    n_free;
+	ATOM_FREE *free;
+};
+
+static ATOM *arena_alloc(RES *res, int n_atom)
+{
+	ATOM_ARENA *arena;
+	ATOM_BLOCK *block;
+	ATOM *atom;
+	int i, max_atom;
+
+	if (!res->arena) {
+		if (!(res->arena = (ATOM_ARENA *) calloc(1, sizeof(ATOM_ARENA)))) return NULL;
+	}
+	arena = res->arena;
+
+	for (i=0; i<arena->n_free; i++) {
+		if (arena->free[i].n_atom == n_atom && arena->free[i].head) {
+			atom = arena->free[i].head;
+			memcpy(&arena->free[i].head, atom, sizeof(ATOM *));
+			return atom;
+		}
+	}
+
+	block = arena->block;
+	if (!block || block->max_atom - block->n_atom < n_atom) {
+		max_atom = block? 2*block->max_atom : ATOM_BLOCK_MIN;
+		if (max_atom < n_atom) max_atom = n_atom;
+		if (!(block = (ATOM_BLOCK *) malloc(sizeof(ATOM_BLOCK)))) return NULL;
+		if (!(block->atom = (ATOM *) malloc(max_atom*sizeof(ATOM)))) {
+			free(block);
+			return NULL;
+		}
+		block->max_atom = max_atom;
+		block->n_atom = 0;
+		block->next = arena->block;
+		arena->block = block;
+	}
+	atom = block->atom + block->n_atom;
+	block->n_atom += n_atom;
+	return atom;
+}
+
+static int arena_owns(ATOM_ARENA *arena, ATOM *atom)
+{
+	ATOM_BLOCK *block;
+
+	if (!arena) return 0;
+	for (block=arena->block; block; block=block->next) {
+		if (atom >= block->atom && atom < block->atom + block->max_atom) return 1;
+	}
+	return 0;
+}
+
+static void free_conf_atom(RES *res, CONF *conf)
+{
+	ATOM_ARENA *arena = res->arena;
+	int i;
+
+	if (!conf->atom) return;
+	if (!arena_owns(arena, conf->atom)) {
+		free(conf->atom);       /* grown atom by atom, e.g. by load_pdb() */
+		return;
+	}
+	if (!conf->n_atom) return;
+
+	for (i=0; i<arena->n_free; i++) {
+		if (arena->free[i].n_atom == conf->n_atom) break;
+	}
+	if (i == arena->n_free) {
+		ATOM_FREE *free_new = (ATOM_FREE *) realloc(arena->free, (arena->n_free+1)*sizeof(ATOM_FREE));
+		if (!free_new) return;  /* the array just stays unused until the residue is freed */
+		arena->free = free_new;
+		arena->free[i].n_atom = conf->n_atom;
+		arena->free[i].head = NULL;
+		arena->n_free++;
+	}
+	memcpy(conf->atom, &arena->free[i].head, sizeof(ATOM *));
+	arena->free[i].head = conf->atom;
+}
+
+static void free_res_conf(RES *res)
+{
+	/* all conformers and atoms of a residue */
+	ATOM_BLOCK *block, *next;
+	int i;
+
+	for (i=0; i<res->n_conf; i++) {
+		if (res->conf[i].atom && !arena_owns(res->arena, res->conf[i].atom)) free(res->conf[i].atom);
+	}
+	free(res->conf);
+	if (res->arena) {
+		for (block=res->arena->block; block; block=next) {
+			next = block->next;
+			free(block->atom);
+			free(block);
+		}
+		free(res->arena->free);
+		free(res->arena);
+	}
+	res->n_conf = 0;
+	res->max_conf = 0;
+	res->conf = NULL;
+	res->arena = NULL;
+}
+
+
 PROT new_prot()
 {
 	PROT prot;
@@ -58,8 +185,11 @@ int cpy_res(RES *tgt, RES *src)
 	memcpy(tgt, src, sizeof(RES));
 
 	/* prepare the lower level array */
-	tgt->n_conf = 0;
-	tgt->conf   = NULL;
+	tgt->n_conf   = 0;
+	tgt->max_conf = 0;
+	tgt->conf     = NULL;
+	tgt->arena    = NULL;
+	tgt->connect_sig = 0;
 	if (src->n_conf) {
 		for (i_conf = 0; i_conf<src->n_conf; i_conf++) {
 			ins_conf(tgt, i_conf, src->conf[i_conf].n_atom);
@@ -71,7 +201,7 @@ int cpy_res(RES *tgt, RES *src)
 }
 
 
-int cpy_prot(PROT *tgt, PROT *src)
+int cpy_prot(PROT *tgt, const PROT *src)
 {
 	int i;
 
@@ -81,6 +211,7 @@ int cpy_prot(PROT *tgt, PROT *src)
 	memcpy(tgt, src, sizeof(PROT));
 
 	/* copy the lower level array */
+	tgt->max_res = src->n_res;
 	if (src->n_res) {
 		tgt->res = (RES *) malloc(src->n_res * sizeof(RES));
 		for (i = 0; i<src->n_res; i++) cpy_res(&tgt->res[i], &src->res[i]);
@@ -97,17 +228,18 @@ int del_conf(RES *res_p, int pos)
 		return USERERR;
 	}
 
-	/* free all the lower level data under this conformer */
-	if (res_p->conf[pos].atom) {
-		free(res_p->conf[pos].atom);
+	/* the last conformer takes the atom storage with it */
+	if (res_p->n_conf == 1) {
+		free_res_conf(res_p);
+		return pos;
 	}
 
-	/* move contents after position "pos" backward by 1 unit */
-	memmove(res_p->conf+pos, res_p->conf+pos+1, (res_p->n_conf - pos - 1) * sizeof(CONF));
+	/* free all the lower level data under this conformer */
+	free_conf_atom(res_p, &res_p->conf[pos]);
 
-	/* update number of conformers, shrink the memory */
+	/* move contents after position "pos" backward by 1 unit, the slot is kept for the next ins_conf() */
+	memmove(res_p->conf+pos, res_p->conf+pos+1, (res_p->n_conf - pos - 1) * sizeof(CONF));
 	res_p->n_conf--;
-	res_p->conf = (CONF *) realloc(res_p->conf, res_p->n_conf * sizeof(CONF));
 
 	return pos;
 }
@@ -115,27 +247,22 @@ int del_conf(RES *res_p, int pos)
 
 int del_res(PROT *prot, int pos)
 {
-	int i;
-
 	if (pos >= prot->n_res) {
 		printf("del_res(): off range deletion.\n");
 		return USERERR;
 	}
 
 	/* free all the lower level data under this group */
-
-	if (prot->res[pos].n_conf) {
-		for (i = 0; i < prot->res[pos].n_conf; i++)
-			if (prot->res[pos].conf[i].n_atom) free(prot->res[pos].conf[i].atom);
-		free(prot->res[pos].conf);
-	}
+	free_res_conf(&prot->res[pos]);
 
 	/* move contents after position "pos" backward by 1 unit */
 	memmove(prot->res+pos, prot->res+pos+1, (prot->n_res - pos - 1) * sizeof(RES));
-
-	/* shrink the memory, update number of atoms */
 	prot->n_res--;
-	prot->res = (RES *) realloc(prot->res, prot->n_res * sizeof(RES));
+	if (!prot->n_res) {
+		free(prot->res);
+		prot->res = NULL;
+		prot->max_res = 0;
+	}
 
 	return pos;
 }
@@ -143,18 +270,11 @@ int del_res(PROT *prot, int pos)
 
 int del_prot(PROT *prot)
 {
-	int i, j;
+	int i;
 
 	/* free all the lower level data under this prot */
 	if (prot->n_res) {
-		for (i=0; i<prot->n_res; i++) {
-			if (prot->res[i].n_conf) {
-				for (j=0; j<prot->res[i].n_conf; j++) {
-					if (prot->res[i].conf[j].n_atom>0) free(prot->res[i].conf[j].atom);/* free atoms */
-				}
-				free(prot->res[i].conf);	/* free conformers */
-			}
-		}
+		for (i=0; i<prot->n_res; i++) free_res_conf(&prot->res[i]);	/* free conformers and atoms */
 		free(prot->res);			/* free residues */
 	}
 
@@ -172,11 +292,17 @@ int ins_conf(RES *res, int ins, int n_atom)
 		return USERERR;
 	}
 
-	/*--- increase the conformer list size by 1 */
-	if (!(res->conf = (CONF *) realloc(res->conf, (res->n_conf + 1) * sizeof(CONF))))
-	{
-		printf("ins_conf(): Fails resizing memory\n");
-		return USERERR;
+	/*--- make room for one more conformer, the list doubles when it is full */
+	if (res->n_conf == res->max_conf) {
+		int max_conf = res->max_conf? 2*res->max_conf : 4;
+		CONF *conf = (CONF *) realloc(res->conf, max_conf * sizeof(CONF));
+		if (!conf)
+		{
+			printf("ins_conf(): Fails resizing memory\n");
+			return USERERR;
+		}
+		res->conf = conf;
+		res->max_conf = max_conf;
 	}
 	res->n_conf++;
 
@@ -187,7 +313,7 @@ int ins_conf(RES *res, int ins, int n_atom)
 	memset(&res->conf[ins], 0, sizeof(CONF));
 	res->conf[ins].n_atom = n_atom;
 	if (n_atom) {
-		if (!(res->conf[ins].atom = (ATOM *) malloc(n_atom*sizeof(ATOM))))
+		if (!(res->conf[ins].atom = arena_alloc(res, n_atom)))
 		{
 			printf("ins_conf(): Fails allocating memory for atoms.\n");
 			return USERERR;
@@ -206,10 +332,16 @@ int ins_res(PROT *prot, int ins)
 		return USERERR;
 	}
 
-	/*--- increase the residue list size by 1 */
-	if (!(prot->res = (RES *) realloc(prot->res, (prot->n_res + 1) * sizeof(RES)))) {
-		printf("ins_res(): Fails resizing memory.\n");
-		return USERERR;
+	/*--- make room for one more residue, the list doubles when it is full */
+	if (prot->n_res == prot->max_res) {
+		int max_res = prot->max_res? 2*prot->max_res : 64;
+		RES *res = (RES *) realloc(prot->res, max_res * sizeof(RES));
+		if (!res) {
+			printf("ins_res(): Fails resizing memory.\n");
+			return USERERR;
+		}
+		prot->res = res;
+		prot->max_res = max_res;
 	}
 	prot->n_res++;
 
@@ -223,7 +355,7 @@ int ins_res(PROT *prot, int ins)
 }
 
 
-int sort_conf(PROT prot)
+int sort_conf(const PROT &prot)
 {
 	int i_res;
     int i_conf;
@@ -286,7 +418,7 @@ int cmp_Eself(CONF *A, CONF *B)
 */
 
 
-int sort_res(PROT prot) {
+int sort_res(const PROT &prot) {
     int i_res,j_res;
     RES swap_res;
 
@@ -330,7 +462,7 @@ int sort_res(PROT prot) {
 }
 
 
-void id_conf(PROT &prot)
+void id_conf(const PROT &prot)
 {
 	int kr, kc;
 	char ins;
@@ -357,7 +489,7 @@ void id_conf(PROT &prot)
 }
 
 
-int cmp_conf(CONF conf1, CONF conf2, float IDEN_THR) {
+int cmp_conf(const CONF &conf1, const CONF &conf2, float IDEN_THR) {
 	int iatom, jatom,n_on1,n_on2;
 	float IDEN_THR2 = IDEN_THR*IDEN_THR;
 
@@ -392,7 +524,7 @@ int cmp_conf(CONF conf1, CONF conf2, float IDEN_THR) {
  * first compare the number of hetero atoms, then distance.
  * return 0, if the two conformers are similar.
  */
-int cmp_conf_hv(CONF conf1, CONF conf2, float IDEN_THR)
+int cmp_conf_hv(const CONF &conf1, const CONF &conf2, float IDEN_THR)
 {
 	int iatom, jatom;
 	float IDEN_THR2 = IDEN_THR*IDEN_THR;
@@ -428,7 +560,7 @@ int cmp_conf_hv(CONF conf1, CONF conf2, float IDEN_THR)
 	return 0;
 }
 
-float dist_conf_hv(CONF conf1, CONF conf2) {
+float dist_conf_hv(const CONF &conf1, const CONF &conf2) {
 	int iatom, jatom;
 	float max_dist = 999.;
 	float next_test_dist, test_dist2;
@@ -478,7 +610,7 @@ float dist_conf_hv(CONF conf1, CONF conf2) {
 	return sqrt(test_dist2+1e-4);
 }
 
-float rmsd_conf_hv(CONF conf1, CONF conf2) {
+float rmsd_conf_hv(const CONF &conf1, const CONF &conf2) {
 	int iatom, jatom;
 	int n_hv1=0, n_hv2=0;
 	float sum_distsq;
@@ -578,7 +710,7 @@ void free_strings(STRINGS *s)
 }
 
 
-int rot_swap(PROT prot) {
+int rot_swap(const PROT &prot) {
 	int i_res, i_conf, n_conf, ins, i_atom, j_atom, i_swap, counter;
 	SWAP_RULE swap_rule;
 	char sbuff[MAXCHAR_LINE];
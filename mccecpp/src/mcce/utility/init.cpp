@@ -3,6 +3,9 @@
 #include <time.h>
 #include <string.h>
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "mcce.h"
 
 ENV env;
@@ -17,6 +20,12 @@ int init()
 	if (get_env()) {printf("   FATAL: init(): \"failed initializing.\"\n"); return USERERR;}
 	else {printf("   Done\n\n"); fflush(stdout);}
 
+#ifdef _OPENMP
+	if (env.n_threads > 0) omp_set_num_threads(env.n_threads);
+	omp_set_max_active_levels(2);  /* titration points, then monte_runs within each */
+	printf("   Parallel sections use up to %d threads.\n\n", omp_get_max_threads()); fflush(stdout);
+#endif
+
 	printf("   Tentatively load local param file \"%s\"...", env.new_tpl); fflush(stdout);
 	if (env.do_premcce) remove(env.new_tpl);
 
@@ -32,23 +41,34 @@ int init()
 	printf("   Done\n\n");
 	fflush(stdout);
 
-	printf("   Load parameters from directory \"%s\" ... \n", env.param); fflush(stdout);
-	if (load_all_param(env.param)) {printf("   FATAL: init(): \"failed.\"\n"); return USERERR;}
-	else {printf("   Done\n\n"); fflush(stdout);}
-
-	printf("   Load linear free energy correction parameters from \"%s\"...", env.extra);fflush(stdout);
-	if ((fp=fopen(env.extra, "r"))) {
-		printf("%s\n", env.extra);
-		fclose(fp);
-		if (load_param(env.extra)) {
-			printf("\n   FATAL: init(): Failed loading file \"%s\".\n", env.extra);
+	if (strcmp(env.param_cache, "none")) {
+		printf("   Load parameters from directory \"%s\" and \"%s\" ... \n", env.param, env.extra); fflush(stdout);
+		if (load_all_param_cached(env.param, env.extra, env.param_cache)) {
+			printf("   FATAL: init(): \"failed.\"\n");
 			return USERERR;
 		}
-		printf("   File loaded.\n");
+		printf("   Done\n\n");
+		fflush(stdout);
+	}
+	else {
+		printf("   Load parameters from directory \"%s\" ... \n", env.param); fflush(stdout);
+		if (load_all_param(env.param)) {printf("   FATAL: init(): \"failed.\"\n"); return USERERR;}
+		else {printf("   Done\n\n"); fflush(stdout);}
+
+		printf("   Load linear free energy correction parameters from \"%s\"...", env.extra);fflush(stdout);
+		if ((fp=fopen(env.extra, "r"))) {
+			printf("%s\n", env.extra);
+			fclose(fp);
+			if (load_param(env.extra)) {
+				printf("\n   FATAL: init(): Failed loading file \"%s\".\n", env.extra);
+				return USERERR;
+			}
+			printf("   File loaded.\n");
+		}
+		else printf("   No such file, ignore.\n");
+		printf("   Done\n\n");
+		fflush(stdout);
 	}
-	else printf("   No such file, ignore.\n");
-	printf("   Done\n\n");
-	fflush(stdout);
 
 	/* Order of scale values:
 	 * 1. default value from env.epsilon_prot
@@ -103,6 +123,7 @@ int get_env()
 	env.repack_e_thr_exposed  = 0.5;
 	env.repack_e_thr_buried  = 4.;
 	env.repack_fav_vdw_off   = 0;
+	env.repack_dee           = 1;
 	env.nconf_limit       =    0;
 	env.n_hv_conf_limit   =   20;
 	env.relax_wat         =    1;
@@ -132,6 +153,7 @@ int get_env()
 	env.hv_relax_shake_tol =  1e-4;  /* Ratio to constraint distance */
 	env.hv_relax_include_ngh    =  0;
 	env.hv_relax_ngh_thr    =  4.;
+	env.hv_relax_verlet_skin =  1.;
 	env.prune_rmsd        = 2.0;
 	env.prune_ele         = 2.0;
 	env.prune_vdw         = 2.0;
@@ -150,6 +172,11 @@ int get_env()
 
 	env.warn_pairwise     = 20.0;
 	env.big_pairwise      = 5.0;
+	env.pw_sparse_thr     = -1.0;
+	strcpy(env.energy_format, "opp");
+	env.pbe_workers       =    1;
+	env.export_opp        =    0;
+	strcpy(env.param_cache, ".");
 
 	env.monte_adv_opt     =    0;
 	env.anneal_temp_start = ROOMT;
@@ -355,6 +382,11 @@ int get_env()
 			if (str1[0] == 't' || str1[0] == 'T') env.repack_fav_vdw_off = 1;
 			else env.repack_fav_vdw_off = 0;
 		}
+		else if (strstr(sbuff, "(REPACK_DEE)")) {
+			str1 = strtok(sbuff, " ");
+			if (str1[0] == 'f' || str1[0] == 'F') env.repack_dee = 0;
+			else env.repack_dee = 1;
+		}
 		else if (strstr(sbuff, "(REPACK_E_THR_EXPOSED)")) {
 			env.repack_e_thr_exposed = atof(strtok(sbuff, " "));
 		}
@@ -440,6 +472,9 @@ int get_env()
 		else if (strstr(sbuff, "(HV_RELAX_NGH_THR)")) {
 			env.hv_relax_ngh_thr = atof(strtok(sbuff, " "));
 		}
+		else if (strstr(sbuff, "(HV_RELAX_VERLET_SKIN)")) {
+			env.hv_relax_verlet_skin = atof(strtok(sbuff, " "));
+		}
 
 		else if (strstr(sbuff, "(RELAX_H)")) {
 			str1 = strtok(sbuff, " ");
@@ -844,6 +879,29 @@ int get_env()
 				env.ms_out = 1;
 			}
 		}
+		else if (strstr(sbuff, "(N_THREADS)")) {
+			env.n_threads = atoi(strtok(sbuff, " "));
+		}
+		else if (strstr(sbuff, "(ENERGY_FORMAT)")) {
+			str1 = strtok(sbuff, " ");
+			if (!strcmp(str1, "bin") || !strcmp(str1, "binz")) strcpy(env.energy_format, str1);
+			else strcpy(env.energy_format, "opp");
+		}
+		else if (strstr(sbuff, "(PW_SPARSE_THR)")) {
+			env.pw_sparse_thr = atof(strtok(sbuff, " "));
+		}
+		else if (strstr(sbuff, "(PBE_WORKERS)")) {
+			env.pbe_workers = atoi(strtok(sbuff, " "));
+			if (env.pbe_workers < 1) env.pbe_workers = 1;
+		}
+		else if (strstr(sbuff, "(EXPORT_OPP)")) {
+			str1 = strtok(sbuff, " ");
+			if (str1[0] == 't' || str1[0] == 'T') env.export_opp = 1;
+			else env.export_opp = 0;
+		}
+		else if (strstr(sbuff, "(PARAM_CACHE)")) {
+			strcpy(env.param_cache, strtok(sbuff, " "));
+		}
 	}
 
 	fclose(fp);
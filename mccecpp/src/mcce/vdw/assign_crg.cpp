@@ -6,7 +6,7 @@
 /** assign charges to all the atoms in protein, get the vale of the "crg" filed of the ATOM structure
  * 	from the topology file filed "CHARGE" by the conformer name of the atom and atom name.
  */
-int assign_crg(PROT prot)
+int assign_crg(const PROT &prot)
 {
 	int k_res,k_conf,k_atom;
 	CONF *conf_p;
@@ -8,7 +8,7 @@
 //float   C12_matrix[N_ELEM_MAX][N_ELEM_MAX];
 FILE *vdwf;
 
-void get_vdw0(PROT prot)
+void get_vdw0(const PROT &prot)
 {
     int i_res, i_conf, i_atom;
     
@@ -47,6 +47,7 @@ void get_vdw0(PROT prot)
         //}
         //free_connect_res(prot, i);
     }
+    sas_env_free();   /* the grid kept by surfw_res() points into prot */
 
     /* resset vdw rad */
     for (i_res=0; i_res<prot.n_res; i_res++) {
@@ -60,7 +61,7 @@ void get_vdw0(PROT prot)
     return;
 }
 
-void get_vdw0_no_sas(PROT prot)
+void get_vdw0_no_sas(const PROT &prot)
 {
     int i, j;
     
@@ -80,7 +81,7 @@ void get_vdw0_no_sas(PROT prot)
     return;
 }
 
-void get_vdw0_res(int i_res, PROT prot)
+void get_vdw0_res(int i_res, const PROT &prot)
 {
     int i_conf, i_atom;
     int k_res, k_conf;
@@ -154,7 +155,7 @@ void get_vdw0_res(int i_res, PROT prot)
     }
 }
 
-void get_vdw0_res_no_sas(int i_res, PROT prot)
+void get_vdw0_res_no_sas(int i_res, const PROT &prot)
 {
     int i_conf;
     setup_vdw_fast_res(i_res, prot);
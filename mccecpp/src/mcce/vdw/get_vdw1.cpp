@@ -5,7 +5,7 @@ int     n_elem;
 //float   C6_matrix[N_ELEM_MAX][N_ELEM_MAX];
 //float   C12_matrix[N_ELEM_MAX][N_ELEM_MAX];
 
-void get_vdw1(PROT prot)
+void get_vdw1(const PROT &prot)
 {
     float e;
     int i, j, k;
@@ -33,7 +33,7 @@ void get_vdw1(PROT prot)
     return;
 }
 
-void get_vdw1_pr_bkb(PROT prot)
+void get_vdw1_pr_bkb(const PROT &prot)
 {
     float e;
     int i, j, k;
@@ -62,7 +62,7 @@ void get_vdw1_pr_bkb(PROT prot)
     return;
 }
 
-void get_vdw1_res(int i, PROT prot)
+void get_vdw1_res(int i, const PROT &prot)
 {
     float e;
     int j, k;
@@ -16,7 +16,7 @@
 float cutoff_near2 = VDW_CUTOFF_NEAR * VDW_CUTOFF_NEAR;
 float cutoff_far2  = VDW_CUTOFF_FAR  * VDW_CUTOFF_FAR;
 
-float vdw(ATOM atom1, ATOM atom2)
+float vdw(const ATOM &atom1, const ATOM &atom2)
 {
     float       e = 0;
     float       d2;      /* distance with power 2 */
@@ -60,7 +60,7 @@ float vdw(ATOM atom1, ATOM atom2)
     return e;
 }
 
-float vdw_sim(ATOM atom1, ATOM atom2)
+float vdw_sim(const ATOM &atom1, const ATOM &atom2)
 {   float f1 = env.vdwf1, f2 = env.vdwf2;   
                                 /* vdw constants
                                  * vdw = epsilon((sigma/(r1+r2))^12 - (sigma/(r1+r2))^6)
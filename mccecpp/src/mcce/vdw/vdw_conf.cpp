@@ -2,7 +2,31 @@
 #include <string.h>
 #include "mcce.h"
 
-float vdw_conf(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
+/* Box of the atoms on in conformer conf_p. Returns 0 if no atom is on. */
+static int conf_box(CONF *conf_p, VECTOR *r_min, VECTOR *r_max)
+{
+    int i_atom, n = 0;
+    ATOM *atom_p;
+
+    for (i_atom=0; i_atom<conf_p->n_atom; i_atom++) {
+        atom_p = &conf_p->atom[i_atom];
+        if (!atom_p->on) continue;
+        if (!n++) {
+            *r_min = atom_p->xyz;
+            *r_max = atom_p->xyz;
+            continue;
+        }
+        if (atom_p->xyz.x < r_min->x) r_min->x = atom_p->xyz.x;
+        if (atom_p->xyz.y < r_min->y) r_min->y = atom_p->xyz.y;
+        if (atom_p->xyz.z < r_min->z) r_min->z = atom_p->xyz.z;
+        if (atom_p->xyz.x > r_max->x) r_max->x = atom_p->xyz.x;
+        if (atom_p->xyz.y > r_max->y) r_max->y = atom_p->xyz.y;
+        if (atom_p->xyz.z > r_max->z) r_max->z = atom_p->xyz.z;
+    }
+    return n;
+}
+
+float vdw_conf(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot)
 {
     float  e = 0.0;
     int    iatom, jatom;
@@ -10,6 +34,8 @@ float vdw_conf(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
     ATOM   *iatom_p, *jatom_p;
     int    connect123_res[MAX_CONNECTED2], connect14_res[MAX_CONNECTED3];
     int    iconnect, jconnect, kconnect, n_connect123, n_connect14, cal_vdw;
+    VECTOR j_min, j_max;
+    float  cutoff_far2 = VDW_CUTOFF_FAR * VDW_CUTOFF_FAR;
 
     if (!prot.res[i_res].cal_vdw) {
         if ( !param_get("CAL_VDW",prot.res[i_res].resName, "", &cal_vdw) ) {
@@ -24,6 +50,9 @@ float vdw_conf(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
         else prot.res[j_res].cal_vdw = 1;
     }
     if (!prot.res[i_res].cal_vdw || !prot.res[j_res].cal_vdw) return e;
+
+    /* vdw() is 0 beyond the cutoff, atoms that far from the box of j_conf see nothing */
+    if (!conf_box(&prot.res[j_res].conf[j_conf], &j_min, &j_max)) return e;
     
     for (iatom=0; iatom<prot.res[i_res].conf[i_conf].n_atom; iatom++) {
         iatom_p = &prot.res[i_res].conf[i_conf].atom[iatom];
@@ -37,6 +66,7 @@ float vdw_conf(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
             else prot.res[i_res].conf[i_conf].atom[iatom].cal_vdw = 1;
         }
         if (!prot.res[i_res].conf[i_conf].atom[iatom].cal_vdw) continue;
+        if (out_of_range(iatom_p->xyz, iatom_p->xyz, j_min, j_max, cutoff_far2)) continue;
 
         n_connect123 = 0;
         n_connect14 = 0;
@@ -45,23 +75,29 @@ float vdw_conf(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
         memset(connect14,    0,MAX_CONNECTED3*sizeof(ATOM *));
         memset(connect14_res,0,MAX_CONNECTED3*sizeof(int));
 
+        /* only partners in j_res can match an atom of j_conf */
         for (iconnect = 0; iconnect < MAX_CONNECTED; iconnect++) {
             if (!iatom_p->on) break;
             if (!iatom_p->connect12[iconnect]) break;
-            n_connect123++;
-            connect123[n_connect123-1] = iatom_p->connect12[iconnect];
-            connect123_res[n_connect123-1] = iatom_p->connect12_res[iconnect];
+            if (iatom_p->connect12_res[iconnect] == j_res) {
+                n_connect123++;
+                connect123[n_connect123-1] = iatom_p->connect12[iconnect];
+                connect123_res[n_connect123-1] = iatom_p->connect12_res[iconnect];
+            }
 
             for (jconnect = 0; jconnect < MAX_CONNECTED; jconnect++) {
                 if (!iatom_p->connect12[iconnect]->on) break;
                 if (!iatom_p->connect12[iconnect]->connect12[jconnect]) break;
-                n_connect123++;
-                connect123[n_connect123-1] = iatom_p->connect12[iconnect]->connect12[jconnect];
-                connect123_res[n_connect123-1] = iatom_p->connect12[iconnect]->connect12_res[jconnect];
+                if (iatom_p->connect12[iconnect]->connect12_res[jconnect] == j_res) {
+                    n_connect123++;
+                    connect123[n_connect123-1] = iatom_p->connect12[iconnect]->connect12[jconnect];
+                    connect123_res[n_connect123-1] = iatom_p->connect12[iconnect]->connect12_res[jconnect];
+                }
 
                 for (kconnect = 0; kconnect < MAX_CONNECTED; kconnect++) {
                     if (!iatom_p->connect12[iconnect]->connect12[jconnect]->on) break;
                     if (!iatom_p->connect12[iconnect]->connect12[jconnect]->connect12[kconnect]) break;
+                    if (iatom_p->connect12[iconnect]->connect12[jconnect]->connect12_res[kconnect] != j_res) continue;
                     n_connect14++;
                     connect14[n_connect14-1] = iatom_p->connect12[iconnect]->connect12[jconnect]->connect12[kconnect];
                     connect14_res[n_connect14-1] = iatom_p->connect12[iconnect]->connect12[jconnect]->connect12_res[kconnect];
@@ -128,7 +164,7 @@ float vdw_conf(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
     else return e;
 }
 
-float vdw_conf_hv(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
+float vdw_conf_hv(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot)
 {
     float  e = 0.0;
     int    iatom, jatom;
@@ -136,6 +172,8 @@ float vdw_conf_hv(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
     ATOM   *iatom_p, *jatom_p;
     int    connect123_res[MAX_CONNECTED2], connect14_res[MAX_CONNECTED3];
     int    iconnect, jconnect, kconnect, n_connect123, n_connect14, cal_vdw;
+    VECTOR j_min, j_max;
+    float  cutoff_far2 = VDW_CUTOFF_FAR * VDW_CUTOFF_FAR;
 
     if (!prot.res[i_res].conf[i_conf].n_atom) return e;
     if (!prot.res[j_res].conf[j_conf].n_atom) return e;
@@ -154,10 +192,14 @@ float vdw_conf_hv(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
     }
     if (!prot.res[i_res].cal_vdw || !prot.res[j_res].cal_vdw) return e;
 
+    /* vdw() is 0 beyond the cutoff, atoms that far from the box of j_conf see nothing */
+    if (!conf_box(&prot.res[j_res].conf[j_conf], &j_min, &j_max)) return e;
+
     for (iatom=0; iatom<prot.res[i_res].conf[i_conf].n_atom; iatom++) {
         iatom_p = &prot.res[i_res].conf[i_conf].atom[iatom];
         if (!iatom_p->on) continue;
         if (iatom_p->name[1] == 'H') continue;
+        if (out_of_range(iatom_p->xyz, iatom_p->xyz, j_min, j_max, cutoff_far2)) continue;
 
         n_connect123 = 0;
         n_connect14 = 0;
@@ -166,23 +208,29 @@ float vdw_conf_hv(int i_res, int i_conf, int j_res, int j_conf, PROT prot)
         memset(connect14,    0,MAX_CONNECTED3*sizeof(ATOM *));
         memset(connect14_res,0,MAX_CONNECTED3*sizeof(int));
 
+        /* only partners in j_res can match an atom of j_conf */
         for (iconnect = 0; iconnect < MAX_CONNECTED; iconnect++) {
             if (!iatom_p->on) break;
             if (!iatom_p->connect12[iconnect]) break;
-            n_connect123++;
-            connect123[n_connect123-1] = iatom_p->connect12[iconnect];
-            connect123_res[n_connect123-1] = iatom_p->connect12_res[iconnect];
+            if (iatom_p->connect12_res[iconnect] == j_res) {
+                n_connect123++;
+                connect123[n_connect123-1] = iatom_p->connect12[iconnect];
+                connect123_res[n_connect123-1] = iatom_p->connect12_res[iconnect];
+            }
 
             for (jconnect = 0; jconnect < MAX_CONNECTED; jconnect++) {
                 if (!iatom_p->connect12[iconnect]->on) break;
                 if (!iatom_p->connect12[iconnect]->connect12[jconnect]) break;
-                n_connect123++;
-                connect123[n_connect123-1] = iatom_p->connect12[iconnect]->connect12[jconnect];
-                connect123_res[n_connect123-1] = iatom_p->connect12[iconnect]->connect12_res[jconnect];
+                if (iatom_p->connect12[iconnect]->connect12_res[jconnect] == j_res) {
+                    n_connect123++;
+                    connect123[n_connect123-1] = iatom_p->connect12[iconnect]->connect12[jconnect];
+                    connect123_res[n_connect123-1] = iatom_p->connect12[iconnect]->connect12_res[jconnect];
+                }
 
                 for (kconnect = 0; kconnect < MAX_CONNECTED; kconnect++) {
                     if (!iatom_p->connect12[iconnect]->connect12[jconnect]->on) break;
                     if (!iatom_p->connect12[iconnect]->connect12[jconnect]->connect12[kconnect]) break;
+                    if (iatom_p->connect12[iconnect]->connect12[jconnect]->connect12_res[kconnect] != j_res) continue;
                     n_connect14++;
                     connect14[n_connect14-1] = iatom_p->connect12[iconnect]->connect12[jconnect]->connect12[kconnect];
                     connect14_res[n_connect14-1] = iatom_p->connect12[iconnect]->connect12[jconnect]->connect12_res[kconnect];
@@ -4,62 +4,94 @@
 #include "mcce.h"
 
 #define PRINT_THR       4
-//extern int   n_elem;
-//extern float C6_matrix[N_ELEM_MAX][N_ELEM_MAX];
-//extern float C12_matrix[N_ELEM_MAX][N_ELEM_MAX];
-extern void collect_all_connect(int i_res, int i_conf, int i_atom, PROT prot, int *n_connect12, ATOM ***connect12, int *n_connect13, ATOM ***connect13, int *n_connect14, ATOM ***connect14);
-
-/*
-int setup_C6_C12(PROT prot) {
-    int   i_elem, j_elem;
-    int   i_res, i_conf, i_atom;
-    char  elem[N_ELEM_MAX];
-
-    // Setup C6,C12 matrix 
-    n_elem = 0;
-    for (i_res=0; i_res<prot.n_res; i_res++) {
-        for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
-            for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
-                if (!prot.res[i_res].conf[i_conf].atom[i_atom].on) continue;
-                for (i_elem=0;i_elem<n_elem;i_elem++)
-                    if (elem[i_elem] == prot.res[i_res].conf[i_conf].atom[i_atom].name[1]) break;
-                if (i_elem == n_elem) {
-                    n_elem++;
-                    elem[i_elem] = prot.res[i_res].conf[i_conf].atom[i_atom].name[1];
-                }
-                prot.res[i_res].conf[i_conf].atom[i_atom].i_elem = i_elem;
-            }
-        }
+extern void collect_all_connect(int i_res, int i_conf, int i_atom, const PROT &prot, int *n_connect12, ATOM ***connect12, int *n_connect13, ATOM ***connect13, int *n_connect14, ATOM ***connect14);
+
+/* C6/C12 table indexed by vdw type. A vdw type is a distinct (vdw_rad, vdw_eps) pair and
+ * atom.i_elem holds the type of an atom, resolved when assign_vdw_param() sets the pair. The
+ * coefficients are computed exactly as the pair loop used to do, so table values are bit identical.
+ */
+static int   n_vdw_type, max_vdw_type;
+static float *vdw_type_rad, *vdw_type_eps;
+static float *C6_table, *C12_table;    /* [i_type*max_vdw_type + j_type] */
+
+static void set_C6_C12(int i_type, int j_type)
+{
+    float sig_min = vdw_type_rad[i_type] + vdw_type_rad[j_type];
+    float eps = sqrt(vdw_type_eps[i_type]*vdw_type_eps[j_type]);
+
+    C12_table[i_type*max_vdw_type+j_type] = eps*pow(sig_min,12);
+    C6_table[i_type*max_vdw_type+j_type]  = 2.*eps*pow(sig_min,6);
+}
+
+int vdw_type(ATOM *atom_p)
+{
+    /* type of this atom, a new type is added to the table if its parameters are new */
+    int i_type, j_type, k_type, new_max;
+    float *C6_new, *C12_new;
+
+    i_type = atom_p->i_elem;
+    if (i_type >= 0 && i_type < n_vdw_type
+        && vdw_type_rad[i_type] == atom_p->vdw_rad && vdw_type_eps[i_type] == atom_p->vdw_eps) return i_type;
+
+    for (i_type=0; i_type<n_vdw_type; i_type++) {
+        if (vdw_type_rad[i_type] == atom_p->vdw_rad && vdw_type_eps[i_type] == atom_p->vdw_eps) break;
     }
-    for (i_elem=0;i_elem<n_elem;i_elem++) {
-        for (j_elem=0;j_elem<n_elem;j_elem++) {
-            char pair[4];
-            pair[0] = elem[i_elem];
-            pair[1] = '-';
-            pair[2] = elem[j_elem];
-            pair[3] = '\0';
-            
-            if(param_get("VDWAMBER", "C6",  pair, &C6_matrix[i_elem][j_elem])) {
-                param_get("VDWAMBER", "C6",  "X-X", &C6_matrix[i_elem][j_elem]);
+
+    if (i_type == n_vdw_type) {
+        if (n_vdw_type == max_vdw_type) {
+            new_max = max_vdw_type ? 2*max_vdw_type : N_ELEM_MAX;
+            vdw_type_rad = (float *) realloc(vdw_type_rad, new_max*sizeof(float));
+            vdw_type_eps = (float *) realloc(vdw_type_eps, new_max*sizeof(float));
+            C6_new  = (float *) malloc(new_max*new_max*sizeof(float));
+            C12_new = (float *) malloc(new_max*new_max*sizeof(float));
+            if (!vdw_type_rad || !vdw_type_eps || !C6_new || !C12_new) {
+                printf("   FATAL: memory error in vdw_type()\n");
+                exit(-1);
             }
-            if (param_get("VDWAMBER", "C12", pair, &C12_matrix[i_elem][j_elem])) {
-                param_get("VDWAMBER", "C12", "X-X", &C12_matrix[i_elem][j_elem]);
+            for (j_type=0; j_type<n_vdw_type; j_type++) {
+                for (k_type=0; k_type<n_vdw_type; k_type++) {
+                    C6_new[j_type*new_max+k_type]  = C6_table[j_type*max_vdw_type+k_type];
+                    C12_new[j_type*new_max+k_type] = C12_table[j_type*max_vdw_type+k_type];
+                }
             }
+            free(C6_table);
+            free(C12_table);
+            C6_table  = C6_new;
+            C12_table = C12_new;
+            max_vdw_type = new_max;
+        }
+        vdw_type_rad[i_type] = atom_p->vdw_rad;
+        vdw_type_eps[i_type] = atom_p->vdw_eps;
+        n_vdw_type++;
+        for (j_type=0; j_type<n_vdw_type; j_type++) {
+            set_C6_C12(i_type, j_type);
+            set_C6_C12(j_type, i_type);
         }
     }
-    
-    return n_elem;
+
+    atom_p->i_elem = i_type;
+    return i_type;
 }
-*/
 
-void setup_vdw_fast(PROT prot) {
+static void vdw_type_conf(CONF *conf_p)
+{
+    /* atoms made after setup_vdw_fast_res(), e.g. copied into a new rotamer, are checked here */
+    int i_atom;
+
+    for (i_atom=0; i_atom<conf_p->n_atom; i_atom++) {
+        if (!conf_p->atom[i_atom].on) continue;
+        vdw_type(&conf_p->atom[i_atom]);
+    }
+}
+
+void setup_vdw_fast(const PROT &prot) {
     int i_res;
     for (i_res=0;i_res<prot.n_res;i_res++) {
         setup_vdw_fast_res(i_res,prot);
     }
 }
 
-void setup_vdw_fast_res(int i_res, PROT prot) {
+void setup_vdw_fast_res(int i_res, const PROT &prot) {
     /* This subroutine sets up back index, r_min, r_max for all residues and conformers */
     int i_conf,i_atom,cal_vdw;
     ATOM *atom_p;
@@ -130,7 +162,63 @@ void setup_vdw_fast_res(int i_res, PROT prot) {
     
 }
 
-void setup_connect_res(PROT prot, int i_res) {
+static void add_excl(const PROT &prot, ATOM *atom_p, int k_list, int *n_excl, EXCL_MASK **excl)
+{
+    /* set the bit of atom_p in list k_list (0: 1-2, 1: 1-3, 2: 1-4) of the mask of its conformer */
+    int i_res, i_conf, i_atom, i_excl;
+    CONF *conf_p = NULL;
+
+    i_res  = atom_p->i_res_prot;
+    i_conf = atom_p->i_conf_res;
+    if (i_res >= 0 && i_res < prot.n_res && i_conf >= 0 && i_conf < prot.res[i_res].n_conf) {
+        conf_p = &prot.res[i_res].conf[i_conf];
+        if (atom_p < conf_p->atom || atom_p >= conf_p->atom + conf_p->n_atom) conf_p = NULL;
+    }
+    for (i_res=0; !conf_p && i_res<prot.n_res; i_res++) {   /* stale back index */
+        for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
+            if (atom_p >= prot.res[i_res].conf[i_conf].atom
+                && atom_p < prot.res[i_res].conf[i_conf].atom + prot.res[i_res].conf[i_conf].n_atom) {
+                conf_p = &prot.res[i_res].conf[i_conf];
+                break;
+            }
+        }
+    }
+    if (!conf_p) return;
+    i_atom = atom_p - conf_p->atom;
+
+    for (i_excl=0; i_excl<(*n_excl); i_excl++) {
+        if ((*excl)[i_excl].conf == conf_p) break;
+    }
+    if (i_excl == (*n_excl)) {
+        (*n_excl)++;
+        if (!((*excl) = (EXCL_MASK *) realloc((*excl), (*n_excl)*sizeof(EXCL_MASK)))) {
+            printf("   FATAL: memory error in add_excl()\n");
+            exit(-1);
+        }
+        (*excl)[i_excl].conf   = conf_p;
+        (*excl)[i_excl].n_word = (conf_p->n_atom+31)/32;
+        if (!((*excl)[i_excl].mask = (unsigned int *) calloc(3*(*excl)[i_excl].n_word, sizeof(unsigned int)))) {
+            printf("   FATAL: memory error in add_excl()\n");
+            exit(-1);
+        }
+    }
+    (*excl)[i_excl].mask[k_list*(*excl)[i_excl].n_word + i_atom/32] |= 1u << (i_atom%32);
+}
+
+static EXCL_MASK *find_excl(const PROT &prot, int i_res, int i_conf, int i_atom, int j_res, int j_conf)
+{
+    /* masks of atom i_atom over the atoms of conformer j_conf, NULL if it has no partner there */
+    int i_excl;
+    CONF *conf_p = &prot.res[j_res].conf[j_conf];
+
+    for (i_excl=0; i_excl<prot.res[i_res].n_excl[i_conf][i_atom]; i_excl++) {
+        if (prot.res[i_res].excl[i_conf][i_atom][i_excl].conf == conf_p)
+            return &prot.res[i_res].excl[i_conf][i_atom][i_excl];
+    }
+    return NULL;
+}
+
+void setup_connect_res(const PROT &prot, int i_res) {
     float d2;
     int i_conf,i_atom,i_connect;
     ATOM *atom_p;
@@ -143,6 +231,12 @@ void setup_connect_res(PROT prot, int i_res) {
     prot.res[i_res].connect13   = (ATOM ****) calloc(prot.res[i_res].n_conf, sizeof(int *));
     prot.res[i_res].n_connect14 = (int **) calloc(prot.res[i_res].n_conf, sizeof(int *));
     prot.res[i_res].connect14   = (ATOM ****) calloc(prot.res[i_res].n_conf, sizeof(int *));
+    prot.res[i_res].n_excl      = (int **) calloc(prot.res[i_res].n_conf, sizeof(int *));
+    prot.res[i_res].excl        = (EXCL_MASK ***) calloc(prot.res[i_res].n_conf, sizeof(EXCL_MASK **));
+    if (prot.res[i_res].n_conf && (!prot.res[i_res].n_excl || !prot.res[i_res].excl)) {
+        printf("   FATAL: memory error in setup_connect_res()\n");
+        exit(-1);
+    }
 
     for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
         if (!prot.res[i_res].conf[i_conf].n_atom) continue;
@@ -152,6 +246,12 @@ void setup_connect_res(PROT prot, int i_res) {
         prot.res[i_res].connect13[i_conf]   = (ATOM ***) calloc(prot.res[i_res].conf[i_conf].n_atom, sizeof(ATOM **));
         prot.res[i_res].n_connect14[i_conf] = (int *) calloc(prot.res[i_res].conf[i_conf].n_atom, sizeof(int));
         prot.res[i_res].connect14[i_conf]   = (ATOM ***) calloc(prot.res[i_res].conf[i_conf].n_atom, sizeof(ATOM **));
+        prot.res[i_res].n_excl[i_conf]      = (int *) calloc(prot.res[i_res].conf[i_conf].n_atom, sizeof(int));
+        prot.res[i_res].excl[i_conf]        = (EXCL_MASK **) calloc(prot.res[i_res].conf[i_conf].n_atom, sizeof(EXCL_MASK *));
+        if (!prot.res[i_res].n_excl[i_conf] || !prot.res[i_res].excl[i_conf]) {
+            printf("   FATAL: memory error in setup_connect_res()\n");
+            exit(-1);
+        }
         
         for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
             atom_p = &prot.res[i_res].conf[i_conf].atom[i_atom];
@@ -160,6 +260,17 @@ void setup_connect_res(PROT prot, int i_res) {
             &prot.res[i_res].n_connect12[i_conf][i_atom], &prot.res[i_res].connect12[i_conf][i_atom],
             &prot.res[i_res].n_connect13[i_conf][i_atom], &prot.res[i_res].connect13[i_conf][i_atom],
             &prot.res[i_res].n_connect14[i_conf][i_atom], &prot.res[i_res].connect14[i_conf][i_atom]);
+
+            /* the same lists as bit masks, one per conformer the partners are in */
+            for (i_connect=0; i_connect<prot.res[i_res].n_connect12[i_conf][i_atom]; i_connect++)
+                add_excl(prot, prot.res[i_res].connect12[i_conf][i_atom][i_connect], 0,
+                         &prot.res[i_res].n_excl[i_conf][i_atom], &prot.res[i_res].excl[i_conf][i_atom]);
+            for (i_connect=0; i_connect<prot.res[i_res].n_connect13[i_conf][i_atom]; i_connect++)
+                add_excl(prot, prot.res[i_res].connect13[i_conf][i_atom][i_connect], 1,
+                         &prot.res[i_res].n_excl[i_conf][i_atom], &prot.res[i_res].excl[i_conf][i_atom]);
+            for (i_connect=0; i_connect<prot.res[i_res].n_connect14[i_conf][i_atom]; i_connect++)
+                add_excl(prot, prot.res[i_res].connect14[i_conf][i_atom][i_connect], 2,
+                         &prot.res[i_res].n_excl[i_conf][i_atom], &prot.res[i_res].excl[i_conf][i_atom]);
         }
         
         /* find max distance for each connectivity list */
@@ -202,19 +313,24 @@ void setup_connect_res(PROT prot, int i_res) {
     }
 }
 
-void free_connect_res(PROT prot, int i_res) {
-    int i_conf,i_atom;
+void free_connect_res(const PROT &prot, int i_res) {
+    int i_conf,i_atom,i_excl;
     ATOM *atom_p;
 
     for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
         if (!prot.res[i_res].conf[i_conf].n_atom) continue;
         for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
             atom_p = &prot.res[i_res].conf[i_conf].atom[i_atom];
+            for (i_excl=0; i_excl<prot.res[i_res].n_excl[i_conf][i_atom]; i_excl++)
+                free(prot.res[i_res].excl[i_conf][i_atom][i_excl].mask);
+            free(prot.res[i_res].excl[i_conf][i_atom]);
             if (!atom_p->on) continue;
             free(prot.res[i_res].connect12[i_conf][i_atom]);
             free(prot.res[i_res].connect13[i_conf][i_atom]);
             free(prot.res[i_res].connect14[i_conf][i_atom]);
         }
+        free(prot.res[i_res].n_excl[i_conf]);
+        free(prot.res[i_res].excl[i_conf]);
         free(prot.res[i_res].n_connect12[i_conf]);
         free(prot.res[i_res].n_connect13[i_conf]);
         free(prot.res[i_res].n_connect14[i_conf]);
@@ -228,26 +344,94 @@ void free_connect_res(PROT prot, int i_res) {
     free(prot.res[i_res].connect12);
     free(prot.res[i_res].connect13);
     free(prot.res[i_res].connect14);
+    free(prot.res[i_res].n_excl);
+    free(prot.res[i_res].excl);
 }    
 
-float vdw_conf_fast(int i_res, int i_conf, int j_res, int j_conf, PROT prot, int handle_hv) {
+void conf_soa_pack(CONF *conf_p, int handle_hv, CONF_SOA *soa)
+{
+    /* Copy coordinates, charges and vdw types of the atoms on in conf_p into soa, skipping
+     * hydrogens if handle_hv. soa lives on the caller's stack, so concurrent callers never
+     * share one; conformers larger than CONF_SOA_LOCAL get a heap block, see conf_soa_free().
+     */
+    int i_atom, n;
+    ATOM *atom_p;
+
+    soa->heap = NULL;
+    if (conf_p->n_atom <= CONF_SOA_LOCAL) {
+        soa->x = soa->x_local;
+        soa->y = soa->y_local;
+        soa->z = soa->z_local;
+        soa->crg = soa->crg_local;
+        soa->d2  = soa->d2_local;
+        soa->type = soa->type_local;
+        soa->i_atom = soa->i_atom_local;
+    }
+    else {
+        n = conf_p->n_atom;
+        if (!(soa->heap = (char *) malloc(n*(3*sizeof(double) + 2*sizeof(float) + 2*sizeof(int))))) {
+            printf("   FATAL: memory error in conf_soa_pack()\n");
+            exit(-1);
+        }
+        soa->x = (double *) soa->heap;
+        soa->y = soa->x + n;
+        soa->z = soa->y + n;
+        soa->crg = (float *) (soa->z + n);
+        soa->d2  = soa->crg + n;
+        soa->type = (int *) (soa->d2 + n);
+        soa->i_atom = soa->type + n;
+    }
+
+    n = 0;
+    for (i_atom=0; i_atom<conf_p->n_atom; i_atom++) {
+        atom_p = &conf_p->atom[i_atom];
+        if (!atom_p->on) continue;
+        if (handle_hv && atom_p->name[1] == 'H') continue;
+        soa->x[n] = atom_p->xyz.x;
+        soa->y[n] = atom_p->xyz.y;
+        soa->z[n] = atom_p->xyz.z;
+        soa->crg[n] = atom_p->crg;
+        soa->type[n] = atom_p->i_elem;
+        soa->i_atom[n] = i_atom;
+        n++;
+    }
+    soa->n = n;
+}
+
+void conf_soa_free(CONF_SOA *soa)
+{
+    free(soa->heap);
+    soa->heap = NULL;
+}
+
+float vdw_conf_fast(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot, int handle_hv) {
     /* This is a fast version of vdw_conf, pre-setup is need to use this function and to make calculation fast,
     to setup, call the setup functions before get into the vdw loop. See example:
     handle_hv = 0: full vdw.
     handle_hv = 1: heavy atom vdw.
     */
     float pair_vdw = 0., d2, d6, d12, e, C6, C12;
-    VECTOR v1,v2;
-    int i_atom, j_atom, i_connect, done;
-    ATOM *iatom_p,*jatom_p;
+    double dx, dy, dz;
+    VECTOR v1;
+    int i_atom, j_atom, k, w, done, same_conf;
+    unsigned int bit;
+    EXCL_MASK *excl;
+    ATOM *iatom_p;
+    CONF_SOA soa;
     float cutoff_near2 = VDW_CUTOFF_NEAR * VDW_CUTOFF_NEAR;
     float cutoff_far2  = VDW_CUTOFF_FAR  * VDW_CUTOFF_FAR;
-    /* FILE *debug_fp; */
+    float *C6_row, *C12_row;
 
     if (!prot.res[i_res].conf[i_conf].n_atom) return pair_vdw;
     if (!prot.res[j_res].conf[j_conf].n_atom) return pair_vdw;
     if (!prot.res[i_res].cal_vdw) return pair_vdw;
     if (!prot.res[j_res].cal_vdw) return pair_vdw;
+    vdw_type_conf(&prot.res[i_res].conf[i_conf]);
+    vdw_type_conf(&prot.res[j_res].conf[j_conf]);
+    same_conf = (i_res == j_res && i_conf == j_conf);
+
+    /* j_conf is read once into packed arrays, the pair loop below only touches those */
+    conf_soa_pack(&prot.res[j_res].conf[j_conf], handle_hv, &soa);
     
     for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
         iatom_p = &prot.res[i_res].conf[i_conf].atom[i_atom];
@@ -256,116 +440,70 @@ float vdw_conf_fast(int i_res, int i_conf, int j_res, int j_conf, PROT prot, int
             if (iatom_p->name[1] == 'H') continue;
         }
         v1 = iatom_p->xyz;
-        for (j_atom=0; j_atom<prot.res[j_res].conf[j_conf].n_atom; j_atom++) {
-            jatom_p = &prot.res[j_res].conf[j_conf].atom[j_atom];
-            if (!jatom_p->on) continue;
-            if (handle_hv) {
-                if (jatom_p->name[1] == 'H') continue;
+        C6_row  = &C6_table[iatom_p->i_elem*max_vdw_type];
+        C12_row = &C12_table[iatom_p->i_elem*max_vdw_type];
+        excl = find_excl(prot, i_res, i_conf, i_atom, j_res, j_conf);
+
+        /* distances first, this loop vectorizes */
+        for (k=0; k<soa.n; k++) {
+            dx = soa.x[k] - v1.x;
+            dy = soa.y[k] - v1.y;
+            dz = soa.z[k] - v1.z;
+            soa.d2[k] = dx*dx+dy*dy+dz*dz;
+        }
+
+        for (k=0; k<soa.n; k++) {
+            d2 = soa.d2[k];
+            if (d2 >= cutoff_far2) continue;
+            j_atom = soa.i_atom[k];
+            if (same_conf && j_atom == i_atom) continue;
+            done = 0;
+            
+            /* 1-2 and 1-3 pairs are excluded, 1-4 pairs are scaled */
+            if (excl && j_atom < 32*excl->n_word) {
+                w = j_atom/32;
+                bit = 1u << (j_atom%32);
+                if ((excl->mask[w] & bit) && d2 <= prot.res[i_res].r12sq_max + 1.0) continue;
+                if ((excl->mask[excl->n_word+w] & bit) && d2 <= prot.res[i_res].r13sq_max + 1.0) continue;
+                if ((excl->mask[2*excl->n_word+w] & bit) && d2 <= prot.res[i_res].r14sq_max + 1.0) done = 1;
             }
-            v2 = jatom_p->xyz;
             
-            if (iatom_p == jatom_p) continue;
-            d2 = ddvv(v1, v2);
-            if (d2 < cutoff_far2) {
-                done = 0;
-                
-                if (d2 <= prot.res[i_res].r12sq_max + 1.0) {
-                    for (i_connect=0;i_connect<prot.res[i_res].n_connect12[i_conf][i_atom];i_connect++) {
-                        if (jatom_p == prot.res[i_res].connect12[i_conf][i_atom][i_connect]) {
-                            done = 1;
-                        }
-                    }
-                }
-                if (done) continue;
-                
-                if (d2 <= prot.res[i_res].r13sq_max + 1.0) {
-                    for (i_connect=0;i_connect<prot.res[i_res].n_connect13[i_conf][i_atom];i_connect++) {
-                        if (jatom_p == prot.res[i_res].connect13[i_conf][i_atom][i_connect]) {
-                            done = 1;
-                        }
-                    }
-                }
-                if (done) continue;
-                
-                /* calculate vdw */
-                if (d2 < cutoff_near2)
-                    e = VDW_ELIMIT_NEAR;            /* Cutoff */
-                else {
-                    float sig_min = iatom_p->vdw_rad + jatom_p->vdw_rad;
-                    float eps = sqrt(iatom_p->vdw_eps*jatom_p->vdw_eps);
-                    C12 = eps*pow(sig_min,12);
-                    C6 = 2.*eps*pow(sig_min,6);
-
-                    //C6 = C6_matrix[iatom_p->i_elem][jatom_p->i_elem];
-                    //C12 = C12_matrix[iatom_p->i_elem][jatom_p->i_elem];
-                    d6 = d2*d2*d2;
-                    d12 = d6*d6;
-                    e = C12/d12 - C6/d6;
-                }
-                
-                if (d2 <= prot.res[i_res].r14sq_max + 1.0) {
-                    for (i_connect=0;i_connect<prot.res[i_res].n_connect14[i_conf][i_atom];i_connect++) {
-                        if (jatom_p == prot.res[i_res].connect14[i_conf][i_atom][i_connect]) {
-                            
-                            pair_vdw += e * env.factor_14lj;
-                            
-                            /* print large atom-atom vdw 
-                            if (e * env.factor_14lj > 2.0) {
-                                if (!i_conf || !j_conf || (i_res==j_res && i_conf==j_conf)) {
-                                    //debug_fp = fopen(env.debug_log,"a");
-                                    //if (!debug_fp) debug_fp = stdout;
-                                    //fprintf(debug_fp, "Warning, interaction btw atom %s of res %s %c%04d and atom %s of res %s %c%04d is %8.3f, d=%11.7f, r12max=%11.7f\n",
-                                        printf("Large vdw btw \"%s %s %c%04d\" and \"%s %s %c%04d\": %8.3f, dist=%8.4f\n",
-                                            iatom_p->name, prot.res[i_res].resName,prot.res[i_res].chainID,prot.res[i_res].resSeq,
-                                            jatom_p->name, prot.res[j_res].resName,prot.res[j_res].chainID,prot.res[j_res].resSeq, e * env.factor_14lj, sqrt(d2));
-                                        //fclose(debug_fp);
-                                }
-                            }
-                             print end */
-                            
-                            done = 1;
-                            break;
-                        }
-                    }
-                }
-                if (done) continue;
-                
-                /* print large atom-atom vdw 
-                if (e > 2.0) {
-                    if (!i_conf || !j_conf || (i_res==j_res && i_conf==j_conf)) {
-                        //debug_fp = fopen(env.debug_log,"a");
-                        //if (!debug_fp) debug_fp = stdout;
-                        //fprintf(debug_fp, "Warning, interaction btw atom %s of res %s %c%04d and atom %s of res %s %c%04d is %8.3f, d=%11.7f, r12max=%11.7f\n",
-                        printf("Large vdw btw \"%s %s %c%04d\" and \"%s %s %c%04d\": %8.3f, dist=%8.4f\n",
-                        iatom_p->name, prot.res[i_res].resName,prot.res[i_res].chainID,prot.res[i_res].resSeq,
-                        jatom_p->name, prot.res[j_res].resName,prot.res[j_res].chainID,prot.res[j_res].resSeq, e, sqrt(d2));
-                        //fclose(debug_fp);
-                    }
-                }
-                 print end */
-                
-                pair_vdw += e;
-                //printf("%s-%s: %8.3f\n",iatom_p->name,jatom_p->name,e);
+            /* calculate vdw */
+            if (d2 < cutoff_near2)
+                e = VDW_ELIMIT_NEAR;            /* Cutoff */
+            else {
+                C6  = C6_row[soa.type[k]];
+                C12 = C12_row[soa.type[k]];
+                d6 = d2*d2*d2;
+                d12 = d6*d6;
+                e = C12/d12 - C6/d6;
             }
+            
+            if (done) pair_vdw += e * env.factor_14lj;
+            else pair_vdw += e;
         }
     }
+    conf_soa_free(&soa);
     
     pair_vdw *= env.s2_vdw;  // also scale vdw in step2
 
-    if (i_res == j_res && i_conf == j_conf) return pair_vdw/2.;
+    if (same_conf) return pair_vdw/2.;
     else return pair_vdw;
 }
 
-float vdw_conf_fast_print(int i_res, int i_conf, int j_res, int j_conf, PROT prot) {
+float vdw_conf_fast_print(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot) {
     /* This is a fast version of vdw_conf, pre-setup is need to use this function and to make calculation fast,
     to setup, call the setup functions before get into the vdw loop. See example:
     */
     float pair_vdw = 0., d2, d6, d12, e, C6, C12;
     VECTOR v1,v2;
-    int i_atom, j_atom, i_connect, done;
+    int i_atom, j_atom, w, done;
+    unsigned int bit;
+    EXCL_MASK *excl;
     ATOM *iatom_p,*jatom_p;
     float cutoff_near2 = VDW_CUTOFF_NEAR * VDW_CUTOFF_NEAR;
     float cutoff_far2  = VDW_CUTOFF_FAR  * VDW_CUTOFF_FAR;
+    float *C6_row, *C12_row;
     /* FILE *debug_fp; */
 
     if (!prot.res[i_res].conf[i_conf].n_atom) return pair_vdw;
@@ -378,6 +516,8 @@ float vdw_conf_fast_print(int i_res, int i_conf, int j_res, int j_conf, PROT pro
         printf("CAL_VDW parameter of residue %s is off\n",prot.res[j_res].resName);
         return pair_vdw;
     }
+    vdw_type_conf(&prot.res[i_res].conf[i_conf]);
+    vdw_type_conf(&prot.res[j_res].conf[j_conf]);
 
     
     for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
@@ -385,6 +525,9 @@ float vdw_conf_fast_print(int i_res, int i_conf, int j_res, int j_conf, PROT pro
         if (!iatom_p->on) continue;
 
         v1 = iatom_p->xyz;
+        C6_row  = &C6_table[iatom_p->i_elem*max_vdw_type];
+        C12_row = &C12_table[iatom_p->i_elem*max_vdw_type];
+        excl = find_excl(prot, i_res, i_conf, i_atom, j_res, j_conf);
         for (j_atom=0; j_atom<prot.res[j_res].conf[j_conf].n_atom; j_atom++) {
             jatom_p = &prot.res[j_res].conf[j_conf].atom[j_atom];
             if (!jatom_p->on) continue;
@@ -396,32 +539,21 @@ float vdw_conf_fast_print(int i_res, int i_conf, int j_res, int j_conf, PROT pro
             if (d2 < cutoff_far2) {
                 done = 0;
                 
-                if (d2 <= prot.res[i_res].r12sq_max + 1.0) {
-                    for (i_connect=0;i_connect<prot.res[i_res].n_connect12[i_conf][i_atom];i_connect++) {
-                        if (jatom_p == prot.res[i_res].connect12[i_conf][i_atom][i_connect]) {
-                            done = 1;
-                        }
-                    }
+                /* 1-2 and 1-3 pairs are excluded, 1-4 pairs are scaled */
+                if (excl && j_atom < 32*excl->n_word) {
+                    w = j_atom/32;
+                    bit = 1u << (j_atom%32);
+                    if ((excl->mask[w] & bit) && d2 <= prot.res[i_res].r12sq_max + 1.0) continue;
+                    if ((excl->mask[excl->n_word+w] & bit) && d2 <= prot.res[i_res].r13sq_max + 1.0) continue;
+                    if ((excl->mask[2*excl->n_word+w] & bit) && d2 <= prot.res[i_res].r14sq_max + 1.0) done = 1;
                 }
-                if (done) continue;
-                
-                if (d2 <= prot.res[i_res].r13sq_max + 1.0) {
-                    for (i_connect=0;i_connect<prot.res[i_res].n_connect13[i_conf][i_atom];i_connect++) {
-                        if (jatom_p == prot.res[i_res].connect13[i_conf][i_atom][i_connect]) {
-                            done = 1;
-                        }
-                    }
-                }
-                if (done) continue;
                 
                 /* calculate vdw */
                 if (d2 < cutoff_near2)
                     e = VDW_ELIMIT_NEAR;            /* Cutoff */
                 else {
-                    float sig_min = iatom_p->vdw_rad + jatom_p->vdw_rad;
-                    float eps = sqrt(iatom_p->vdw_eps*jatom_p->vdw_eps);
-                    C12 = eps*pow(sig_min,12);
-                    C6 = 2.*eps*pow(sig_min,6);
+                    C6  = C6_row[jatom_p->i_elem];
+                    C12 = C12_row[jatom_p->i_elem];
 
                     d6 = d2*d2*d2;
                     d12 = d6*d6;
@@ -429,25 +561,18 @@ float vdw_conf_fast_print(int i_res, int i_conf, int j_res, int j_conf, PROT pro
                 }
                 
                 /* 1,4 connectivity */
-                if (d2 <= prot.res[i_res].r14sq_max + 1.0) {
-                    for (i_connect=0;i_connect<prot.res[i_res].n_connect14[i_conf][i_atom];i_connect++) {
-                        if (jatom_p == prot.res[i_res].connect14[i_conf][i_atom][i_connect]) {
-                            
-                            pair_vdw += e * env.factor_14lj;
-                            
-                            /* print large atom-atom vdw */
-                            printf("VDW (1,4) btw \"%s %s\" and \"%s %s\": %8.3f, dist=%8.4f\n",
-                                iatom_p->name, prot.res[i_res].conf[i_conf].uniqID,
-                                jatom_p->name, prot.res[j_res].conf[j_conf].uniqID,
-                                e * env.factor_14lj, sqrt(d2));
-                            /* print end */
-                            
-                            done = 1;
-                            break;
-                        }
-                    }
+                if (done) {
+                    pair_vdw += e * env.factor_14lj;
+                    
+                    /* print large atom-atom vdw */
+                    printf("VDW (1,4) btw \"%s %s\" and \"%s %s\": %8.3f, dist=%8.4f\n",
+                        iatom_p->name, prot.res[i_res].conf[i_conf].uniqID,
+                        jatom_p->name, prot.res[j_res].conf[j_conf].uniqID,
+                        e * env.factor_14lj, sqrt(d2));
+                    /* print end */
+                    
+                    continue;
                 }
-                if (done) continue;
                 
                 /* print large atom-atom vdw */
                 printf("VDW       btw \"%s %s\" and \"%s %s\": %8.3f, dist=%8.4f\n",
@@ -465,71 +590,63 @@ float vdw_conf_fast_print(int i_res, int i_conf, int j_res, int j_conf, PROT pro
     else return pair_vdw;
 }
 
-float coulomb_conf_fast(int i_res, int i_conf, int j_res, int j_conf, PROT prot) {
+float coulomb_conf_fast(int i_res, int i_conf, int j_res, int j_conf, const PROT &prot) {
     /* This is a fast version of vdw_conf, pre-setup is need to use this function and to make calculation fast,
     to setup, call the setup functions before get into the vdw loop. See example:
     */
     float pair_coulomb = 0., d, d2, e;
-    VECTOR v1,v2;
-    int i_atom, j_atom, i_connect, done;
-    ATOM *iatom_p,*jatom_p;
+    double dx, dy, dz;
+    VECTOR v1;
+    int i_atom, j_atom, k, w, done, same_conf;
+    unsigned int bit;
+    EXCL_MASK *excl;
+    ATOM *iatom_p;
+    CONF_SOA soa;
     
     if (!prot.res[i_res].conf[i_conf].n_atom) return pair_coulomb;
     if (!prot.res[j_res].conf[j_conf].n_atom) return pair_coulomb;
+    same_conf = (i_res == j_res && i_conf == j_conf);
+    conf_soa_pack(&prot.res[j_res].conf[j_conf], 0, &soa);
     
     for (i_atom=0; i_atom<prot.res[i_res].conf[i_conf].n_atom; i_atom++) {
         iatom_p = &prot.res[i_res].conf[i_conf].atom[i_atom];
         if (!iatom_p->on) continue;
         v1 = iatom_p->xyz;
-        for (j_atom=0; j_atom<prot.res[j_res].conf[j_conf].n_atom; j_atom++) {
-            jatom_p = &prot.res[j_res].conf[j_conf].atom[j_atom];
-            if (!jatom_p->on) continue;
-            v2 = jatom_p->xyz;
-            
-            if (iatom_p == jatom_p) continue;
-            d2 = ddvv(v1, v2);
+        excl = find_excl(prot, i_res, i_conf, i_atom, j_res, j_conf);
+
+        for (k=0; k<soa.n; k++) {
+            dx = soa.x[k] - v1.x;
+            dy = soa.y[k] - v1.y;
+            dz = soa.z[k] - v1.z;
+            soa.d2[k] = dx*dx+dy*dy+dz*dz;
+        }
+
+        for (k=0; k<soa.n; k++) {
+            j_atom = soa.i_atom[k];
+            if (same_conf && j_atom == i_atom) continue;
+            d2 = soa.d2[k];
             done = 0;
             
-            if (d2 <= prot.res[i_res].r12sq_max) {
-                for (i_connect=0;i_connect<prot.res[i_res].n_connect12[i_conf][i_atom];i_connect++) {
-                    if (jatom_p == prot.res[i_res].connect12[i_conf][i_atom][i_connect]) {
-                        done = 1;
-                    }
-                }
+            if (excl && j_atom < 32*excl->n_word) {
+                w = j_atom/32;
+                bit = 1u << (j_atom%32);
+                if ((excl->mask[w] & bit) && d2 <= prot.res[i_res].r12sq_max) continue;
+                if ((excl->mask[excl->n_word+w] & bit) && d2 <= prot.res[i_res].r13sq_max) continue;
+                if ((excl->mask[2*excl->n_word+w] & bit) && d2 <= prot.res[i_res].r14sq_max) done = 1;
             }
-            if (done) continue;
-            
-            if (d2 <= prot.res[i_res].r13sq_max) {
-                for (i_connect=0;i_connect<prot.res[i_res].n_connect13[i_conf][i_atom];i_connect++) {
-                    if (jatom_p == prot.res[i_res].connect13[i_conf][i_atom][i_connect]) {
-                        done = 1;
-                    }
-                }
-            }
-            if (done) continue;
             
             /* calculate coulumb */
             d = sqrt(d2);
             if (d < 0.8) d = 0.8;
-            e = 331.5*iatom_p->crg*jatom_p->crg/(env.epsilon_coulomb * d);
+            e = 331.5*iatom_p->crg*soa.crg[k]/(env.epsilon_coulomb * d);
             
-            if (d2 <= prot.res[i_res].r14sq_max) {
-                for (i_connect=0;i_connect<prot.res[i_res].n_connect14[i_conf][i_atom];i_connect++) {
-                    if (jatom_p == prot.res[i_res].connect14[i_conf][i_atom][i_connect]) {
-                        
-                        pair_coulomb += e * env.factor_14lj;
-                        done = 1;
-                        break;
-                    }
-                }
-            }
-            if (done) continue;
-            
-            pair_coulomb += e;
+            if (done) pair_coulomb += e * env.factor_14lj;
+            else pair_coulomb += e;
         }
     }
+    conf_soa_free(&soa);
     
-    if (i_res == j_res && i_conf == j_conf) return pair_coulomb/2.;
+    if (same_conf) return pair_coulomb/2.;
     else return pair_coulomb;
 }
 
@@ -564,3 +681,170 @@ int out_of_range(VECTOR i_min, VECTOR i_max, VECTOR j_min, VECTOR j_max, float r
     else return 0;
 }
 
+
+/* Protein-wide uniform grid of conformer boxes for step 3. Every conformer with atoms on is
+ * dropped into all cells its r_min/r_max box overlaps, so one conformer only has to look in
+ * the cells around its own box, widened by the vdw cutoff, to find everything it can touch.
+ * Conformers are identified by i_conf_prot, their serial index over all conformers of the protein.
+ */
+#define VDW_GRID_MAX_CELLS   1000000
+
+static int    grid_n_conf;
+static int    grid_nx, grid_ny, grid_nz;
+static float  grid_cell;
+static VECTOR grid_origin;
+static int    *grid_start;   /* items of cell c are grid_item[grid_start[c]] .. grid_item[grid_start[c+1]-1] */
+static int    *grid_item;
+static CONF   **grid_conf;   /* i_conf_prot -> conformer, NULL if it has no atom on */
+
+static void vdw_grid_range(VECTOR r_min, VECTOR r_max, float pad, int *lo, int *hi)
+{
+    lo[0] = (int) floor((r_min.x - pad - grid_origin.x)/grid_cell);
+    lo[1] = (int) floor((r_min.y - pad - grid_origin.y)/grid_cell);
+    lo[2] = (int) floor((r_min.z - pad - grid_origin.z)/grid_cell);
+    hi[0] = (int) floor((r_max.x + pad - grid_origin.x)/grid_cell);
+    hi[1] = (int) floor((r_max.y + pad - grid_origin.y)/grid_cell);
+    hi[2] = (int) floor((r_max.z + pad - grid_origin.z)/grid_cell);
+    if (lo[0] < 0) lo[0] = 0;
+    if (lo[1] < 0) lo[1] = 0;
+    if (lo[2] < 0) lo[2] = 0;
+    if (hi[0] >= grid_nx) hi[0] = grid_nx - 1;
+    if (hi[1] >= grid_ny) hi[1] = grid_ny - 1;
+    if (hi[2] >= grid_nz) hi[2] = grid_nz - 1;
+}
+
+int setup_vdw_grid(const PROT &prot)
+{
+    int i_res, i_conf, i_atom, ix, iy, iz, c, n_cell, n_item, first;
+    int lo[3], hi[3];
+    VECTOR p_min, p_max;
+    CONF *conf_p;
+
+    free_vdw_grid();
+
+    /* i_conf_prot indexing and the conformer boxes */
+    setup_vdw_fast(prot);
+    grid_n_conf = 0;
+    for (i_res=0; i_res<prot.n_res; i_res++) {
+        for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
+            prot.res[i_res].conf[i_conf].i_conf_prot = grid_n_conf;
+            grid_n_conf++;
+        }
+    }
+    if (!(grid_conf = (CONF **) calloc(grid_n_conf ? grid_n_conf : 1, sizeof(CONF *)))) {
+        printf("   FATAL: memory error in setup_vdw_grid()\n");
+        return USERERR;
+    }
+
+    first = 1;
+    memset(&p_min, 0, sizeof(VECTOR));
+    memset(&p_max, 0, sizeof(VECTOR));
+    for (i_res=0; i_res<prot.n_res; i_res++) {
+        for (i_conf=0; i_conf<prot.res[i_res].n_conf; i_conf++) {
+            conf_p = &prot.res[i_res].conf[i_conf];
+            for (i_atom=0; i_atom<conf_p->n_atom; i_atom++) {
+                if (conf_p->atom[i_atom].on) break;
+            }
+            if (i_atom == conf_p->n_atom) continue;
+            grid_conf[conf_p->i_conf_prot] = conf_p;
+
+            if (first || conf_p->r_min.x < p_min.x) p_min.x = conf_p->r_min.x;
+            if (first || conf_p->r_min.y < p_min.y) p_min.y = conf_p->r_min.y;
+            if (first || conf_p->r_min.z < p_min.z) p_min.z = conf_p->r_min.z;
+            if (first || conf_p->r_max.x > p_max.x) p_max.x = conf_p->r_max.x;
+            if (first || conf_p->r_max.y > p_max.y) p_max.y = conf_p->r_max.y;
+            if (first || conf_p->r_max.z > p_max.z) p_max.z = conf_p->r_max.z;
+            first = 0;
+        }
+    }
+
+    /* cells as wide as the vdw cutoff, coarser if the box is very large */
+    grid_origin = p_min;
+    grid_cell = VDW_CUTOFF_FAR;
+    while (1) {
+        grid_nx = (int) ((p_max.x - p_min.x)/grid_cell) + 1;
+        grid_ny = (int) ((p_max.y - p_min.y)/grid_cell) + 1;
+        grid_nz = (int) ((p_max.z - p_min.z)/grid_cell) + 1;
+        if ((double) grid_nx*grid_ny*grid_nz <= VDW_GRID_MAX_CELLS) break;
+        grid_cell *= 2.0;
+    }
+    n_cell = grid_nx*grid_ny*grid_nz;
+
+    if (!(grid_start = (int *) calloc(n_cell+1, sizeof(int)))) {
+        printf("   FATAL: memory error in setup_vdw_grid()\n");
+        return USERERR;
+    }
+
+    /* count, offsets, then fill */
+    for (c=0; c<grid_n_conf; c++) {
+        if (!grid_conf[c]) continue;
+        vdw_grid_range(grid_conf[c]->r_min, grid_conf[c]->r_max, 0.0, lo, hi);
+        for (ix=lo[0]; ix<=hi[0]; ix++)
+            for (iy=lo[1]; iy<=hi[1]; iy++)
+                for (iz=lo[2]; iz<=hi[2]; iz++)
+                    grid_start[(ix*grid_ny+iy)*grid_nz+iz+1]++;
+    }
+    for (c=0; c<n_cell; c++) grid_start[c+1] += grid_start[c];
+    n_item = grid_start[n_cell];
+
+    if (!(grid_item = (int *) malloc((n_item ? n_item : 1)*sizeof(int)))) {
+        printf("   FATAL: memory error in setup_vdw_grid()\n");
+        return USERERR;
+    }
+    for (c=0; c<grid_n_conf; c++) {
+        if (!grid_conf[c]) continue;
+        vdw_grid_range(grid_conf[c]->r_min, grid_conf[c]->r_max, 0.0, lo, hi);
+        for (ix=lo[0]; ix<=hi[0]; ix++)
+            for (iy=lo[1]; iy<=hi[1]; iy++)
+                for (iz=lo[2]; iz<=hi[2]; iz++)
+                    grid_item[grid_start[(ix*grid_ny+iy)*grid_nz+iz]++] = c;
+    }
+    /* the fill pass moved every start to the next cell's start */
+    for (c=n_cell; c>0; c--) grid_start[c] = grid_start[c-1];
+    grid_start[0] = 0;
+
+    return 0;
+}
+
+int vdw_grid_near(CONF *conf_p, char *near)
+{
+    /* Flag in near[] (indexed by i_conf_prot) every conformer whose box comes within the vdw cutoff
+     * of conf_p's box. Pairs not flagged have no atom pair inside the cutoff, so their vdw is 0.
+     * Returns USERERR when there is no grid or conf_p is not in it, near[] is then left to the caller.
+     */
+    int ix, iy, iz, c, k;
+    int lo[3], hi[3];
+    float cutoff_far2 = VDW_CUTOFF_FAR * VDW_CUTOFF_FAR;
+
+    if (!grid_start) return USERERR;
+    if (conf_p->i_conf_prot < 0 || conf_p->i_conf_prot >= grid_n_conf || grid_conf[conf_p->i_conf_prot] != conf_p) return USERERR;
+    memset(near, 0, grid_n_conf*sizeof(char));
+
+    vdw_grid_range(conf_p->r_min, conf_p->r_max, VDW_CUTOFF_FAR, lo, hi);
+    for (ix=lo[0]; ix<=hi[0]; ix++) {
+        for (iy=lo[1]; iy<=hi[1]; iy++) {
+            for (iz=lo[2]; iz<=hi[2]; iz++) {
+                c = (ix*grid_ny+iy)*grid_nz+iz;
+                for (k=grid_start[c]; k<grid_start[c+1]; k++) {
+                    if (near[grid_item[k]]) continue;
+                    if (out_of_range(conf_p->r_min, conf_p->r_max,
+                                     grid_conf[grid_item[k]]->r_min, grid_conf[grid_item[k]]->r_max, cutoff_far2)) continue;
+                    near[grid_item[k]] = 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+void free_vdw_grid()
+{
+    free(grid_start);
+    free(grid_item);
+    free(grid_conf);
+    grid_start = NULL;
+    grid_item = NULL;
+    grid_conf = NULL;
+    grid_n_conf = 0;
+}